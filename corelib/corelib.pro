@@ -33,6 +33,8 @@ SOURCES += \
     src/raster.cpp \
     src/frame.cpp \
     src/pathtracerfact.cpp \
+    src/sampler.cpp \
+    src/samplerfact.cpp \
     src/pipeline.cpp \
     src/thread.cpp \
     src/compositor.cpp \
@@ -54,7 +56,10 @@ SOURCES += \
     test/testunidirectrenderer.cpp \
     src/cameracontainer.cpp \
     src/worldspace.cpp \
-    src/materialcontainer.cpp
+    src/materialcontainer.cpp \
+    src/irradiancecache.cpp \
+    src/pathguide.cpp \
+    src/denoiser.cpp
 
 
 HEADERS += \
@@ -75,6 +80,8 @@ HEADERS += \
     src/thread.h \
     src/compositor.h \
     src/pathtracerfact.h \
+    src/sampler.h \
+    src/samplerfact.h \
     src/pipeline.h \
     test/testgeometry.h \
     test/testresource.h \
@@ -94,7 +101,10 @@ HEADERS += \
     test/testunidirectrenderer.h \
     src/cameracontainer.h \
     src/worldspace.h \
-    src/materialcontainer.h
+    src/materialcontainer.h \
+    src/irradiancecache.h \
+    src/pathguide.h \
+    src/denoiser.h
 
 LIBS += -lvulkan
 
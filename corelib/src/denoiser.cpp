@@ -0,0 +1,316 @@
+#include "denoiser.h"
+#include "compositor.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+namespace {
+
+// B3-spline kernel every level of the wavelet transform applies along both axes.
+float const AtrousKernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+// The normal weight is the cosine between the normals to the power of 2^AtrousNormalSquarings.
+unsigned const AtrousNormalSquarings = 7;
+
+// Depth difference, relative to what the depth gradient predicts over the distance of the tap,
+// and luminance difference, relative to the standard deviation of the pixel's luminance, at which
+// a tap's weight falls by a factor of e.
+float const AtrousDepthSigma = 1.0f;
+float const AtrousLuminanceSigma = 4.0f;
+
+// Tolerances, relative to the depth and absolute in luminance, which keep the weights finite where
+// the surfaces are flat and the estimates have converged.
+float const AtrousDepthEpsilon = 1e-3f;
+float const AtrousLuminanceEpsilon = 1e-4f;
+
+// Albedo under which a color channel isn't divided by it.
+float const AtrousMinAlbedo = 1e-3f;
+
+/**
+ * @brief demodulation The albedo the color is divided by before filtering.
+ */
+e8util::color3 demodulation(e8util::color3 const &albedo) {
+    e8util::color3 a;
+    for (unsigned c = 0; c < 3; c++) {
+        a(c) = albedo(c) > AtrousMinAlbedo ? albedo(c) : 1.0f;
+    }
+    return a;
+}
+
+/**
+ * @brief The pixel_row struct Guides of the row of pixels being filtered.
+ */
+struct pixel_row {
+    float const *nx;
+    float const *ny;
+    float const *nz;
+    float const *depth;
+    float const *depth_grad;
+    float const *lum;
+
+    // How much the luminance of the taps may differ from the pixels'.
+    float const *lum_tolerance;
+};
+
+/**
+ * @brief The plane_row struct Guides and demodulated color of the row of taps, lined up with the
+ * pixels.
+ */
+struct plane_row {
+    float const *nx;
+    float const *ny;
+    float const *nz;
+    float const *depth;
+    float const *r;
+    float const *g;
+    float const *b;
+    float const *var;
+};
+
+/**
+ * @brief accumulate_tap Adds the taps of the pixels [begin, end) to their weighted sums. The sums
+ * are the task's own, which only the restrict qualifiers tell the compiler, so that it vectorizes
+ * the loop.
+ * @param dist Distance between the pixels and their taps.
+ */
+void accumulate_tap(pixel_row const &p, plane_row const &q, float kernel, float dist,
+                    unsigned begin, unsigned end, float *__restrict sum_r,
+                    float *__restrict sum_g, float *__restrict sum_b, float *__restrict sum_var,
+                    float *__restrict sum_w) {
+    for (unsigned x = begin; x < end; x++) {
+        // Pixels outside of the scene have no normal, so they get no weight.
+        float cos = std::max(0.0f, p.nx[x] * q.nx[x] + p.ny[x] * q.ny[x] + p.nz[x] * q.nz[x]);
+        for (unsigned k = 0; k < AtrousNormalSquarings; k++) {
+            cos *= cos;
+        }
+        float lum_q = 0.299f * q.r[x] + 0.587f * q.g[x] + 0.114f * q.b[x];
+        float depth_diff =
+            std::abs(p.depth[x] - q.depth[x]) /
+            (AtrousDepthSigma * p.depth_grad[x] * dist + AtrousDepthEpsilon * p.depth[x] + 1e-6f);
+        float lum_diff = std::abs(p.lum[x] - lum_q) / p.lum_tolerance[x];
+        float weight = kernel * cos * std::exp(-depth_diff - lum_diff);
+        sum_r[x] += weight * q.r[x];
+        sum_g[x] += weight * q.g[x];
+        sum_b[x] += weight * q.b[x];
+        sum_var[x] += weight * weight * q.var[x];
+        sum_w[x] += weight;
+    }
+}
+
+} // namespace
+
+e8::atrous_denoiser::band_task::band_task(unsigned index, unsigned num_bands)
+    : e8util::if_task(false), m_index(index), m_num_bands(num_bands) {}
+
+void e8::atrous_denoiser::band_task::run(e8util::if_task_storage *storage) {
+    level_data const *data = static_cast<level_data const *>(storage);
+    unsigned const w = data->width;
+    int const h = static_cast<int>(data->height);
+    for (std::vector<float> &sums : m_sums) {
+        sums.resize(w);
+    }
+    m_lum.resize(w);
+    m_lum_tolerance.resize(w);
+    float *sum_r = m_sums[0].data();
+    float *sum_g = m_sums[1].data();
+    float *sum_b = m_sums[2].data();
+    float *sum_var = m_sums[3].data();
+    float *sum_w = m_sums[4].data();
+    float *lum = m_lum.data();
+    float *lum_tolerance = m_lum_tolerance.data();
+    float const *nx = data->nx;
+    float const *ny = data->ny;
+    float const *nz = data->nz;
+    float const *depth = data->depth;
+    float const *depth_grad = data->depth_grad;
+    float const *r = data->src[0];
+    float const *g = data->src[1];
+    float const *b = data->src[2];
+    float const *var = data->src[3];
+
+    unsigned y_begin = data->height * m_index / m_num_bands;
+    unsigned y_end = data->height * (m_index + 1) / m_num_bands;
+    for (unsigned y = y_begin; y < y_end; y++) {
+        unsigned const row = y * w;
+
+        // The variance the luminance weight is scaled by is blurred over the 3x3 neighborhood, or
+        // pixels whose few samples happen to agree would reject all the others.
+        std::fill(lum_tolerance, lum_tolerance + w, 0.0f);
+        for (int dy = -1; dy <= 1; dy++) {
+            int qy = std::min(std::max(static_cast<int>(y) + dy, 0), h - 1);
+            float const *var_row = var + qy * static_cast<int>(w);
+            float wy = dy == 0 ? 0.5f : 0.25f;
+            for (unsigned x = 0; x < w; x++) {
+                unsigned x0 = x > 0 ? x - 1 : 0;
+                unsigned x1 = x + 1 < w ? x + 1 : x;
+                lum_tolerance[x] +=
+                    wy * (0.25f * var_row[x0] + 0.5f * var_row[x] + 0.25f * var_row[x1]);
+            }
+        }
+
+        pixel_row pixels{nx + row, ny + row, nz + row, depth + row, depth_grad + row, lum,
+                         lum_tolerance};
+        float const center = AtrousKernel[2] * AtrousKernel[2];
+        for (unsigned x = 0; x < w; x++) {
+            unsigned p = row + x;
+            lum[x] = 0.299f * r[p] + 0.587f * g[p] + 0.114f * b[p];
+            lum_tolerance[x] = AtrousLuminanceSigma * std::sqrt(std::max(lum_tolerance[x], 0.0f)) +
+                               AtrousLuminanceEpsilon;
+            sum_r[x] = center * r[p];
+            sum_g[x] = center * g[p];
+            sum_b[x] = center * b[p];
+            sum_var[x] = center * center * var[p];
+            sum_w[x] = center;
+        }
+
+        for (int ky = 0; ky < 5; ky++) {
+            int qy = static_cast<int>(y) + (ky - 2) * static_cast<int>(data->step);
+            if (qy < 0 || qy >= h) {
+                continue;
+            }
+            for (int kx = 0; kx < 5; kx++) {
+                if (kx == 2 && ky == 2) {
+                    continue;
+                }
+                int dx = (kx - 2) * static_cast<int>(data->step);
+                if (std::abs(dx) >= static_cast<int>(w)) {
+                    continue;
+                }
+                unsigned x_begin = dx < 0 ? static_cast<unsigned>(-dx) : 0;
+                unsigned x_end = dx > 0 ? w - static_cast<unsigned>(dx) : w;
+                float const kernel = AtrousKernel[ky] * AtrousKernel[kx];
+                float const dist =
+                    data->step * std::sqrt(static_cast<float>((kx - 2) * (kx - 2) +
+                                                              (ky - 2) * (ky - 2)));
+
+                std::ptrdiff_t const offset = static_cast<std::ptrdiff_t>(qy) * w + dx;
+                plane_row taps{nx + offset, ny + offset, nz + offset, depth + offset,
+                               r + offset,  g + offset,  b + offset,  var + offset};
+                accumulate_tap(pixels, taps, kernel, dist, x_begin, x_end, sum_r, sum_g,
+                               sum_b, sum_var, sum_w);
+            }
+        }
+
+        for (unsigned x = 0; x < w; x++) {
+            unsigned p = row + x;
+            if (depth[p] == 0.0f) {
+                // Not on a surface, so there is nothing to tell the edges by.
+                data->dst[0][p] = r[p];
+                data->dst[1][p] = g[p];
+                data->dst[2][p] = b[p];
+                data->dst[3][p] = var[p];
+                continue;
+            }
+            float inv_w = 1.0f / sum_w[x];
+            data->dst[0][p] = sum_r[x] * inv_w;
+            data->dst[1][p] = sum_g[x] * inv_w;
+            data->dst[2][p] = sum_b[x] * inv_w;
+            data->dst[3][p] = sum_var[x] * inv_w * inv_w;
+        }
+    }
+}
+
+e8::atrous_denoiser::atrous_denoiser(unsigned num_threads, unsigned num_levels)
+    : m_thrpool(num_threads == 0 ? e8util::cpu_core_count() : num_threads),
+      m_num_levels(num_levels) {
+    unsigned num_bands = num_threads == 0 ? e8util::cpu_core_count() : num_threads;
+    for (unsigned i = 0; i < num_bands; i++) {
+        m_tasks.push_back(band_task(i, num_bands));
+    }
+}
+
+e8::atrous_denoiser::~atrous_denoiser() = default;
+
+void e8::atrous_denoiser::denoise(aov_buffers const &aovs, if_compositor *compositor) {
+    unsigned const w = aovs.width;
+    unsigned const h = aovs.height;
+    unsigned const n = w * h;
+    if (n == 0 || compositor->width() != w || compositor->height() != h) {
+        return;
+    }
+    m_nx.resize(n);
+    m_ny.resize(n);
+    m_nz.resize(n);
+    m_depth.resize(n);
+    m_depth_grad.resize(n);
+    for (std::vector<float> *planes : {m_planes[0], m_planes[1]}) {
+        for (unsigned c = 0; c < 4; c++) {
+            planes[c].resize(n);
+        }
+    }
+
+    // Split the guides and the demodulated color into planes.
+    for (unsigned y = 0; y < h; y++) {
+        for (unsigned x = 0; x < w; x++) {
+            unsigned p = x + y * w;
+            m_nx[p] = aovs.normal[p](0);
+            m_ny[p] = aovs.normal[p](1);
+            m_nz[p] = aovs.normal[p](2);
+            m_depth[p] = aovs.depth[p];
+            e8util::color3 a = demodulation(aovs.albedo[p]);
+            rgba_color color = (*compositor)(x, y);
+            for (unsigned c = 0; c < 3; c++) {
+                m_planes[0][c][p] = color(c) / a(c);
+            }
+            float a_lum = e8util::color3_luminance(a);
+            m_planes[0][3][p] = aovs.variance[p] / (a_lum * a_lum);
+        }
+    }
+
+    // The gradient takes the smaller of the one-sided differences, so it doesn't see across the
+    // silhouettes.
+    auto one_sided = [this](unsigned p, bool has_lo, unsigned lo, bool has_hi, unsigned hi) {
+        float d = std::numeric_limits<float>::infinity();
+        if (has_lo && m_depth[lo] > 0.0f) {
+            d = std::min(d, std::abs(m_depth[p] - m_depth[lo]));
+        }
+        if (has_hi && m_depth[hi] > 0.0f) {
+            d = std::min(d, std::abs(m_depth[p] - m_depth[hi]));
+        }
+        return std::isinf(d) ? 0.0f : d;
+    };
+    for (unsigned y = 0; y < h; y++) {
+        for (unsigned x = 0; x < w; x++) {
+            unsigned p = x + y * w;
+            float gx = one_sided(p, x > 0, p - 1, x + 1 < w, p + 1);
+            float gy = one_sided(p, y > 0, p - w, y + 1 < h, p + w);
+            m_depth_grad[p] = std::sqrt(gx * gx + gy * gy);
+        }
+    }
+
+    level_data data;
+    data.width = w;
+    data.height = h;
+    data.nx = m_nx.data();
+    data.ny = m_ny.data();
+    data.nz = m_nz.data();
+    data.depth = m_depth.data();
+    data.depth_grad = m_depth_grad.data();
+    for (unsigned level = 0; level < m_num_levels; level++) {
+        data.step = 1U << level;
+        for (unsigned c = 0; c < 4; c++) {
+            data.src[c] = m_planes[level % 2][c].data();
+            data.dst[c] = m_planes[(level + 1) % 2][c].data();
+        }
+        for (band_task &task : m_tasks) {
+            m_thrpool.run(&task, &data);
+        }
+        for (unsigned k = 0; k < m_tasks.size(); k++) {
+            m_thrpool.retrieve_next_completed();
+        }
+    }
+
+    // Modulate the filtered color back.
+    std::vector<float> const *result = m_planes[m_num_levels % 2];
+    for (unsigned y = 0; y < h; y++) {
+        for (unsigned x = 0; x < w; x++) {
+            unsigned p = x + y * w;
+            e8util::color3 a = demodulation(aovs.albedo[p]);
+            rgba_color &color = (*compositor)(x, y);
+            for (unsigned c = 0; c < 3; c++) {
+                color(c) = result[c][p] * a(c);
+            }
+        }
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "tensor.h"
+#include "thread.h"
+#include <vector>
+
+namespace e8 {
+
+class if_compositor;
+
+/**
+ * @brief The aov_buffers struct Arbitrary output variables of the image, the features of the first
+ * hits that the denoiser tells the edges apart by. The pixels are laid out row by row.
+ */
+struct aov_buffers {
+    unsigned width = 0;
+    unsigned height = 0;
+
+    // Normal at the first hit, facing the camera, or 0 where the ray escapes the scene.
+    std::vector<e8util::vec3> normal;
+
+    // Distance to the first hit, or 0 where the ray escapes the scene.
+    std::vector<float> depth;
+
+    // Albedo of the material at the first hit.
+    std::vector<e8util::color3> albedo;
+
+    // Variance of the luminance of the pixel estimates.
+    std::vector<float> variance;
+};
+
+/**
+ * @brief The atrous_denoiser class Edge-avoiding À-trous wavelet filter (Dammertz et al.,
+ * "Edge-avoiding À-trous wavelet transform for fast global illumination filtering", 2010), with
+ * the luminance weight scaled by the variance of the estimates as in spatiotemporal
+ * variance-guided filtering (Schied et al., 2017). Every level applies a 5x5 B3-spline kernel whose
+ * taps are spread twice as far as the previous level's, weighted by how alike the normals, the
+ * depths and the luminances are. The albedo is divided out before filtering and multiplied back
+ * after, so the textures stay sharp. The levels are filtered in bands of rows in parallel, and
+ * every tap goes over a row at a time so the compiler can vectorize it.
+ */
+class atrous_denoiser {
+  public:
+    /**
+     * @brief atrous_denoiser
+     * @param num_threads Number of filtering threads. 0 means one per CPU core.
+     * @param num_levels Number of levels of the wavelet transform. The filter covers
+     * 4*(2^num_levels - 1) + 1 pixels across.
+     */
+    explicit atrous_denoiser(unsigned num_threads = 0, unsigned num_levels = 5);
+    ~atrous_denoiser();
+
+    /**
+     * @brief denoise Filters the image in the compositor, which must be the size of the AOVs.
+     */
+    void denoise(aov_buffers const &aovs, if_compositor *compositor);
+
+  private:
+    /**
+     * @brief The level_data struct The planes a level of the filter reads and writes.
+     */
+    struct level_data : public e8util::if_task_storage {
+        unsigned width = 0;
+        unsigned height = 0;
+
+        // Distance between the taps.
+        unsigned step = 1;
+
+        // Guides.
+        float const *nx = nullptr;
+        float const *ny = nullptr;
+        float const *nz = nullptr;
+        float const *depth = nullptr;
+        float const *depth_grad = nullptr;
+
+        // Demodulated color and the variance of its luminance, before and after the level.
+        float const *src[4] = {nullptr, nullptr, nullptr, nullptr};
+        float *dst[4] = {nullptr, nullptr, nullptr, nullptr};
+    };
+
+    /**
+     * @brief The band_task class Filters a band of rows of a level.
+     */
+    class band_task : public e8util::if_task {
+      public:
+        band_task(unsigned index, unsigned num_bands);
+
+        void run(e8util::if_task_storage *storage) override;
+
+      private:
+        unsigned m_index;
+        unsigned m_num_bands;
+
+        // Sums of the weighted taps along a row, the luminance of the row's pixels and how much the
+        // luminance of the taps may differ from it.
+        std::vector<float> m_sums[5];
+        std::vector<float> m_lum;
+        std::vector<float> m_lum_tolerance;
+    };
+
+    std::vector<band_task> m_tasks;
+    e8util::thread_pool m_thrpool;
+    unsigned m_num_levels;
+
+    // Guide and color planes.
+    std::vector<float> m_nx;
+    std::vector<float> m_ny;
+    std::vector<float> m_nz;
+    std::vector<float> m_depth;
+    std::vector<float> m_depth_grad;
+    std::vector<float> m_planes[2][4];
+};
+
+} // namespace e8
+
+#endif // DENOISER_H
@@ -27,7 +27,7 @@ e8::trimesh::trimesh(trimesh const &mesh) : if_geometry(mesh) {
     m_texcoords = mesh.m_texcoords;
     m_tris = mesh.m_tris;
     m_aabb = mesh.m_aabb;
-    m_cum_area = mesh.m_cum_area;
+    m_face_table = mesh.m_face_table;
     m_area = mesh.m_area;
 }
 
@@ -41,16 +41,14 @@ std::vector<e8util::vec2> const &e8::trimesh::texcoords() const { return m_texco
 
 std::vector<e8::triangle> const &e8::trimesh::triangles() const { return m_tris; }
 
-e8::if_geometry::surface_sample e8::trimesh::sample(e8util::rng *rng) const {
-    // select a triangle.
-    // @todo: use cdf.
-    float q = rng->draw();
-    unsigned i = static_cast<unsigned>(q * m_tris.size());
+e8::if_geometry::surface_sample e8::trimesh::sample(if_sampler *sampler) const {
+    // select a triangle in proportion to its area.
+    unsigned i = m_face_table.sample(sampler->draw());
 
     e8::triangle const &t = m_tris[i];
 
-    float u = rng->draw();
-    float v = rng->draw();
+    float u = sampler->draw();
+    float v = sampler->draw();
 
     float r = std::sqrt(u);
     float b0 = 1 - r;
@@ -60,7 +58,11 @@ e8::if_geometry::surface_sample e8::trimesh::sample(e8util::rng *rng) const {
     surface_sample sample;
     sample.p = b0 * m_verts[t(0)] + b1 * m_verts[t(1)] + b2 * m_verts[t(2)];
     sample.n = (b0 * m_norms[t(0)] + b1 * m_norms[t(1)] + b2 * m_norms[t(2)]).normalize();
+    if (!m_texcoords.empty()) {
+        sample.uv = b0 * m_texcoords[t(0)] + b1 * m_texcoords[t(1)] + b2 * m_texcoords[t(2)];
+    }
     sample.area_dens = 1.0f / m_area;
+    sample.face = i;
 
     return sample;
 }
@@ -83,6 +85,7 @@ std::unique_ptr<e8::if_geometry> e8::trimesh::transform(e8util::mat44 const &tra
         transformed->m_norms[i] = (normal_trans * transformed->m_norms[i].homo(1.0f)).cart();
     }
     transformed->update_aabb();
+    transformed->update_face_cdf();
     return transformed;
 }
 
@@ -104,17 +107,17 @@ void e8::trimesh::update_aabb() {
 
 void e8::trimesh::update_face_cdf() {
     // compute area distribution.
-    m_cum_area.resize(m_tris.size());
-    float cum = 0;
+    std::vector<float> areas(m_tris.size());
+    float total = 0;
     for (unsigned i = 0; i < m_tris.size(); i++) {
         unsigned v0 = m_tris[i](0);
         unsigned v1 = m_tris[i](1);
         unsigned v2 = m_tris[i](2);
-        float a = 0.5f * (m_verts[v1] - m_verts[v0]).outer(m_verts[v2] - m_verts[v0]).norm();
-        cum += a;
-        m_cum_area[i] = cum;
+        areas[i] = 0.5f * (m_verts[v1] - m_verts[v0]).outer(m_verts[v2] - m_verts[v0]).norm();
+        total += areas[i];
     }
-    m_area = cum;
+    m_face_table = e8util::alias_table(areas);
+    m_area = total;
 }
 
 void e8::trimesh::update() {
@@ -158,6 +161,45 @@ e8::triangle_fragment::triangle_fragment(std::string const &name, e8util::vec3 c
 
 e8::triangle_fragment::~triangle_fragment() {}
 
+// quad
+e8::quad::quad(std::string const &name, e8util::vec3 const &o, e8util::vec3 const &u,
+               e8util::vec3 const &v)
+    : trimesh(name), m_o(o), m_u(u), m_v(v) {
+    update_mesh();
+}
+
+e8::quad::quad(quad const &other)
+    : trimesh(other), m_o(other.m_o), m_u(other.m_u), m_v(other.m_v) {}
+
+e8::quad::~quad() {}
+
+e8util::vec3 const &e8::quad::corner() const { return m_o; }
+
+e8util::vec3 const &e8::quad::edge_u() const { return m_u; }
+
+e8util::vec3 const &e8::quad::edge_v() const { return m_v; }
+
+std::unique_ptr<e8::if_geometry> e8::quad::copy() const { return std::make_unique<quad>(*this); }
+
+std::unique_ptr<e8::if_geometry> e8::quad::transform(e8util::mat44 const &trans) const {
+    std::unique_ptr<quad> transformed = std::make_unique<quad>(*this);
+    transformed->m_o = (trans * m_o.homo(1.0f)).cart();
+    transformed->m_u = (trans * (m_o + m_u).homo(1.0f)).cart() - transformed->m_o;
+    transformed->m_v = (trans * (m_o + m_v).homo(1.0f)).cart() - transformed->m_o;
+    transformed->update_mesh();
+    return transformed;
+}
+
+void e8::quad::update_mesh() {
+    m_verts = std::vector<e8util::vec3>{m_o, m_o + m_u, m_o + m_u + m_v, m_o + m_v};
+    e8util::vec3 n = m_u.outer(m_v).normalize();
+    m_norms = std::vector<e8util::vec3>{n, n, n, n};
+    m_texcoords =
+        std::vector<e8util::vec2>{{0.0f, 0.0f}, {1.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 1.0f}};
+    m_tris = std::vector<triangle>{triangle{0, 1, 2}, triangle{0, 2, 3}};
+    update();
+}
+
 // sphere
 e8::uv_sphere::uv_sphere(std::string const &name, e8util::vec3 const &o, float r,
                          unsigned const res, bool flip_normal)
@@ -60,12 +60,14 @@ class if_geometry : public if_operable_obj<if_geometry> {
     virtual std::vector<triangle> const &triangles() const = 0;
 
     struct surface_sample {
-        e8util::vec3 p;  // Spatial position on the sampled surface.
-        e8util::vec3 n;  // Normal vector at p.
-        float area_dens; // Area probability density of the sample.
+        e8util::vec3 p;    // Spatial position on the sampled surface.
+        e8util::vec3 n;    // Normal vector at p.
+        e8util::vec2 uv;   // Texture coordinate at p, if the geometry has any.
+        float area_dens;   // Area probability density of the sample.
+        unsigned face = 0; // Index of the triangle p is on.
     };
 
-    virtual surface_sample sample(e8util::rng *rng) const = 0;
+    virtual surface_sample sample(if_sampler *sampler) const = 0;
     virtual float surface_area() const = 0;
     virtual e8util::aabb aabb() const = 0;
     virtual std::unique_ptr<if_geometry> copy() const override = 0;
@@ -89,7 +91,7 @@ class trimesh : public if_geometry {
     std::vector<e8util::vec3> const &normals() const override;
     std::vector<e8util::vec2> const &texcoords() const override;
     std::vector<triangle> const &triangles() const override;
-    surface_sample sample(e8util::rng *rng) const override;
+    surface_sample sample(if_sampler *sampler) const override;
     float surface_area() const override;
     virtual e8util::aabb aabb() const override;
     std::unique_ptr<if_geometry> copy() const override;
@@ -111,7 +113,9 @@ class trimesh : public if_geometry {
     std::vector<e8util::vec2> m_texcoords;
     std::vector<triangle> m_tris;
     e8util::aabb m_aabb;
-    std::vector<float> m_cum_area;
+
+    // Samples the faces in proportion to their areas.
+    e8util::alias_table m_face_table;
     float m_area;
 };
 
@@ -122,6 +126,39 @@ class triangle_fragment : public trimesh {
     ~triangle_fragment();
 };
 
+/**
+ * @brief The quad class Rectangle spanned by two perpendicular edges from a corner. It keeps the
+ * analytic form so that lights can sample its solid angle.
+ */
+class quad : public trimesh {
+  public:
+    /**
+     * @brief quad
+     * @param name Name of the geometry.
+     * @param o Corner of the rectangle.
+     * @param u Edge from the corner.
+     * @param v Edge from the corner, perpendicular to u. The rectangle faces u x v.
+     */
+    quad(std::string const &name, e8util::vec3 const &o, e8util::vec3 const &u,
+         e8util::vec3 const &v);
+    quad(quad const &other);
+    ~quad() override;
+
+    e8util::vec3 const &corner() const;
+    e8util::vec3 const &edge_u() const;
+    e8util::vec3 const &edge_v() const;
+
+    std::unique_ptr<if_geometry> copy() const override;
+    std::unique_ptr<if_geometry> transform(e8util::mat44 const &trans) const override;
+
+  private:
+    void update_mesh();
+
+    e8util::vec3 m_o;
+    e8util::vec3 m_u;
+    e8util::vec3 m_v;
+};
+
 class uv_sphere : public trimesh {
   public:
     uv_sphere(std::string const &name, e8util::vec3 const &o, float r, unsigned const res,
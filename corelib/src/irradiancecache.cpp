@@ -0,0 +1,204 @@
+#include "irradiancecache.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// Records behind the lookup point by more than this fraction of their radius don't see the same
+// surroundings.
+float const InFrontTolerance = 0.05f;
+
+/**
+ * @brief overlaps Whether the cube centered at c with half size h overlaps the box [lo, hi].
+ */
+bool overlaps(e8util::vec3 const &c, float h, e8util::vec3 const &lo, e8util::vec3 const &hi) {
+    for (unsigned a = 0; a < 3; a++) {
+        if (c(a) + h < lo(a) || c(a) - h > hi(a)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+e8::irradiance_cache::irradiance_cache(float max_error) : m_max_error(max_error) {}
+
+e8::irradiance_cache::~irradiance_cache() = default;
+
+e8util::vec3 e8::irradiance_cache::stratum_direction(e8util::vec3 const &n, unsigned j,
+                                                     unsigned k, float e0, float e1) {
+    e8util::vec3 u, v;
+    e8util::vec3_basis(n, &u, &v);
+    float sin_theta = std::sqrt((j + e1) / num_theta);
+    float cos_theta = std::sqrt(std::max(0.0f, 1.0f - sin_theta * sin_theta));
+    float phi = 2.0f * static_cast<float>(M_PI) * (k + e0) / num_phi;
+    return sin_theta * std::cos(phi) * u + sin_theta * std::sin(phi) * v + cos_theta * n;
+}
+
+void e8::irradiance_cache::reset(e8util::aabb const &bound, float min_radius, float max_radius) {
+    m_min_radius = min_radius;
+    m_max_radius = max_radius;
+    m_records.clear();
+    m_nodes.clear();
+    if (bound.is_empty()) {
+        m_nodes.push_back(node(e8util::vec3(0.0f), 1.0f));
+    } else {
+        e8util::vec3 extent = bound.max() - bound.min();
+        float half_size = 0.5f * std::max(extent(0), std::max(extent(1), extent(2)));
+        m_nodes.push_back(node(bound.centroid(), half_size * 1.01f + 1e-4f));
+    }
+}
+
+bool e8::irradiance_cache::empty() const { return m_records.empty(); }
+
+unsigned e8::irradiance_cache::num_records() const {
+    return static_cast<unsigned>(m_records.size());
+}
+
+e8util::color3 e8::irradiance_cache::insert(e8util::vec3 const &p, e8util::vec3 const &n,
+                                            e8util::color3 const *rad, float const *dist) {
+    e8util::vec3 u, v;
+    e8util::vec3_basis(n, &u, &v);
+    float const two_pi = 2.0f * static_cast<float>(M_PI);
+    float const stratum_weight = static_cast<float>(M_PI) / (num_theta * num_phi);
+    auto at = [](unsigned j, unsigned k) { return j * num_phi + k % num_phi; };
+
+    record rec;
+    rec.p = p;
+    rec.n = n;
+    for (unsigned c = 0; c < 3; c++) {
+        rec.rot_grad[c] = 0.0f;
+        rec.trans_grad[c] = 0.0f;
+    }
+
+    float inv_dist_sum = 0.0f;
+    for (unsigned k = 0; k < num_phi; k++) {
+        // Azimuth through the middle of the stratum, and the one of its boundary with the previous
+        // stratum.
+        float phi = two_pi * (k + 0.5f) / num_phi;
+        float phi_lo = two_pi * k / num_phi;
+        e8util::vec3 u_k = std::cos(phi) * u + std::sin(phi) * v;
+        e8util::vec3 v_k = -std::sin(phi) * u + std::cos(phi) * v;
+        e8util::vec3 v_k_lo = -std::sin(phi_lo) * u + std::cos(phi_lo) * v;
+
+        e8util::color3 rot_sum;
+        e8util::color3 polar_sum;
+        e8util::color3 azimuth_sum;
+        for (unsigned j = 0; j < num_theta; j++) {
+            e8util::color3 const &l = rad[at(j, k)];
+            float d = dist[at(j, k)];
+            rec.irradiance += l;
+            inv_dist_sum += 1.0f / d;
+
+            float sin2_mid = (j + 0.5f) / num_theta;
+            rot_sum += l * std::sqrt(sin2_mid / (1.0f - sin2_mid));
+
+            // Translation changes the solid angle of the strata by the amount their boundaries
+            // move, which is inversely proportional to the distance to what is seen through them.
+            float sin2_lo = static_cast<float>(j) / num_theta;
+            float sin_lo = std::sqrt(sin2_lo);
+            float sin_hi = std::sqrt((j + 1.0f) / num_theta);
+            if (j > 0) {
+                float d_lo = std::min(d, dist[at(j - 1, k)]);
+                polar_sum += (l - rad[at(j - 1, k)]) * (sin_lo * (1.0f - sin2_lo) / d_lo);
+            }
+            float d_prev = std::min(d, dist[at(j, k + num_phi - 1)]);
+            azimuth_sum += (l - rad[at(j, k + num_phi - 1)]) * ((sin_hi - sin_lo) / d_prev);
+        }
+        for (unsigned c = 0; c < 3; c++) {
+            rec.rot_grad[c] += v_k * (rot_sum(c) * stratum_weight);
+            rec.trans_grad[c] +=
+                u_k * (polar_sum(c) * two_pi / num_phi) + v_k_lo * azimuth_sum(c);
+        }
+    }
+    rec.irradiance = rec.irradiance * stratum_weight;
+
+    float radius = inv_dist_sum > 0.0f ? num_theta * num_phi / inv_dist_sum
+                                       : std::numeric_limits<float>::infinity();
+    rec.radius = std::min(std::max(radius, m_min_radius), m_max_radius);
+
+    if (m_nodes.empty()) {
+        reset(e8util::aabb(), m_min_radius, m_max_radius);
+    }
+    unsigned index = static_cast<unsigned>(m_records.size());
+    m_records.push_back(rec);
+    float reach = m_max_error * rec.radius;
+    e8util::vec3 lo = p - e8util::vec3(reach);
+    e8util::vec3 hi = p + e8util::vec3(reach);
+    if (overlaps(m_nodes[0].center, m_nodes[0].half_size, lo, hi)) {
+        add_to_nodes(/*node_index=*/0, index, lo, hi, /*depth=*/0);
+    } else {
+        // Lookups always visit the root.
+        m_nodes[0].records.push_back(index);
+    }
+    return rec.irradiance;
+}
+
+void e8::irradiance_cache::add_to_nodes(unsigned node_index, unsigned rec, e8util::vec3 const &lo,
+                                        e8util::vec3 const &hi, unsigned depth) {
+    if (depth == m_max_depth || 2.0f * m_nodes[node_index].half_size <= hi(0) - lo(0)) {
+        m_nodes[node_index].records.push_back(rec);
+        return;
+    }
+    for (unsigned octant = 0; octant < 8; octant++) {
+        float child_half = 0.5f * m_nodes[node_index].half_size;
+        e8util::vec3 child_center = m_nodes[node_index].center;
+        for (unsigned a = 0; a < 3; a++) {
+            child_center(a) += (octant >> a & 1) ? child_half : -child_half;
+        }
+        if (!overlaps(child_center, child_half, lo, hi)) {
+            continue;
+        }
+        if (m_nodes[node_index].children[octant] == 0) {
+            m_nodes[node_index].children[octant] = static_cast<unsigned>(m_nodes.size());
+            m_nodes.push_back(node(child_center, child_half));
+        }
+        add_to_nodes(m_nodes[node_index].children[octant], rec, lo, hi, depth + 1);
+    }
+}
+
+bool e8::irradiance_cache::lookup(e8util::vec3 const &p, e8util::vec3 const &n,
+                                  e8util::color3 *irradiance) const {
+    e8util::color3 sum;
+    float weight_sum = 0.0f;
+    unsigned node_index = 0;
+    while (node_index < m_nodes.size()) {
+        node const &nd = m_nodes[node_index];
+        for (unsigned r : nd.records) {
+            record const &rec = m_records[r];
+            e8util::vec3 d = p - rec.p;
+            if (d.inner(n + rec.n) * 0.5f < -InFrontTolerance * rec.radius) {
+                continue;
+            }
+            // Ward's weight, shifted so that it falls continuously to 0 at the error threshold.
+            float error = std::sqrt(d.inner(d)) / rec.radius +
+                          std::sqrt(std::max(0.0f, 1.0f - n.inner(rec.n)));
+            if (error >= m_max_error) {
+                continue;
+            }
+            float w = 1.0f / std::max(error, 1e-4f) - 1.0f / m_max_error;
+            e8util::vec3 rot = rec.n.outer(n);
+            e8util::color3 e = rec.irradiance;
+            for (unsigned c = 0; c < 3; c++) {
+                e(c) = std::max(0.0f, e(c) + rot.inner(rec.rot_grad[c]) +
+                                          d.inner(rec.trans_grad[c]));
+            }
+            sum += e * w;
+            weight_sum += w;
+        }
+
+        unsigned octant = (p(0) > nd.center(0) ? 1 : 0) | (p(1) > nd.center(1) ? 2 : 0) |
+                          (p(2) > nd.center(2) ? 4 : 0);
+        if (nd.children[octant] == 0) {
+            break;
+        }
+        node_index = nd.children[octant];
+    }
+    if (weight_sum == 0.0f) {
+        return false;
+    }
+    *irradiance = sum / weight_sum;
+    return true;
+}
@@ -0,0 +1,127 @@
+#ifndef IRRADIANCECACHE_H
+#define IRRADIANCECACHE_H
+
+#include "tensor.h"
+#include <vector>
+
+namespace e8 {
+
+/**
+ * @brief The irradiance_cache class Sparse set of irradiance records on the surfaces, which are
+ * interpolated near the points they were computed at instead of integrating the hemisphere at every
+ * point (Ward et al., "A ray tracing solution for diffuse interreflection", 1988). A record
+ * integrates the radiance through stratified cosine-weighted directions, and carries the rotational
+ * and translational gradients of the irradiance (Ward and Heckbert, "Irradiance gradients", 1992).
+ * The records are stored in an octree, in the nodes about the size of the region each is valid in,
+ * so a lookup only visits the nodes on the way to the leaf containing the point. The cache isn't
+ * synchronized, so every thread should own its cache.
+ */
+class irradiance_cache {
+  public:
+    /**
+     * @brief irradiance_cache
+     * @param max_error Error threshold of the interpolation weights. A record is valid up to
+     * max_error times its harmonic mean distance to the surroundings, or less where the normal
+     * differs.
+     */
+    explicit irradiance_cache(float max_error = 0.3f);
+    ~irradiance_cache();
+
+    // Number of polar and azimuthal strata of the hemisphere a record integrates.
+    static unsigned const num_theta = 8;
+    static unsigned const num_phi = 24;
+
+    /**
+     * @brief stratum_direction Direction of the stratum (j, k) of the cosine-weighted hemisphere
+     * around n, where j indexes the polar and k the azimuthal strata.
+     * @param e0 Uniform number in [0, 1) which jitters the azimuth within the stratum.
+     * @param e1 Uniform number in [0, 1) which jitters the polar angle within the stratum.
+     */
+    static e8util::vec3 stratum_direction(e8util::vec3 const &n, unsigned j, unsigned k, float e0,
+                                          float e1);
+
+    /**
+     * @brief reset Discards all the records, and sets up the octree for the records computed
+     * within bound.
+     * @param min_radius Lower bound of the harmonic mean distance of the records, so that records
+     * in the corners aren't confined to a single point.
+     * @param max_radius Upper bound of the harmonic mean distance of the records, so that records
+     * in open space don't spread over the details.
+     */
+    void reset(e8util::aabb const &bound, float min_radius, float max_radius);
+
+    /**
+     * @brief empty Whether the cache has no record or hasn't been set up by reset().
+     */
+    bool empty() const;
+
+    /**
+     * @brief num_records Number of records in the cache.
+     */
+    unsigned num_records() const;
+
+    /**
+     * @brief insert Adds a record at p with normal n.
+     * @param rad Radiance arriving through the direction of every stratum, indexed by
+     * j*num_phi + k.
+     * @param dist The distance the radiance travels along every stratum direction, which is
+     * infinite if it comes from outside the scene.
+     * @return Irradiance of the record.
+     */
+    e8util::color3 insert(e8util::vec3 const &p, e8util::vec3 const &n, e8util::color3 const *rad,
+                          float const *dist);
+
+    /**
+     * @brief lookup Interpolates the irradiance at p with normal n from the records valid there.
+     * @return false if no record is valid at p.
+     */
+    bool lookup(e8util::vec3 const &p, e8util::vec3 const &n, e8util::color3 *irradiance) const;
+
+  private:
+    struct record {
+        e8util::vec3 p;
+        e8util::vec3 n;
+        e8util::color3 irradiance;
+
+        // Gradients of every color channel of the irradiance, with respect to the rotation of n
+        // and the translation of p.
+        e8util::vec3 rot_grad[3];
+        e8util::vec3 trans_grad[3];
+
+        // Clamped harmonic mean distance to the surroundings.
+        float radius;
+    };
+
+    struct node {
+        node(e8util::vec3 const &center, float half_size) : center(center), half_size(half_size) {}
+
+        e8util::vec3 center;
+        float half_size;
+
+        // Index of the child in every octant, or 0 if it doesn't exist.
+        unsigned children[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+        std::vector<unsigned> records;
+    };
+
+    /**
+     * @brief add_to_nodes Stores the record in the nodes of the subtree rooted at node_index which
+     * overlap the box [lo, hi] and are no bigger than the box, or at the maximum depth.
+     */
+    void add_to_nodes(unsigned node_index, unsigned rec, e8util::vec3 const &lo,
+                      e8util::vec3 const &hi, unsigned depth);
+
+    // Depth of the octree beyond which the records are stored at the leaves they overlap.
+    static unsigned const m_max_depth = 16;
+
+    float m_max_error;
+    float m_min_radius = 0.0f;
+    float m_max_radius = 0.0f;
+
+    std::vector<record> m_records;
+    std::vector<node> m_nodes;
+};
+
+} // namespace e8
+
+#endif // IRRADIANCECACHE_H
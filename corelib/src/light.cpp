@@ -3,43 +3,367 @@
 #include <algorithm>
 #include <cmath>
 
+namespace {
+
+// Solid angles outside of this range are sampled by area, since sampling them by solid angle isn't
+// numerically robust.
+float const MinSphericalSampleSolidAngle = 3e-4f;
+float const MaxSphericalSampleSolidAngle = 6.22f;
+
+// Meshes with at most this many triangles select the triangle to sample by solid angle rather than
+// by area.
+unsigned const MaxSolidAngleSelectTriangles = 16;
+
+/**
+ * @brief angle_between Angle between the unit vectors a and b, accurate when they are nearly
+ * parallel.
+ */
+float angle_between(e8util::vec3 const &a, e8util::vec3 const &b) {
+    if (a.inner(b) < 0) {
+        return static_cast<float>(M_PI) - 2 * std::asin(std::min((a + b).norm() / 2, 1.0f));
+    }
+    return 2 * std::asin(std::min((b - a).norm() / 2, 1.0f));
+}
+
+/**
+ * @brief triangle_solid_angle Solid angle the triangle v0v1v2 subtends from p (Van Oosterom and
+ * Strackee, "The Solid Angle of a Plane Triangle", 1983).
+ */
+float triangle_solid_angle(e8util::vec3 const &p, e8util::vec3 const &v0, e8util::vec3 const &v1,
+                           e8util::vec3 const &v2) {
+    e8util::vec3 a = (v0 - p).normalize();
+    e8util::vec3 b = (v1 - p).normalize();
+    e8util::vec3 c = (v2 - p).normalize();
+    return 2 * std::atan2(std::abs(a.inner(b.outer(c))), 1 + a.inner(b) + b.inner(c) + c.inner(a));
+}
+
+/**
+ * @brief sample_spherical_triangle Uniformly samples a direction from p within the solid angle
+ * subtended by the triangle v0v1v2 (Arvo, "Stratified Sampling of Spherical Triangles", SIGGRAPH
+ * 1995).
+ */
+e8util::vec3 sample_spherical_triangle(e8util::vec3 const &p, e8util::vec3 const &v0,
+                                       e8util::vec3 const &v1, e8util::vec3 const &v2, float u0,
+                                       float u1) {
+    e8util::vec3 a = (v0 - p).normalize();
+    e8util::vec3 b = (v1 - p).normalize();
+    e8util::vec3 c = (v2 - p).normalize();
+
+    // Interior angles of the spherical triangle.
+    e8util::vec3 n_ab = a.outer(b).normalize();
+    e8util::vec3 n_bc = b.outer(c).normalize();
+    e8util::vec3 n_ca = c.outer(a).normalize();
+    float alpha = angle_between(n_ab, -n_ca);
+    float beta = angle_between(n_bc, -n_ab);
+    float gamma = angle_between(n_ca, -n_bc);
+
+    // Find the vertex c' such that the sub-triangle abc' covers the fraction u0 of the area.
+    float area_pi = (1 - u0) * static_cast<float>(M_PI) + u0 * (alpha + beta + gamma);
+    float cos_alpha = std::cos(alpha);
+    float sin_alpha = std::sin(alpha);
+    float sin_phi = std::sin(area_pi) * cos_alpha - std::cos(area_pi) * sin_alpha;
+    float cos_phi = std::cos(area_pi) * cos_alpha + std::sin(area_pi) * sin_alpha;
+    float k1 = cos_phi + cos_alpha;
+    float k2 = sin_phi - sin_alpha * a.inner(b);
+    float cos_bp = (k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) /
+                   ((k2 * sin_phi + k1 * cos_phi) * sin_alpha);
+    cos_bp = std::isfinite(cos_bp) ? std::min(std::max(cos_bp, -1.0f), 1.0f) : 1.0f;
+    float sin_bp = std::sqrt(std::max(0.0f, 1 - cos_bp * cos_bp));
+    e8util::vec3 cp = cos_bp * a + sin_bp * (c - c.inner(a) * a).normalize();
+
+    // Sample along the arc from b to c'.
+    float cos_theta = 1 - u1 * (1 - cp.inner(b));
+    float sin_theta = std::sqrt(std::max(0.0f, 1 - cos_theta * cos_theta));
+    return (cos_theta * b + sin_theta * (cp - cp.inner(b) * b).normalize()).normalize();
+}
+
+/**
+ * @brief sample_piecewise_constant Inverts the cumulative distribution cdf[0..n] of a piecewise
+ * constant function over [0, 1) with n equally sized pieces.
+ * @param dens Density of the sample.
+ * @return The sample in [0, 1).
+ */
+float sample_piecewise_constant(float const *cdf, unsigned n, float u, float *dens) {
+    unsigned i = static_cast<unsigned>(std::upper_bound(cdf, cdf + n + 1, u) - cdf);
+    i = std::min(std::max(i, 1U), n) - 1;
+    float mass = cdf[i + 1] - cdf[i];
+    *dens = mass * n;
+    float offset = mass > 0 ? (u - cdf[i]) / mass : 0.5f;
+    return std::min((i + offset) / n, 0x1.fffffep-1f);
+}
+
+/**
+ * @brief build_cdf Normalized cumulative distribution of the weights, written to cdf[0..n]. It's
+ * uniform if the weights sum to zero.
+ * @return Sum of the weights.
+ */
+float build_cdf(float const *weights, unsigned n, float *cdf) {
+    cdf[0] = 0;
+    for (unsigned i = 0; i < n; i++) {
+        cdf[i + 1] = cdf[i] + weights[i];
+    }
+    float sum = cdf[n];
+    for (unsigned i = 1; i <= n; i++) {
+        cdf[i] = sum > 0 ? cdf[i] / sum : static_cast<float>(i) / n;
+    }
+    cdf[n] = 1.0f;
+    return sum;
+}
+
+/**
+ * @brief The spherical_rectangle struct A rectangle as seen from a point, in the local frame of
+ * the rectangle centered at the point, where the rectangle spans [x0, x1]x[y0, y1] at z = z0.
+ */
+struct spherical_rectangle {
+    e8util::vec3 x;
+    e8util::vec3 y;
+    e8util::vec3 z;
+    float x0;
+    float y0;
+    float z0;
+    float x1;
+    float y1;
+
+    // Normals of the planes through the point and the bottom and top edges.
+    e8util::vec3 n0;
+    e8util::vec3 n2;
+
+    // Interior angles at the top and left edges.
+    float g2;
+    float g3;
+
+    // Solid angle subtended, or 0 if the point is behind the rectangle.
+    float omega;
+};
+
+spherical_rectangle subtend_rectangle(e8::quad const &q, e8util::vec3 const &p) {
+    spherical_rectangle rect;
+    float ex_len = q.edge_u().norm();
+    float ey_len = q.edge_v().norm();
+    rect.x = q.edge_u() / ex_len;
+    rect.y = q.edge_v() / ey_len;
+    rect.z = rect.x.outer(rect.y);
+
+    e8util::vec3 d = q.corner() - p;
+    rect.x0 = d.inner(rect.x);
+    rect.y0 = d.inner(rect.y);
+    rect.z0 = d.inner(rect.z);
+    rect.x1 = rect.x0 + ex_len;
+    rect.y1 = rect.y0 + ey_len;
+    rect.omega = 0;
+    if (rect.z0 >= 0) {
+        return rect;
+    }
+
+    // Solid angle from the interior angles of the spherical rectangle.
+    e8util::vec3 v00{rect.x0, rect.y0, rect.z0};
+    e8util::vec3 v01{rect.x0, rect.y1, rect.z0};
+    e8util::vec3 v10{rect.x1, rect.y0, rect.z0};
+    e8util::vec3 v11{rect.x1, rect.y1, rect.z0};
+    rect.n0 = v00.outer(v10).normalize();
+    e8util::vec3 n1 = v10.outer(v11).normalize();
+    rect.n2 = v11.outer(v01).normalize();
+    e8util::vec3 n3 = v01.outer(v00).normalize();
+    float g0 = angle_between(-rect.n0, n1);
+    float g1 = angle_between(-n1, rect.n2);
+    rect.g2 = angle_between(-rect.n2, n3);
+    rect.g3 = angle_between(-n3, rect.n0);
+    rect.omega = g0 + g1 + rect.g2 + rect.g3 - 2 * static_cast<float>(M_PI);
+    return rect;
+}
+
+} // namespace
+
 e8::if_light::if_light(std::string const &name) : if_operable_obj<if_light>(name) {}
 
 e8::if_light::~if_light() {}
 
 void e8::if_light::set_scene_boundary(e8util::aabb const & /* bbox */) {}
 
+e8util::vec3 e8::if_light::escaped_radiance(e8util::vec3 const & /* w */) const { return 0.0f; }
+
 e8::obj_protocol e8::if_light::protocol() const { return obj_protocol::obj_protocol_light; }
 
 e8::if_light::if_light(obj_id_t id, std::string const &name)
     : if_operable_obj<if_light>(id, name) {}
 
+e8::if_light::emission_surface_sample
+e8::if_light::sample_emssion_surface(if_sampler *sampler,
+                                     e8util::vec3 const & /* p_target */) const {
+    return sample_emssion_surface(sampler);
+}
+
 e8::area_light::area_light(std::string const &name, std::shared_ptr<if_geometry> const &geo,
                            e8util::vec3 const &rad)
     : if_light(name), m_geo(geo), m_rad(rad),
-      m_power(static_cast<float>(M_PI) * m_geo->surface_area() * rad) {}
+      m_power(static_cast<float>(M_PI) * m_geo->surface_area() * rad) {
+    std::vector<e8util::vec3> const &verts = m_geo->vertices();
+    std::vector<triangle> const &tris = m_geo->triangles();
+    m_tri_area.resize(tris.size());
+    for (unsigned i = 0; i < tris.size(); i++) {
+        triangle const &t = tris[i];
+        m_tri_area[i] = 0.5f * (verts[t(1)] - verts[t(0)]).outer(verts[t(2)] - verts[t(0)]).norm();
+    }
+    m_tri_table = e8util::alias_table(m_tri_area);
+}
 
 e8::area_light::area_light(area_light const &other)
     : if_light(other.id(), other.name()), m_geo(other.m_geo), m_rad(other.m_rad),
-      m_power(other.m_power) {}
+      m_power(other.m_power), m_tri_table(other.m_tri_table), m_tri_area(other.m_tri_area) {}
 
-e8::if_light::emission_sample e8::area_light::sample_emssion(e8util::rng *rng) const {
+e8::if_light::emission_sample e8::area_light::sample_emssion(if_sampler *sampler) const {
     emission_sample sample;
-    sample.surface = m_geo->sample(rng);
-    sample.w = e8util::vec3_cos_hemisphere_sample(sample.surface.n, rng->draw(), rng->draw());
+    sample.surface = m_geo->sample(sampler);
+    sample.w =
+        e8util::vec3_cos_hemisphere_sample(sample.surface.n, sampler->draw(), sampler->draw());
     sample.solid_angle_dens = sample.surface.n.inner(sample.w) / static_cast<float>(M_PI);
     return sample;
 }
 
 e8::if_light::emission_surface_sample
-e8::area_light::sample_emssion_surface(e8util::rng *rng) const {
+e8::area_light::sample_emssion_surface(if_sampler *sampler) const {
+    emission_surface_sample sample;
+    sample.surface = m_geo->sample(sampler);
+    return sample;
+}
+
+float e8::area_light::solid_angle(unsigned i, e8util::vec3 const &p_target) const {
+    std::vector<e8util::vec3> const &verts = m_geo->vertices();
+    std::vector<e8util::vec3> const &norms = m_geo->normals();
+    triangle const &t = m_geo->triangles()[i];
+    e8util::vec3 g = (verts[t(1)] - verts[t(0)]).outer(verts[t(2)] - verts[t(0)]);
+    if (g.inner(norms[t(0)] + norms[t(1)] + norms[t(2)]) < 0) {
+        g = -g;
+    }
+    if (g.inner(p_target - verts[t(0)]) <= 0) {
+        return 0.0f;
+    }
+    return triangle_solid_angle(p_target, verts[t(0)], verts[t(1)], verts[t(2)]);
+}
+
+float e8::area_light::select_by_solid_angle(e8util::vec3 const &p_target, float *omegas) const {
+    unsigned num_tris = static_cast<unsigned>(m_geo->triangles().size());
+    if (num_tris > MaxSolidAngleSelectTriangles) {
+        return 0.0f;
+    }
+    float omega_sum = 0;
+    for (unsigned j = 0; j < num_tris; j++) {
+        omegas[j] = solid_angle(j, p_target);
+        omega_sum += omegas[j];
+    }
+    return omega_sum;
+}
+
+e8::if_light::emission_surface_sample
+e8::area_light::sample_emssion_surface(if_sampler *sampler, e8util::vec3 const &p_target) const {
+    std::vector<e8util::vec3> const &verts = m_geo->vertices();
+    std::vector<e8util::vec3> const &norms = m_geo->normals();
+    std::vector<e8util::vec2> const &texcoords = m_geo->texcoords();
+    std::vector<triangle> const &tris = m_geo->triangles();
+
+    // Select a triangle by solid angle if there are only a few of them, or by area.
+    float u = sampler->draw();
+    unsigned i = 0;
+    float tri_prob = 0;
+    float omega = 0;
+    float omegas[MaxSolidAngleSelectTriangles];
+    float omega_sum = select_by_solid_angle(p_target, omegas);
+    if (omega_sum > 0) {
+        float target = u * omega_sum;
+        for (i = 0; i + 1 < tris.size() && (omegas[i] == 0 || target >= omegas[i]); i++) {
+            target -= omegas[i];
+        }
+        while (omegas[i] == 0) {
+            i--;
+        }
+        omega = omegas[i];
+        tri_prob = omega / omega_sum;
+    } else {
+        i = m_tri_table.sample(u, &tri_prob);
+        omega = solid_angle(i, p_target);
+    }
+
+    triangle const &t = tris[i];
+    e8util::vec3 const &v0 = verts[t(0)];
+    e8util::vec3 const &v1 = verts[t(1)];
+    e8util::vec3 const &v2 = verts[t(2)];
+    float u0 = sampler->draw();
+    float u1 = sampler->draw();
+
     emission_surface_sample sample;
-    sample.surface = m_geo->sample(rng);
+    float b1;
+    float b2;
+    if (omega >= MinSphericalSampleSolidAngle && omega <= MaxSphericalSampleSolidAngle) {
+        e8util::vec3 w = sample_spherical_triangle(p_target, v0, v1, v2, u0, u1);
+        e8util::vec3 e1 = v1 - v0;
+        e8util::vec3 e2 = v2 - v0;
+        e8util::vec3 g = e1.outer(e2);
+        float dist = (v0 - p_target).inner(g) / w.inner(g);
+        e8util::vec3 x = p_target + dist * w;
+        b1 = std::max(0.0f, (x - v0).outer(e2).inner(g) / g.inner(g));
+        b2 = std::max(0.0f, e1.outer(x - v0).inner(g) / g.inner(g));
+
+        // Convert the solid angle density to area density.
+        float cos_o = std::abs(w.inner(g.normalize()));
+        sample.surface.area_dens = tri_prob / omega * cos_o / (dist * dist);
+    } else {
+        float r = std::sqrt(u0);
+        b1 = r * u1;
+        b2 = r * (1 - u1);
+        sample.surface.area_dens = tri_prob / m_tri_area[i];
+    }
+    float b0 = std::max(0.0f, 1 - b1 - b2);
+
+    sample.surface.p = b0 * v0 + b1 * v1 + b2 * v2;
+    sample.surface.n = (b0 * norms[t(0)] + b1 * norms[t(1)] + b2 * norms[t(2)]).normalize();
+    if (!texcoords.empty()) {
+        sample.surface.uv = b0 * texcoords[t(0)] + b1 * texcoords[t(1)] + b2 * texcoords[t(2)];
+    }
+    sample.surface.face = i;
     return sample;
 }
 
+float e8::area_light::emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                            e8util::vec3 const & /* n */, unsigned face) const {
+    std::vector<e8util::vec3> const &verts = m_geo->vertices();
+    std::vector<triangle> const &tris = m_geo->triangles();
+    if (face >= tris.size()) {
+        return 0.0f;
+    }
+
+    float tri_prob;
+    float omega;
+    float omegas[MaxSolidAngleSelectTriangles];
+    float omega_sum = select_by_solid_angle(p_target, omegas);
+    if (omega_sum > 0) {
+        omega = omegas[face];
+        tri_prob = omega / omega_sum;
+    } else {
+        tri_prob = m_tri_table.prob(face);
+        omega = solid_angle(face, p_target);
+    }
+
+    if (omega >= MinSphericalSampleSolidAngle && omega <= MaxSphericalSampleSolidAngle) {
+        triangle const &t = tris[face];
+        e8util::vec3 g = (verts[t(1)] - verts[t(0)]).outer(verts[t(2)] - verts[t(0)]);
+        e8util::vec3 l = p - p_target;
+        float dist2 = l.inner(l);
+        float cos_o = std::abs(l.inner(g.normalize())) / std::sqrt(dist2);
+        return tri_prob / omega * cos_o / dist2;
+    }
+    return m_tri_area[face] > 0 ? tri_prob / m_tri_area[face] : 0.0f;
+}
+
+void e8::area_light::emission_dens(e8util::vec3 const & /* p */, e8util::vec3 const &n,
+                                   unsigned /* face */, e8util::vec3 const &w, float *area_dens,
+                                   float *solid_angle_dens) const {
+    *area_dens = 1.0f / m_geo->surface_area();
+    *solid_angle_dens = std::max(n.inner(w), 0.0f) / static_cast<float>(M_PI);
+}
+
 e8util::vec3 e8::area_light::eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
-                                  e8util::vec3 const &n_target) const {
+                                  e8util::vec3 const &n_target,
+                                  e8util::vec2 const & /* uv */) const {
     float r2 = i.inner(i);
     e8util::vec3 i_norm = i / std::sqrt(r2);
     float cos_o = n_light.inner(i_norm);
@@ -51,8 +375,8 @@ e8util::vec3 e8::area_light::eval(e8util::vec3 const &i, e8util::vec3 const &n_l
     }
 }
 
-e8util::vec3 e8::area_light::projected_radiance(e8util::vec3 const &w,
-                                                e8util::vec3 const &n) const {
+e8util::vec3 e8::area_light::projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                                e8util::vec2 const & /* uv */) const {
     float cos = n.inner(w);
     if (cos > 0) {
         return m_rad * cos;
@@ -61,7 +385,8 @@ e8util::vec3 e8::area_light::projected_radiance(e8util::vec3 const &w,
     }
 }
 
-e8util::vec3 e8::area_light::radiance(e8util::vec3 const &w, e8util::vec3 const &n) const {
+e8util::vec3 e8::area_light::radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                      e8util::vec2 const & /* uv */) const {
     float cos = n.inner(w);
     if (cos > 0) {
         return m_rad;
@@ -72,10 +397,37 @@ e8util::vec3 e8::area_light::radiance(e8util::vec3 const &w, e8util::vec3 const
 
 e8util::vec3 e8::area_light::power() const { return m_power; }
 
+e8::if_light::emission_bounds e8::area_light::bounds() const {
+    emission_bounds bounds;
+    bounds.box = m_geo->aabb();
+    bounds.infinite = false;
+
+    // The surface only emits on the side its normals point to.
+    bounds.cos_theta_e = 0.0f;
+
+    e8util::vec3 sum;
+    for (e8util::vec3 const &n : m_geo->normals()) {
+        sum += n;
+    }
+    if (e8util::equals(sum, e8util::vec3())) {
+        bounds.axis = e8util::vec3{0.0f, 0.0f, 1.0f};
+        bounds.cos_theta_o = -1.0f;
+        return bounds;
+    }
+    bounds.axis = sum.normalize();
+    bounds.cos_theta_o = 1.0f;
+    for (e8util::vec3 const &n : m_geo->normals()) {
+        bounds.cos_theta_o = std::min(bounds.cos_theta_o, bounds.axis.inner(n));
+    }
+    return bounds;
+}
+
 std::vector<e8::if_geometry const *> e8::area_light::geometries() const {
     return std::vector<e8::if_geometry const *>{m_geo.get()};
 }
 
+bool e8::area_light::has_geometries() const { return true; }
+
 std::unique_ptr<e8::if_light> e8::area_light::copy() const {
     return std::make_unique<area_light>(*this);
 }
@@ -84,6 +436,294 @@ std::unique_ptr<e8::if_light> e8::area_light::transform(e8util::mat44 const & /*
     return copy();
 }
 
+e8::quad_light::quad_light(std::string const &name, std::shared_ptr<quad> const &geo,
+                           e8util::vec3 const &rad)
+    : area_light(name, geo, rad), m_quad(geo) {}
+
+e8::quad_light::quad_light(quad_light const &other) : area_light(other), m_quad(other.m_quad) {}
+
+e8::if_light::emission_surface_sample
+e8::quad_light::sample_emssion_surface(if_sampler *sampler, e8util::vec3 const &p_target) const {
+    spherical_rectangle rect = subtend_rectangle(*m_quad, p_target);
+    if (!(rect.omega >= MinSphericalSampleSolidAngle &&
+          rect.omega <= MaxSphericalSampleSolidAngle)) {
+        // The rectangle can't illuminate p_target, or it can't be sampled robustly.
+        return area_light::sample_emssion_surface(sampler);
+    }
+
+    float u0 = sampler->draw();
+    float u1 = sampler->draw();
+
+    // Sample the x coordinate by the solid angle to its left.
+    float b0 = rect.n0(2);
+    float b1 = rect.n2(2);
+    float au = u0 * rect.omega + 2 * static_cast<float>(M_PI) - rect.g2 - rect.g3;
+    float fu = (std::cos(au) * b0 - b1) / std::sin(au);
+    float cu = std::copysign(1 / std::sqrt(fu * fu + b0 * b0), fu);
+    cu = std::min(std::max(cu, -0x1.fffffep-1f), 0x1.fffffep-1f);
+    float xu = -(cu * rect.z0) / std::sqrt(1 - cu * cu);
+    xu = std::min(std::max(xu, rect.x0), rect.x1);
+
+    // Sample the y coordinate uniformly in the projected height.
+    float dd = std::sqrt(xu * xu + rect.z0 * rect.z0);
+    float h0 = rect.y0 / std::sqrt(dd * dd + rect.y0 * rect.y0);
+    float h1 = rect.y1 / std::sqrt(dd * dd + rect.y1 * rect.y1);
+    float hv = h0 + u1 * (h1 - h0);
+    float yv = hv * hv < 1 - 1e-4f ? hv * dd / std::sqrt(1 - hv * hv) : rect.y1;
+
+    emission_surface_sample sample;
+    e8util::vec3 l = xu * rect.x + yv * rect.y + rect.z0 * rect.z;
+    float dist = l.norm();
+    sample.surface.p = p_target + l;
+    sample.surface.n = rect.z;
+    sample.surface.uv = e8util::vec2{(xu - rect.x0) / (rect.x1 - rect.x0),
+                                     (yv - rect.y0) / (rect.y1 - rect.y0)};
+    sample.surface.area_dens = -rect.z0 / (rect.omega * dist * dist * dist);
+    return sample;
+}
+
+float e8::quad_light::emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                            e8util::vec3 const & /* n */,
+                                            unsigned /* face */) const {
+    spherical_rectangle rect = subtend_rectangle(*m_quad, p_target);
+    if (!(rect.omega >= MinSphericalSampleSolidAngle &&
+          rect.omega <= MaxSphericalSampleSolidAngle)) {
+        return 1.0f / m_quad->surface_area();
+    }
+    float dist = (p - p_target).norm();
+    return -rect.z0 / (rect.omega * dist * dist * dist);
+}
+
+std::unique_ptr<e8::if_light> e8::quad_light::copy() const {
+    return std::make_unique<quad_light>(*this);
+}
+
+std::unique_ptr<e8::if_light> e8::quad_light::transform(e8util::mat44 const & /* trans */) const {
+    return copy();
+}
+
+e8::emissive_mesh_light::emissive_mesh_light(
+    std::string const &name, std::shared_ptr<if_geometry> const &geo, e8util::vec3 const &factor,
+    std::shared_ptr<texture_map<e8util::vec3>> const &texture)
+    : if_light(name), m_geo(geo), m_factor(factor), m_texture(texture) {
+    update_triangle_power();
+}
+
+e8::emissive_mesh_light::emissive_mesh_light(emissive_mesh_light const &other)
+    : if_light(other.id(), other.name()), m_geo(other.m_geo), m_factor(other.m_factor),
+      m_texture(other.m_texture), m_tri_table(other.m_tri_table), m_tri_area(other.m_tri_area),
+      m_power(other.m_power) {}
+
+e8util::vec3 e8::emissive_mesh_light::emission(e8util::vec2 const &uv) const {
+    if (m_texture == nullptr || m_geo->texcoords().empty()) {
+        return m_factor;
+    }
+    return m_factor * m_texture->map(uv);
+}
+
+void e8::emissive_mesh_light::update_triangle_power() {
+    std::vector<e8util::vec3> const &verts = m_geo->vertices();
+    std::vector<e8util::vec2> const &texcoords = m_geo->texcoords();
+    std::vector<triangle> const &tris = m_geo->triangles();
+    bool textured = m_texture != nullptr && !texcoords.empty();
+
+    std::vector<float> tri_power(tris.size());
+    m_tri_area.resize(tris.size());
+    m_power = 0.0f;
+    for (unsigned i = 0; i < tris.size(); i++) {
+        triangle const &t = tris[i];
+        m_tri_area[i] = 0.5f * (verts[t(1)] - verts[t(0)]).outer(verts[t(2)] - verts[t(0)]).norm();
+
+        e8util::vec3 mean_rad;
+        if (textured) {
+            // Average the texture over the triangle by splitting it into k^2 congruent
+            // sub-triangles that each cover about a texel, and looking up their centroids.
+            e8util::vec2 duv1 = texcoords[t(1)] - texcoords[t(0)];
+            e8util::vec2 duv2 = texcoords[t(2)] - texcoords[t(0)];
+            float footprint = 0.5f * std::abs(duv1(0) * duv2(1) - duv1(1) * duv2(0)) *
+                              m_texture->width() * m_texture->height();
+            unsigned k = std::min(std::max(static_cast<unsigned>(std::ceil(std::sqrt(footprint))),
+                                           1U),
+                                  32U);
+            auto texcoord = [&](float b1, float b2) {
+                return texcoords[t(0)] + b1 * duv1 + b2 * duv2;
+            };
+            for (unsigned a = 0; a < k; a++) {
+                for (unsigned b = 0; a + b < k; b++) {
+                    mean_rad += emission(texcoord((a + 1 / 3.0f) / k, (b + 1 / 3.0f) / k));
+                    if (a + b + 1 < k) {
+                        mean_rad += emission(texcoord((a + 2 / 3.0f) / k, (b + 2 / 3.0f) / k));
+                    }
+                }
+            }
+            mean_rad = mean_rad / static_cast<float>(k * k);
+        } else {
+            mean_rad = m_factor;
+        }
+
+        e8util::vec3 power = static_cast<float>(M_PI) * m_tri_area[i] * mean_rad;
+        tri_power[i] = power.norm();
+        m_power += power;
+    }
+    m_tri_table = e8util::alias_table(tri_power);
+}
+
+e8::if_light::emission_sample e8::emissive_mesh_light::sample_emssion(if_sampler *sampler) const {
+    emission_sample sample;
+    static_cast<emission_surface_sample &>(sample) = sample_emssion_surface(sampler);
+    sample.w =
+        e8util::vec3_cos_hemisphere_sample(sample.surface.n, sampler->draw(), sampler->draw());
+    sample.solid_angle_dens = sample.surface.n.inner(sample.w) / static_cast<float>(M_PI);
+    return sample;
+}
+
+e8::if_light::emission_surface_sample
+e8::emissive_mesh_light::sample_emssion_surface(if_sampler *sampler) const {
+    // select a triangle in proportion to its power.
+    float tri_prob;
+    unsigned i = m_tri_table.sample(sampler->draw(), &tri_prob);
+
+    triangle const &t = m_geo->triangles()[i];
+    std::vector<e8util::vec3> const &verts = m_geo->vertices();
+    std::vector<e8util::vec3> const &norms = m_geo->normals();
+    std::vector<e8util::vec2> const &texcoords = m_geo->texcoords();
+
+    float r = std::sqrt(sampler->draw());
+    float b0 = 1 - r;
+    float b1 = r * sampler->draw();
+    float b2 = 1 - b0 - b1;
+
+    emission_surface_sample sample;
+    sample.surface.p = b0 * verts[t(0)] + b1 * verts[t(1)] + b2 * verts[t(2)];
+    sample.surface.n = (b0 * norms[t(0)] + b1 * norms[t(1)] + b2 * norms[t(2)]).normalize();
+    if (!texcoords.empty()) {
+        sample.surface.uv = b0 * texcoords[t(0)] + b1 * texcoords[t(1)] + b2 * texcoords[t(2)];
+    }
+    sample.surface.area_dens = tri_prob / m_tri_area[i];
+    sample.surface.face = i;
+    return sample;
+}
+
+float e8::emissive_mesh_light::emission_surface_dens(e8util::vec3 const & /* p_target */,
+                                                     e8util::vec3 const & /* p */,
+                                                     e8util::vec3 const & /* n */,
+                                                     unsigned face) const {
+    if (face >= m_tri_area.size() || m_tri_area[face] == 0.0f) {
+        return 0.0f;
+    }
+    return m_tri_table.prob(face) / m_tri_area[face];
+}
+
+void e8::emissive_mesh_light::emission_dens(e8util::vec3 const &p, e8util::vec3 const &n,
+                                            unsigned face, e8util::vec3 const &w,
+                                            float *area_dens, float *solid_angle_dens) const {
+    // The surface samples don't depend on the target.
+    *area_dens = emission_surface_dens(/*p_target=*/p, p, n, face);
+    *solid_angle_dens = std::max(n.inner(w), 0.0f) / static_cast<float>(M_PI);
+}
+
+e8util::vec3 e8::emissive_mesh_light::eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
+                                           e8util::vec3 const &n_target,
+                                           e8util::vec2 const &uv) const {
+    float r2 = i.inner(i);
+    e8util::vec3 i_norm = i / std::sqrt(r2);
+    float cos_o = n_light.inner(i_norm);
+    float cos_i = n_target.inner(-i_norm);
+    if (cos_o > 0 && cos_i > 0) {
+        return emission(uv) * cos_i * cos_o / r2;
+    } else {
+        return 0.0f;
+    }
+}
+
+e8util::vec3 e8::emissive_mesh_light::projected_radiance(e8util::vec3 const &w,
+                                                         e8util::vec3 const &n,
+                                                         e8util::vec2 const &uv) const {
+    float cos = n.inner(w);
+    if (cos > 0) {
+        return emission(uv) * cos;
+    } else {
+        return 0.0f;
+    }
+}
+
+e8util::vec3 e8::emissive_mesh_light::radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                               e8util::vec2 const &uv) const {
+    if (n.inner(w) > 0) {
+        return emission(uv);
+    } else {
+        return 0.0f;
+    }
+}
+
+e8util::vec3 e8::emissive_mesh_light::power() const { return m_power; }
+
+e8::if_light::emission_bounds e8::emissive_mesh_light::bounds() const {
+    // Only the triangles that can be sampled contribute to the bounds.
+    std::vector<e8util::vec3> const &verts = m_geo->vertices();
+    std::vector<e8util::vec3> const &norms = m_geo->normals();
+    std::vector<triangle> const &tris = m_geo->triangles();
+
+    emission_bounds bounds;
+    bounds.infinite = false;
+    bounds.cos_theta_e = 0.0f;
+
+    bool has_emitter = false;
+    e8util::vec3 sum;
+    for (unsigned i = 0; i < tris.size(); i++) {
+        if (m_tri_table.prob(i) == 0.0f) {
+            continue;
+        }
+        for (unsigned j = 0; j < 3; j++) {
+            e8util::vec3 const &v = verts[tris[i](j)];
+            bounds.box = has_emitter ? bounds.box + v : e8util::aabb(v, v);
+            has_emitter = true;
+            sum += norms[tris[i](j)];
+        }
+    }
+    if (!has_emitter) {
+        bounds.box = m_geo->aabb();
+    }
+    if (!has_emitter || e8util::equals(sum, e8util::vec3())) {
+        bounds.axis = e8util::vec3{0.0f, 0.0f, 1.0f};
+        bounds.cos_theta_o = -1.0f;
+        return bounds;
+    }
+    bounds.axis = sum.normalize();
+    bounds.cos_theta_o = 1.0f;
+    for (unsigned i = 0; i < tris.size(); i++) {
+        if (m_tri_table.prob(i) == 0.0f) {
+            continue;
+        }
+        for (unsigned j = 0; j < 3; j++) {
+            bounds.cos_theta_o = std::min(bounds.cos_theta_o, bounds.axis.inner(norms[tris[i](j)]));
+        }
+    }
+    return bounds;
+}
+
+std::vector<e8::if_geometry const *> e8::emissive_mesh_light::geometries() const {
+    return std::vector<e8::if_geometry const *>{m_geo.get()};
+}
+
+bool e8::emissive_mesh_light::has_geometries() const { return true; }
+
+std::unique_ptr<e8::if_light> e8::emissive_mesh_light::copy() const {
+    return std::make_unique<emissive_mesh_light>(*this);
+}
+
+std::unique_ptr<e8::if_light>
+e8::emissive_mesh_light::transform(e8util::mat44 const &trans) const {
+    // The power depends on the triangle areas, so the triangles are sampled from the mesh in the
+    // world space.
+    std::unique_ptr<emissive_mesh_light> transformed = std::make_unique<emissive_mesh_light>(*this);
+    transformed->m_geo = m_geo->transform(trans);
+    transformed->update_triangle_power();
+    return transformed;
+}
+
+float e8::emissive_mesh_light::triangle_prob(unsigned i) const { return m_tri_table.prob(i); }
+
 e8::sky_light::sky_light(std::string const &name, e8util::vec3 const &rad)
     : if_light(name), m_rad(rad) {}
 
@@ -99,11 +739,11 @@ void e8::sky_light::set_scene_boundary(e8util::aabb const &bbox) {
     m_ref_p(2) = 0.0f;
 }
 
-e8::if_light::emission_sample e8::sky_light::sample_emssion(e8util::rng *rng) const {
+e8::if_light::emission_sample e8::sky_light::sample_emssion(if_sampler *sampler) const {
     emission_sample sample;
 
     e8util::vec3 z{0, 0, 1};
-    e8util::vec3 u = e8util::vec3_cos_hemisphere_sample(z, rng->draw(), rng->draw());
+    e8util::vec3 u = e8util::vec3_cos_hemisphere_sample(z, sampler->draw(), sampler->draw());
     sample.w = -u;
     sample.solid_angle_dens = 1.0f;
 
@@ -115,11 +755,11 @@ e8::if_light::emission_sample e8::sky_light::sample_emssion(e8util::rng *rng) co
 }
 
 e8::if_light::emission_surface_sample
-e8::sky_light::sample_emssion_surface(e8util::rng *rng) const {
+e8::sky_light::sample_emssion_surface(if_sampler *sampler) const {
     emission_surface_sample sample;
 
     e8util::vec3 z{0, 0, 1};
-    e8util::vec3 u = e8util::vec3_cos_hemisphere_sample(z, rng->draw(), rng->draw());
+    e8util::vec3 u = e8util::vec3_cos_hemisphere_sample(z, sampler->draw(), sampler->draw());
 
     sample.surface.n = -u;
     sample.surface.p = (u + m_ref_p) * m_dia;
@@ -128,19 +768,35 @@ e8::sky_light::sample_emssion_surface(e8util::rng *rng) const {
     return sample;
 }
 
+float e8::sky_light::emission_surface_dens(e8util::vec3 const & /* p_target */,
+                                           e8util::vec3 const & /* p */, e8util::vec3 const &n,
+                                           unsigned /* face */) const {
+    return std::max(-n(2), 0.0f) / static_cast<float>(M_PI);
+}
+
+void e8::sky_light::emission_dens(e8util::vec3 const & /* p */, e8util::vec3 const & /* n */,
+                                  unsigned /* face */, e8util::vec3 const & /* w */,
+                                  float *area_dens, float *solid_angle_dens) const {
+    *area_dens = 0.0f;
+    *solid_angle_dens = 0.0f;
+}
+
 e8util::vec3 e8::sky_light::eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
-                                 e8util::vec3 const &n_target) const {
+                                 e8util::vec3 const &n_target,
+                                 e8util::vec2 const & /* uv */) const {
     e8util::vec3 i_norm = i.normalize();
     float cos_o = n_light.inner(i_norm);
     float cos_i = n_target.inner(-i_norm);
     return m_rad * std::max(cos_o, 0.0f) * std::max(cos_i, 0.0f);
 }
 
-e8util::vec3 e8::sky_light::projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n) const {
+e8util::vec3 e8::sky_light::projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                               e8util::vec2 const & /* uv */) const {
     return m_rad * std::max(w.inner(n), 0.0f);
 }
 
-e8util::vec3 e8::sky_light::radiance(e8util::vec3 const &w, e8util::vec3 const &n) const {
+e8util::vec3 e8::sky_light::radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                     e8util::vec2 const & /* uv */) const {
     if (n.inner(w) > 0.0f) {
         return m_rad;
     } else {
@@ -148,12 +804,32 @@ e8util::vec3 e8::sky_light::radiance(e8util::vec3 const &w, e8util::vec3 const &
     }
 }
 
+e8util::vec3 e8::sky_light::escaped_radiance(e8util::vec3 const &w) const {
+    // The sky only covers the upper hemisphere, which its samples are drawn from.
+    if (w(2) > 0.0f) {
+        return m_rad;
+    } else {
+        return 0.0f;
+    }
+}
+
 e8util::vec3 e8::sky_light::power() const { return static_cast<float>(M_PI) * (m_dia * m_dia / 2); }
 
+e8::if_light::emission_bounds e8::sky_light::bounds() const {
+    emission_bounds bounds;
+    bounds.axis = e8util::vec3{0.0f, 0.0f, -1.0f};
+    bounds.cos_theta_o = -1.0f;
+    bounds.cos_theta_e = 0.0f;
+    bounds.infinite = true;
+    return bounds;
+}
+
 std::vector<e8::if_geometry const *> e8::sky_light::geometries() const {
     return std::vector<e8::if_geometry const *>();
 }
 
+bool e8::sky_light::has_geometries() const { return false; }
+
 std::unique_ptr<e8::if_light> e8::sky_light::copy() const {
     return std::make_unique<sky_light>(*this);
 }
@@ -161,3 +837,172 @@ std::unique_ptr<e8::if_light> e8::sky_light::copy() const {
 std::unique_ptr<e8::if_light> e8::sky_light::transform(e8util::mat44 const & /* trans */) const {
     return copy();
 }
+
+e8::env_light::env_light(std::string const &name,
+                         std::shared_ptr<texture_map<e8util::vec3>> const &rad_map)
+    : if_light(name), m_map(rad_map) {
+    unsigned width = m_map->width();
+    unsigned height = m_map->height();
+    float texel_solid_angle = 2 * static_cast<float>(M_PI * M_PI) / (width * height);
+
+    // Texels near the poles cover less solid angle, so they are weighted by sin(theta).
+    std::vector<float> weights(width);
+    std::vector<float> row_weights(height);
+    m_texel_cdf.resize(height * (width + 1));
+    for (unsigned r = 0; r < height; r++) {
+        float v = (r + 0.5f) / height;
+        float sin_theta = std::sin(static_cast<float>(M_PI) * v);
+        for (unsigned c = 0; c < width; c++) {
+            e8util::vec3 rad = m_map->map(e8util::vec2{(c + 0.5f) / width, v});
+            weights[c] = e8util::color3_luminance(rad) * sin_theta;
+            m_integral += rad * sin_theta * texel_solid_angle;
+        }
+        row_weights[r] = build_cdf(weights.data(), width, &m_texel_cdf[r * (width + 1)]);
+    }
+    m_row_cdf.resize(height + 1);
+    build_cdf(row_weights.data(), height, m_row_cdf.data());
+}
+
+e8::env_light::env_light(env_light const &other)
+    : if_light(other.id(), other.name()), m_map(other.m_map), m_row_cdf(other.m_row_cdf),
+      m_texel_cdf(other.m_texel_cdf), m_integral(other.m_integral), m_ref_p(other.m_ref_p),
+      m_dia(other.m_dia) {}
+
+void e8::env_light::set_scene_boundary(e8util::aabb const &bbox) {
+    m_dia = 2 * bbox.enclosing_radius();
+    m_ref_p = bbox.centroid();
+}
+
+e8util::vec2 e8::env_light::direction_to_uv(e8util::vec3 const &w) {
+    float phi = std::atan2(w(1), w(0));
+    if (phi < 0) {
+        phi += 2 * static_cast<float>(M_PI);
+    }
+    float theta = std::acos(std::min(std::max(w(2), -1.0f), 1.0f));
+    return e8util::vec2{phi / (2 * static_cast<float>(M_PI)), theta / static_cast<float>(M_PI)};
+}
+
+e8util::vec3 e8::env_light::sample_direction(if_sampler *sampler, e8util::vec2 *uv,
+                                             float *dens) const {
+    unsigned width = m_map->width();
+    unsigned height = m_map->height();
+
+    float row_dens;
+    float v = sample_piecewise_constant(m_row_cdf.data(), height, sampler->draw(), &row_dens);
+    unsigned r = std::min(static_cast<unsigned>(v * height), height - 1);
+    float texel_dens;
+    float u = sample_piecewise_constant(&m_texel_cdf[r * (width + 1)], width, sampler->draw(),
+                                        &texel_dens);
+    *uv = e8util::vec2{u, v};
+
+    float phi = 2 * static_cast<float>(M_PI) * u;
+    float theta = static_cast<float>(M_PI) * v;
+    float sin_theta = std::sin(theta);
+    *dens = sin_theta > 0 ? row_dens * texel_dens /
+                                (2 * static_cast<float>(M_PI * M_PI) * sin_theta)
+                          : 0.0f;
+    return e8util::vec3{sin_theta * std::cos(phi), sin_theta * std::sin(phi), std::cos(theta)};
+}
+
+float e8::env_light::solid_angle_dens(e8util::vec3 const &w) const {
+    unsigned width = m_map->width();
+    unsigned height = m_map->height();
+    e8util::vec2 uv = direction_to_uv(w);
+    float sin_theta = std::sin(static_cast<float>(M_PI) * uv(1));
+    if (sin_theta <= 0) {
+        return 0.0f;
+    }
+    unsigned r = std::min(static_cast<unsigned>(uv(1) * height), height - 1);
+    unsigned c = std::min(static_cast<unsigned>(uv(0) * width), width - 1);
+    float const *texel_cdf = &m_texel_cdf[r * (width + 1)];
+    float row_dens = (m_row_cdf[r + 1] - m_row_cdf[r]) * height;
+    float texel_dens = (texel_cdf[c + 1] - texel_cdf[c]) * width;
+    return row_dens * texel_dens / (2 * static_cast<float>(M_PI * M_PI) * sin_theta);
+}
+
+e8::if_light::emission_sample e8::env_light::sample_emssion(if_sampler *sampler) const {
+    emission_sample sample;
+    e8util::vec3 u = sample_direction(sampler, &sample.surface.uv, &sample.surface.area_dens);
+    sample.w = -u;
+    sample.solid_angle_dens = 1.0f;
+    sample.surface.n = -u;
+    sample.surface.p = m_ref_p + u * m_dia;
+    return sample;
+}
+
+e8::if_light::emission_surface_sample
+e8::env_light::sample_emssion_surface(if_sampler *sampler) const {
+    // Like the sky, the area density is the solid angle density of the direction.
+    emission_surface_sample sample;
+    e8util::vec3 u = sample_direction(sampler, &sample.surface.uv, &sample.surface.area_dens);
+    sample.surface.n = -u;
+    sample.surface.p = m_ref_p + u * m_dia;
+    return sample;
+}
+
+float e8::env_light::emission_surface_dens(e8util::vec3 const & /* p_target */,
+                                           e8util::vec3 const & /* p */, e8util::vec3 const &n,
+                                           unsigned /* face */) const {
+    return solid_angle_dens(-n);
+}
+
+void e8::env_light::emission_dens(e8util::vec3 const & /* p */, e8util::vec3 const & /* n */,
+                                  unsigned /* face */, e8util::vec3 const & /* w */,
+                                  float *area_dens, float *solid_angle_dens) const {
+    *area_dens = 0.0f;
+    *solid_angle_dens = 0.0f;
+}
+
+e8util::vec3 e8::env_light::eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
+                                 e8util::vec3 const &n_target, e8util::vec2 const &uv) const {
+    e8util::vec3 i_norm = i.normalize();
+    float cos_o = n_light.inner(i_norm);
+    float cos_i = n_target.inner(-i_norm);
+    return m_map->map(uv) * std::max(cos_o, 0.0f) * std::max(cos_i, 0.0f);
+}
+
+e8util::vec3 e8::env_light::projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                               e8util::vec2 const &uv) const {
+    return m_map->map(uv) * std::max(w.inner(n), 0.0f);
+}
+
+e8util::vec3 e8::env_light::radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                     e8util::vec2 const &uv) const {
+    if (n.inner(w) > 0.0f) {
+        return m_map->map(uv);
+    } else {
+        return 0.0f;
+    }
+}
+
+e8util::vec3 e8::env_light::escaped_radiance(e8util::vec3 const &w) const {
+    return m_map->map(direction_to_uv(w));
+}
+
+e8util::vec3 e8::env_light::power() const {
+    // Radiance that crosses the disk the scene projects to.
+    return static_cast<float>(M_PI) * (m_dia * m_dia / 4) * m_integral;
+}
+
+e8::if_light::emission_bounds e8::env_light::bounds() const {
+    emission_bounds bounds;
+    bounds.axis = e8util::vec3{0.0f, 0.0f, -1.0f};
+    bounds.cos_theta_o = -1.0f;
+    bounds.cos_theta_e = 0.0f;
+    bounds.infinite = true;
+    return bounds;
+}
+
+std::vector<e8::if_geometry const *> e8::env_light::geometries() const {
+    return std::vector<e8::if_geometry const *>();
+}
+
+bool e8::env_light::has_geometries() const { return false; }
+
+std::unique_ptr<e8::if_light> e8::env_light::copy() const {
+    return std::make_unique<env_light>(*this);
+}
+
+std::unique_ptr<e8::if_light> e8::env_light::transform(e8util::mat44 const & /* trans */) const {
+    return copy();
+}
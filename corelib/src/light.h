@@ -26,15 +26,85 @@ class if_light : public if_operable_obj<if_light> {
     };
     struct emission_sample : public emission_surface_sample, emission_direction_sample {};
 
-    virtual emission_sample sample_emssion(e8util::rng *rng) const = 0;
-    virtual emission_surface_sample sample_emssion_surface(e8util::rng *rng) const = 0;
+    virtual emission_sample sample_emssion(if_sampler *sampler) const = 0;
+    virtual emission_surface_sample sample_emssion_surface(if_sampler *sampler) const = 0;
 
+    /**
+     * @brief sample_emssion_surface Samples a point on the emitting surface to illuminate p_target
+     * with. Lights can concentrate the samples on where the surface looks large from p_target, e.g.
+     * by sampling the solid angle it subtends. The density is still expressed in area measure. By
+     * default, it samples independently of p_target.
+     */
+    virtual emission_surface_sample sample_emssion_surface(if_sampler *sampler,
+                                                           e8util::vec3 const &p_target) const;
+
+    /**
+     * @brief emission_surface_dens Area density that sample_emssion_surface(sampler, p_target)
+     * samples the point p with normal n on the face-th triangle of the emitting surface with, e.g.
+     * to weight a light sample against a BRDF sample that hits the light. Lights without a surface
+     * give the solid angle density of the direction -n, as their samples do.
+     */
+    virtual float emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                        e8util::vec3 const &n, unsigned face) const = 0;
+
+    /**
+     * @brief emission_dens Densities that sample_emssion() samples the point p on the face-th
+     * triangle of the emitting surface with, in area measure, and the direction w leaving p with,
+     * in solid angle measure. n is the normal at p. Lights without a surface give zero densities.
+     */
+    virtual void emission_dens(e8util::vec3 const &p, e8util::vec3 const &n, unsigned face,
+                               e8util::vec3 const &w, float *area_dens,
+                               float *solid_angle_dens) const = 0;
+
+    /**
+     * @brief eval Irradiance a point on the light transports to a target surface.
+     * @param i Vector from the point on the light to the target.
+     * @param n_light Normal at the point on the light.
+     * @param n_target Normal at the target.
+     * @param uv Texture coordinate of the point on the light, which textured emission varies with.
+     */
     virtual e8util::vec3 eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
-                              e8util::vec3 const &n_target) const = 0;
-    virtual e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n) const = 0;
-    virtual e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n) const = 0;
+                              e8util::vec3 const &n_target, e8util::vec2 const &uv) const = 0;
+    virtual e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                            e8util::vec2 const &uv) const = 0;
+    virtual e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                  e8util::vec2 const &uv) const = 0;
+
+    /**
+     * @brief escaped_radiance Radiance that a light surrounding the scene sends to a ray escaping
+     * the scene in the direction w. The density of sampling the direction is given by
+     * emission_surface_dens() with the normal -w. By default, the light doesn't surround the scene
+     * and sends nothing.
+     */
+    virtual e8util::vec3 escaped_radiance(e8util::vec3 const &w) const;
     virtual e8util::vec3 power() const = 0;
 
+    /**
+     * @brief The emission_bounds struct Conservative bounds of where and in which directions a
+     * light emits, from which collections of lights can estimate how much a light may contribute
+     * to a point.
+     */
+    struct emission_bounds {
+        // Bounding box of the emitting surface.
+        e8util::aabb box;
+
+        // Cone that bounds the surface normals, given by its axis and the cosine of its half angle.
+        e8util::vec3 axis;
+        float cos_theta_o;
+
+        // Cosine of the largest angle away from the surface normal radiance is emitted at.
+        float cos_theta_e;
+
+        // Whether the light surrounds the scene rather than being located in it. The other
+        // fields don't apply in this case.
+        bool infinite;
+    };
+
+    /**
+     * @brief bounds Bounds of the emission (see above).
+     */
+    virtual emission_bounds bounds() const = 0;
+
     virtual std::unique_ptr<if_light> copy() const override = 0;
     virtual std::unique_ptr<if_light> transform(e8util::mat44 const &trans) const override = 0;
 
@@ -44,6 +114,11 @@ class if_light : public if_operable_obj<if_light> {
      */
     virtual std::vector<if_geometry const *> geometries() const = 0;
 
+    /**
+     * @brief has_geometries Whether geometries() is non-empty, without building the list.
+     */
+    virtual bool has_geometries() const = 0;
+
     obj_protocol protocol() const override;
 
   protected:
@@ -56,21 +131,145 @@ class area_light : public if_light {
                e8util::vec3 const &rad);
     area_light(area_light const &other);
 
-    emission_sample sample_emssion(e8util::rng *rng) const override;
-    emission_surface_sample sample_emssion_surface(e8util::rng *rng) const override;
+    emission_sample sample_emssion(if_sampler *sampler) const override;
+    emission_surface_sample sample_emssion_surface(if_sampler *sampler) const override;
+
+    /**
+     * @brief sample_emssion_surface Samples the triangles of the surface by the solid angle they
+     * subtend from p_target, when the solid angle is neither too small nor too large to be sampled
+     * robustly. Otherwise, it falls back to area sampling.
+     */
+    emission_surface_sample sample_emssion_surface(if_sampler *sampler,
+                                                   e8util::vec3 const &p_target) const override;
+    float emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                e8util::vec3 const &n, unsigned face) const override;
+    void emission_dens(e8util::vec3 const &p, e8util::vec3 const &n, unsigned face,
+                       e8util::vec3 const &w, float *area_dens,
+                       float *solid_angle_dens) const override;
     e8util::vec3 eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
-                      e8util::vec3 const &n_target) const override;
-    e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n) const override;
-    e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n) const override;
+                      e8util::vec3 const &n_target, e8util::vec2 const &uv) const override;
+    e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                    e8util::vec2 const &uv) const override;
+    e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                          e8util::vec2 const &uv) const override;
     e8util::vec3 power() const override;
+    emission_bounds bounds() const override;
     std::vector<if_geometry const *> geometries() const override;
+    bool has_geometries() const override;
     std::unique_ptr<if_light> copy() const override;
     std::unique_ptr<if_light> transform(e8util::mat44 const &trans) const override;
 
   private:
+    /**
+     * @brief solid_angle Solid angle the i-th triangle subtends from p_target, or 0 if p_target is
+     * behind it.
+     */
+    float solid_angle(unsigned i, e8util::vec3 const &p_target) const;
+
+    /**
+     * @brief select_by_solid_angle Fills in the solid angles of the triangles, if there are few
+     * enough of them to be selected by solid angle.
+     * @return The sum of the solid angles, or 0 if the triangles are selected by area.
+     */
+    float select_by_solid_angle(e8util::vec3 const &p_target, float *omegas) const;
+
     std::shared_ptr<if_geometry> m_geo;
     e8util::vec3 m_rad;
     e8util::vec3 m_power;
+
+    // Samples the triangles in proportion to their areas.
+    e8util::alias_table m_tri_table;
+    std::vector<float> m_tri_area;
+};
+
+/**
+ * @brief The quad_light class Area light on a rectangle, which samples the spherical rectangle the
+ * light subtends. See Urena et al., "An Area-Preserving Parametrization for Spherical Rectangles",
+ * EGSR 2013.
+ */
+class quad_light : public area_light {
+  public:
+    quad_light(std::string const &name, std::shared_ptr<quad> const &geo,
+               e8util::vec3 const &rad);
+    quad_light(quad_light const &other);
+
+    using area_light::sample_emssion_surface;
+    emission_surface_sample sample_emssion_surface(if_sampler *sampler,
+                                                   e8util::vec3 const &p_target) const override;
+    float emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                e8util::vec3 const &n, unsigned face) const override;
+    std::unique_ptr<if_light> copy() const override;
+    std::unique_ptr<if_light> transform(e8util::mat44 const &trans) const override;
+
+  private:
+    std::shared_ptr<quad> m_quad;
+};
+
+/**
+ * @brief The emissive_mesh_light class Treats every triangle of a mesh as a light whose radiance is
+ * the emissive factor modulated by an optional emission texture. Triangles are sampled in
+ * proportion to the power they emit, so dark regions of the texture receive few or no samples.
+ */
+class emissive_mesh_light : public if_light {
+  public:
+    /**
+     * @brief emissive_mesh_light
+     * @param name Name of the light.
+     * @param geo The emitting mesh.
+     * @param factor Emitted radiance, or the scale of the texture radiance if one is present.
+     * @param texture Optional emission texture looked up by the texture coordinates of the mesh.
+     */
+    emissive_mesh_light(std::string const &name, std::shared_ptr<if_geometry> const &geo,
+                        e8util::vec3 const &factor,
+                        std::shared_ptr<texture_map<e8util::vec3>> const &texture = nullptr);
+    emissive_mesh_light(emissive_mesh_light const &other);
+
+    emission_sample sample_emssion(if_sampler *sampler) const override;
+    emission_surface_sample sample_emssion_surface(if_sampler *sampler) const override;
+    using if_light::sample_emssion_surface;
+    float emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                e8util::vec3 const &n, unsigned face) const override;
+    void emission_dens(e8util::vec3 const &p, e8util::vec3 const &n, unsigned face,
+                       e8util::vec3 const &w, float *area_dens,
+                       float *solid_angle_dens) const override;
+    e8util::vec3 eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
+                      e8util::vec3 const &n_target, e8util::vec2 const &uv) const override;
+    e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                    e8util::vec2 const &uv) const override;
+    e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                          e8util::vec2 const &uv) const override;
+    e8util::vec3 power() const override;
+    emission_bounds bounds() const override;
+    std::vector<if_geometry const *> geometries() const override;
+    bool has_geometries() const override;
+    std::unique_ptr<if_light> copy() const override;
+    std::unique_ptr<if_light> transform(e8util::mat44 const &trans) const override;
+
+    /**
+     * @brief triangle_prob Probability that sample_emssion_surface() picks the i-th triangle.
+     */
+    float triangle_prob(unsigned i) const;
+
+  private:
+    /**
+     * @brief emission Radiance emitted at the texture coordinate uv.
+     */
+    e8util::vec3 emission(e8util::vec2 const &uv) const;
+
+    /**
+     * @brief update_triangle_power Integrates the emission over every triangle and builds the
+     * triangle distribution from the results.
+     */
+    void update_triangle_power();
+
+    std::shared_ptr<if_geometry> m_geo;
+    e8util::vec3 m_factor;
+    std::shared_ptr<texture_map<e8util::vec3>> m_texture;
+
+    // Samples the triangles in proportion to their power.
+    e8util::alias_table m_tri_table;
+    std::vector<float> m_tri_area;
+    e8util::vec3 m_power;
 };
 
 class sky_light : public if_light {
@@ -80,24 +279,102 @@ class sky_light : public if_light {
     sky_light(sky_light const &other);
 
     void set_scene_boundary(e8util::aabb const &bbox) override;
-    emission_sample sample_emssion(e8util::rng *rng) const override;
-    emission_surface_sample sample_emssion_surface(e8util::rng *rng) const override;
+    emission_sample sample_emssion(if_sampler *sampler) const override;
+    emission_surface_sample sample_emssion_surface(if_sampler *sampler) const override;
+    using if_light::sample_emssion_surface;
+    float emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                e8util::vec3 const &n, unsigned face) const override;
+    void emission_dens(e8util::vec3 const &p, e8util::vec3 const &n, unsigned face,
+                       e8util::vec3 const &w, float *area_dens,
+                       float *solid_angle_dens) const override;
     e8util::vec3 eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
-                      e8util::vec3 const &n_target) const override;
-    e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n) const override;
-    e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n) const override;
+                      e8util::vec3 const &n_target, e8util::vec2 const &uv) const override;
+    e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                    e8util::vec2 const &uv) const override;
+    e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                          e8util::vec2 const &uv) const override;
+    e8util::vec3 escaped_radiance(e8util::vec3 const &w) const override;
     e8util::vec3 power() const override;
+    emission_bounds bounds() const override;
     std::vector<if_geometry const *> geometries() const override;
+    bool has_geometries() const override;
     std::unique_ptr<if_light> copy() const override;
     std::unique_ptr<if_light> transform(e8util::mat44 const &trans) const override;
 
   private:
     e8util::vec3 m_rad;
-    e8util::vec3 m_ref_p;
-    float m_dia;
+
+    // Center and diameter of the scene, which the pipeline sets before the lights are committed.
+    e8util::vec3 m_ref_p = 0.0f;
+    float m_dia = 0.0f;
     uint32_t m_padding;
 };
 
+/**
+ * @brief The env_light class Distant light surrounding the scene with the radiance of an
+ * equirectangular map, whose rows go from the +z pole (v = 0) to the -z pole (v = 1). Directions
+ * are importance sampled by inverting the marginal distribution of the rows and the conditional
+ * distribution of the texels in the row, both weighted by the solid angle the texels cover.
+ */
+class env_light : public if_light {
+  public:
+    env_light(std::string const &name, std::shared_ptr<texture_map<e8util::vec3>> const &rad_map);
+    env_light(env_light const &other);
+
+    void set_scene_boundary(e8util::aabb const &bbox) override;
+    emission_sample sample_emssion(if_sampler *sampler) const override;
+    emission_surface_sample sample_emssion_surface(if_sampler *sampler) const override;
+    using if_light::sample_emssion_surface;
+    float emission_surface_dens(e8util::vec3 const &p_target, e8util::vec3 const &p,
+                                e8util::vec3 const &n, unsigned face) const override;
+    void emission_dens(e8util::vec3 const &p, e8util::vec3 const &n, unsigned face,
+                       e8util::vec3 const &w, float *area_dens,
+                       float *solid_angle_dens) const override;
+    e8util::vec3 eval(e8util::vec3 const &i, e8util::vec3 const &n_light,
+                      e8util::vec3 const &n_target, e8util::vec2 const &uv) const override;
+    e8util::vec3 projected_radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                                    e8util::vec2 const &uv) const override;
+    e8util::vec3 radiance(e8util::vec3 const &w, e8util::vec3 const &n,
+                          e8util::vec2 const &uv) const override;
+    e8util::vec3 escaped_radiance(e8util::vec3 const &w) const override;
+    e8util::vec3 power() const override;
+    emission_bounds bounds() const override;
+    std::vector<if_geometry const *> geometries() const override;
+    bool has_geometries() const override;
+    std::unique_ptr<if_light> copy() const override;
+    std::unique_ptr<if_light> transform(e8util::mat44 const &trans) const override;
+
+    /**
+     * @brief solid_angle_dens Solid angle density of sampling the direction w, pointing from the
+     * scene to the light.
+     */
+    float solid_angle_dens(e8util::vec3 const &w) const;
+
+    /**
+     * @brief direction_to_uv Texture coordinate of the map in the direction w.
+     */
+    static e8util::vec2 direction_to_uv(e8util::vec3 const &w);
+
+  private:
+    /**
+     * @brief sample_direction Samples a direction pointing from the scene to the light.
+     */
+    e8util::vec3 sample_direction(if_sampler *sampler, e8util::vec2 *uv, float *dens) const;
+
+    std::shared_ptr<texture_map<e8util::vec3>> m_map;
+
+    // Cumulative distributions of the rows, and of the texels in every row.
+    std::vector<float> m_row_cdf;
+    std::vector<float> m_texel_cdf;
+
+    // Radiance integrated over the sphere of directions.
+    e8util::vec3 m_integral;
+
+    // Center and diameter of the scene, which the pipeline sets before the lights are committed.
+    e8util::vec3 m_ref_p = 0.0f;
+    float m_dia = 0.0f;
+};
+
 } // namespace e8
 
 #endif // LIGHT_H
@@ -1,9 +1,102 @@
 #include "lightsources.h"
 #include "light.h"
 #include "util.h"
+#include <algorithm>
 #include <assert.h>
+#include <cmath>
 #include <utility>
 
+namespace {
+
+// Largest float below 1.
+float const OneMinusEpsilon = 0x1.fffffep-1f;
+
+// Number of cells along the longest side of the scene boundary in the adaptive selection.
+float const AdaptiveGridResolution = 32.0f;
+
+// Upper bounds of the number of hashed cells, and of the records over all cells and lights.
+unsigned const MaxAdaptiveCells = 4096;
+unsigned const MaxAdaptiveRecords = 1 << 20;
+
+// Number of records a cell needs before it selects by what it learns.
+unsigned const MinAdaptiveCellRecords = 32;
+
+// Weight of the uniform distribution mixed into the learned ones.
+float const AdaptiveUniformFraction = 0.1f;
+
+void atomic_add(std::atomic<float> *x, float v) {
+    float old = x->load(std::memory_order_relaxed);
+    while (!x->compare_exchange_weak(old, old + v, std::memory_order_relaxed)) {
+    }
+}
+
+float safe_sqrt(float x) { return std::sqrt(std::max(x, 0.0f)); }
+
+/**
+ * @brief cos_sub_clamped Cosine of max(0, a - b), given the sines and cosines of the angles a and
+ * b in [0, pi].
+ */
+float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+    if (cos_a > cos_b) {
+        return 1.0f;
+    }
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+/**
+ * @brief sin_sub_clamped Sine of max(0, a - b), given the sines and cosines of the angles a and b
+ * in [0, pi].
+ */
+float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+    if (cos_a > cos_b) {
+        return 0.0f;
+    }
+    return sin_a * cos_b - cos_a * sin_b;
+}
+
+/**
+ * @brief union_bounds The smallest bounds that contain both a and b. The union of the normal
+ * cones follows Conty Estevez and Kulla, 2018.
+ */
+e8::if_light::emission_bounds union_bounds(e8::if_light::emission_bounds const &a,
+                                           e8::if_light::emission_bounds const &b) {
+    e8::if_light::emission_bounds u;
+    u.box = a.box + b.box;
+    u.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+    u.infinite = false;
+
+    u.axis = a.axis;
+    u.cos_theta_o = -1.0f;
+    if (a.cos_theta_o == -1.0f || b.cos_theta_o == -1.0f) {
+        return u;
+    }
+    float theta_a = std::acos(std::clamp(a.cos_theta_o, -1.0f, 1.0f));
+    float theta_b = std::acos(std::clamp(b.cos_theta_o, -1.0f, 1.0f));
+    float theta_d = std::acos(std::clamp(a.axis.inner(b.axis), -1.0f, 1.0f));
+    if (std::min(theta_d + theta_b, static_cast<float>(M_PI)) <= theta_a) {
+        u.cos_theta_o = a.cos_theta_o;
+        return u;
+    }
+    if (std::min(theta_d + theta_a, static_cast<float>(M_PI)) <= theta_b) {
+        u.axis = b.axis;
+        u.cos_theta_o = b.cos_theta_o;
+        return u;
+    }
+    float theta_o = (theta_a + theta_d + theta_b) / 2;
+    e8util::vec3 rot_axis = a.axis.outer(b.axis);
+    if (theta_o >= static_cast<float>(M_PI) || rot_axis.norm2() < 1e-12f) {
+        return u;
+    }
+    // Rotate a's axis towards b's, so the new cone just touches the far sides of both.
+    float theta_r = theta_o - theta_a;
+    e8util::vec3 k = rot_axis.normalize();
+    u.axis = (a.axis * std::cos(theta_r) + k.outer(a.axis) * std::sin(theta_r)).normalize();
+    u.cos_theta_o = std::cos(theta_o);
+    return u;
+}
+
+} // namespace
+
 e8::if_light_sources::if_light_sources() {}
 
 e8::if_light_sources::~if_light_sources() {}
@@ -15,17 +108,27 @@ void e8::if_light_sources::load(if_obj const &obj, e8util::mat44 const &trans) {
     for (if_geometry const *geo : light_obj.geometries()) {
         m_obj_lights_lookup.insert(std::make_pair(geo->id(), it->second.get()));
     }
+    if (it->second->bounds().infinite) {
+        m_infinite_lights.push_back(it->second.get());
+    }
 }
 
 void e8::if_light_sources::unload(if_obj const &obj) {
     auto it = m_lights.find(obj.id());
     if (it != m_lights.end()) {
+        m_infinite_lights.erase(
+            std::remove(m_infinite_lights.begin(), m_infinite_lights.end(), it->second.get()),
+            m_infinite_lights.end());
         m_lights.erase(it);
     }
 }
 
 e8::obj_protocol e8::if_light_sources::support() const { return obj_protocol::obj_protocol_light; }
 
+std::vector<e8::if_light const *> const &e8::if_light_sources::infinite_lights() const {
+    return m_infinite_lights;
+}
+
 e8::if_light const *e8::if_light_sources::obj_light(if_geometry const &obj) const {
     auto it = m_obj_lights_lookup.find(obj.id());
     if (it != m_obj_lights_lookup.end()) {
@@ -35,20 +138,39 @@ e8::if_light const *e8::if_light_sources::obj_light(if_geometry const &obj) cons
     }
 }
 
+e8::if_light const *e8::if_light_sources::sample_light(if_sampler *sampler,
+                                                       e8util::vec3 const & /*p*/,
+                                                       e8util::vec3 const & /*n*/,
+                                                       float *prob_mass) const {
+    return sample_light(sampler, prob_mass);
+}
+
+void e8::if_light_sources::set_scene_boundary(e8util::aabb const &bbox) {
+    for (std::pair<obj_id_t const, std::unique_ptr<if_light>> &light : m_lights) {
+        light.second->set_scene_boundary(bbox);
+    }
+}
+
+void e8::if_light_sources::record_contribution(if_light const * /*light*/,
+                                               e8util::vec3 const & /*p*/,
+                                               float /*contrib*/) const {}
+
+void e8::if_light_sources::adapt() {}
+
 e8::basic_light_sources::basic_light_sources() {}
 
 e8::basic_light_sources::~basic_light_sources() {}
 
-e8::basic_light_sources::light_cdf::light_cdf(if_light const *light, float cum_power)
-    : light(light), cum_power(cum_power) {}
-
 void e8::basic_light_sources::commit() {
-    m_light_cdf.clear();
+    m_light_list.clear();
     m_total_power = 0;
+    std::vector<float> powers;
     for (std::pair<obj_id_t const, std::unique_ptr<if_light>> const &light : m_lights) {
-        m_total_power += light.second->power().norm();
-        m_light_cdf.push_back(light_cdf(light.second.get(), m_total_power));
+        m_light_list.push_back(light.second.get());
+        powers.push_back(light.second->power().norm());
+        m_total_power += powers.back();
     }
+    m_light_table = e8util::alias_table(powers);
 }
 
 std::vector<e8::if_light const *>
@@ -56,20 +178,327 @@ e8::basic_light_sources::get_relevant_lights(e8util::frustum const &) const {
     throw e8util::not_implemented_exception("get_relevant_lights");
 }
 
-e8::if_light const *e8::basic_light_sources::sample_light(e8util::rng *rng,
+e8::if_light const *e8::basic_light_sources::sample_light(if_sampler *sampler,
                                                           float *prob_mass) const {
-    assert(!m_light_cdf.empty());
-    float e = rng->draw() * m_total_power;
-    unsigned lo = 0;
-    unsigned hi = static_cast<unsigned>(m_light_cdf.size());
-    while (lo < hi) {
-        unsigned mi = (lo + hi) >> 1;
-        if (m_light_cdf[mi].cum_power < e) {
-            lo = mi + 1;
+    assert(!m_light_table.empty());
+    unsigned i = m_light_table.sample(sampler->draw(), prob_mass);
+    return m_light_list[i];
+}
+
+float e8::basic_light_sources::light_prob(if_light const *light) const {
+    if (m_total_power == 0.0f) {
+        return 1.0f / m_light_list.size();
+    }
+    return light->power().norm() / m_total_power;
+}
+
+float e8::basic_light_sources::light_prob(if_light const *light, e8util::vec3 const & /*p*/,
+                                          e8util::vec3 const & /*n*/) const {
+    return light_prob(light);
+}
+
+e8::bvh_light_sources::bvh_light_sources() {}
+
+e8::bvh_light_sources::~bvh_light_sources() {}
+
+void e8::bvh_light_sources::commit() {
+    basic_light_sources::commit();
+
+    m_nodes.clear();
+    m_infinite_lights.clear();
+    m_leaves.clear();
+
+    std::vector<bounded_light> lights;
+    for (std::pair<obj_id_t const, std::unique_ptr<if_light>> const &light : m_lights) {
+        if_light::emission_bounds bounds = light.second->bounds();
+        if (bounds.infinite) {
+            m_infinite_lights.push_back(light.second.get());
         } else {
-            hi = mi;
+            lights.push_back(std::make_pair(light.second.get(), bounds));
+        }
+    }
+    if (!lights.empty()) {
+        build(lights, 0, static_cast<unsigned>(lights.size()), /*parent=*/0);
+    }
+}
+
+unsigned e8::bvh_light_sources::build(std::vector<bounded_light> &lights, unsigned start,
+                                      unsigned end, unsigned parent) {
+    unsigned index = static_cast<unsigned>(m_nodes.size());
+    m_nodes.push_back(node());
+    m_nodes[index].parent = parent;
+    m_nodes[index].second_child = 0;
+    m_nodes[index].light = nullptr;
+
+    if (end - start == 1) {
+        m_nodes[index].bounds = lights[start].second;
+        m_nodes[index].power = lights[start].first->power().norm();
+        m_nodes[index].light = lights[start].first;
+        m_leaves.insert(std::make_pair(lights[start].first, index));
+        return index;
+    }
+
+    // Split at the median along the axis the centroids spread the most.
+    e8util::aabb centroids;
+    for (unsigned i = start; i < end; i++) {
+        centroids = centroids + lights[i].second.box.centroid();
+    }
+    e8util::vec3 extent = centroids.max() - centroids.min();
+    unsigned axis = 0;
+    if (extent(1) > extent(axis)) {
+        axis = 1;
+    }
+    if (extent(2) > extent(axis)) {
+        axis = 2;
+    }
+    unsigned mid = (start + end) / 2;
+    std::nth_element(lights.begin() + start, lights.begin() + mid, lights.begin() + end,
+                     [axis](bounded_light const &a, bounded_light const &b) -> bool {
+                         return a.second.box.centroid()(axis) < b.second.box.centroid()(axis);
+                     });
+
+    unsigned first = build(lights, start, mid, index);
+    unsigned second = build(lights, mid, end, index);
+    m_nodes[index].bounds = union_bounds(m_nodes[first].bounds, m_nodes[second].bounds);
+    m_nodes[index].power = m_nodes[first].power + m_nodes[second].power;
+    m_nodes[index].second_child = second;
+    return index;
+}
+
+float e8::bvh_light_sources::importance(node const &node, e8util::vec3 const &p,
+                                        e8util::vec3 const &n) const {
+    e8util::vec3 pc = node.bounds.box.centroid();
+    float r = node.bounds.box.enclosing_radius();
+    float d2 = std::max((p - pc).norm2(), r * r);
+    e8util::vec3 wi = (p - pc).normalize();
+    if (e8util::equals(p, pc)) {
+        wi = node.bounds.axis;
+    }
+
+    // Angles between the axis and the direction to p, of the normal cone and subtended by the
+    // bounding sphere.
+    float cos_theta_w = node.bounds.axis.inner(wi);
+    float sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+    float cos_theta_o = node.bounds.cos_theta_o;
+    float sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+    float cos_theta_b = (p - pc).norm2() > r * r ? safe_sqrt(1 - r * r / (p - pc).norm2()) : -1.0f;
+    float sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+
+    // Smallest possible angle between p and the normal of any emitting point.
+    float cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    float sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+    float cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+    if (cos_theta_p <= node.bounds.cos_theta_e) {
+        return 0.0f;
+    }
+
+    // Smallest possible angle between the surface normal at p and any emitting point.
+    float cos_theta_i = -n.inner(wi);
+    float sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+    float cos_theta_pi = cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+    if (cos_theta_pi <= 0.0f) {
+        return 0.0f;
+    }
+    return node.power * cos_theta_p * cos_theta_pi / d2;
+}
+
+e8::if_light const *e8::bvh_light_sources::sample_light(if_sampler *sampler,
+                                                        e8util::vec3 const &p,
+                                                        e8util::vec3 const &n,
+                                                        float *prob_mass) const {
+    unsigned num_choices =
+        static_cast<unsigned>(m_infinite_lights.size()) + (m_nodes.empty() ? 0 : 1);
+    if (num_choices == 0) {
+        return nullptr;
+    }
+    float u = sampler->draw();
+
+    // Choose between the infinite lights and the hierarchy uniformly.
+    float p_infinite = static_cast<float>(m_infinite_lights.size()) / num_choices;
+    if (u < p_infinite) {
+        unsigned i = std::min(static_cast<unsigned>(u * num_choices),
+                              static_cast<unsigned>(m_infinite_lights.size()) - 1);
+        *prob_mass = 1.0f / num_choices;
+        return m_infinite_lights[i];
+    }
+
+    // Descend the hierarchy, reusing the random number for every decision.
+    u = std::min((u - p_infinite) / (1 - p_infinite), OneMinusEpsilon);
+    float prob = 1 - p_infinite;
+    unsigned i = 0;
+    while (m_nodes[i].light == nullptr) {
+        float w0 = importance(m_nodes[i + 1], p, n);
+        float w1 = importance(m_nodes[m_nodes[i].second_child], p, n);
+        if (w0 + w1 == 0.0f) {
+            return nullptr;
+        }
+        float p0 = w0 / (w0 + w1);
+        if (u < p0) {
+            i = i + 1;
+            u = std::min(u / p0, OneMinusEpsilon);
+            prob *= p0;
+        } else {
+            i = m_nodes[i].second_child;
+            u = std::min((u - p0) / (1 - p0), OneMinusEpsilon);
+            prob *= 1 - p0;
+        }
+    }
+    *prob_mass = prob;
+    return m_nodes[i].light;
+}
+
+float e8::bvh_light_sources::light_prob(if_light const *light, e8util::vec3 const &p,
+                                        e8util::vec3 const &n) const {
+    unsigned num_choices =
+        static_cast<unsigned>(m_infinite_lights.size()) + (m_nodes.empty() ? 0 : 1);
+    if (std::find(m_infinite_lights.begin(), m_infinite_lights.end(), light) !=
+        m_infinite_lights.end()) {
+        return 1.0f / num_choices;
+    }
+    auto it = m_leaves.find(light);
+    if (it == m_leaves.end()) {
+        return 0.0f;
+    }
+
+    // Retrace the decisions sample_light() makes from the leaf up to the root.
+    float prob = 1 - static_cast<float>(m_infinite_lights.size()) / num_choices;
+    for (unsigned i = it->second; i != 0; i = m_nodes[i].parent) {
+        unsigned parent = m_nodes[i].parent;
+        float w0 = importance(m_nodes[parent + 1], p, n);
+        float w1 = importance(m_nodes[m_nodes[parent].second_child], p, n);
+        if (w0 + w1 == 0.0f) {
+            return 0.0f;
+        }
+        prob *= (i == parent + 1 ? w0 : w1) / (w0 + w1);
+    }
+    return prob;
+}
+
+e8::adaptive_light_sources::adaptive_light_sources() {}
+
+e8::adaptive_light_sources::~adaptive_light_sources() {}
+
+void e8::adaptive_light_sources::load(if_obj const &obj, e8util::mat44 const &trans) {
+    basic_light_sources::load(obj, trans);
+    m_lights_changed = true;
+}
+
+void e8::adaptive_light_sources::unload(if_obj const &obj) {
+    basic_light_sources::unload(obj);
+    m_lights_changed = true;
+}
+
+void e8::adaptive_light_sources::commit() {
+    basic_light_sources::commit();
+    if (!m_lights_changed) {
+        // Keep learning across the frames.
+        return;
+    }
+    m_lights_changed = false;
+    m_light_index.clear();
+    for (unsigned i = 0; i < m_light_list.size(); i++) {
+        m_light_index.insert(std::make_pair(m_light_list[i], i));
+    }
+    reset_records();
+}
+
+void e8::adaptive_light_sources::set_scene_boundary(e8util::aabb const &bbox) {
+    basic_light_sources::set_scene_boundary(bbox);
+    if (bbox.min() == m_grid_bound.min() && bbox.max() == m_grid_bound.max()) {
+        return;
+    }
+    m_grid_bound = bbox;
+    e8util::vec3 extent = bbox.max() - bbox.min();
+    float longest = std::max(std::max(extent(0), extent(1)), extent(2));
+    m_grid_origin = bbox.min();
+    m_inv_cell_size = longest > 0 ? AdaptiveGridResolution / longest : 0.0f;
+    reset_records();
+}
+
+void e8::adaptive_light_sources::reset_records() {
+    unsigned num_lights = static_cast<unsigned>(m_light_list.size());
+    m_num_cells = num_lights > 0 ? std::max(std::min(MaxAdaptiveCells,
+                                                     MaxAdaptiveRecords / num_lights), 1U)
+                                 : 0;
+    m_records = std::vector<record>(m_num_cells * num_lights);
+    for (record &r : m_records) {
+        r.sum.store(0.0f, std::memory_order_relaxed);
+        r.count.store(0, std::memory_order_relaxed);
+    }
+    m_cell_tables = std::vector<e8util::alias_table>(m_num_cells);
+}
+
+unsigned e8::adaptive_light_sources::cell_of(e8util::vec3 const &p) const {
+    e8util::vec3 x = (p - m_grid_origin) * m_inv_cell_size;
+    uint64_t h = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        int64_t c = static_cast<int64_t>(std::floor(x(i)));
+        h = e8util::hash64(h ^ static_cast<uint64_t>(c));
+    }
+    return static_cast<unsigned>(h % m_num_cells);
+}
+
+e8::if_light const *e8::adaptive_light_sources::sample_light(if_sampler *sampler,
+                                                             e8util::vec3 const &p,
+                                                             e8util::vec3 const & /*n*/,
+                                                             float *prob_mass) const {
+    if (m_num_cells == 0) {
+        return basic_light_sources::sample_light(sampler, prob_mass);
+    }
+    e8util::alias_table const &table = m_cell_tables[cell_of(p)];
+    if (table.empty()) {
+        return basic_light_sources::sample_light(sampler, prob_mass);
+    }
+    return m_light_list[table.sample(sampler->draw(), prob_mass)];
+}
+
+float e8::adaptive_light_sources::light_prob(if_light const *light, e8util::vec3 const &p,
+                                             e8util::vec3 const &n) const {
+    if (m_num_cells == 0) {
+        return basic_light_sources::light_prob(light, p, n);
+    }
+    e8util::alias_table const &table = m_cell_tables[cell_of(p)];
+    auto it = m_light_index.find(light);
+    if (table.empty() || it == m_light_index.end()) {
+        return basic_light_sources::light_prob(light, p, n);
+    }
+    return table.prob(it->second);
+}
+
+void e8::adaptive_light_sources::record_contribution(if_light const *light,
+                                                     e8util::vec3 const &p,
+                                                     float contrib) const {
+    auto it = m_light_index.find(light);
+    if (m_num_cells == 0 || it == m_light_index.end() || !std::isfinite(contrib)) {
+        return;
+    }
+    record &r = m_records[cell_of(p) * m_light_list.size() + it->second];
+    atomic_add(&r.sum, contrib);
+    r.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void e8::adaptive_light_sources::adapt() {
+    unsigned num_lights = static_cast<unsigned>(m_light_list.size());
+    std::vector<float> weights(num_lights);
+    for (unsigned c = 0; c < m_num_cells; c++) {
+        record const *records = &m_records[c * num_lights];
+        unsigned num_records = 0;
+        float total = 0;
+        for (unsigned i = 0; i < num_lights; i++) {
+            unsigned count = records[i].count.load(std::memory_order_relaxed);
+            float sum = records[i].sum.load(std::memory_order_relaxed);
+            weights[i] = count > 0 ? sum / count : 0.0f;
+            num_records += count;
+            total += weights[i];
+        }
+        if (num_records < MinAdaptiveCellRecords || total == 0.0f) {
+            // Nothing learned yet, or no light has reached the cell. Keep selecting by power.
+            continue;
+        }
+        for (unsigned i = 0; i < num_lights; i++) {
+            weights[i] = (1 - AdaptiveUniformFraction) * weights[i] / total +
+                         AdaptiveUniformFraction / num_lights;
         }
+        m_cell_tables[c] = e8util::alias_table(weights);
     }
-    *prob_mass = m_light_cdf[lo].light->power().norm() / m_total_power;
-    return m_light_cdf[lo].light;
 }
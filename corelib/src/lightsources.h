@@ -1,18 +1,17 @@
 #ifndef LIGHTSOURCES_H
 #define LIGHTSOURCES_H
 
+#include "light.h"
 #include "obj.h"
+#include "sampler.h"
 #include "tensor.h"
+#include <atomic>
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
-namespace e8 {
-class if_light;
-class if_geometry;
-} // namespace e8
-
 namespace e8 {
 
 class if_light_sources : public if_obj_actuator {
@@ -26,17 +25,69 @@ class if_light_sources : public if_obj_actuator {
     obj_protocol support() const override;
     if_light const *obj_light(if_geometry const &obj) const;
 
+    /**
+     * @brief infinite_lights The lights that surround the scene, which the rays escaping the scene
+     * reach.
+     */
+    std::vector<if_light const *> const &infinite_lights() const;
+
     virtual void commit() override = 0;
-    virtual if_light const *sample_light(e8util::rng *rng, float *pdf) const = 0;
+    virtual if_light const *sample_light(if_sampler *sampler, float *pdf) const = 0;
+
+    /**
+     * @brief light_prob Probability mass that sample_light(sampler, pdf) selects the light with.
+     */
+    virtual float light_prob(if_light const *light) const = 0;
+
+    /**
+     * @brief sample_light Selects a light to illuminate the point p, whose surface normal is n,
+     * from. By default, it ignores the point and selects the same way as the overload above.
+     * @param sampler Source of the random numbers. It draws a single dimension.
+     * @param prob_mass Probability mass of the light selected.
+     * @return The light selected, or nullptr if no light can illuminate the point.
+     */
+    virtual if_light const *sample_light(if_sampler *sampler, e8util::vec3 const &p,
+                                         e8util::vec3 const &n, float *prob_mass) const;
+
+    /**
+     * @brief light_prob Probability mass that sample_light(sampler, p, n, prob_mass) selects the
+     * light with, e.g. to weight the light sample against a BRDF sample that hits the light.
+     */
+    virtual float light_prob(if_light const *light, e8util::vec3 const &p,
+                             e8util::vec3 const &n) const = 0;
     virtual std::vector<if_light const *>
     get_relevant_lights(e8util::frustum const &frustum) const = 0;
 
+    /**
+     * @brief set_scene_boundary Lets the lights and the selection know the extent of the scene.
+     */
+    virtual void set_scene_boundary(e8util::aabb const &bbox);
+
+    /**
+     * @brief record_contribution Reports how much a light sample of the light delivered to the
+     * point p, including the visibility, regardless of the probability the light was selected
+     * with. Selections that learn from the contributions may use the records in adapt(). By
+     * default, the records are ignored. It may be called concurrently with the sampling.
+     */
+    virtual void record_contribution(if_light const *light, e8util::vec3 const &p,
+                                     float contrib) const;
+
+    /**
+     * @brief adapt Updates the selection with the contributions recorded so far. It must not be
+     * called while sampling, e.g. it is called between frames, so that every frame samples from a
+     * fixed distribution. By default, it does nothing.
+     */
+    virtual void adapt();
+
   protected:
     // Store all loaded lights, keyed by light ID.
     std::map<obj_id_t, std::unique_ptr<if_light>> m_lights;
 
     // Fast lookup for lights that are attached an object.
     std::unordered_map<obj_id_t, if_light *const> m_obj_lights_lookup;
+
+    // Lights that surround the scene.
+    std::vector<if_light const *> m_infinite_lights;
 };
 
 class basic_light_sources : public if_light_sources {
@@ -46,18 +97,141 @@ class basic_light_sources : public if_light_sources {
 
     std::vector<if_light const *>
     get_relevant_lights(e8util::frustum const &frustum) const override;
-    if_light const *sample_light(e8util::rng *rng, float *prob_mass) const override;
+    using if_light_sources::sample_light;
+    if_light const *sample_light(if_sampler *sampler, float *prob_mass) const override;
+    float light_prob(if_light const *light) const override;
+    float light_prob(if_light const *light, e8util::vec3 const &p,
+                     e8util::vec3 const &n) const override;
+    void commit() override;
+
+  protected:
+    // Samples the lights in proportion to their power.
+    std::vector<if_light const *> m_light_list;
+    e8util::alias_table m_light_table;
+    float m_total_power;
+};
+
+/**
+ * @brief The bvh_light_sources class Organizes the lights into a bounding volume hierarchy, where
+ * every node bounds the position and the emission directions of the lights below it, as well as
+ * their total power. Selecting a light for a point traverses the hierarchy and chooses each child
+ * in proportion to a conservative estimate of its contribution to the point, so distant and
+ * back-facing lights are rarely chosen. Lights without a position, such as the sky, are selected
+ * uniformly against the hierarchy. See Conty Estevez and Kulla, "Importance sampling of many
+ * lights with adaptive tree splitting", 2018. Selection regardless of the point is left to the
+ * power distribution of the basic_light_sources.
+ */
+class bvh_light_sources : public basic_light_sources {
+  public:
+    bvh_light_sources();
+    ~bvh_light_sources() override;
+
+    using basic_light_sources::light_prob;
+    using basic_light_sources::sample_light;
+    if_light const *sample_light(if_sampler *sampler, e8util::vec3 const &p, e8util::vec3 const &n,
+                                 float *prob_mass) const override;
+    float light_prob(if_light const *light, e8util::vec3 const &p,
+                     e8util::vec3 const &n) const override;
     void commit() override;
 
   private:
-    struct light_cdf {
-        light_cdf(if_light const *light, float cum_power);
+    // A light and the bounds of its emission.
+    using bounded_light = std::pair<if_light const *, if_light::emission_bounds>;
+
+    struct node {
+        if_light::emission_bounds bounds;
+        float power;
+
+        // Index of the parent node, or the node itself if it is the root.
+        unsigned parent;
+
+        // The first child of an interior node is the node next to it. A leaf has no second child
+        // and holds a single light.
+        unsigned second_child;
         if_light const *light;
-        float cum_power;
     };
 
-    std::vector<light_cdf> m_light_cdf;
-    float m_total_power;
+    /**
+     * @brief build Builds the sub-tree over lights[start:end] in m_nodes.
+     * @return Index of the sub-tree's root.
+     */
+    unsigned build(std::vector<bounded_light> &lights, unsigned start, unsigned end,
+                   unsigned parent);
+
+    /**
+     * @brief importance Estimate of the contribution the lights under the node can make to the
+     * point p with surface normal n, which never underestimates the cosine terms.
+     */
+    float importance(node const &node, e8util::vec3 const &p, e8util::vec3 const &n) const;
+
+    std::vector<node> m_nodes;
+    std::vector<if_light const *> m_infinite_lights;
+
+    // Index of the leaf each light is stored at.
+    std::unordered_map<if_light const *, unsigned> m_leaves;
+};
+
+/**
+ * @brief The adaptive_light_sources class Learns where each light actually contributes, so that
+ * lights behind walls stop taking samples from the points they can't reach. The scene is divided
+ * into a hashed grid of cells, each of which accumulates the contributions every light delivered
+ * to the points in the cell. adapt() turns the average contributions into the selection
+ * distribution of the cell, mixed with a uniform distribution so that no light loses all of its
+ * samples. Cells that haven't gathered enough records select by power.
+ */
+class adaptive_light_sources : public basic_light_sources {
+  public:
+    adaptive_light_sources();
+    ~adaptive_light_sources() override;
+
+    void load(if_obj const &obj, e8util::mat44 const &trans) override;
+    void unload(if_obj const &obj) override;
+    using basic_light_sources::light_prob;
+    using basic_light_sources::sample_light;
+    if_light const *sample_light(if_sampler *sampler, e8util::vec3 const &p, e8util::vec3 const &n,
+                                 float *prob_mass) const override;
+    float light_prob(if_light const *light, e8util::vec3 const &p,
+                     e8util::vec3 const &n) const override;
+    void commit() override;
+    void set_scene_boundary(e8util::aabb const &bbox) override;
+    void record_contribution(if_light const *light, e8util::vec3 const &p,
+                             float contrib) const override;
+    void adapt() override;
+
+  private:
+    struct record {
+        std::atomic<float> sum;
+        std::atomic<unsigned> count;
+    };
+
+    /**
+     * @brief reset_records Discards the records and the distributions learned from them.
+     */
+    void reset_records();
+
+    /**
+     * @brief cell_of Index of the grid cell the point p hashes to.
+     */
+    unsigned cell_of(e8util::vec3 const &p) const;
+
+    // Index of every light in the light list.
+    std::unordered_map<if_light const *, unsigned> m_light_index;
+
+    // Whether the lights have changed since the last commit.
+    bool m_lights_changed = true;
+
+    // Grid of the scene boundary.
+    e8util::aabb m_grid_bound;
+    e8util::vec3 m_grid_origin;
+    float m_inv_cell_size = 0.0f;
+    unsigned m_num_cells = 0;
+
+    // Records of every light in every cell, indexed by cell * num_lights + light. They are mutable
+    // since the tracers record through const references.
+    mutable std::vector<record> m_records;
+
+    // Distributions learned for every cell. An empty table selects by power.
+    std::vector<e8util::alias_table> m_cell_tables;
 };
 
 } // namespace e8
@@ -67,14 +67,23 @@ e8util::color3 e8::mat_fail_safe::eval(e8util::vec2 const & /*uv*/, e8util::vec3
     return m_albedo * (1.0f / static_cast<float>(M_PI));
 }
 
-e8util::vec3 e8::mat_fail_safe::sample(e8util::rng *rng, float *cond_density,
+e8util::vec3 e8::mat_fail_safe::sample(if_sampler *sampler, float *cond_density,
                                        e8util::vec2 const & /*uv*/, e8util::vec3 const &n,
                                        e8util::vec3 const & /*o*/) const {
-    e8util::vec3 i = e8util::vec3_cos_hemisphere_sample(n, rng->draw(), rng->draw());
+    e8util::vec3 i = e8util::vec3_cos_hemisphere_sample(n, sampler->draw(), sampler->draw());
     *cond_density = i.inner(n) / static_cast<float>(M_PI);
     return i;
 }
 
+float e8::mat_fail_safe::pdf(e8util::vec2 const & /*uv*/, e8util::vec3 const &n,
+                             e8util::vec3 const & /*o*/, e8util::vec3 const &i) const {
+    return std::max(i.inner(n), 0.0f) / static_cast<float>(M_PI);
+}
+
+bool e8::mat_fail_safe::diffuse() const { return true; }
+
+e8util::color3 e8::mat_fail_safe::albedo(e8util::vec2 const & /*uv*/) const { return m_albedo; }
+
 e8::mat_mixture::mat_mixture(std::string const &name, std::unique_ptr<if_material> mat_0,
                              std::unique_ptr<if_material> mat_1, float ratio)
     : if_material(name), m_mat_0(std::move(mat_0)), m_mat_1(std::move(mat_1)), m_ratio(ratio) {}
@@ -92,19 +101,34 @@ e8util::color3 e8::mat_mixture::eval(e8util::vec2 const &uv, e8util::vec3 const
     return m_ratio * m_mat_0->eval(uv, n, o, i) + (1 - m_ratio) * m_mat_1->eval(uv, n, o, i);
 }
 
-e8util::vec3 e8::mat_mixture::sample(e8util::rng *rng, float *cond_density, e8util::vec2 const &uv,
-                                     e8util::vec3 const &n, e8util::vec3 const &o) const {
+e8util::vec3 e8::mat_mixture::sample(if_sampler *sampler, float *cond_density,
+                                     e8util::vec2 const &uv, e8util::vec3 const &n,
+                                     e8util::vec3 const &o) const {
     e8util::vec3 i;
-    if (rng->draw() < m_ratio) {
-        i = m_mat_0->sample(rng, cond_density, uv, n, o);
-        *cond_density *= m_ratio;
+    if (sampler->draw() < m_ratio) {
+        i = m_mat_0->sample(sampler, cond_density, uv, n, o);
     } else {
-        i = m_mat_1->sample(rng, cond_density, uv, n, o);
-        *cond_density *= 1 - m_ratio;
+        i = m_mat_1->sample(sampler, cond_density, uv, n, o);
     }
+    if (*cond_density == 0.0f) {
+        return i;
+    }
+    // Either material may have sampled i.
+    *cond_density = pdf(uv, n, o, i);
     return i;
 }
 
+float e8::mat_mixture::pdf(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
+                           e8util::vec3 const &i) const {
+    return m_ratio * m_mat_0->pdf(uv, n, o, i) + (1 - m_ratio) * m_mat_1->pdf(uv, n, o, i);
+}
+
+bool e8::mat_mixture::diffuse() const { return m_mat_0->diffuse() && m_mat_1->diffuse(); }
+
+e8util::color3 e8::mat_mixture::albedo(e8util::vec2 const &uv) const {
+    return m_ratio * m_mat_0->albedo(uv) + (1 - m_ratio) * m_mat_1->albedo(uv);
+}
+
 e8::oren_nayar::oren_nayar(std::string const &name, e8util::color3 const &albedo, float roughness,
                            std::shared_ptr<texture_map<e8util::color3>> const &albedo_map,
                            std::shared_ptr<texture_map<float>> const &roughness_map)
@@ -160,14 +184,21 @@ e8util::color3 e8::oren_nayar::eval(e8util::vec2 const &uv, e8util::vec3 const &
            (m_a + m_b * std::max(0.0f, cos_theio) * sin_alpha * tan_beta);
 }
 
-e8util::vec3 e8::oren_nayar::sample(e8util::rng *rng, float *cond_density,
+e8util::vec3 e8::oren_nayar::sample(if_sampler *sampler, float *cond_density,
                                     e8util::vec2 const & /*uv*/, e8util::vec3 const &n,
                                     e8util::vec3 const & /*o*/) const {
-    e8util::vec3 const &i = e8util::vec3_cos_hemisphere_sample(n, rng->draw(), rng->draw());
+    e8util::vec3 const &i = e8util::vec3_cos_hemisphere_sample(n, sampler->draw(), sampler->draw());
     *cond_density = i.inner(n) / static_cast<float>(M_PI);
     return i;
 }
 
+float e8::oren_nayar::pdf(e8util::vec2 const & /*uv*/, e8util::vec3 const &n,
+                          e8util::vec3 const & /*o*/, e8util::vec3 const &i) const {
+    return std::max(i.inner(n), 0.0f) / static_cast<float>(M_PI);
+}
+
+bool e8::oren_nayar::diffuse() const { return true; }
+
 e8::cook_torr::cook_torr(std::string const &name, e8util::color3 const &albedo, float roughness,
                          std::complex<float> const &ior,
                          std::shared_ptr<texture_map<e8util::color3>> const &albedo_map,
@@ -221,7 +252,7 @@ e8util::color3 e8::cook_torr::eval(e8util::vec2 const &uv, e8util::vec3 const &n
     return c * albedo(uv);
 }
 
-e8util::vec3 e8::cook_torr::sample(e8util::rng *rng, float *cond_density, e8util::vec2 const &uv,
+e8util::vec3 e8::cook_torr::sample(if_sampler *sampler, float *cond_density, e8util::vec2 const &uv,
                                    e8util::vec3 const &n, e8util::vec3 const &o) const {
     float ms_slope = alpha2(uv);
 
@@ -229,8 +260,8 @@ e8util::vec3 e8::cook_torr::sample(e8util::rng *rng, float *cond_density, e8util
     e8util::vec3 u, v;
     e8util::vec3_basis(n, &u, &v);
 
-    float theta = 2.0f * static_cast<float>(M_PI) * rng->draw();
-    float t = rng->draw();
+    float theta = 2.0f * static_cast<float>(M_PI) * sampler->draw();
+    float t = sampler->draw();
     float phi = std::atan(std::sqrt(ms_slope * t / (1.0f - t)));
     float sin_phi = std::sin(phi);
     float cos_phi = std::cos(phi);
@@ -250,3 +281,23 @@ e8util::vec3 e8::cook_torr::sample(e8util::rng *rng, float *cond_density, e8util
 
     return i_sample;
 }
+
+float e8::cook_torr::pdf(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
+                         e8util::vec3 const &i) const {
+    if (i.inner(n) < 0.0f) {
+        return 0.0f;
+    }
+    e8util::vec3 h = i + o;
+    if (e8util::equals(h, e8util::vec3(0.0f))) {
+        return 0.0f;
+    }
+    h = h.normalize();
+    float h_dot_o = h.inner(o);
+    float cos_h = h.inner(n);
+    if (h_dot_o <= 0.0f || cos_h <= 0.0f) {
+        return 0.0f;
+    }
+    return ggx_distri(alpha2(uv), n, h) * cos_h / (4.0f * h_dot_o);
+}
+
+bool e8::cook_torr::diffuse() const { return false; }
@@ -2,7 +2,10 @@
 #define MATERIAL_H
 
 #include "obj.h"
+#include "sampler.h"
 #include "tensor.h"
+#include <algorithm>
+#include <cmath>
 #include <complex>
 #include <memory>
 #include <string>
@@ -26,11 +29,22 @@ template <typename T> class texture_map {
 
     /**
      * @brief map Maps a normalized 2D coordinate to content on the texture (map: [0,1)x[0,1)->T).
-     * @param uv A 2D coordinate where each component is normalized to [0, 1).
+     * @param uv A 2D coordinate where each component is normalized to [0, 1). Coordinates outside
+     * of the range wrap around, so the texture repeats itself.
      * @return Mapped content.
      */
     T map(e8util::vec2 const &uv) const;
 
+    /**
+     * @brief width Width of the texture in terms of texel.
+     */
+    unsigned width() const;
+
+    /**
+     * @brief height Height of the texture in terms of texel.
+     */
+    unsigned height() const;
+
   private:
     unsigned m_width;
     unsigned m_height;
@@ -42,11 +56,17 @@ texture_map<T>::texture_map(unsigned width, unsigned height, std::vector<T> cons
     : m_width(width), m_height(height), m_data(data) {}
 
 template <typename T> T texture_map<T>::map(e8util::vec2 const &uv) const {
-    unsigned iu = uv(0) * m_width;
-    unsigned iv = uv(1) * m_height;
+    unsigned iu = std::min(static_cast<unsigned>((uv(0) - std::floor(uv(0))) * m_width),
+                           m_width - 1);
+    unsigned iv = std::min(static_cast<unsigned>((uv(1) - std::floor(uv(1))) * m_height),
+                           m_height - 1);
     return m_data[iu + iv * m_width];
 }
 
+template <typename T> unsigned texture_map<T>::width() const { return m_width; }
+
+template <typename T> unsigned texture_map<T>::height() const { return m_height; }
+
 /**
  * @brief The if_material class Material interface specialized for path-tracing.
  */
@@ -77,7 +97,7 @@ class if_material : public if_copyable_obj<if_material> {
 
     /**
      * @brief sample Compute a incident path sample given the normal and reflected path.
-     * @param rng Random number generator.
+     * @param sampler Source of the random numbers.
      * @param cond_density The conditional probability density of the sample.
      * @param uv Coordinate to map a normalized 2D coordinate to content on the texture (map:
      * [0,1)x[0,1)->T).
@@ -85,9 +105,33 @@ class if_material : public if_copyable_obj<if_material> {
      * @param o Reflected path.
      * @return Incident path sample.
      */
-    virtual e8util::vec3 sample(e8util::rng *rng, float *cond_density, e8util::vec2 const &uv,
+    virtual e8util::vec3 sample(if_sampler *sampler, float *cond_density, e8util::vec2 const &uv,
                                 e8util::vec3 const &n, e8util::vec3 const &o) const = 0;
 
+    /**
+     * @brief pdf Conditional density, in solid angle measure, that sample() samples the incident
+     * path i with, e.g. to weight the sample against other sampling strategies.
+     * @param uv Coordinate to map a normalized 2D coordinate to content on the texture.
+     * @param n Normal vector at the surface.
+     * @param o Reflected path.
+     * @param i Incident path.
+     */
+    virtual float pdf(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
+                      e8util::vec3 const &i) const = 0;
+
+    /**
+     * @brief diffuse Whether the reflectance varies slowly enough with the directions that the
+     * incident radiance may be estimated from the neighborhood of a point rather than traced
+     * through the point itself, e.g. by density estimation over photons.
+     */
+    virtual bool diffuse() const = 0;
+
+    /**
+     * @brief albedo Base color of the surface, which previews show in place of the reflectance.
+     * @param uv Coordinate to map a normalized 2D coordinate to content on the texture.
+     */
+    virtual e8util::color3 albedo(e8util::vec2 const &uv) const = 0;
+
   protected:
     if_material(obj_id_t id, std::string const &name);
 };
@@ -106,8 +150,12 @@ class mat_fail_safe : public if_material {
 
     e8util::color3 eval(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
                         e8util::vec3 const &i) const override;
-    e8util::vec3 sample(e8util::rng *rng, float *cond_density, e8util::vec2 const &uv,
+    e8util::vec3 sample(if_sampler *sampler, float *cond_density, e8util::vec2 const &uv,
                         e8util::vec3 const &n, e8util::vec3 const &o) const override;
+    float pdf(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
+              e8util::vec3 const &i) const override;
+    bool diffuse() const override;
+    e8util::color3 albedo(e8util::vec2 const &uv) const override;
 
   private:
     e8util::color3 m_albedo;
@@ -127,8 +175,12 @@ class mat_mixture : public if_material {
 
     e8util::color3 eval(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
                         e8util::vec3 const &i) const override;
-    e8util::vec3 sample(e8util::rng *rng, float *cond_density, e8util::vec2 const &uv,
+    e8util::vec3 sample(if_sampler *sampler, float *cond_density, e8util::vec2 const &uv,
                         e8util::vec3 const &n, e8util::vec3 const &o) const override;
+    float pdf(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
+              e8util::vec3 const &i) const override;
+    bool diffuse() const override;
+    e8util::color3 albedo(e8util::vec2 const &uv) const override;
 
   private:
     std::unique_ptr<if_material> m_mat_0;
@@ -152,12 +204,14 @@ class oren_nayar : public if_material {
 
     e8util::color3 eval(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
                         e8util::vec3 const &i) const override;
-    e8util::vec3 sample(e8util::rng *rng, float *cond_density, e8util::vec2 const &uv,
+    e8util::vec3 sample(if_sampler *sampler, float *cond_density, e8util::vec2 const &uv,
                         e8util::vec3 const &n, e8util::vec3 const &o) const override;
+    float pdf(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
+              e8util::vec3 const &i) const override;
+    bool diffuse() const override;
+    e8util::color3 albedo(e8util::vec2 const &uv) const override;
 
   private:
-    e8util::color3 albedo(e8util::vec2 const &uv) const;
-
     std::shared_ptr<texture_map<e8util::color3>> m_albedo_map;
     std::shared_ptr<texture_map<float>> m_roughness_map;
 
@@ -183,11 +237,14 @@ class cook_torr : public if_material {
 
     e8util::color3 eval(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
                         e8util::vec3 const &i) const override;
-    e8util::vec3 sample(e8util::rng *rng, float *cond_density, e8util::vec2 const &uv,
+    e8util::vec3 sample(if_sampler *sampler, float *cond_density, e8util::vec2 const &uv,
                         e8util::vec3 const &n, e8util::vec3 const &o) const override;
+    float pdf(e8util::vec2 const &uv, e8util::vec3 const &n, e8util::vec3 const &o,
+              e8util::vec3 const &i) const override;
+    bool diffuse() const override;
+    e8util::color3 albedo(e8util::vec2 const &uv) const override;
 
   private:
-    e8util::color3 albedo(e8util::vec2 const &uv) const;
     float alpha2(e8util::vec2 const &uv) const;
 
     std::shared_ptr<texture_map<e8util::color3>> m_albedo_map;
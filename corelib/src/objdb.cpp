@@ -56,22 +56,26 @@ std::vector<e8::if_obj *> e8::objdb::find_obj(std::string const &name, obj_proto
     return result;
 }
 
-void e8::objdb::push_updates() {
+bool e8::objdb::push_updates() {
+    bool pushed = false;
     for (std::shared_ptr<if_obj> const &obj : m_roots) {
-        push_updates(obj.get(), e8util::mat44_scale(1.0f), obj->dirty());
+        pushed |= push_updates(obj.get(), e8util::mat44_scale(1.0f), obj->dirty());
     }
     for (auto const &it : m_actuators) {
         it.second->commit();
     }
+    return pushed;
 }
 
-void e8::objdb::push_updates(if_obj *obj, e8util::mat44 const &global_trans, bool is_dirty_anyway) {
+bool e8::objdb::push_updates(if_obj *obj, e8util::mat44 const &global_trans, bool is_dirty_anyway) {
     if (!obj->active()) {
-        return;
+        return false;
     }
 
+    bool pushed = false;
     e8util::mat44 const &modified_trans = obj->blueprint_to_transform() * global_trans;
     if (obj->dirty() || is_dirty_anyway) {
+        pushed = true;
         if_obj_actuator *actuator = actuator_of(obj->protocol());
         if (actuator != nullptr) {
             actuator->unload(*obj);
@@ -80,10 +84,11 @@ void e8::objdb::push_updates(if_obj *obj, e8util::mat44 const &global_trans, boo
     }
 
     for (std::shared_ptr<if_obj> const &child : obj->m_children) {
-        push_updates(child.get(), modified_trans, obj->dirty() || is_dirty_anyway);
+        pushed |= push_updates(child.get(), modified_trans, obj->dirty() || is_dirty_anyway);
     }
 
     obj->mark_clean();
+    return pushed;
 }
 
 void e8::objdb::clear() { m_roots.clear(); }
@@ -67,12 +67,13 @@ class objdb {
      * @brief push_updates Push all the active dirty nodes to the underlying registered managers.
      * A node is dirty if its state is set to dirty or the parent node is dirty. A node is inactive
      * if its state is set to inactive or the parent node is inactive.
+     * @return true if any dirty node has been pushed.
      */
-    void push_updates();
+    bool push_updates();
     void clear();
 
   private:
-    void push_updates(if_obj *obj, e8util::mat44 const &global_trans, bool is_dirty_anyway);
+    bool push_updates(if_obj *obj, e8util::mat44 const &global_trans, bool is_dirty_anyway);
 
     std::set<std::shared_ptr<if_obj>> m_roots;
     std::map<obj_protocol, std::unique_ptr<if_obj_actuator>> m_actuators;
@@ -0,0 +1,365 @@
+#include "pathguide.h"
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Fraction of a quadtree's energy above which a quadrant is subdivided for the next iteration.
+float const GuideSubdivisionThreshold = 0.01f;
+
+// Maximum depth of the directional quadtrees.
+unsigned const GuideMaxDirectionalDepth = 20;
+
+// Records a spatial leaf can collect in an iteration of one pass before it splits. The threshold
+// grows with the square root of the passes of the iteration, so that the directional distributions
+// get both more samples and finer spatial support as the iterations double.
+float const GuideSpatialSplitRecords = 4000.0f;
+
+// Maximum depth of the spatial tree.
+unsigned const GuideMaxSpatialDepth = 32;
+
+/**
+ * @brief to_canonical Maps a direction to the cylindrical coordinates (cos(theta) + 1)/2 and
+ * phi/(2*pi), which map the sphere to the unit square preserving the area up to a factor of 4*pi.
+ */
+e8util::vec2 to_canonical(e8util::vec3 const &w) {
+    float cos_theta = std::min(std::max(w(2), -1.0f), 1.0f);
+    float phi = std::atan2(w(1), w(0)) / (2.0f * static_cast<float>(M_PI));
+    if (phi < 0.0f) {
+        phi += 1.0f;
+    }
+    return e8util::vec2{(cos_theta + 1.0f) * 0.5f, phi};
+}
+
+e8util::vec3 from_canonical(e8util::vec2 const &c) {
+    float cos_theta = 2.0f * c(0) - 1.0f;
+    float sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+    float phi = 2.0f * static_cast<float>(M_PI) * c(1);
+    return e8util::vec3{sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta};
+}
+
+/**
+ * @brief quadrant Quadrant of the node at origin with the specified size that contains c.
+ */
+unsigned quadrant(e8util::vec2 const &c, e8util::vec2 const &origin, float half) {
+    return (c(0) >= origin(0) + half ? 1 : 0) | (c(1) >= origin(1) + half ? 2 : 0);
+}
+
+} // namespace
+
+float e8::path_guide::dtree::total() const {
+    return nodes[0].sums[0] + nodes[0].sums[1] + nodes[0].sums[2] + nodes[0].sums[3];
+}
+
+unsigned e8::path_guide::dtree::slot(e8util::vec2 c) const {
+    unsigned n = 0;
+    e8util::vec2 origin;
+    float size = 1.0f;
+    for (;;) {
+        float half = 0.5f * size;
+        unsigned q = quadrant(c, origin, half);
+        if (nodes[n].children[q] == 0) {
+            return n * 4 + q;
+        }
+        origin(0) += (q & 1) ? half : 0.0f;
+        origin(1) += (q & 2) ? half : 0.0f;
+        size = half;
+        n = nodes[n].children[q];
+    }
+}
+
+e8util::vec2 e8::path_guide::dtree::sample(if_sampler *sampler, float *dens) const {
+    if (total() <= 0.0f) {
+        *dens = 1.0f;
+        float e0 = sampler->draw();
+        float e1 = sampler->draw();
+        return e8util::vec2{e0, e1};
+    }
+    unsigned n = 0;
+    e8util::vec2 origin;
+    float size = 1.0f;
+    float d = 1.0f;
+    for (;;) {
+        dnode const &node = nodes[n];
+        float node_sum = node.sums[0] + node.sums[1] + node.sums[2] + node.sums[3];
+        float x = sampler->draw() * node_sum;
+        unsigned q = 0;
+        float cdf = node.sums[0];
+        while (q < 3 && (x >= cdf || node.sums[q] == 0.0f)) {
+            q++;
+            cdf += node.sums[q];
+        }
+        while (node.sums[q] == 0.0f) {
+            // Rounding went past the last non-empty quadrant.
+            q--;
+        }
+        d *= 4.0f * node.sums[q] / node_sum;
+
+        float half = 0.5f * size;
+        origin(0) += (q & 1) ? half : 0.0f;
+        origin(1) += (q & 2) ? half : 0.0f;
+        size = half;
+        if (node.children[q] == 0) {
+            *dens = d;
+            float e0 = sampler->draw();
+            float e1 = sampler->draw();
+            return e8util::vec2{origin(0) + e0 * size, origin(1) + e1 * size};
+        }
+        n = node.children[q];
+    }
+}
+
+float e8::path_guide::dtree::pdf(e8util::vec2 c) const {
+    if (total() <= 0.0f) {
+        return 1.0f;
+    }
+    unsigned n = 0;
+    e8util::vec2 origin;
+    float size = 1.0f;
+    float d = 1.0f;
+    for (;;) {
+        dnode const &node = nodes[n];
+        float node_sum = node.sums[0] + node.sums[1] + node.sums[2] + node.sums[3];
+        float half = 0.5f * size;
+        unsigned q = quadrant(c, origin, half);
+        if (node.sums[q] == 0.0f) {
+            return 0.0f;
+        }
+        d *= 4.0f * node.sums[q] / node_sum;
+        if (node.children[q] == 0) {
+            return d;
+        }
+        origin(0) += (q & 1) ? half : 0.0f;
+        origin(1) += (q & 2) ? half : 0.0f;
+        size = half;
+        n = node.children[q];
+    }
+}
+
+void e8::path_guide::dtree::accumulate(float const *energy) {
+    // Children are always created after their parents.
+    for (unsigned n = static_cast<unsigned>(nodes.size()); n-- > 0;) {
+        for (unsigned q = 0; q < 4; q++) {
+            unsigned child = nodes[n].children[q];
+            if (child == 0) {
+                nodes[n].sums[q] = energy[n * 4 + q];
+            } else {
+                dnode const &c = nodes[child];
+                nodes[n].sums[q] = c.sums[0] + c.sums[1] + c.sums[2] + c.sums[3];
+            }
+        }
+    }
+}
+
+e8::path_guide::dtree e8::path_guide::dtree::refined() const {
+    dtree result;
+    float t = total();
+    if (t <= 0.0f) {
+        return result;
+    }
+
+    struct pending_node {
+        unsigned node;
+        // Counterpart in this tree, or 0 if this tree isn't as fine there.
+        unsigned source;
+        float energy;
+        unsigned depth;
+    };
+    std::vector<pending_node> stack{{/*node=*/0, /*source=*/0, t, /*depth=*/1}};
+    while (!stack.empty()) {
+        pending_node pending = stack.back();
+        stack.pop_back();
+        if (pending.depth >= GuideMaxDirectionalDepth) {
+            continue;
+        }
+        for (unsigned q = 0; q < 4; q++) {
+            bool has_source = pending.node == 0 || pending.source != 0;
+            float energy = has_source ? nodes[pending.source].sums[q] : 0.25f * pending.energy;
+            if (energy <= GuideSubdivisionThreshold * t) {
+                continue;
+            }
+            unsigned child = static_cast<unsigned>(result.nodes.size());
+            result.nodes.push_back(dnode());
+            result.nodes[pending.node].children[q] = child;
+            unsigned source = has_source ? nodes[pending.source].children[q] : 0;
+            stack.push_back({child, source, energy, pending.depth + 1});
+        }
+    }
+    return result;
+}
+
+e8::path_guide::path_guide() : m_mutex(e8util::mutex()) {}
+
+e8::path_guide::~path_guide() { e8util::destroy(m_mutex); }
+
+void e8::path_guide::begin_pass(recorder *rec, e8util::aabb const &bound) {
+    e8util::lock(m_mutex);
+    if (m_nodes.empty()) {
+        if (bound.is_empty()) {
+            m_lo = e8util::vec3(-1.0f);
+            m_size = 2.0f;
+        } else {
+            e8util::vec3 extent = bound.max() - bound.min();
+            m_size = std::max(extent(0), std::max(extent(1), extent(2))) * 1.01f + 1e-4f;
+            m_lo = bound.centroid() - e8util::vec3(0.5f * m_size);
+        }
+        m_nodes.push_back(spatial_node());
+        m_leaves.push_back(spatial_leaf());
+        lay_out();
+    }
+    if (m_learn_pending) {
+        learn();
+        m_learn_pending = false;
+    }
+    e8util::unlock(m_mutex);
+
+    if (rec->m_version != m_version) {
+        rec->m_energy.assign(m_energy.size(), 0.0f);
+        rec->m_counts.assign(m_counts.size(), 0);
+        rec->m_version = m_version;
+        rec->m_num_passes = 0;
+    }
+    rec->m_num_passes++;
+}
+
+void e8::path_guide::end_pass(recorder *rec) {
+    if (rec->m_version != m_version) {
+        return;
+    }
+    for (unsigned i = 0; i < m_energy.size(); i++) {
+        m_energy[i] += rec->m_energy[i];
+    }
+    for (unsigned i = 0; i < m_counts.size(); i++) {
+        m_counts[i] += rec->m_counts[i];
+    }
+    std::fill(rec->m_energy.begin(), rec->m_energy.end(), 0.0f);
+    std::fill(rec->m_counts.begin(), rec->m_counts.end(), 0);
+    m_iteration_passes += rec->m_num_passes;
+    rec->m_num_passes = 0;
+    if (m_iteration_passes >= 1U << std::min(m_iteration, 20U)) {
+        m_learn_pending = true;
+    }
+}
+
+void e8::path_guide::reset() {
+    e8util::lock(m_mutex);
+    m_nodes.clear();
+    m_leaves.clear();
+    m_energy.clear();
+    m_counts.clear();
+    m_version++;
+    m_iteration = 0;
+    m_iteration_passes = 0;
+    m_learn_pending = false;
+    m_trained = false;
+    e8util::unlock(m_mutex);
+}
+
+bool e8::path_guide::trained() const { return m_trained; }
+
+e8util::vec3 e8::path_guide::sample(if_sampler *sampler, e8util::vec3 const &p,
+                                    float *dens) const {
+    float canonical_dens;
+    e8util::vec2 c;
+    if (m_nodes.empty()) {
+        c = dtree().sample(sampler, &canonical_dens);
+    } else {
+        c = m_leaves[leaf_of(p)].sampling.sample(sampler, &canonical_dens);
+    }
+    *dens = canonical_dens / (4.0f * static_cast<float>(M_PI));
+    return from_canonical(c);
+}
+
+float e8::path_guide::pdf(e8util::vec3 const &p, e8util::vec3 const &w) const {
+    float canonical_dens =
+        m_nodes.empty() ? 1.0f : m_leaves[leaf_of(p)].sampling.pdf(to_canonical(w));
+    return canonical_dens / (4.0f * static_cast<float>(M_PI));
+}
+
+void e8::path_guide::record(recorder *rec, e8util::vec3 const &p, e8util::vec3 const &w,
+                            float value) const {
+    if (rec->m_version != m_version) {
+        return;
+    }
+    unsigned leaf = leaf_of(p);
+    rec->m_counts[leaf]++;
+    if (value > 0.0f && std::isfinite(value)) {
+        rec->m_energy[m_leaves[leaf].offset + m_leaves[leaf].building.slot(to_canonical(w))] +=
+            value;
+    }
+}
+
+unsigned e8::path_guide::leaf_of(e8util::vec3 const &p) const {
+    e8util::vec3 lo = m_lo;
+    e8util::vec3 size(m_size);
+    unsigned n = 0;
+    while (m_nodes[n].children[0] != 0) {
+        unsigned axis = m_nodes[n].axis;
+        size(axis) *= 0.5f;
+        if (p(axis) >= lo(axis) + size(axis)) {
+            lo(axis) += size(axis);
+            n = m_nodes[n].children[1];
+        } else {
+            n = m_nodes[n].children[0];
+        }
+    }
+    return m_nodes[n].leaf;
+}
+
+void e8::path_guide::learn() {
+    for (spatial_leaf &leaf : m_leaves) {
+        leaf.building.accumulate(&m_energy[leaf.offset]);
+        leaf.sampling = leaf.building;
+        if (leaf.sampling.total() > 0.0f) {
+            m_trained = true;
+        }
+    }
+
+    float threshold = GuideSpatialSplitRecords * std::sqrt(static_cast<float>(m_iteration_passes));
+    unsigned num_nodes = static_cast<unsigned>(m_nodes.size());
+    for (unsigned n = 0; n < num_nodes; n++) {
+        if (m_nodes[n].children[0] == 0) {
+            split(n, threshold);
+        }
+    }
+    lay_out();
+    m_iteration++;
+    m_iteration_passes = 0;
+}
+
+void e8::path_guide::split(unsigned node_index, float threshold) {
+    unsigned leaf = m_nodes[node_index].leaf;
+    if (m_counts[leaf] <= threshold || m_nodes[node_index].depth >= GuideMaxSpatialDepth) {
+        return;
+    }
+    // Both halves start from the distribution of the whole, with half of its records.
+    unsigned half_count = m_counts[leaf] / 2;
+    m_counts[leaf] = half_count;
+    m_counts.push_back(half_count);
+    m_leaves.push_back(m_leaves[leaf]);
+
+    spatial_node child;
+    child.axis = (m_nodes[node_index].axis + 1) % 3;
+    child.depth = m_nodes[node_index].depth + 1;
+    unsigned first_child = static_cast<unsigned>(m_nodes.size());
+    for (unsigned c = 0; c < 2; c++) {
+        child.leaf = c == 0 ? leaf : static_cast<unsigned>(m_leaves.size() - 1);
+        m_nodes.push_back(child);
+        m_nodes[node_index].children[c] = first_child + c;
+    }
+    split(first_child, threshold);
+    split(first_child + 1, threshold);
+}
+
+void e8::path_guide::lay_out() {
+    unsigned offset = 0;
+    for (spatial_leaf &leaf : m_leaves) {
+        leaf.building = leaf.sampling.refined();
+        leaf.offset = offset;
+        offset += static_cast<unsigned>(leaf.building.nodes.size()) * 4;
+    }
+    m_energy.assign(offset, 0.0f);
+    m_counts.assign(m_leaves.size(), 0);
+    m_version++;
+}
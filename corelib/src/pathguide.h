@@ -0,0 +1,180 @@
+#ifndef PATHGUIDE_H
+#define PATHGUIDE_H
+
+#include "tensor.h"
+#include "thread.h"
+#include <vector>
+
+namespace e8 {
+
+class if_sampler;
+
+/**
+ * @brief The path_guide class Distribution of the incident radiance over the scene, learnt from the
+ * paths traced so far, so that the tracers can sample the directions the light comes from rather
+ * than only the ones the BSDF favors (Müller et al., "Practical path guiding for efficient
+ * light-transport simulation", 2017). It is an SD-tree: a binary tree subdivides the space, and
+ * every spatial leaf holds a quadtree over the directions, in cylindrical coordinates so that the
+ * quadrants of a level subtend the same solid angle. Learning goes in iterations of doubling
+ * numbers of passes. The passes of an iteration record into the building trees while the sampling
+ * trees learnt from the previous iteration guide them. At the end of the iteration, the spatial
+ * leaves that have collected the most records split, and the quadrants that hold the most energy
+ * are refined for the next one.
+ *
+ * sample(), pdf() and record() may be called concurrently. The records go into a recorder that
+ * every thread owns, and are merged into the building trees by end_pass(), which must not run
+ * concurrently with anything else.
+ */
+class path_guide {
+  public:
+    /**
+     * @brief The recorder class The records a thread has made during a pass.
+     */
+    class recorder {
+      public:
+        recorder() = default;
+
+      private:
+        friend class path_guide;
+
+        // Version of the building trees the statistics are laid out for.
+        unsigned m_version = ~0U;
+        unsigned m_num_passes = 0;
+
+        // Energy recorded in every leaf quadrant of the building trees, and number of records in
+        // every spatial leaf.
+        std::vector<float> m_energy;
+        std::vector<unsigned> m_counts;
+    };
+
+    path_guide();
+    ~path_guide();
+
+    path_guide(path_guide const &) = delete;
+    path_guide &operator=(path_guide const &) = delete;
+
+    /**
+     * @brief begin_pass Prepares the guide and the thread's recorder before a pass. The guide
+     * learns from the passes recorded so far if they complete an iteration.
+     * @param bound Bound of the scene, which the spatial tree subdivides after a reset().
+     */
+    void begin_pass(recorder *rec, e8util::aabb const &bound);
+
+    /**
+     * @brief end_pass Merges the records of the thread's pass into the building trees.
+     */
+    void end_pass(recorder *rec);
+
+    /**
+     * @brief reset Forgets all that has been learnt.
+     */
+    void reset();
+
+    /**
+     * @brief trained Whether the guide has learnt anything yet. Before that, sample() samples the
+     * sphere uniformly.
+     */
+    bool trained() const;
+
+    /**
+     * @brief sample Samples an incident direction at p from the learnt distribution.
+     * @param dens Density of the direction in solid angle measure.
+     */
+    e8util::vec3 sample(if_sampler *sampler, e8util::vec3 const &p, float *dens) const;
+
+    /**
+     * @brief pdf Density, in solid angle measure, that sample() samples the direction w at p with.
+     */
+    float pdf(e8util::vec3 const &p, e8util::vec3 const &w) const;
+
+    /**
+     * @brief record Records the radiance arriving at p from the direction w.
+     * @param value Luminance of the radiance divided by the density the direction was sampled
+     * with. It is 0 where the direction carries no light, which still counts as a record.
+     */
+    void record(recorder *rec, e8util::vec3 const &p, e8util::vec3 const &w, float value) const;
+
+  private:
+    /**
+     * @brief The dnode struct Node of a directional quadtree. Quadrant q covers the half of the
+     * node with the larger first coordinate if q & 1, and the larger second coordinate if q & 2.
+     */
+    struct dnode {
+        float sums[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+        // Index of the child of every quadrant, or 0 if the quadrant is a leaf.
+        unsigned children[4] = {0, 0, 0, 0};
+    };
+
+    /**
+     * @brief The dtree struct Directional quadtree over the square of the cylindrical coordinates.
+     */
+    struct dtree {
+        dtree() : nodes(1) {}
+
+        float total() const;
+        unsigned slot(e8util::vec2 c) const;
+        e8util::vec2 sample(if_sampler *sampler, float *dens) const;
+        float pdf(e8util::vec2 c) const;
+
+        /**
+         * @brief accumulate Sets the energy of the leaf quadrants, indexed by node * 4 + quadrant,
+         * and sums it up to the root.
+         */
+        void accumulate(float const *energy);
+
+        /**
+         * @brief refined Tree with no energy whose quadrants are subdivided wherever they hold
+         * more than the threshold fraction of this tree's energy.
+         */
+        dtree refined() const;
+
+        std::vector<dnode> nodes;
+    };
+
+    struct spatial_leaf {
+        dtree sampling;
+        dtree building;
+
+        // Where the building tree's quadrants are laid out in the recorders.
+        unsigned offset = 0;
+    };
+
+    struct spatial_node {
+        // The axis the node splits at its middle, or will split if it's a leaf.
+        unsigned axis = 0;
+        unsigned depth = 0;
+
+        // Index of the children, or 0 if the node is a leaf.
+        unsigned children[2] = {0, 0};
+        unsigned leaf = 0;
+    };
+
+    unsigned leaf_of(e8util::vec3 const &p) const;
+    void learn();
+    void split(unsigned node_index, float threshold);
+    void lay_out();
+
+    e8util::mutex_t m_mutex;
+
+    // Cube the spatial tree subdivides.
+    e8util::vec3 m_lo;
+    float m_size = 0.0f;
+
+    std::vector<spatial_node> m_nodes;
+    std::vector<spatial_leaf> m_leaves;
+
+    // Statistics merged from the recorders during the current iteration.
+    std::vector<float> m_energy;
+    std::vector<unsigned> m_counts;
+
+    unsigned m_version = 0;
+    unsigned m_iteration = 0;
+    unsigned m_iteration_passes = 0;
+    bool m_learn_pending = false;
+    bool m_trained = false;
+};
+
+} // namespace e8
+
+#endif // PATHGUIDE_H
@@ -12,6 +12,16 @@ e8::if_path_space::~if_path_space() {}
 
 e8util::aabb e8::if_path_space::aabb() const { return m_bound; }
 
+void e8::if_path_space::occluded(std::vector<e8util::ray> const &rays, float t_min,
+                                 std::vector<float> const &t_max,
+                                 std::vector<bool> *results) const {
+    results->resize(rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        float t;
+        (*results)[i] = has_intersect(rays[i], t_min, t_max[i], t);
+    }
+}
+
 void e8::if_path_space::load(if_obj const &obj, e8util::mat44 const &trans) {
     std::unique_ptr<if_geometry const> geo = static_cast<if_geometry const &>(obj).transform(trans);
     m_bound = m_bound + geo->aabb();
@@ -85,7 +95,8 @@ e8::intersect_info e8::linear_path_space_layout::intersect(e8util::ray const &r)
             e8util::vec2 uv2 = texcoords[(*hit_tri)(2)];
             uv = hit_b(0) * uv0 + hit_b(1) * uv1 + hit_b(2) * uv2;
         }
-        return intersect_info(t, vertex, normal, uv, hit_geo);
+        return intersect_info(t, vertex, normal, uv, hit_geo,
+                              static_cast<unsigned>(hit_tri - &hit_geo->triangles()[0]));
     } else {
         return intersect_info();
     }
@@ -123,6 +134,10 @@ e8::linear_path_space_layout::get_relevant_geometries(e8util::frustum const &) c
 #define BVH_RAY_TRIANGLE_COST 8
 #define BVH_RAY_BOX_COST 1
 
+// Capacity of the traversal stack. bvh() switches to median splits past depth log2(#prims), so the
+// tree is never deeper than 2 log2(#prims) + 2, and the stack holds at most one node per level.
+#define BVH_MAX_DEPTH 128
+
 e8::bvh_path_space_layout::bvh_path_space_layout() {}
 
 e8::bvh_path_space_layout::~bvh_path_space_layout() {}
@@ -306,8 +321,10 @@ void e8::bvh_path_space_layout::commit() {
     // Construct primitive list.
     std::vector<primitive_details> prims;
     for (std::pair<obj_id_t const, std::unique_ptr<if_geometry const>> const &p : m_geometries) {
-        for (triangle const &tri : p.second->triangles()) {
-            prims.push_back(primitive_details(tri, p.second.get(), geo2ind[p.second.get()]));
+        std::vector<triangle> const &tris = p.second->triangles();
+        for (unsigned i = 0; i < tris.size(); i++) {
+            prims.push_back(
+                primitive_details(tris[i], p.second.get(), geo2ind[p.second.get()], i));
         }
     }
 
@@ -340,10 +357,11 @@ e8::intersect_info e8::bvh_path_space_layout::intersect(e8util::ray const &r) co
     primitive const *hit_prim = nullptr;
     e8util::vec3 hit_b;
 
-    std::vector<unsigned> candids({0});
-    while (!candids.empty()) {
-        unsigned n = candids.back();
-        candids.pop_back();
+    unsigned candids[BVH_MAX_DEPTH];
+    unsigned num_candids = 0;
+    candids[num_candids++] = 0;
+    while (num_candids > 0) {
+        unsigned n = candids[--num_candids];
 
         if (m_bvh[n].num_prims > 0) {
             // exterior node.
@@ -373,11 +391,11 @@ e8::intersect_info e8::bvh_path_space_layout::intersect(e8util::ray const &r) co
 
             float t0, t1;
             if (m_bvh[left].bound.intersect(r, t_min, t_max, t0, t1)) {
-                candids.push_back(left);
+                candids[num_candids++] = left;
             }
 
             if (m_bvh[right].bound.intersect(r, t_min, t_max, t0, t1)) {
-                candids.push_back(right);
+                candids[num_candids++] = right;
             }
         }
     }
@@ -406,7 +424,7 @@ e8::intersect_info e8::bvh_path_space_layout::intersect(e8util::ray const &r) co
             uv = hit_b(0) * uv0 + hit_b(1) * uv1 + hit_b(2) * uv2;
         }
 
-        return intersect_info(t, vertex, normal, uv, hit_geo);
+        return intersect_info(t, vertex, normal, uv, hit_geo, hit_prim->i_tri);
     } else {
         return intersect_info();
     }
@@ -414,10 +432,11 @@ e8::intersect_info e8::bvh_path_space_layout::intersect(e8util::ray const &r) co
 
 bool e8::bvh_path_space_layout::has_intersect(e8util::ray const &r, float t_min, float t_max,
                                               float &t) const {
-    std::vector<unsigned> candids({0});
-    while (!candids.empty()) {
-        unsigned n = candids.back();
-        candids.pop_back();
+    unsigned candids[BVH_MAX_DEPTH];
+    unsigned num_candids = 0;
+    candids[num_candids++] = 0;
+    while (num_candids > 0) {
+        unsigned n = candids[--num_candids];
 
         if (m_bvh[n].num_prims > 0) {
             // exterior node.
@@ -444,11 +463,11 @@ bool e8::bvh_path_space_layout::has_intersect(e8util::ray const &r, float t_min,
 
             float t0, t1;
             if (m_bvh[left].bound.intersect(r, t_min, t_max, t0, t1)) {
-                candids.push_back(left);
+                candids[num_candids++] = left;
             }
 
             if (m_bvh[right].bound.intersect(r, t_min, t_max, t0, t1)) {
-                candids.push_back(right);
+                candids[num_candids++] = right;
             }
         }
     }
@@ -17,8 +17,8 @@ namespace e8 {
 // Represents a ray-surface intersection. The intersection is valid only when geo is present.
 struct intersect_info {
     intersect_info(float t, e8util::vec3 const &vertex, e8util::vec3 const &normal,
-                   e8util::vec2 const &uv, if_geometry const *geo)
-        : geo(geo), t(t), vertex(vertex), normal(normal), uv(uv) {}
+                   e8util::vec2 const &uv, if_geometry const *geo, unsigned face)
+        : geo(geo), t(t), vertex(vertex), normal(normal), uv(uv), face(face) {}
 
     intersect_info() : geo(nullptr) {}
     bool valid() const { return geo != nullptr; }
@@ -28,6 +28,9 @@ struct intersect_info {
     e8util::vec3 vertex;
     e8util::vec3 normal;
     e8util::vec2 uv;
+
+    // Index of the triangle hit in the geometry.
+    unsigned face = 0;
 };
 
 typedef std::map<if_material const *, std::vector<if_geometry const *>> batched_geometry;
@@ -44,6 +47,18 @@ class if_path_space : public if_obj_actuator {
     virtual void commit() override = 0;
     virtual intersect_info intersect(e8util::ray const &r) const = 0;
     virtual bool has_intersect(e8util::ray const &r, float t_min, float t_max, float &t) const = 0;
+
+    /**
+     * @brief occluded Shadow test of a batch of rays, such as the ones connecting a point to many
+     * others, which a layout may trace together. By default, the rays are tested one by one with
+     * has_intersect().
+     * @param t_min Lower bound of the distance of the occluders along every ray.
+     * @param t_max Upper bound of the distance of the occluders along each ray.
+     * @param results Set to whether each ray hits something within its bounds.
+     */
+    virtual void occluded(std::vector<e8util::ray> const &rays, float t_min,
+                          std::vector<float> const &t_max, std::vector<bool> *results) const;
+
     virtual batched_geometry get_relevant_geometries(e8util::frustum const &frustum) const = 0;
     e8util::aabb aabb() const;
 
@@ -68,7 +83,12 @@ class linear_path_space_layout : public if_path_space {
     virtual batched_geometry get_relevant_geometries(e8util::frustum const &frustum) const override;
 };
 
-class bvh_path_space_layout : public linear_path_space_layout {
+/**
+ * @brief The bvh_path_space_layout class Bounding volume hierarchy over the triangles, built by the
+ * surface area heuristic. It is final so that the tracers specialized for it call the intersection
+ * tests directly.
+ */
+class bvh_path_space_layout final : public linear_path_space_layout {
   public:
     bvh_path_space_layout();
     ~bvh_path_space_layout() override;
@@ -84,17 +104,22 @@ class bvh_path_space_layout : public linear_path_space_layout {
 
   private:
     struct primitive {
-        primitive(triangle const &tri, unsigned i_geo) : tri(tri), i_geo(i_geo) {}
+        primitive(triangle const &tri, unsigned i_geo, unsigned i_tri)
+            : tri(tri), i_geo(i_geo), i_tri(i_tri) {}
 
         triangle tri;
 
         // Stores index instead of pointer to save cache space.
         unsigned int i_geo;
+
+        // Index of the triangle in the geometry.
+        unsigned int i_tri;
     };
 
     struct primitive_details : public primitive {
-        primitive_details(triangle const &tri, e8::if_geometry const *geo, unsigned i_geo)
-            : primitive(tri, i_geo) {
+        primitive_details(triangle const &tri, e8::if_geometry const *geo, unsigned i_geo,
+                          unsigned i_tri)
+            : primitive(tri, i_geo, i_tri) {
             std::vector<e8util::vec3> const &verts = geo->vertices();
             e8util::vec3 const &v0 = verts[tri(0)];
             e8util::vec3 const &v1 = verts[tri(1)];
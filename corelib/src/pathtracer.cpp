@@ -1,13 +1,20 @@
 #include "pathtracer.h"
+#include "irradiancecache.h"
 #include "light.h"
+#include "pathguide.h"
 #include "lightsources.h"
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
 
 namespace {
 
 /**
  * @brief The sampled_pathlet struct
- * Element of the smallest parition of a path.
+ * Element of the smallest parition of a path. It keeps only what the transport and the connections
+ * read off the vertex, with the material resolved once at sampling time.
  */
 struct sampled_pathlet {
     // The path vector pointing away from the vertex. Note that the vector's direction does not
@@ -19,30 +26,35 @@ struct sampled_pathlet {
 
     // The vertex to anchor the vector in space. Note that, the end of the vector is anchored rather
     // than the beginning.
-    e8::intersect_info vert;
+    e8util::vec3 p;
+    e8util::vec3 n;
+    e8util::vec2 uv;
 
-    e8::if_light const *light = nullptr;
+    e8::if_material const *mat = nullptr;
 
     sampled_pathlet() {}
 
     sampled_pathlet(e8util::vec3 const &away, e8::intersect_info const &vert,
-                    e8::if_light const *light, float dens)
-        : v(away), dens(dens), vert(vert), light(light) {}
+                    e8::if_material_container const &mats, float dens)
+        : v(away), dens(dens), p(vert.vertex), n(vert.normal), uv(vert.uv),
+          mat(&mats.find(vert.geo->material_id())) {}
 
     e8util::vec3 towards_prev() const { return v; }
     e8util::vec3 towards() const { return -v; }
 
-    e8util::vec3 sample_brdf(e8util::rng *rng, float *dens,
-                             e8::if_material_container const &mats) const {
-        e8::if_material const &mat = mats.find(vert.geo->material_id());
-        return mat.sample(rng, dens, vert.uv, vert.normal, towards_prev());
+    e8util::vec3 sample_brdf(e8::if_sampler *sampler, float *dens) const {
+        return mat->sample(sampler, dens, uv, n, towards_prev());
+    }
+
+    e8util::color3 brdf(e8util::vec3 const &o, e8util::vec3 const &i) const {
+        return mat->eval(uv, n, o, i);
     }
 };
 
-e8util::vec3 sample_brdf(e8util::rng *rng, float *dens, e8::intersect_info const &vert,
+e8util::vec3 sample_brdf(e8::if_sampler *sampler, float *dens, e8::intersect_info const &vert,
                          e8util::vec3 const &o, e8::if_material_container const &mats) {
     e8::if_material const &mat = mats.find(vert.geo->material_id());
-    return mat.sample(rng, dens, vert.uv, vert.normal, o);
+    return mat.sample(sampler, dens, vert.uv, vert.normal, o);
 }
 
 e8util::color3 brdf(e8::intersect_info const &vert, e8util::vec3 const &o, e8util::vec3 const &i,
@@ -51,44 +63,36 @@ e8util::color3 brdf(e8::intersect_info const &vert, e8util::vec3 const &o, e8uti
     return mat.eval(vert.uv, vert.normal, o, i);
 }
 
-e8util::color3 projected_brdf(sampled_pathlet const &current, sampled_pathlet const &next,
-                              e8::if_material_container const &mats) {
-    e8::if_material const &mat = mats.find(current.vert.geo->material_id());
-    float cos_w = current.vert.normal.inner(next.towards());
-    return mat.eval(current.vert.uv, current.vert.normal, next.towards(), current.towards_prev()) *
-           cos_w;
+e8util::color3 projected_brdf(sampled_pathlet const &current, sampled_pathlet const &next) {
+    float cos_w = current.n.inner(next.towards());
+    return current.brdf(next.towards(), current.towards_prev()) * cos_w;
 }
 
-e8util::color3 projected_adjoint_brdf(sampled_pathlet const &current, sampled_pathlet const &next,
-                                      e8::if_material_container const &mats) {
-    e8::if_material const &mat = mats.find(current.vert.geo->material_id());
-    float cos_w = current.vert.normal.inner(next.towards());
-    return mat.eval(current.vert.uv, current.vert.normal, current.towards_prev(), next.towards()) *
-           cos_w;
+e8util::color3 projected_adjoint_brdf(sampled_pathlet const &current,
+                                      sampled_pathlet const &next) {
+    float cos_w = current.n.inner(next.towards());
+    return current.brdf(current.towards_prev(), next.towards()) * cos_w;
 }
 
 /**
  * @brief sample_path Recursively sample then concatenate pathlets to form a path sample.
  */
-unsigned sample_path(e8util::rng *rng, sampled_pathlet *sampled_path,
+unsigned sample_path(e8::if_sampler *sampler, sampled_pathlet *sampled_path,
                      e8::if_path_space const &path_space, e8::if_material_container const &mats,
                      unsigned depth, unsigned max_depth) {
     if (depth == max_depth)
         return depth;
 
     float w_dens;
-    e8util::vec3 i = sampled_path[depth - 1].sample_brdf(rng, &w_dens, mats);
+    e8util::vec3 i = sampled_path[depth - 1].sample_brdf(sampler, &w_dens);
     if (e8util::equals(w_dens, 0.0f)) {
         return depth;
     }
 
-    e8::intersect_info next_vert =
-        path_space.intersect(e8util::ray(sampled_path[depth - 1].vert.vertex, i));
+    e8::intersect_info next_vert = path_space.intersect(e8util::ray(sampled_path[depth - 1].p, i));
     if (next_vert.valid() && next_vert.normal.inner(-i) > 0) {
-        sampled_path[depth] =
-            sampled_pathlet(-i, next_vert, /*light=*/nullptr,
-                            w_dens); // Only the first hit requires to check light hit.
-        return sample_path(rng, sampled_path, path_space, mats, depth + 1, max_depth);
+        sampled_path[depth] = sampled_pathlet(-i, next_vert, mats, w_dens);
+        return sample_path(sampler, sampled_path, path_space, mats, depth + 1, max_depth);
     } else {
         return depth;
     }
@@ -96,7 +100,7 @@ unsigned sample_path(e8util::rng *rng, sampled_pathlet *sampled_path,
 
 /**
  * @brief sample_path Sample a path X conditioned on X0 = r0 and max_depth.
- * @param rng Random number generator.
+ * @param sampler Source of the random numbers.
  * @param sampled_path Result, path sample.
  * @param r0 The bootstrap path to condition on.
  * @param dens0 The density of the pathlet r0.
@@ -106,16 +110,15 @@ unsigned sample_path(e8util::rng *rng, sampled_pathlet *sampled_path,
  * @return Actual path length of the sampled_path. It may not be max_depth in the case when the
  * light escapes out of the path_space during sampling.
  */
-unsigned sample_path(e8util::rng *rng, sampled_pathlet *sampled_path, e8util::ray const &r0,
+unsigned sample_path(e8::if_sampler *sampler, sampled_pathlet *sampled_path, e8util::ray const &r0,
                      float dens0, e8::if_path_space const &path_space,
                      e8::if_material_container const &mats, unsigned max_depth) {
     e8::intersect_info const &vert0 = path_space.intersect(r0);
     if (!vert0.valid() || vert0.normal.inner(-r0.v()) <= 0.0f || max_depth == 0) {
         return 0;
     } else {
-        sampled_path[0] = sampled_pathlet(-r0.v(), vert0, /*light=*/nullptr,
-                                          dens0); // Only the first hit requires to check light hit.
-        return sample_path(rng, sampled_path, path_space, mats, 1, max_depth);
+        sampled_path[0] = sampled_pathlet(-r0.v(), vert0, mats, dens0);
+        return sample_path(sampler, sampled_path, path_space, mats, 1, max_depth);
     }
 }
 
@@ -124,15 +127,15 @@ unsigned sample_path(e8util::rng *rng, sampled_pathlet *sampled_path, e8util::ra
  * first hit.
  * @param first_hit The first deterministic intersection which bootstraps the sampling process.
  */
-unsigned sample_path(e8util::rng *rng, sampled_pathlet *sampled_path, e8util::ray const &r0,
+unsigned sample_path(e8::if_sampler *sampler, sampled_pathlet *sampled_path, e8util::ray const &r0,
                      e8::if_path_tracer::first_hits::hit const &hit,
                      e8::if_path_space const &path_space, e8::if_material_container const &mats,
                      unsigned max_depth) {
     if (!hit.intersect.valid() || max_depth == 0) {
         return 0;
     } else {
-        sampled_path[0] = sampled_pathlet(-r0.v(), hit.intersect, hit.light, /*dens=*/1.0f);
-        return sample_path(rng, sampled_path, path_space, mats, 1, max_depth);
+        sampled_path[0] = sampled_pathlet(-r0.v(), hit.intersect, mats, /*dens=*/1.0f);
+        return sample_path(sampler, sampled_path, path_space, mats, 1, max_depth);
     }
 }
 
@@ -141,24 +144,28 @@ unsigned sample_path(e8util::rng *rng, sampled_pathlet *sampled_path, e8util::ra
  * the
  * target_vertex, then compute the light transport of the connection.
  * @param light The light source definition where p_illum is on.
- * @param p_illum A spatial point on the light source.
- * @param n_illum The normal at p_illum.
- * @param target_vert The target where p_illum is connecting to.
+ * @param illum A point p_illum sampled on the light source, with its normal and texture coordinate.
+ * @param target_mat Material at the target.
+ * @param target_p The target where p_illum is connecting to.
+ * @param target_n Normal at target_p.
+ * @param target_uv Texture coordinate at target_p.
  * @param target_o_ray The reflected light ray at target_vert.
- * @param path_space Path space container.
- * @param mats Material container.
+ * @param path_space Path space container, or the concrete layout of it so that the shadow ray is
+ * tested by a direct call.
  * @return The amount of radiance transported.
  */
-e8util::color3 transport_illum_source(e8::if_light const &light, e8util::vec3 const &p_illum,
-                                      e8util::vec3 const &n_illum,
-                                      e8::intersect_info const &target_vert,
+template <typename PathSpace>
+e8util::color3 transport_illum_source(e8::if_light const &light,
+                                      e8::if_geometry::surface_sample const &illum,
+                                      e8::if_material const &target_mat,
+                                      e8util::vec3 const &target_p, e8util::vec3 const &target_n,
+                                      e8util::vec2 const &target_uv,
                                       e8util::vec3 const &target_o_ray,
-                                      e8::if_path_space const &path_space,
-                                      e8::if_material_container const &mats) {
+                                      PathSpace const &path_space) {
     // construct light path.
-    e8util::vec3 l = target_vert.vertex - p_illum;
-    e8util::color3 illum = light.eval(l, n_illum, target_vert.normal);
-    if (e8util::equals(illum, e8util::vec3(0.0f))) {
+    e8util::vec3 l = target_p - illum.p;
+    e8util::color3 irradiance = light.eval(l, illum.n, target_n, illum.uv);
+    if (e8util::equals(irradiance, e8util::vec3(0.0f))) {
         return 0.0f;
     }
 
@@ -166,15 +173,33 @@ e8util::color3 transport_illum_source(e8::if_light const &light, e8util::vec3 co
     e8util::vec3 i = -l / distance;
 
     // evaluate.
-    e8util::ray light_ray(target_vert.vertex, i);
+    e8util::ray light_ray(target_p, i);
     float t;
     if (!path_space.has_intersect(light_ray, 1e-4f, distance - 1e-3f, t)) {
-        return illum * brdf(target_vert, target_o_ray, i, mats);
+        return irradiance * target_mat.eval(target_uv, target_n, target_o_ray, i);
     } else {
         return 0.0f;
     }
 }
 
+/**
+ * @brief transport_illum_source The same as the transport_illum_source() above, but connects to an
+ * intersection.
+ * @param target_vert The target where p_illum is connecting to.
+ * @param mats Material container.
+ */
+template <typename PathSpace>
+e8util::color3 transport_illum_source(e8::if_light const &light,
+                                      e8::if_geometry::surface_sample const &illum,
+                                      e8::intersect_info const &target_vert,
+                                      e8util::vec3 const &target_o_ray,
+                                      PathSpace const &path_space,
+                                      e8::if_material_container const &mats) {
+    return transport_illum_source(light, illum, mats.find(target_vert.geo->material_id()),
+                                  target_vert.vertex, target_vert.normal, target_vert.uv,
+                                  target_o_ray, path_space);
+}
+
 /**
  * @brief The light_sample struct
  */
@@ -184,37 +209,44 @@ struct light_sample {
 
     // Emission sampled from the selected light.
     e8::if_light::emission_surface_sample emission;
-    unsigned align0;
+
+    // Probability mass the light was selected with.
+    float prob_mass;
 };
 
 /**
  * @brief sample_light_source Sample a point on a light source as well as the geometric information
  * local to that point.
- * @param rng Random number generator.
+ * @param sampler Source of the random numbers.
+ * @param target_vert The point to be illuminated by the light sample.
  * @param light_sources The set of all light sources.
- * @return light_sample.
+ * @return light_sample. The light is nullptr if no light can illuminate the target.
  */
-light_sample sample_light_source(e8util::rng &rng, e8::intersect_info const & /*target_vert*/,
+light_sample sample_light_source(e8::if_sampler &sampler, e8::intersect_info const &target_vert,
                                  e8::if_light_sources const &light_sources) {
     light_sample sample;
 
     // Sample light.
     float light_prob_mass;
-    e8::if_light const *light = light_sources.sample_light(&rng, &light_prob_mass);
+    e8::if_light const *light = light_sources.sample_light(&sampler, target_vert.vertex,
+                                                           target_vert.normal, &light_prob_mass);
+    sample.light = light;
+    sample.prob_mass = light_prob_mass;
+    if (light == nullptr) {
+        return sample;
+    }
 
     // Sample emission.
-    sample.emission = light->sample_emssion_surface(&rng);
+    sample.emission = light->sample_emssion_surface(&sampler, target_vert.vertex);
     sample.emission.surface.area_dens *= light_prob_mass;
 
-    sample.light = light;
-
     return sample;
 }
 
 /**
  * @brief transport_direct_illum Connect a point in space to a point sample on a light surface then
  * compute light transportation.
- * @param rng Random number generator used to compute a light sample.
+ * @param sampler Sampler used to compute a light sample.
  * @param target_o_ray The light ray that exits the target point in space.
  * @param target_vert The target point in space where the radiance is transported.
  * @param path_space Path space container.
@@ -223,24 +255,264 @@ light_sample sample_light_source(e8util::rng &rng, e8::intersect_info const & /*
  * @param multi_light_samps The number of transportation samples used to compute the estimate.
  * @return A direct illumination radiance estimate.
  */
-e8util::color3 transport_direct_illum(e8util::rng &rng, e8util::vec3 const &target_o_ray,
+template <typename PathSpace>
+e8util::color3 transport_direct_illum(e8::if_sampler &sampler, e8util::vec3 const &target_o_ray,
                                       e8::intersect_info const &target_vert,
-                                      e8::if_path_space const &path_space,
+                                      PathSpace const &path_space,
                                       e8::if_material_container const &mats,
                                       e8::if_light_sources const &light_sources,
                                       unsigned multi_light_samps) {
     e8util::color3 rad;
     for (unsigned k = 0; k < multi_light_samps; k++) {
         light_sample sample;
-        sample = sample_light_source(rng, target_vert, light_sources);
-        rad += transport_illum_source(*sample.light, sample.emission.surface.p,
-                                      sample.emission.surface.n, target_vert, target_o_ray,
-                                      path_space, mats) /
-               sample.emission.surface.area_dens;
+        sample = sample_light_source(sampler, target_vert, light_sources);
+        if (sample.light == nullptr) {
+            continue;
+        }
+        e8util::color3 illum = transport_illum_source(*sample.light, sample.emission.surface,
+                                                      target_vert, target_o_ray, path_space,
+                                                      mats) /
+                               sample.emission.surface.area_dens;
+        light_sources.record_contribution(sample.light, target_vert.vertex,
+                                          e8util::color3_luminance(illum) * sample.prob_mass);
+        rad += illum;
     }
     return rad / multi_light_samps;
 }
 
+/**
+ * @brief power_heuristic MIS weight of a sample drawn with density dens against another strategy
+ * that could have drawn it with density other_dens, both in the same measure.
+ */
+float power_heuristic(float dens, float other_dens) {
+    float dens2 = dens * dens;
+    float other_dens2 = other_dens * other_dens;
+    return dens2 + other_dens2 > 0 ? dens2 / (dens2 + other_dens2) : 0.0f;
+}
+
+/**
+ * @brief transport_direct_illum_mis Like transport_direct_illum() with a single sample, but weighs
+ * the light sample against sampling the BRDF at target_vert with the power heuristic. The lights
+ * surrounding the scene are reached by the BRDF samples that escape it, so their samples are
+ * weighed in solid angle measure. Other lights without a surface can't be reached by the BRDF
+ * samples, so their samples keep the full weight.
+ */
+template <typename PathSpace>
+e8util::color3 transport_direct_illum_mis(e8::if_sampler &sampler, e8util::vec3 const &target_o_ray,
+                                          e8::intersect_info const &target_vert,
+                                          PathSpace const &path_space,
+                                          e8::if_material_container const &mats,
+                                          e8::if_light_sources const &light_sources) {
+    light_sample sample = sample_light_source(sampler, target_vert, light_sources);
+    if (sample.light == nullptr) {
+        return 0.0f;
+    }
+    e8util::color3 illum = transport_illum_source(*sample.light, sample.emission.surface,
+                                                  target_vert, target_o_ray, path_space, mats) /
+                           sample.emission.surface.area_dens;
+    light_sources.record_contribution(sample.light, target_vert.vertex,
+                                      e8util::color3_luminance(illum) * sample.prob_mass);
+    if (e8util::equals(illum, e8util::vec3(0.0f))) {
+        return illum;
+    }
+    bool has_surface = sample.light->has_geometries();
+    if (!has_surface && !sample.light->bounds().infinite) {
+        return illum;
+    }
+
+    // Density of the BRDF sampling the same point, in the measure of the light sample.
+    e8util::vec3 l = sample.emission.surface.p - target_vert.vertex;
+    float dist2 = l.inner(l);
+    e8util::vec3 i = l / std::sqrt(dist2);
+    e8::if_material const &mat = mats.find(target_vert.geo->material_id());
+    float brdf_dens = mat.pdf(target_vert.uv, target_vert.normal, target_o_ray, i);
+    if (has_surface) {
+        brdf_dens = brdf_dens * std::abs(sample.emission.surface.n.inner(i)) / dist2;
+    }
+    return illum * power_heuristic(sample.emission.surface.area_dens, brdf_dens);
+}
+
+// Number of vertices a path scatters at before Russian roulette starts to terminate it.
+unsigned const RouletteStartDepth = 2;
+
+// Upper bound of the survival probability, so that paths with a non-decaying throughput terminate.
+float const MaxSurvivalProb = 0.95f;
+
+/**
+ * @brief survive_russian_roulette Randomly terminates a path at the vertex of the specified depth
+ * with a probability that grows as its throughput decays. A surviving path has its throughput
+ * divided by the survival probability to keep the estimate unbiased.
+ * @return false if the path is terminated.
+ */
+bool survive_russian_roulette(e8::if_sampler &sampler, unsigned depth,
+                              e8util::color3 *throughput) {
+    if (depth < RouletteStartDepth) {
+        return true;
+    }
+    float max_comp = std::max((*throughput)(0), std::max((*throughput)(1), (*throughput)(2)));
+    float p_survive = std::min(max_comp, MaxSurvivalProb);
+    if (sampler.draw() >= p_survive) {
+        return false;
+    }
+    *throughput = *throughput / p_survive;
+    return true;
+}
+
+/**
+ * @brief trace_unidirect_path Extends a path from vert by sampling the BRDF until Russian roulette
+ * or the path length terminates it, which is the loop the unidirectional tracers share. It is
+ * instantiated for every way of gathering the direct illumination, and for the layouts of the path
+ * space that are final classes, so that the strategies cost no branch in the loop and the
+ * intersection tests are direct calls which link-time optimization can inline. The materials and
+ * the lights still differ from vertex to vertex, so they are called through their interfaces.
+ * @tparam PathSpace Concrete layout of the path space, or if_path_space for any of them.
+ * @tparam NextEvent Whether the lights are sampled at every vertex. Otherwise, the direct
+ * illumination is only found by hitting the lights, and includes what vert emits.
+ * @tparam Mis Whether the light samples are weighted against hitting the lights with the BRDF
+ * samples by the power heuristic. It requires NextEvent.
+ * @param max_path_len Maximum number of vertices of the path, not counting the one on the camera.
+ * @param multi_light_samps Number of light samples at every vertex without MIS.
+ * @param start_depth Depth of vert in the path.
+ * @return Radiance leaving vert towards o.
+ */
+template <typename PathSpace, bool NextEvent, bool Mis>
+e8util::color3 trace_unidirect_path(e8::if_sampler &sampler, e8util::vec3 const &o,
+                                    e8::intersect_info const &vert, PathSpace const &path_space,
+                                    e8::if_material_container const &mats,
+                                    e8::if_light_sources const &light_sources,
+                                    unsigned max_path_len, unsigned multi_light_samps,
+                                    unsigned start_depth) {
+    static_assert(NextEvent || !Mis, "MIS weighs the light samples against the BRDF samples.");
+
+    e8util::color3 rad;
+    e8util::color3 throughput = 1.0f;
+    e8util::vec3 o_cur = o;
+    e8::intersect_info vert_cur = vert;
+    // With next event estimation, the light sample or hit makes one more vertex beyond the one that
+    // scatters.
+    for (unsigned depth = start_depth; depth + (NextEvent ? 1 : 0) < max_path_len; depth++) {
+        if (!survive_russian_roulette(sampler, depth, &throughput)) {
+            break;
+        }
+
+        // Direct.
+        if (!NextEvent) {
+            e8::if_light const *light = light_sources.obj_light(*vert_cur.geo);
+            if (light != nullptr) {
+                rad += throughput * light->radiance(o_cur, vert_cur.normal, vert_cur.uv);
+            }
+        } else if (Mis) {
+            rad += throughput * transport_direct_illum_mis(sampler, o_cur, vert_cur, path_space,
+                                                           mats, light_sources);
+        } else {
+            rad += throughput * transport_direct_illum(sampler, o_cur, vert_cur, path_space, mats,
+                                                       light_sources, multi_light_samps);
+        }
+
+        // Indirect.
+        float proj_solid_dens;
+        e8util::vec3 i = sample_brdf(&sampler, &proj_solid_dens, vert_cur, o_cur, mats);
+        if (proj_solid_dens == 0.0f) {
+            break;
+        }
+        e8::intersect_info indirect_vert = path_space.intersect(e8util::ray(vert_cur.vertex, i));
+        bool escaped = !indirect_vert.valid();
+        if (escaped && light_sources.infinite_lights().empty()) {
+            break;
+        }
+        if (!escaped && indirect_vert.normal.inner(-i) <= 0.0f) {
+            break;
+        }
+
+        float cos_w = vert_cur.normal.inner(i);
+        throughput = throughput * brdf(vert_cur, o_cur, i, mats) * cos_w / proj_solid_dens;
+
+        if (escaped) {
+            // Direct, by reaching the lights surrounding the scene. Next event estimation without
+            // MIS has already counted them.
+            for (e8::if_light const *light : light_sources.infinite_lights()) {
+                e8util::color3 emission = light->escaped_radiance(i);
+                if (!NextEvent) {
+                    rad += throughput * emission;
+                } else if (Mis) {
+                    float light_dens =
+                        light_sources.light_prob(light, vert_cur.vertex, vert_cur.normal) *
+                        light->emission_surface_dens(vert_cur.vertex, vert_cur.vertex + i, -i,
+                                                     /*face=*/0);
+                    rad += throughput * emission * power_heuristic(proj_solid_dens, light_dens);
+                }
+            }
+            break;
+        }
+
+        if (Mis) {
+            // Direct, by hitting a light with the BRDF sample.
+            e8::if_light const *light = light_sources.obj_light(*indirect_vert.geo);
+            if (light != nullptr) {
+                e8util::color3 emission =
+                    light->radiance(-i, indirect_vert.normal, indirect_vert.uv);
+                float cos_light = indirect_vert.normal.inner(-i);
+                float brdf_dens = proj_solid_dens * cos_light / (indirect_vert.t * indirect_vert.t);
+                float light_dens =
+                    light_sources.light_prob(light, vert_cur.vertex, vert_cur.normal) *
+                    light->emission_surface_dens(vert_cur.vertex, indirect_vert.vertex,
+                                                 indirect_vert.normal, indirect_vert.face);
+                rad += throughput * emission * power_heuristic(brdf_dens, light_dens);
+            }
+        }
+
+        o_cur = -i;
+        vert_cur = indirect_vert;
+    }
+    return rad;
+}
+
+/**
+ * @brief trace_unidirect_paths Traces a unidirectional path from the first hit of every ray. With
+ * next event estimation, the camera can only see the lights by hitting them.
+ */
+template <typename PathSpace, bool NextEvent, bool Mis>
+std::vector<e8util::color3>
+trace_unidirect_paths(e8::if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                      e8::if_path_tracer::first_hits const &first_hits,
+                      PathSpace const &path_space, e8::if_material_container const &mats,
+                      e8::if_light_sources const &light_sources, unsigned max_path_len) {
+    std::vector<e8util::color3> rad(rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        e8util::ray const &ray = rays[i];
+        e8::if_path_tracer::first_hits::hit const &hit = first_hits.hits[i];
+        if (hit.intersect.valid()) {
+            rad[i] = trace_unidirect_path<PathSpace, NextEvent, Mis>(
+                sampler, -ray.v(), hit.intersect, path_space, mats, light_sources, max_path_len,
+                /*multi_light_samps=*/1, /*start_depth=*/0);
+            if (NextEvent && hit.light != nullptr) {
+                rad[i] += hit.light->radiance(-ray.v(), hit.intersect.normal, hit.intersect.uv);
+            }
+        }
+    }
+    return rad;
+}
+
+/**
+ * @brief sample_unidirect_paths Resolves the layout of the path space once for the whole batch of
+ * rays, then traces them with the kernel specialized for it.
+ */
+template <bool NextEvent, bool Mis>
+std::vector<e8util::color3>
+sample_unidirect_paths(e8::if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                       e8::if_path_tracer::first_hits const &first_hits,
+                       e8::if_path_space const &path_space, e8::if_material_container const &mats,
+                       e8::if_light_sources const &light_sources, unsigned max_path_len) {
+    if (e8::bvh_path_space_layout const *bvh =
+            dynamic_cast<e8::bvh_path_space_layout const *>(&path_space)) {
+        return trace_unidirect_paths<e8::bvh_path_space_layout, NextEvent, Mis>(
+            sampler, rays, first_hits, *bvh, mats, light_sources, max_path_len);
+    }
+    return trace_unidirect_paths<e8::if_path_space, NextEvent, Mis>(
+        sampler, rays, first_hits, path_space, mats, light_sources, max_path_len);
+}
+
 /**
  * @brief The light_transport_info class
  */
@@ -248,17 +520,16 @@ template <bool IMPORTANCE> class light_transport_info {
   public:
     /**
      * @brief light_transport_info Pre-compute a light transport over all prefixes of the specified
-     * path, as well as conditional area density that every vertex was generated. This makes
-     * transport() a constant time computation and conditional_density() a smaller constant
-     * (complexity).
+     * path. This makes transport() a constant time computation.
      * Template variable IMPORTANCE specifies whether to transport light importance or radiance.
      * @param path The path sample that the light transport is to compute on.
      * @param len Length of the path.
-     * @param mats Material container.
+     * @param prefix_transport Storage of at least len elements for the prefix transports. It's
+     * owned by the caller so that it can be reused across paths.
      */
     light_transport_info(sampled_pathlet const *path, unsigned len,
-                         e8::if_material_container const &mats)
-        : m_prefix_transport(len), m_cond_density(len), m_path(path) {
+                         e8util::color3 *prefix_transport)
+        : m_prefix_transport(prefix_transport) {
         if (len == 0)
             return;
 
@@ -267,18 +538,12 @@ template <bool IMPORTANCE> class light_transport_info {
         m_prefix_transport[0] = 1.0f;
         for (unsigned k = 0; k < len - 1; k++) {
             if (IMPORTANCE) {
-                transport *= projected_brdf(path[k], path[k + 1], mats) / path[k + 1].dens;
+                transport *= projected_brdf(path[k], path[k + 1]) / path[k + 1].dens;
             } else {
-                transport *= projected_adjoint_brdf(path[k], path[k + 1], mats) / path[k + 1].dens;
+                transport *= projected_adjoint_brdf(path[k], path[k + 1]) / path[k + 1].dens;
             }
             m_prefix_transport[k + 1] = transport;
         }
-
-        // Pre-compute conditional density on vertex generation.
-        for (unsigned k = 0; k < len; k++) {
-            m_cond_density[k] = path[k].dens * path[k].vert.normal.inner(path[k].towards_prev()) /
-                                (path[k].vert.t * path[k].vert.t);
-        }
     }
 
     /**
@@ -290,44 +555,10 @@ template <bool IMPORTANCE> class light_transport_info {
      */
     e8util::color3 transport(unsigned subpath_len) const { return m_prefix_transport[subpath_len]; }
 
-    /**
-     * @brief conditional_density The conditional pathspace density of sampled_path[i]
-     * @param i The ith pathlet to compute on.
-     * @return The conditional density of that the ith vertex is generated.
-     */
-    float conditional_density(unsigned i) const { return m_cond_density[i]; }
-
   private:
-    std::vector<e8util::color3> m_prefix_transport;
-    std::vector<float> m_cond_density;
-    sampled_pathlet const *m_path;
+    e8util::color3 *m_prefix_transport;
 };
 
-/**
- * @brief subpath_density The path density of sampled_path[path_start:path_end]
- * @param src_dens The density of the initial vertex.
- * @param sampled_path The path sample that the sub-path is to be taken from.
- * @param path_start See the brief description.
- * @param path_end See the brief description.
- * @return The probability density of the subpath sampled_path[path_start:path_end].
- */
-float subpath_density(float src_point_dens, /*float src_cos,*/ sampled_pathlet const *sampled_path,
-                      unsigned path_end) {
-    if (path_end == 0)
-        return 0.0f;
-    float dens = src_point_dens * sampled_path[0].dens *
-                 sampled_path[0].vert.normal.inner(sampled_path[0].towards_prev()) /
-                 sampled_path[0].vert.t * sampled_path[0].vert.t;
-    for (unsigned k = 1; k < path_end; k++) {
-        float d = sampled_path[k].dens *
-                  sampled_path[k - 1].vert.normal.inner(sampled_path[k].towards()) *
-                  sampled_path[k].vert.normal.inner(sampled_path[k].towards_prev()) /
-                  (sampled_path[k].vert.t * sampled_path[k].vert.t);
-        dens *= d;
-    }
-    return dens;
-}
-
 /**
  * @brief transport_all_connectible_subpaths Two subpaths are conectible iff. they joins the
  * camera
@@ -344,23 +575,29 @@ float subpath_density(float src_point_dens, /*float src_cos,*/ sampled_pathlet c
  * @param light_n The normal at light_p.
  * @param light_p_dens The probability density at light_p.
  * @param light The light source on which light_p is attached.
+ * @param cam_hit_light The light source that the camera subpath hits first, if any.
+ * @param cam_prefix_transport Scratch of max_cam_path_len elements.
+ * @param light_prefix_transport Scratch of max_light_path_len elements.
  * @param path_space Path space container.
- * @param mats Material container.
  * @return A lower bound sample of the measure function.
  */
 e8util::color3
 transport_all_connectible_subpaths(sampled_pathlet const *cam_path, unsigned max_cam_path_len,
                                    sampled_pathlet const *light_path, unsigned max_light_path_len,
                                    e8::if_light::emission_sample const &emission,
-                                   e8::if_light const &light, e8::if_path_space const &path_space,
-                                   e8::if_material_container const &mats) {
+                                   e8::if_light const &light, e8::if_light const *cam_hit_light,
+                                   e8util::color3 *cam_prefix_transport,
+                                   e8util::color3 *light_prefix_transport,
+                                   e8::if_path_space const &path_space) {
     if (max_cam_path_len == 0) {
         // Nothing to sample;
         return 0.0f;
     }
 
-    light_transport_info</*IMPORTANCE=*/false> cam_transport(cam_path, max_cam_path_len, mats);
-    light_transport_info</*IMPORTANCE=*/true> light_transport(light_path, max_light_path_len, mats);
+    light_transport_info</*IMPORTANCE=*/false> cam_transport(cam_path, max_cam_path_len,
+                                                             cam_prefix_transport);
+    light_transport_info</*IMPORTANCE=*/true> light_transport(light_path, max_light_path_len,
+                                                              light_prefix_transport);
 
     e8util::color3 rad;
 
@@ -377,18 +614,18 @@ transport_all_connectible_subpaths(sampled_pathlet const *cam_path, unsigned max
             if (light_plen == 0 && cam_plen == 0) {
                 // We have only the connection path, if it exists, which connects one vertex from
                 // the camera and one vertex from the light.
-                if (cam_path[0].light != nullptr) {
-                    e8util::color3 path_rad = cam_path[0].light->radiance(
-                        cam_path[0].towards_prev(), cam_path[0].vert.normal);
+                if (cam_hit_light != nullptr) {
+                    e8util::color3 path_rad = cam_hit_light->radiance(
+                        cam_path[0].towards_prev(), cam_path[0].n, cam_path[0].uv);
                     partition_rad_sum += cur_path_weight * path_rad;
                 }
                 partition_weight_sum += cur_path_weight;
             } else if (light_plen == 0) {
-                sampled_pathlet cam_join_vert = cam_path[cam_plen - 1];
+                sampled_pathlet const &cam_join_vert = cam_path[cam_plen - 1];
                 e8util::color3 transported_importance =
-                    transport_illum_source(light, emission.surface.p, emission.surface.n,
-                                           cam_join_vert.vert, cam_join_vert.towards_prev(),
-                                           path_space, mats) /
+                    transport_illum_source(light, emission.surface, *cam_join_vert.mat,
+                                           cam_join_vert.p, cam_join_vert.n, cam_join_vert.uv,
+                                           cam_join_vert.towards_prev(), path_space) /
                     emission.surface.area_dens; // direction was not chosen by random process.
 
                 // compute light transportation for camera subpath.
@@ -401,21 +638,22 @@ transport_all_connectible_subpaths(sampled_pathlet const *cam_path, unsigned max
                 // The chance of the light path hitting the camera is zero.
                 ;
             } else {
-                sampled_pathlet light_join_vert = light_path[light_plen - 1];
-                sampled_pathlet cam_join_vert = cam_path[cam_plen - 1];
-                e8util::vec3 join_path = cam_join_vert.vert.vertex - light_join_vert.vert.vertex;
+                sampled_pathlet const &light_join_vert = light_path[light_plen - 1];
+                sampled_pathlet const &cam_join_vert = cam_path[cam_plen - 1];
+                e8util::vec3 join_path = cam_join_vert.p - light_join_vert.p;
                 float join_distance = join_path.norm();
                 join_path = join_path / join_distance;
 
-                e8util::ray join_ray(light_join_vert.vert.vertex, join_path);
-                float cos_wo = light_join_vert.vert.normal.inner(join_path);
-                float cos_wi = cam_join_vert.vert.normal.inner(-join_path);
+                e8util::ray join_ray(light_join_vert.p, join_path);
+                float cos_wo = light_join_vert.n.inner(join_path);
+                float cos_wi = cam_join_vert.n.inner(-join_path);
                 float t;
                 if (cos_wo > 0.0f && cos_wi > 0.0f &&
                     !path_space.has_intersect(join_ray, 1e-3f, join_distance - 1e-3f, t)) {
                     // compute light transportation for light subpath.
                     e8util::color3 light_emission =
-                        light.projected_radiance(light_path[0].towards(), emission.surface.n) /
+                        light.projected_radiance(light_path[0].towards(), emission.surface.n,
+                                                 emission.surface.uv) /
                         (light_path[0].dens * emission.surface.area_dens);
                     e8util::color3 light_subpath_importance =
                         light_emission * light_transport.transport(light_plen - 1);
@@ -423,9 +661,9 @@ transport_all_connectible_subpaths(sampled_pathlet const *cam_path, unsigned max
                     // transport light over the join path.
                     float to_area_differential = cos_wi * cos_wo / (join_distance * join_distance);
                     e8util::color3 light_join_weight =
-                        brdf(light_join_vert.vert, join_path, light_join_vert.towards_prev(), mats);
+                        light_join_vert.brdf(join_path, light_join_vert.towards_prev());
                     e8util::color3 cam_join_weight =
-                        brdf(cam_join_vert.vert, cam_join_vert.towards_prev(), -join_path, mats);
+                        cam_join_vert.brdf(cam_join_vert.towards_prev(), -join_path);
                     e8util::color3 transported_importance = light_subpath_importance *
                                                             light_join_weight * cam_join_weight *
                                                             to_area_differential;
@@ -451,199 +689,1070 @@ transport_all_connectible_subpaths(sampled_pathlet const *cam_path, unsigned max
     return rad;
 }
 
-} // namespace
 
-e8::if_path_tracer::first_hits
-e8::if_path_tracer::compute_first_hit(std::vector<e8util::ray> const &rays,
-                                      if_path_space const &path_space,
-                                      if_light_sources const &light_sources) {
-    first_hits results(rays.size());
-    for (unsigned i = 0; i < rays.size(); i++) {
-        results.hits[i].intersect = path_space.intersect(rays[i]);
-        if (results.hits[i].intersect.normal.inner(-rays[i].v()) <= 0) {
-            results.hits[i].intersect = intersect_info();
-        } else {
-            if (results.hits[i].intersect.valid()) {
-                results.hits[i].light = light_sources.obj_light(*results.hits[i].intersect.geo);
-            }
-        }
-    }
-    return results;
-}
+/**
+ * @brief The path_vertex struct A vertex of a camera or light subpath, along with the densities
+ * that sampling from either end of the path generates it with.
+ */
+struct path_vertex {
+    e8::intersect_info vert;
 
-std::vector<e8util::vec3>
-e8::position_tracer::sample(e8util::rng & /*rng*/, std::vector<e8util::ray> const & /*rays*/,
-                            first_hits const &first_hits, if_path_space const &path_space,
-                            if_material_container const & /*mats*/,
-                            if_light_sources const & /*light_sources*/) const {
-    e8util::aabb const &aabb = path_space.aabb();
-    e8util::vec3 const &range = aabb.max() - aabb.min();
-    std::vector<e8util::vec3> rad(first_hits.hits.size());
-    for (unsigned i = 0; i < first_hits.hits.size(); i++) {
-        if (first_hits.hits[i].intersect.valid()) {
-            e8util::vec3 const &p = (first_hits.hits[i].intersect.vertex - aabb.min()) / range;
-            rad[i] = e8util::vec3({p(0), p(1), p(2)});
-        } else
-            rad[i] = 0.0f;
-    }
-    return rad;
+    // Direction towards the previous vertex of the subpath.
+    e8util::vec3 o;
+
+    // Throughput of the subpath up to the vertex, excluding the scattering at the vertex.
+    e8util::color3 throughput;
+
+    // Area density that the subpath generates the vertex with, conditioned on the vertices before.
+    float dens_fwd = 0.0f;
+
+    // Area density that sampling from the other end of the path generates the vertex with,
+    // conditioned on the next two vertices of the subpath. It's only known once they are sampled.
+    float dens_rev = 0.0f;
+
+    // The light source the vertex is on, if any.
+    e8::if_light const *light = nullptr;
+
+    // Index of the vertex in its subpath.
+    unsigned depth = 0;
+};
+
+/**
+ * @brief mat_pdf Solid angle density that the material at vert samples i with, given o.
+ */
+float mat_pdf(e8::intersect_info const &vert, e8util::vec3 const &o, e8util::vec3 const &i,
+              e8::if_material_container const &mats) {
+    e8::if_material const &mat = mats.find(vert.geo->material_id());
+    return mat.pdf(vert.uv, vert.normal, o, i);
 }
 
-std::vector<e8util::vec3>
-e8::normal_tracer::sample(e8util::rng & /*rng*/, std::vector<e8util::ray> const & /*rays*/,
-                          first_hits const &first_hits, if_path_space const & /*path_space*/,
-                          if_material_container const & /*mats*/,
-                          if_light_sources const & /*light_sources*/) const {
-    std::vector<e8util::vec3> rad(first_hits.hits.size());
-    for (unsigned i = 0; i < first_hits.hits.size(); i++) {
-        if (first_hits.hits[i].intersect.valid()) {
-            e8util::vec3 const &p = (first_hits.hits[i].intersect.normal + 1.0f) / 2.0f;
-            rad[i] = e8util::vec3({p(0), p(1), p(2)});
-        } else
-            rad[i] = 0.0f;
+/**
+ * @brief The path_densities struct Area densities that sampling from the camera and from the light
+ * generate every vertex of a complete path with. The vertices are indexed from the first hit of the
+ * camera to the vertex on the light.
+ */
+struct path_densities {
+    // cam[j] is conditioned on the vertices before j.
+    std::vector<float> cam;
+
+    // light[j] is conditioned on the vertices after j. The density of the last vertex is the one
+    // that light subpaths start with.
+    std::vector<float> light;
+
+    // Area density that next event estimation from the second last vertex samples the last with.
+    float nee = 0.0f;
+
+    void reset(unsigned path_len) {
+        cam.assign(path_len, 0.0f);
+        light.assign(path_len, 0.0f);
     }
-    return rad;
-}
 
-std::vector<e8util::color3>
-e8::direct_path_tracer::sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
-                               first_hits const &first_hits, if_path_space const &path_space,
-                               if_material_container const &mats,
-                               if_light_sources const &light_sources) const {
-    std::vector<e8util::color3> rad(first_hits.hits.size());
-    for (unsigned i = 0; i < rays.size(); i++) {
-        if (first_hits.hits[i].intersect.valid()) {
-            // compute radiance.
-            rad[i] = transport_direct_illum(rng, -rays[i].v(), first_hits.hits[i].intersect,
-                                            path_space, mats, light_sources,
-                                            /*multi_light_samps=*/1);
-            if (first_hits.hits[i].light != nullptr)
-                rad[i] += first_hits.hits[i].light->projected_radiance(
-                    -rays[i].v(), first_hits.hits[i].intersect.normal);
+    /**
+     * @brief fill_camera_subpath Copies the densities known from the camera subpath's own sampling
+     * for its first cam_len vertices.
+     */
+    void fill_camera_subpath(std::vector<path_vertex> const &cam_path, unsigned cam_len) {
+        for (unsigned j = 0; j < cam_len; j++) {
+            cam[j] = cam_path[j].dens_fwd;
+            if (j + 2 < cam_len) {
+                light[j] = cam_path[j].dens_rev;
+            }
         }
     }
-    return rad;
-}
 
-e8util::vec3 e8::unidirect_path_tracer::sample_indirect_illum(
-    e8util::rng &rng, e8util::vec3 const &o, e8::intersect_info const &vert,
-    if_path_space const &path_space, if_material_container const &mats,
-    if_light_sources const &light_sources, unsigned depth) const {
-    static const int mutate_depth = 2;
-    float p_survive = 0.5f;
-    if (depth >= mutate_depth) {
-        if (rng.draw() >= p_survive) {
-            return 0.0f;
+    /**
+     * @brief balance_weight Balance heuristic weight of the technique that samples the first
+     * cam_len vertices from the camera and the rest from the light. Techniques with at least two
+     * light vertices connect num_connections times as often as the others. The camera subpath keeps
+     * at least one vertex, since nothing connects to the camera.
+     */
+    float balance_weight(unsigned cam_len, float num_connections) const {
+        unsigned path_len = static_cast<unsigned>(cam.size());
+        unsigned light_end = path_len - 1;
+        auto ratio = [](float num, float den) { return den > 0 ? num / den : 0.0f; };
+
+        float sum = 1.0f;
+
+        // Techniques that take more vertices from the light.
+        float r = 1.0f;
+        for (unsigned c = cam_len; c > 1; c--) {
+            unsigned j = c - 1;
+            unsigned s = path_len - c;
+            if (s == 0) {
+                r *= ratio(nee, cam[j]);
+            } else if (s == 1) {
+                r *= ratio(num_connections * light[j] * light[light_end], cam[j] * nee);
+            } else {
+                r *= ratio(light[j], cam[j]);
+            }
+            sum += r;
         }
-    } else {
-        p_survive = 1;
-    }
 
-    // Direct.
-    if_light const *light = light_sources.obj_light(*vert.geo);
-    e8util::vec3 light_emission;
-    if (light != nullptr) {
-        light_emission = light->radiance(o, vert.normal);
+        // Techniques that take more vertices from the camera.
+        r = 1.0f;
+        for (unsigned c = cam_len; c < path_len; c++) {
+            unsigned j = c;
+            unsigned s = path_len - c;
+            if (s == 1) {
+                r *= ratio(cam[j], nee);
+            } else if (s == 2) {
+                r *= ratio(cam[j] * nee, num_connections * light[j] * light[light_end]);
+            } else {
+                r *= ratio(cam[j], light[j]);
+            }
+            sum += r;
+        }
+        return 1.0f / sum;
     }
+};
 
-    // Indirect.
-    float proj_solid_dens;
-    e8util::vec3 i = sample_brdf(&rng, &proj_solid_dens, vert, o, mats);
-    if (proj_solid_dens == 0.0f) {
-        return light_emission / p_survive;
+/**
+ * @brief trace_light_subpath Starts a subpath from a light source selected by power and appends its
+ * vertices to light_vertices. The vertices that camera vertices can connect to, i.e. all but the
+ * one on the light, are also indexed in connectible. Lights without a surface don't start
+ * subpaths, as only next event estimation samples them.
+ */
+void trace_light_subpath(e8::if_sampler &sampler, e8::if_path_space const &path_space,
+                         e8::if_material_container const &mats,
+                         e8::if_light_sources const &light_sources, unsigned max_path_len,
+                         std::vector<path_vertex> *light_vertices,
+                         std::vector<unsigned> *connectible) {
+    float light_prob_mass;
+    e8::if_light const *light = light_sources.sample_light(&sampler, &light_prob_mass);
+    if (!light->has_geometries()) {
+        return;
     }
-    e8::intersect_info indirect_vert = path_space.intersect(e8util::ray(vert.vertex, i));
-    if (!indirect_vert.valid() || indirect_vert.normal.inner(-i) <= 0.0f) {
-        return light_emission / p_survive;
+    e8::if_light::emission_sample emission = light->sample_emssion(&sampler);
+    if (emission.solid_angle_dens == 0.0f) {
+        return;
     }
 
-    e8util::color3 p_depth_to_inf =
-        sample_indirect_illum(rng, -i, indirect_vert, path_space, mats, light_sources, depth + 1);
-    float cos_w = vert.normal.inner(i);
-    e8util::color3 indirect = p_depth_to_inf * brdf(vert, o, i, mats) * cos_w / proj_solid_dens;
-
-    return (light_emission + indirect) / p_survive;
-}
-
-std::vector<e8util::color3>
-e8::unidirect_path_tracer::sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
-                                  first_hits const &first_hits, if_path_space const &path_space,
-                                  if_material_container const &mats,
-                                  if_light_sources const &light_sources) const {
-    std::vector<e8util::color3> rad(rays.size());
-    for (unsigned i = 0; i < rays.size(); i++) {
-        e8util::ray const &ray = rays[i];
-        if (first_hits.hits[i].intersect.valid()) {
-            // compute radiance.
-            e8util::color3 p_inf =
-                sample_indirect_illum(rng, -ray.v(), first_hits.hits[i].intersect, path_space, mats,
-                                      light_sources, /*depth=*/0);
-            rad[i] = p_inf;
+    path_vertex y0;
+    y0.vert = e8::intersect_info(/*t=*/0.0f, emission.surface.p, emission.surface.n,
+                                 emission.surface.uv, /*geo=*/nullptr, emission.surface.face);
+    y0.dens_fwd = light_prob_mass * emission.surface.area_dens;
+    y0.light = light;
+    light_vertices->push_back(y0);
+
+    e8util::color3 emitted =
+        light->projected_radiance(emission.w, emission.surface.n, emission.surface.uv) /
+        (y0.dens_fwd * emission.solid_angle_dens);
+    e8util::color3 scattering = 1.0f;
+    e8util::vec3 w = emission.w;
+    float w_dens = emission.solid_angle_dens;
+
+    // Camera subpaths take at least a vertex of any complete path.
+    for (unsigned depth = 1; depth + 1 < max_path_len; depth++) {
+        unsigned prev = static_cast<unsigned>(light_vertices->size()) - 1;
+        e8::intersect_info next =
+            path_space.intersect(e8util::ray((*light_vertices)[prev].vert.vertex, w));
+        if (!next.valid() || next.normal.inner(-w) <= 0.0f) {
+            break;
         }
-    }
-    return rad;
-}
-
-e8util::color3 e8::unidirect_lt1_path_tracer::sample_indirect_illum(
-    e8util::rng &rng, e8util::vec3 const &o, e8::intersect_info const &vert,
-    if_path_space const &path_space, if_material_container const &mats,
-    if_light_sources const &light_sources, unsigned depth, unsigned multi_light_samps,
-    unsigned multi_indirect_samps) const {
-    static const int mutate_depth = 2;
-    float p_survive = 0.5f;
-    if (depth >= mutate_depth) {
-        if (rng.draw() >= p_survive)
-            return 0.0f;
-    } else
-        p_survive = 1;
-
-    if (depth >= 1)
-        multi_indirect_samps = 1;
 
-    // direct.
-    e8util::color3 direct =
-        transport_direct_illum(rng, o, vert, path_space, mats, light_sources, multi_light_samps);
+        path_vertex y;
+        y.vert = next;
+        y.o = -w;
+        y.throughput = emitted * scattering;
+        y.dens_fwd = w_dens * next.normal.inner(-w) / (next.t * next.t);
+        y.depth = depth;
+        connectible->push_back(static_cast<unsigned>(light_vertices->size()));
+        light_vertices->push_back(y);
 
-    // indirect.
-    float proj_solid_dens;
-    e8util::vec3 multi_indirect;
-    for (unsigned k = 0; k < multi_indirect_samps; k++) {
-        e8util::color3 i = sample_brdf(&rng, &proj_solid_dens, vert, o, mats);
-        if (proj_solid_dens == 0.0f) {
+        if (!survive_russian_roulette(sampler, depth, &scattering)) {
             break;
         }
-        e8::intersect_info indirect_vert = path_space.intersect(e8util::ray(vert.vertex, i));
-        if (!indirect_vert.valid() || indirect_vert.normal.inner(-i) <= 0.0f) {
+        float dens;
+        e8util::vec3 i = sample_brdf(&sampler, &dens, y.vert, y.o, mats);
+        if (dens == 0.0f) {
             break;
         }
+        path_vertex &y_prev = (*light_vertices)[prev];
+        y_prev.dens_rev = mat_pdf(y.vert, i, y.o, mats) *
+                          std::abs(y_prev.vert.normal.inner(y.o)) / (next.t * next.t);
+        scattering =
+            scattering * brdf(y.vert, y.o, i, mats) * std::abs(next.normal.inner(i)) / dens;
+        w = i;
+        w_dens = dens;
+    }
+}
 
-        e8util::color3 indirect =
-            sample_indirect_illum(rng, -i, indirect_vert, path_space, mats, light_sources,
-                                  depth + 1, multi_light_samps, multi_indirect_samps);
-        float cos_w = vert.normal.inner(i);
-        multi_indirect += indirect * brdf(vert, o, i, mats) * cos_w / proj_solid_dens;
+/**
+ * @brief lvc_hit_emission Emission that the last vertex of the camera subpath, cam_path[cam_len -
+ * 1], hits, weighted against sampling the light from the other end of the path.
+ */
+e8util::color3 lvc_hit_emission(std::vector<path_vertex> const &cam_path, unsigned cam_len,
+                                e8::if_light_sources const &light_sources, float num_connections,
+                                path_densities *dens) {
+    path_vertex const &x = cam_path[cam_len - 1];
+    e8util::color3 emission = x.throughput * x.light->radiance(x.o, x.vert.normal, x.vert.uv);
+    if (cam_len == 1) {
+        return emission;
     }
 
-    return (direct + multi_indirect / multi_indirect_samps) / p_survive;
+    path_vertex const &prev = cam_path[cam_len - 2];
+    dens->reset(cam_len);
+    dens->fill_camera_subpath(cam_path, cam_len);
+    float area_dens;
+    float dir_dens;
+    x.light->emission_dens(x.vert.vertex, x.vert.normal, x.vert.face, x.o, &area_dens, &dir_dens);
+    dens->light[cam_len - 1] = light_sources.light_prob(x.light) * area_dens;
+    dens->light[cam_len - 2] =
+        dir_dens * std::abs(prev.vert.normal.inner(x.o)) / (x.vert.t * x.vert.t);
+    dens->nee =
+        light_sources.light_prob(x.light, prev.vert.vertex, prev.vert.normal) *
+        x.light->emission_surface_dens(prev.vert.vertex, x.vert.vertex, x.vert.normal, x.vert.face);
+    return emission * dens->balance_weight(cam_len, num_connections);
 }
 
-std::vector<e8util::color3>
-e8::unidirect_lt1_path_tracer::sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
-                                      first_hits const &first_hits, if_path_space const &path_space,
-                                      if_material_container const &mats,
-                                      if_light_sources const &light_sources) const {
-    std::vector<e8util::color3> rad(rays.size());
-    for (unsigned i = 0; i < rays.size(); i++) {
-        e8util::ray const &ray = rays[i];
-        if (first_hits.hits[i].intersect.valid()) {
-            // compute radiance.
-            e8util::color3 p2_inf =
-                sample_indirect_illum(rng, -ray.v(), first_hits.hits[i].intersect, path_space, mats,
-                                      light_sources, /*depth=*/0,
-                                      /*multi_light_samps=*/1, /*multi_indirect_samps=*/1);
-            if (first_hits.hits[i].light) {
-                rad[i] = p2_inf + first_hits.hits[i].light->radiance(
-                                      -ray.v(), first_hits.hits[i].intersect.normal);
+/**
+ * @brief lvc_next_event Next event estimation from the last vertex of the camera subpath, weighted
+ * against the other techniques of the same path.
+ */
+e8util::color3 lvc_next_event(e8::if_sampler &sampler, std::vector<path_vertex> const &cam_path,
+                              unsigned cam_len, e8::if_path_space const &path_space,
+                              e8::if_material_container const &mats,
+                              e8::if_light_sources const &light_sources, float num_connections,
+                              path_densities *dens) {
+    path_vertex const &x = cam_path[cam_len - 1];
+    light_sample sample = sample_light_source(sampler, x.vert, light_sources);
+    if (sample.light == nullptr) {
+        return 0.0f;
+    }
+    e8::if_geometry::surface_sample const &y0 = sample.emission.surface;
+    e8util::color3 illum =
+        transport_illum_source(*sample.light, y0, x.vert, x.o, path_space, mats) / y0.area_dens;
+    light_sources.record_contribution(sample.light, x.vert.vertex,
+                                      e8util::color3_luminance(illum) * sample.prob_mass);
+    if (e8util::equals(illum, e8util::vec3(0.0f)) || !sample.light->has_geometries()) {
+        return x.throughput * illum;
+    }
+
+    e8util::vec3 l = y0.p - x.vert.vertex;
+    float dist2 = l.inner(l);
+    e8util::vec3 dir = l / std::sqrt(dist2);
+    dens->reset(cam_len + 1);
+    dens->fill_camera_subpath(cam_path, cam_len);
+    dens->cam[cam_len] = mat_pdf(x.vert, x.o, dir, mats) * std::abs(y0.n.inner(dir)) / dist2;
+    float area_dens;
+    float dir_dens;
+    sample.light->emission_dens(y0.p, y0.n, y0.face, -dir, &area_dens, &dir_dens);
+    dens->light[cam_len] = light_sources.light_prob(sample.light) * area_dens;
+    dens->light[cam_len - 1] = dir_dens * std::abs(x.vert.normal.inner(dir)) / dist2;
+    if (cam_len >= 2) {
+        path_vertex const &prev = cam_path[cam_len - 2];
+        dens->light[cam_len - 2] = mat_pdf(x.vert, dir, x.o, mats) *
+                                   std::abs(prev.vert.normal.inner(x.o)) / (x.vert.t * x.vert.t);
+    }
+    dens->nee = y0.area_dens;
+    return x.throughput * illum * dens->balance_weight(cam_len, num_connections);
+}
+
+/**
+ * @brief lvc_connect Connects the last vertex of the camera subpath to the cached light vertex
+ * light_vertices[y_index], whose subpath precedes it in light_vertices. The result is weighted
+ * against the other techniques of the same path, and also divided by how many times more often the
+ * connections are made than the other techniques.
+ */
+e8util::color3 lvc_connect(std::vector<path_vertex> const &cam_path, unsigned cam_len,
+                           std::vector<path_vertex> const &light_vertices, unsigned y_index,
+                           e8::if_path_space const &path_space,
+                           e8::if_material_container const &mats,
+                           e8::if_light_sources const &light_sources, float num_connections,
+                           path_densities *dens) {
+    path_vertex const &x = cam_path[cam_len - 1];
+    path_vertex const &y = light_vertices[y_index];
+    unsigned light_len = y.depth + 1;
+
+    e8util::vec3 l = y.vert.vertex - x.vert.vertex;
+    float dist2 = l.inner(l);
+    float dist = std::sqrt(dist2);
+    e8util::vec3 dir = l / dist;
+    float cos_x = x.vert.normal.inner(dir);
+    float cos_y = y.vert.normal.inner(-dir);
+    if (cos_x <= 0.0f || cos_y <= 0.0f) {
+        return 0.0f;
+    }
+    e8util::color3 contrib = x.throughput * brdf(x.vert, x.o, dir, mats) *
+                             brdf(y.vert, -dir, y.o, mats) * y.throughput * cos_x * cos_y / dist2;
+    float t;
+    if (e8util::equals(contrib, e8util::vec3(0.0f)) ||
+        path_space.has_intersect(e8util::ray(x.vert.vertex, dir), 1e-3f, dist - 1e-3f, t)) {
+        return 0.0f;
+    }
+
+    dens->reset(cam_len + light_len);
+    dens->fill_camera_subpath(cam_path, cam_len);
+    dens->cam[cam_len] = mat_pdf(x.vert, x.o, dir, mats) * cos_y / dist2;
+    dens->light[cam_len - 1] = mat_pdf(y.vert, y.o, -dir, mats) * cos_x / dist2;
+    if (cam_len >= 2) {
+        path_vertex const &prev = cam_path[cam_len - 2];
+        dens->light[cam_len - 2] = mat_pdf(x.vert, dir, x.o, mats) *
+                                   std::abs(prev.vert.normal.inner(x.o)) / (x.vert.t * x.vert.t);
+    }
+    path_vertex const &y_prev = light_vertices[y_index - 1];
+    dens->cam[cam_len + 1] = mat_pdf(y.vert, -dir, y.o, mats) *
+                             std::abs(y_prev.vert.normal.inner(y.o)) / (y.vert.t * y.vert.t);
+    for (unsigned m = 0; m < light_len; m++) {
+        path_vertex const &v = light_vertices[y_index - m];
+        dens->light[cam_len + m] = v.dens_fwd;
+        if (m >= 2) {
+            dens->cam[cam_len + m] = v.dens_rev;
+        }
+    }
+    path_vertex const &y0 = light_vertices[y_index - y.depth];
+    path_vertex const &y1 = light_vertices[y_index - y.depth + 1];
+    dens->nee = light_sources.light_prob(y0.light, y1.vert.vertex, y1.vert.normal) *
+                y0.light->emission_surface_dens(y1.vert.vertex, y0.vert.vertex, y0.vert.normal,
+                                                y0.vert.face);
+    return contrib * dens->balance_weight(cam_len, num_connections) / num_connections;
+}
+
+// Probability that a Metropolis mutation proposes an independent path.
+float const MltLargeStepProb = 0.3f;
+
+/**
+ * @brief chain_seed Seeds the Markov chains of a sample() call by the call's random numbers, so
+ * every sample index runs different chains.
+ */
+uint64_t chain_seed(e8::if_sampler &sampler) {
+    sampler.start_pixel(0);
+    uint64_t hi = static_cast<uint64_t>(sampler.draw() * 0x1p24f);
+    uint64_t lo = static_cast<uint64_t>(sampler.draw() * 0x1p24f);
+    return e8util::hash64(hi << 24 | lo);
+}
+
+/**
+ * @brief pss_path_contribution Evaluates the path that the primary sample space state maps to. The
+ * first dimensions pick the pixel.
+ * @param width Width of the image the rays cover, or 0 if they aren't laid out as an image.
+ * @param pixel Result, the pixel the path goes through.
+ * @param lum Result, the luminance of the contribution, or 0 if it isn't a finite positive number.
+ * @return The contribution of the path.
+ */
+e8util::color3 pss_path_contribution(e8::pss_sampler &pss,
+                                     e8::bidirect_mis_path_tracer const &estimator,
+                                     std::vector<e8util::ray> const &rays,
+                                     e8::if_path_tracer::first_hits const &first_hits,
+                                     e8::if_path_space const &path_space,
+                                     e8::if_material_container const &mats,
+                                     e8::if_light_sources const &light_sources, unsigned width,
+                                     unsigned *pixel, float *lum) {
+    pss.start_pixel(0);
+    unsigned num_pixels = static_cast<unsigned>(rays.size());
+    if (width != 0) {
+        // Small steps then move to the neighbor pixels rather than along the scanline.
+        unsigned height = num_pixels / width;
+        unsigned x = std::min(static_cast<unsigned>(pss.draw() * width), width - 1);
+        unsigned y = std::min(static_cast<unsigned>(pss.draw() * height), height - 1);
+        *pixel = x + y * width;
+    } else {
+        *pixel = std::min(static_cast<unsigned>(pss.draw() * num_pixels), num_pixels - 1);
+    }
+    e8util::color3 f = estimator.estimate(pss, rays[*pixel], first_hits.hits[*pixel], path_space,
+                                          mats, light_sources);
+    *lum = e8util::color3_luminance(f);
+    if (!std::isfinite(*lum) || *lum <= 0.0f) {
+        *lum = 0.0f;
+        return 0.0f;
+    }
+    return f;
+}
+
+/**
+ * @brief The photon struct Light subpath vertex stored for density estimation, or shaded as a
+ * virtual point light.
+ */
+struct photon {
+    e8util::vec3 p;
+    e8util::vec3 n;
+    e8util::vec2 uv;
+    e8::if_material const *mat;
+
+    // Direction towards the previous vertex of the light subpath.
+    e8util::vec3 w;
+
+    // Flux the photon carries, already divided by the number of light subpaths of the pass.
+    e8util::color3 power;
+};
+
+// Exponent of the radius reduction. The squared radius of pass j+1 is (j + alpha)/(j + 1) of the
+// one of pass j, which keeps both the variance and the bias of the averaged passes vanishing
+// (Knaus and Zwicker, 2011).
+float const PpmRadiusAlpha = 2.0f / 3.0f;
+
+// Photons a lookup of the first pass finds on average, roughly, if the photons spread over surfaces
+// of area on the order of the square of the scene's enclosing radius.
+float const PpmInitialLookupPhotons = 16.0f;
+
+// Upper bound of the first radius relative to the scene's enclosing radius. Few photon paths would
+// otherwise give radii over which the surfaces curve away, out of the photons' hemisphere.
+float const PpmMaxInitialRadiusRatio = 1.0f / 8.0f;
+
+// Bounds of the harmonic mean distance of the irradiance records, relative to the scene's enclosing
+// radius.
+float const IrradianceCacheMinRadiusRatio = 1.0f / 64.0f;
+float const IrradianceCacheMaxRadiusRatio = 1.0f / 4.0f;
+
+// Probability that a guided vertex samples its direction from the path guide rather than the BSDF.
+float const GuideSamplingFraction = 0.5f;
+
+// Number of light subpaths that deposit the virtual point lights, and the number of them a sample
+// gathers from at its first hit.
+unsigned const VplLightPaths = 1024;
+unsigned const VplGatherCount = 16;
+
+// The distance, relative to the scene's enclosing radius, under which the geometry term between a
+// point and a virtual point light is clamped, so the lights don't show up as bright spots on the
+// surfaces right next to them.
+float const VplClampDistanceRatio = 1.0f / 8.0f;
+
+// Number of light candidates a pixel resamples per pass.
+unsigned const RestirCandidates = 16;
+
+// Upper bound of the candidates the reservoir of the previous pass counts for, relative to the
+// candidates of a pass. The passes are accumulated, so a longer history only correlates them, and
+// it spreads the bias of the visibility further.
+float const RestirMaxHistory = 1.0f;
+
+// Number of neighbor pixels a pixel reuses the reservoirs of, and the radius, in pixels, they are
+// picked within.
+unsigned const RestirSpatialNeighbors = 4;
+float const RestirSpatialRadius = 10.0f;
+
+// Reservoirs are only reused between first hits whose normals are within this cosine and whose
+// depths differ by less than this fraction.
+float const RestirNormalThreshold = 0.9f;
+float const RestirDepthThreshold = 0.1f;
+
+/**
+ * @brief The reservoir struct A light sample kept out of a stream of candidates by weighted
+ * reservoir sampling.
+ */
+struct reservoir {
+    e8::if_light const *light = nullptr;
+    e8::if_geometry::surface_sample y;
+
+    // Target function of y at the pixel, sum of the resampling weights of the candidates, and the
+    // number of them.
+    float target = 0.0f;
+    float w_sum = 0.0f;
+    float m = 0.0f;
+
+    // Normal and depth of the first hit the reservoir was built for.
+    e8util::vec3 n;
+    float depth = 0.0f;
+
+    /**
+     * @brief update Streams a candidate with resampling weight w, which is kept with probability
+     * w over the weights streamed so far.
+     * @param m Number of candidates the candidate counts for.
+     * @param u Uniform number in [0, 1).
+     */
+    void update(e8::if_light const *candid_light, e8::if_geometry::surface_sample const &candid,
+                float candid_target, float w, float candid_m, float u) {
+        w_sum += w;
+        m += candid_m;
+        if (w > 0.0f && u * w_sum < w) {
+            light = candid_light;
+            y = candid;
+            target = candid_target;
+        }
+    }
+
+    /**
+     * @brief weight Unbiased contribution weight of y, the reciprocal of its density as the
+     * reservoir selects it.
+     */
+    float weight() const { return target > 0.0f ? w_sum / (m * target) : 0.0f; }
+
+    bool alike(e8::intersect_info const &x) const {
+        return n.inner(x.normal) > RestirNormalThreshold &&
+               std::abs(depth - x.t) < RestirDepthThreshold * x.t;
+    }
+};
+
+/**
+ * @brief unshadowed_contribution Radiance the light sample y reflects off x towards o, regardless
+ * of the visibility, which the reservoirs resample by.
+ */
+e8util::color3 unshadowed_contribution(e8::if_light const &light,
+                                       e8::if_geometry::surface_sample const &y,
+                                       e8::if_material const &mat, e8::intersect_info const &x,
+                                       e8util::vec3 const &o) {
+    e8util::vec3 l = x.vertex - y.p;
+    e8util::color3 irradiance = light.eval(l, y.n, x.normal, y.uv);
+    if (e8util::equals(irradiance, e8util::vec3(0.0f))) {
+        return 0.0f;
+    }
+    return irradiance * mat.eval(x.uv, x.normal, o, -l.normalize());
+}
+
+/**
+ * @brief trace_photon_path Starts a subpath from a light source selected by power, and stores a
+ * photon wherever it lands on a diffuse surface. Lights without a surface don't emit photons.
+ * @param power_scale Reciprocal of the number of subpaths traced in the pass.
+ * @param min_depth Depth of the first vertex stored. By default, the photons that arrive straight
+ * from the light aren't stored, as next event estimation covers the direct illumination.
+ */
+void trace_photon_path(e8::if_sampler &sampler, e8::if_path_space const &path_space,
+                       e8::if_material_container const &mats,
+                       e8::if_light_sources const &light_sources, float power_scale,
+                       std::vector<photon> *photons, unsigned min_depth = 2) {
+    float light_prob_mass;
+    e8::if_light const *light = light_sources.sample_light(&sampler, &light_prob_mass);
+    if (!light->has_geometries()) {
+        return;
+    }
+    e8::if_light::emission_sample emission = light->sample_emssion(&sampler);
+    if (emission.solid_angle_dens == 0.0f) {
+        return;
+    }
+
+    e8util::color3 emitted =
+        light->projected_radiance(emission.w, emission.surface.n, emission.surface.uv) *
+        power_scale / (light_prob_mass * emission.surface.area_dens * emission.solid_angle_dens);
+    e8util::color3 scattering = 1.0f;
+    e8util::vec3 p = emission.surface.p;
+    e8util::vec3 w = emission.w;
+    for (unsigned depth = 1;; depth++) {
+        e8::intersect_info next = path_space.intersect(e8util::ray(p, w));
+        if (!next.valid() || next.normal.inner(-w) <= 0.0f) {
+            break;
+        }
+        e8::if_material const &mat = mats.find(next.geo->material_id());
+        if (depth >= min_depth && mat.diffuse()) {
+            photons->push_back(
+                photon{next.vertex, next.normal, next.uv, &mat, -w, emitted * scattering});
+        }
+
+        if (!survive_russian_roulette(sampler, depth, &scattering)) {
+            break;
+        }
+        float dens;
+        e8util::vec3 i = mat.sample(&sampler, &dens, next.uv, next.normal, -w);
+        if (dens == 0.0f) {
+            break;
+        }
+        scattering = scattering * mat.eval(next.uv, next.normal, -w, i) *
+                     std::abs(next.normal.inner(i)) / dens;
+        p = next.vertex;
+        w = i;
+    }
+}
+
+} // namespace
+
+void e8::if_path_tracer::end_pass() {}
+
+void e8::if_path_tracer::reset() {}
+
+e8::if_path_tracer::first_hits
+e8::if_path_tracer::compute_first_hit(std::vector<e8util::ray> const &rays,
+                                      if_path_space const &path_space,
+                                      if_light_sources const &light_sources) {
+    first_hits results(rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        results.hits[i].intersect = path_space.intersect(rays[i]);
+        if (results.hits[i].intersect.normal.inner(-rays[i].v()) <= 0) {
+            results.hits[i].intersect = intersect_info();
+        } else {
+            if (results.hits[i].intersect.valid()) {
+                results.hits[i].light = light_sources.obj_light(*results.hits[i].intersect.geo);
+            }
+        }
+    }
+    return results;
+}
+
+std::vector<e8util::vec3>
+e8::position_tracer::sample(if_sampler & /*sampler*/, std::vector<e8util::ray> const & /*rays*/,
+                            first_hits const &first_hits, if_path_space const &path_space,
+                            if_material_container const & /*mats*/,
+                            if_light_sources const & /*light_sources*/) const {
+    e8util::aabb const &aabb = path_space.aabb();
+    e8util::vec3 const &range = aabb.max() - aabb.min();
+    std::vector<e8util::vec3> rad(first_hits.hits.size());
+    for (unsigned i = 0; i < first_hits.hits.size(); i++) {
+        if (first_hits.hits[i].intersect.valid()) {
+            e8util::vec3 const &p = (first_hits.hits[i].intersect.vertex - aabb.min()) / range;
+            rad[i] = e8util::vec3({p(0), p(1), p(2)});
+        } else
+            rad[i] = 0.0f;
+    }
+    return rad;
+}
+
+std::vector<e8util::vec3>
+e8::normal_tracer::sample(if_sampler & /*sampler*/, std::vector<e8util::ray> const & /*rays*/,
+                          first_hits const &first_hits, if_path_space const & /*path_space*/,
+                          if_material_container const & /*mats*/,
+                          if_light_sources const & /*light_sources*/) const {
+    std::vector<e8util::vec3> rad(first_hits.hits.size());
+    for (unsigned i = 0; i < first_hits.hits.size(); i++) {
+        if (first_hits.hits[i].intersect.valid()) {
+            e8util::vec3 const &p = (first_hits.hits[i].intersect.normal + 1.0f) / 2.0f;
+            rad[i] = e8util::vec3({p(0), p(1), p(2)});
+        } else
+            rad[i] = 0.0f;
+    }
+    return rad;
+}
+
+e8::ao_tracer::ao_tracer(float radius_ratio, unsigned num_rays)
+    : m_radius_ratio(radius_ratio), m_num_rays(num_rays) {}
+
+std::vector<e8util::color3>
+e8::ao_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                      first_hits const &first_hits, if_path_space const &path_space,
+                      if_material_container const &mats,
+                      if_light_sources const & /*light_sources*/) const {
+    std::vector<e8util::color3> rad(rays.size());
+    float radius = m_radius_ratio * path_space.aabb().enclosing_radius();
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        first_hits::hit const &hit = first_hits.hits[i];
+        if (!hit.intersect.valid()) {
+            continue;
+        }
+        e8::intersect_info const &x = hit.intersect;
+        e8util::vec3 o = -rays[i].v();
+        if (hit.light != nullptr) {
+            rad[i] = hit.light->radiance(o, x.normal, x.uv);
+            continue;
+        }
+
+        e8util::vec3 n = x.normal.inner(o) < 0.0f ? -x.normal : x.normal;
+        unsigned num_unoccluded = 0;
+        for (unsigned k = 0; k < m_num_rays; k++) {
+            e8util::vec3 w = e8util::vec3_cos_hemisphere_sample(n, sampler.draw(), sampler.draw());
+            float t;
+            if (!path_space.has_intersect(e8util::ray(x.vertex, w), 1e-4f, radius, t)) {
+                num_unoccluded++;
+            }
+        }
+        float visibility = m_num_rays > 0 ? static_cast<float>(num_unoccluded) / m_num_rays : 1.0f;
+        rad[i] = mats.find(x.geo->material_id()).albedo(x.uv) * visibility;
+    }
+    return rad;
+}
+
+std::vector<e8util::color3>
+e8::direct_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                               first_hits const &first_hits, if_path_space const &path_space,
+                               if_material_container const &mats,
+                               if_light_sources const &light_sources) const {
+    std::vector<e8util::color3> rad(first_hits.hits.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        if (first_hits.hits[i].intersect.valid()) {
+            // compute radiance.
+            rad[i] = transport_direct_illum(sampler, -rays[i].v(),
+                                            first_hits.hits[i].intersect, path_space, mats,
+                                            light_sources, /*multi_light_samps=*/1);
+            if (first_hits.hits[i].light != nullptr)
+                rad[i] += first_hits.hits[i].light->projected_radiance(
+                    -rays[i].v(), first_hits.hits[i].intersect.normal,
+                    first_hits.hits[i].intersect.uv);
+        }
+    }
+    return rad;
+}
+
+struct e8::restir_path_tracer::reservoirs {
+    // Reservoirs of the pixels as left by the previous pass, and as built by the current one
+    // before and after the spatial reuse.
+    std::vector<reservoir> prev;
+    std::vector<reservoir> cur;
+    std::vector<reservoir> reused;
+
+    // The random numbers every pixel took to build its reservoir.
+    std::vector<unsigned> dims;
+};
+
+e8::restir_path_tracer::restir_path_tracer() : m_reservoirs(std::make_unique<reservoirs>()) {}
+
+e8::restir_path_tracer::~restir_path_tracer() = default;
+
+void e8::restir_path_tracer::reset() { m_reservoirs = std::make_unique<reservoirs>(); }
+
+std::vector<e8util::color3>
+e8::restir_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                               first_hits const &first_hits, if_path_space const &path_space,
+                               if_material_container const &mats,
+                               if_light_sources const &light_sources) const {
+    std::vector<e8util::color3> rad(rays.size());
+    unsigned num_pixels = static_cast<unsigned>(rays.size());
+    reservoirs &res = *m_reservoirs;
+    unsigned width = sampler.batch_pixels() == nullptr ? sampler.image_width() : 0;
+    if (width != 0 && num_pixels % width != 0) {
+        width = 0;
+    }
+    bool temporal = res.prev.size() == num_pixels;
+    res.cur.assign(num_pixels, reservoir());
+    res.dims.resize(num_pixels);
+
+    // Resample the candidates, then the reservoir of the previous pass.
+    for (unsigned i = 0; i < num_pixels; i++) {
+        sampler.start_pixel(i);
+        first_hits::hit const &hit = first_hits.hits[i];
+        if (!hit.intersect.valid()) {
+            res.dims[i] = sampler.dimension();
+            continue;
+        }
+        e8::intersect_info const &x = hit.intersect;
+        e8util::vec3 o = -rays[i].v();
+        e8::if_material const &mat = mats.find(x.geo->material_id());
+        reservoir &r = res.cur[i];
+        r.n = x.normal;
+        r.depth = x.t;
+        for (unsigned k = 0; k < RestirCandidates; k++) {
+            light_sample candid = sample_light_source(sampler, x, light_sources);
+            if (candid.light == nullptr) {
+                r.m += 1.0f;
+                continue;
+            }
+            float target = e8util::color3_luminance(unshadowed_contribution(
+                *candid.light, candid.emission.surface, mat, x, o));
+            r.update(candid.light, candid.emission.surface, target,
+                     target / candid.emission.surface.area_dens, /*candid_m=*/1.0f,
+                     sampler.draw());
+        }
+
+        if (temporal && res.prev[i].alike(x)) {
+            reservoir const &prev = res.prev[i];
+            float target = prev.light != nullptr
+                               ? e8util::color3_luminance(
+                                     unshadowed_contribution(*prev.light, prev.y, mat, x, o))
+                               : 0.0f;
+            float m = std::min(prev.m, RestirMaxHistory * RestirCandidates);
+            r.update(prev.light, prev.y, target, target * prev.weight() * m, m, sampler.draw());
+        }
+        res.dims[i] = sampler.dimension();
+    }
+
+    // Reuse the reservoirs of the neighbors, and trace the samples kept.
+    res.reused = res.cur;
+    for (unsigned i = 0; i < num_pixels; i++) {
+        sampler.start_pixel(i);
+        // Skip the random numbers that the pixel's reservoir took.
+        while (sampler.dimension() < res.dims[i]) {
+            sampler.draw();
+        }
+
+        first_hits::hit const &hit = first_hits.hits[i];
+        if (!hit.intersect.valid()) {
+            continue;
+        }
+        e8::intersect_info const &x = hit.intersect;
+        e8util::vec3 o = -rays[i].v();
+        if (hit.light != nullptr) {
+            rad[i] += hit.light->projected_radiance(o, x.normal, x.uv);
+        }
+
+        e8::if_material const &mat = mats.find(x.geo->material_id());
+        reservoir &r = res.reused[i];
+        unsigned neighbors[RestirSpatialNeighbors];
+        unsigned num_neighbors = 0;
+        for (unsigned k = 0; k < RestirSpatialNeighbors && width != 0; k++) {
+            int dx = static_cast<int>(std::round((2.0f * sampler.draw() - 1.0f) *
+                                                 RestirSpatialRadius));
+            int dy = static_cast<int>(std::round((2.0f * sampler.draw() - 1.0f) *
+                                                 RestirSpatialRadius));
+            int nx = static_cast<int>(i % width) + dx;
+            int ny = static_cast<int>(i / width) + dy;
+            if ((dx == 0 && dy == 0) || nx < 0 || ny < 0 || nx >= static_cast<int>(width) ||
+                ny >= static_cast<int>(num_pixels / width)) {
+                continue;
+            }
+            unsigned j = static_cast<unsigned>(nx) + static_cast<unsigned>(ny) * width;
+            reservoir const &neighbor = res.cur[j];
+            if (neighbor.light == nullptr || !neighbor.alike(x)) {
+                continue;
+            }
+            float target = e8util::color3_luminance(
+                unshadowed_contribution(*neighbor.light, neighbor.y, mat, x, o));
+            r.update(neighbor.light, neighbor.y, target,
+                     target * neighbor.weight() * neighbor.m, neighbor.m, sampler.draw());
+            neighbors[num_neighbors++] = j;
+        }
+        if (r.light == nullptr || r.target == 0.0f) {
+            continue;
+        }
+
+        // Only the neighbors that could have drawn the sample kept count towards the
+        // normalization, or the reuse darkens where the neighbors see other lights.
+        float m = res.cur[i].m;
+        for (unsigned k = 0; k < num_neighbors; k++) {
+            unsigned j = neighbors[k];
+            e8::intersect_info const &x_j = first_hits.hits[j].intersect;
+            if (e8util::color3_luminance(
+                    unshadowed_contribution(*r.light, r.y, mats.find(x_j.geo->material_id()),
+                                            x_j, -rays[j].v())) > 0.0f) {
+                m += res.cur[j].m;
+            }
+        }
+        r.m = m;
+
+        float weight = r.weight();
+        e8util::color3 illum = transport_illum_source(*r.light, r.y, x, o, path_space, mats);
+        if (e8util::equals(illum, e8util::vec3(0.0f))) {
+            // Occluded samples don't propagate to the next pass.
+            r.w_sum = 0.0f;
+            continue;
+        }
+        rad[i] += illum * weight;
+    }
+    std::swap(res.prev, res.reused);
+    return rad;
+}
+
+struct e8::unidirect_path_tracer::guiding_state {
+    struct guided_vertex {
+        e8util::vec3 p;
+        e8util::vec3 w;
+        float dens;
+
+        // Throughput of the path after the vertex scattered, and the radiance it had gathered by
+        // then. The radiance gathered afterwards, divided by the throughput, is what arrives at
+        // the vertex from w.
+        e8util::color3 throughput;
+        e8util::color3 rad;
+    };
+
+    path_guide::recorder recorder;
+
+    // Guided vertices of the path being traced.
+    std::vector<guided_vertex> vertices;
+};
+
+e8::unidirect_path_tracer::unidirect_path_tracer(unsigned max_path_len,
+                                                 std::shared_ptr<path_guide> guide)
+    : m_max_path_len(max_path_len), m_guide(std::move(guide)),
+      m_guiding(std::make_unique<guiding_state>()) {}
+
+e8::unidirect_path_tracer::~unidirect_path_tracer() = default;
+
+void e8::unidirect_path_tracer::end_pass() {
+    if (m_guide != nullptr) {
+        m_guide->end_pass(&m_guiding->recorder);
+    }
+}
+
+void e8::unidirect_path_tracer::reset() {
+    if (m_guide != nullptr) {
+        m_guide->reset();
+    }
+}
+
+e8util::vec3 e8::unidirect_path_tracer::sample_indirect_illum(
+    if_sampler &sampler, e8util::vec3 const &o, e8::intersect_info const &vert,
+    if_path_space const &path_space, if_material_container const &mats,
+    if_light_sources const &light_sources) const {
+    e8util::color3 rad;
+    e8util::color3 throughput = 1.0f;
+    e8util::vec3 o_cur = o;
+    e8::intersect_info vert_cur = vert;
+    std::vector<guiding_state::guided_vertex> &guided = m_guiding->vertices;
+    guided.clear();
+    for (unsigned depth = 0; depth < m_max_path_len; depth++) {
+        if (!survive_russian_roulette(sampler, depth, &throughput)) {
+            break;
+        }
+
+        // Direct.
+        if_light const *light = light_sources.obj_light(*vert_cur.geo);
+        if (light != nullptr) {
+            rad += throughput * light->radiance(o_cur, vert_cur.normal, vert_cur.uv);
+        }
+
+        // Indirect. The guide only learns the incident radiance, so it leaves the glossy vertices
+        // to their BSDF.
+        float proj_solid_dens;
+        e8util::vec3 i;
+        e8::if_material const &mat = mats.find(vert_cur.geo->material_id());
+        bool is_guided = m_guide != nullptr && mat.diffuse();
+        if (is_guided && m_guide->trained()) {
+            if (sampler.draw() < GuideSamplingFraction) {
+                float guide_dens;
+                i = m_guide->sample(&sampler, vert_cur.vertex, &guide_dens);
+                proj_solid_dens = GuideSamplingFraction * guide_dens +
+                                  (1.0f - GuideSamplingFraction) *
+                                      mat.pdf(vert_cur.uv, vert_cur.normal, o_cur, i);
+            } else {
+                float brdf_dens;
+                i = mat.sample(&sampler, &brdf_dens, vert_cur.uv, vert_cur.normal, o_cur);
+                proj_solid_dens = GuideSamplingFraction * m_guide->pdf(vert_cur.vertex, i) +
+                                  (1.0f - GuideSamplingFraction) * brdf_dens;
+            }
+        } else {
+            i = mat.sample(&sampler, &proj_solid_dens, vert_cur.uv, vert_cur.normal, o_cur);
+        }
+        if (proj_solid_dens == 0.0f) {
+            break;
+        }
+        float cos_w = vert_cur.normal.inner(i);
+        if (is_guided && cos_w <= 0.0f) {
+            // The guide samples the whole sphere, while the surface only reflects.
+            break;
+        }
+        e8::intersect_info indirect_vert = path_space.intersect(e8util::ray(vert_cur.vertex, i));
+        if (!indirect_vert.valid() || indirect_vert.normal.inner(-i) <= 0.0f) {
+            // The escaping ray still sees the lights surrounding the scene.
+            e8util::color3 incident;
+            if (!indirect_vert.valid()) {
+                for (if_light const *light : light_sources.infinite_lights()) {
+                    incident += light->escaped_radiance(i);
+                }
+                rad += throughput * brdf(vert_cur, o_cur, i, mats) * cos_w / proj_solid_dens *
+                       incident;
+            }
+            if (is_guided) {
+                m_guide->record(&m_guiding->recorder, vert_cur.vertex, i,
+                                e8util::color3_luminance(incident) / proj_solid_dens);
+            }
+            break;
+        }
+
+        throughput = throughput * brdf(vert_cur, o_cur, i, mats) * cos_w / proj_solid_dens;
+        if (is_guided) {
+            guided.push_back({vert_cur.vertex, i, proj_solid_dens, throughput, rad});
+        }
+        o_cur = -i;
+        vert_cur = indirect_vert;
+    }
+
+    for (guiding_state::guided_vertex const &v : guided) {
+        e8util::color3 incident;
+        for (unsigned c = 0; c < 3; c++) {
+            if (v.throughput(c) > 0.0f) {
+                incident(c) = (rad(c) - v.rad(c)) / v.throughput(c);
+            }
+        }
+        m_guide->record(&m_guiding->recorder, v.p, v.w,
+                        e8util::color3_luminance(incident) / v.dens);
+    }
+    return rad;
+}
+
+std::vector<e8util::color3>
+e8::unidirect_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                  first_hits const &first_hits, if_path_space const &path_space,
+                                  if_material_container const &mats,
+                                  if_light_sources const &light_sources) const {
+    if (m_guide == nullptr) {
+        return sample_unidirect_paths</*NextEvent=*/false, /*Mis=*/false>(
+            sampler, rays, first_hits, path_space, mats, light_sources, m_max_path_len);
+    }
+    std::vector<e8util::color3> rad(rays.size());
+    m_guide->begin_pass(&m_guiding->recorder, path_space.aabb());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        e8util::ray const &ray = rays[i];
+        if (first_hits.hits[i].intersect.valid()) {
+            // compute radiance.
+            e8util::color3 p_inf = sample_indirect_illum(
+                sampler, -ray.v(), first_hits.hits[i].intersect, path_space, mats, light_sources);
+            rad[i] = p_inf;
+        }
+    }
+    return rad;
+}
+
+e8::unidirect_lt1_path_tracer::unidirect_lt1_path_tracer(unsigned max_path_len,
+                                                         bool irradiance_caching)
+    : m_max_path_len(max_path_len),
+      m_irradiance_cache(irradiance_caching ? std::make_unique<irradiance_cache>() : nullptr) {}
+
+e8::unidirect_lt1_path_tracer::~unidirect_lt1_path_tracer() = default;
+
+void e8::unidirect_lt1_path_tracer::reset() {
+    if (m_irradiance_cache != nullptr) {
+        m_irradiance_cache = std::make_unique<irradiance_cache>();
+    }
+}
+
+e8util::color3 e8::unidirect_lt1_path_tracer::sample_indirect_illum(
+    if_sampler &sampler, e8util::vec3 const &o, e8::intersect_info const &vert,
+    if_path_space const &path_space, if_material_container const &mats,
+    if_light_sources const &light_sources, unsigned multi_light_samps,
+    unsigned start_depth) const {
+    return trace_unidirect_path<if_path_space, /*NextEvent=*/true, /*Mis=*/false>(
+        sampler, o, vert, path_space, mats, light_sources, m_max_path_len, multi_light_samps,
+        start_depth);
+}
+
+e8util::color3 e8::unidirect_lt1_path_tracer::indirect_irradiance(
+    if_sampler &sampler, e8::intersect_info const &vert, if_path_space const &path_space,
+    if_material_container const &mats, if_light_sources const &light_sources) const {
+    irradiance_cache &cache = *m_irradiance_cache;
+    e8util::color3 irradiance;
+    if (cache.lookup(vert.vertex, vert.normal, &irradiance)) {
+        return irradiance;
+    }
+    if (cache.empty()) {
+        float scene_radius = path_space.aabb().enclosing_radius();
+        cache.reset(path_space.aabb(), IrradianceCacheMinRadiusRatio * scene_radius,
+                    IrradianceCacheMaxRadiusRatio * scene_radius);
+    }
+
+    // The light sources reached directly are left to the direct illumination estimate.
+    unsigned const num_strata = irradiance_cache::num_theta * irradiance_cache::num_phi;
+    e8util::color3 rad[num_strata];
+    float dist[num_strata];
+    for (unsigned j = 0; j < irradiance_cache::num_theta; j++) {
+        for (unsigned k = 0; k < irradiance_cache::num_phi; k++) {
+            unsigned s = j * irradiance_cache::num_phi + k;
+            float e0 = sampler.draw();
+            float e1 = sampler.draw();
+            e8util::vec3 w = irradiance_cache::stratum_direction(vert.normal, j, k, e0, e1);
+            e8::intersect_info next = path_space.intersect(e8util::ray(vert.vertex, w));
+            if (!next.valid()) {
+                dist[s] = std::numeric_limits<float>::infinity();
+                continue;
+            }
+            dist[s] = next.t;
+            if (next.normal.inner(-w) > 0.0f) {
+                rad[s] = sample_indirect_illum(sampler, -w, next, path_space, mats, light_sources,
+                                               /*multi_light_samps=*/1, /*start_depth=*/1);
+            }
+        }
+    }
+    return cache.insert(vert.vertex, vert.normal, rad, dist);
+}
+
+std::vector<e8util::color3>
+e8::unidirect_lt1_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                      first_hits const &first_hits, if_path_space const &path_space,
+                                      if_material_container const &mats,
+                                      if_light_sources const &light_sources) const {
+    if (m_irradiance_cache == nullptr) {
+        return sample_unidirect_paths</*NextEvent=*/true, /*Mis=*/false>(
+            sampler, rays, first_hits, path_space, mats, light_sources, m_max_path_len);
+    }
+    std::vector<e8util::color3> rad(rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        e8util::ray const &ray = rays[i];
+        if (first_hits.hits[i].intersect.valid()) {
+            // compute radiance.
+            e8::intersect_info const &x = first_hits.hits[i].intersect;
+            e8::if_material const &mat = mats.find(x.geo->material_id());
+            e8util::color3 p2_inf;
+            if (mat.diffuse()) {
+                // A diffuse surface reflects the irradiance regardless of where it comes from.
+                p2_inf = transport_direct_illum(sampler, -ray.v(), x, path_space, mats,
+                                                light_sources, /*multi_light_samps=*/1) +
+                         mat.eval(x.uv, x.normal, -ray.v(), x.normal) *
+                             indirect_irradiance(sampler, x, path_space, mats, light_sources);
+            } else {
+                p2_inf = sample_indirect_illum(sampler, -ray.v(), x, path_space, mats,
+                                               light_sources, /*multi_light_samps=*/1);
+            }
+            if (first_hits.hits[i].light) {
+                rad[i] = p2_inf + first_hits.hits[i].light->radiance(
+                                      -ray.v(), first_hits.hits[i].intersect.normal,
+                                      first_hits.hits[i].intersect.uv);
             } else {
                 rad[i] = p2_inf;
             }
@@ -652,17 +1761,29 @@ e8::unidirect_lt1_path_tracer::sample(e8util::rng &rng, std::vector<e8util::ray>
     return rad;
 }
 
+e8::unidirect_mis_path_tracer::unidirect_mis_path_tracer(unsigned max_path_len)
+    : m_max_path_len(max_path_len) {}
+
+std::vector<e8util::color3>
+e8::unidirect_mis_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                      first_hits const &first_hits, if_path_space const &path_space,
+                                      if_material_container const &mats,
+                                      if_light_sources const &light_sources) const {
+    return sample_unidirect_paths</*NextEvent=*/true, /*Mis=*/true>(
+        sampler, rays, first_hits, path_space, mats, light_sources, m_max_path_len);
+}
+
 e8util::color3 e8::bidirect_lt2_path_tracer::join_with_light_paths(
-    e8util::rng &rng, e8util::vec3 const &o, e8::intersect_info const &poi,
+    if_sampler &sampler, e8util::vec3 const &o, e8::intersect_info const &poi,
     if_path_space const &path_space, if_material_container const &mats,
     if_light_sources const &light_sources, unsigned cam_path_len) const {
     e8util::color3 p1_direct =
-        transport_direct_illum(rng, o, poi, path_space, mats, light_sources, 1);
+        transport_direct_illum(sampler, o, poi, path_space, mats, light_sources, 1);
 
     // sample light.
     float light_prob_mass;
-    if_light const *light = light_sources.sample_light(&rng, &light_prob_mass);
-    e8::if_light::emission_sample emission = light->sample_emssion(&rng);
+    if_light const *light = light_sources.sample_light(&sampler, &light_prob_mass);
+    e8::if_light::emission_sample emission = light->sample_emssion(&sampler);
     e8util::ray light_path(emission.surface.p, emission.w);
     e8::intersect_info const &light_info = path_space.intersect(light_path);
     if (!light_info.valid())
@@ -670,7 +1791,7 @@ e8util::color3 e8::bidirect_lt2_path_tracer::join_with_light_paths(
 
     // construct light path.
     e8util::color3 light_illum =
-        light->projected_radiance(emission.w, emission.surface.n) /
+        light->projected_radiance(emission.w, emission.surface.n, emission.surface.uv) /
         (light_prob_mass * emission.surface.area_dens * emission.solid_angle_dens);
 
     e8::intersect_info terminate = light_info;
@@ -699,28 +1820,28 @@ e8util::color3 e8::bidirect_lt2_path_tracer::join_with_light_paths(
 }
 
 e8util::color3 e8::bidirect_lt2_path_tracer::sample_indirect_illum(
-    e8util::rng &rng, e8util::vec3 const &o, e8::intersect_info const &vert,
+    if_sampler &sampler, e8util::vec3 const &o, e8::intersect_info const &vert,
     if_path_space const &path_space, if_material_container const &mats,
     if_light_sources const &light_sources, unsigned depth) const {
     static const unsigned mutate_depth = 1;
     float p_survive = 0.5f;
     if (depth >= mutate_depth) {
-        if (rng.draw() >= p_survive)
+        if (sampler.draw() >= p_survive)
             return 0.0f;
     } else
         p_survive = 1;
 
     e8util::color3 bidirect =
-        join_with_light_paths(rng, o, vert, path_space, mats, light_sources, depth);
+        join_with_light_paths(sampler, o, vert, path_space, mats, light_sources, depth);
 
     // indirect.
     float mat_pdf;
-    e8util::vec3 i = sample_brdf(&rng, &mat_pdf, vert, o, mats);
+    e8util::vec3 i = sample_brdf(&sampler, &mat_pdf, vert, o, mats);
     e8::intersect_info indirect_info = path_space.intersect(e8util::ray(vert.vertex, i));
     e8util::color3 r;
     if (indirect_info.valid()) {
-        e8util::color3 indirect = sample_indirect_illum(rng, -i, indirect_info, path_space, mats,
-                                                        light_sources, depth + 1);
+        e8util::color3 indirect = sample_indirect_illum(sampler, -i, indirect_info, path_space,
+                                                        mats, light_sources, depth + 1);
         float cos_w = vert.normal.inner(i);
         if (cos_w < 0.0f)
             return 0.0f;
@@ -730,20 +1851,23 @@ e8util::color3 e8::bidirect_lt2_path_tracer::sample_indirect_illum(
 }
 
 std::vector<e8util::color3>
-e8::bidirect_lt2_path_tracer::sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+e8::bidirect_lt2_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const {
     std::vector<e8util::color3> rad(rays.size());
     for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
         e8util::ray const &ray = rays[i];
         if (first_hits.hits[i].intersect.valid()) {
             // compute radiance.
-            e8util::color3 p2_inf = sample_indirect_illum(
-                rng, -ray.v(), first_hits.hits[i].intersect, path_space, mats, light_sources, 0);
+            e8util::color3 p2_inf =
+                sample_indirect_illum(sampler, -ray.v(), first_hits.hits[i].intersect,
+                                      path_space, mats, light_sources, 0);
             if (first_hits.hits[i].light)
                 rad[i] = p2_inf + first_hits.hits[i].light->projected_radiance(
-                                      -ray.v(), first_hits.hits[i].intersect.normal);
+                                      -ray.v(), first_hits.hits[i].intersect.normal,
+                                      first_hits.hits[i].intersect.uv);
             else
                 rad[i] = p2_inf;
         }
@@ -752,52 +1876,603 @@ e8::bidirect_lt2_path_tracer::sample(e8util::rng &rng, std::vector<e8util::ray>
 }
 
 e8::if_light const *
-e8::bidirect_mis_path_tracer::sample_illum_source(e8util::rng *rng,
+e8::bidirect_mis_path_tracer::sample_illum_source(if_sampler *sampler,
                                                   if_light::emission_sample *emission_samp,
                                                   if_light_sources const &light_sources) const {
     // Sample light.
     float light_prob_mass;
-    if_light const *light = light_sources.sample_light(rng, &light_prob_mass);
+    if_light const *light = light_sources.sample_light(sampler, &light_prob_mass);
 
     // Sample emission.
-    *emission_samp = light->sample_emssion(rng);
+    *emission_samp = light->sample_emssion(sampler);
     emission_samp->surface.area_dens *= light_prob_mass;
 
     return light;
 }
 
+struct e8::bidirect_mis_path_tracer::path_pool {
+    sampled_pathlet cam_path[m_max_path_len];
+    sampled_pathlet light_path[m_max_path_len];
+    e8util::color3 cam_prefix_transport[m_max_path_len];
+    e8util::color3 light_prefix_transport[m_max_path_len];
+};
+
+e8::bidirect_mis_path_tracer::bidirect_mis_path_tracer() : m_pool(std::make_unique<path_pool>()) {}
+
+e8::bidirect_mis_path_tracer::~bidirect_mis_path_tracer() = default;
+
+std::vector<e8util::color3>
+e8::bidirect_mis_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const {
+    std::vector<e8util::color3> rad(rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        rad[i] = estimate(sampler, rays[i], first_hits.hits[i], path_space, mats, light_sources);
+    }
+    return rad;
+}
+
+e8util::color3 e8::bidirect_mis_path_tracer::estimate(if_sampler &sampler, e8util::ray const &ray,
+                                                      first_hits::hit const &hit,
+                                                      if_path_space const &path_space,
+                                                      if_material_container const &mats,
+                                                      if_light_sources const &light_sources) const {
+    // Initiates the first pathlets for both camera and light, then random walk over the path
+    // space.
+    unsigned cam_path_len =
+        sample_path(&sampler, m_pool->cam_path, ray, hit, path_space, mats, m_max_path_len);
+
+    if_light::emission_sample emission_sample;
+    if_light const *light = sample_illum_source(&sampler, &emission_sample, light_sources);
+    e8util::ray light_path0 = e8util::ray(emission_sample.surface.p, emission_sample.w);
+    unsigned light_path_len =
+        sample_path(&sampler, m_pool->light_path, light_path0, emission_sample.solid_angle_dens,
+                    path_space, mats, m_max_path_len);
+
+    // Compute radiance by combining different strategies.
+    return transport_all_connectible_subpaths(
+        m_pool->cam_path, cam_path_len, m_pool->light_path, light_path_len, emission_sample, *light,
+        hit.light, m_pool->cam_prefix_transport, m_pool->light_prefix_transport, path_space);
+}
+
+struct e8::bidirect_lvc_path_tracer::vertex_cache {
+    std::vector<path_vertex> light_vertices;
+    std::vector<unsigned> connectible;
+    std::vector<unsigned> light_dims;
+    std::vector<path_vertex> cam_path;
+    path_densities dens;
+};
+
+e8::bidirect_lvc_path_tracer::bidirect_lvc_path_tracer(unsigned max_path_len)
+    : m_max_path_len(max_path_len), m_cache(std::make_unique<vertex_cache>()) {}
+
+e8::bidirect_lvc_path_tracer::~bidirect_lvc_path_tracer() = default;
+
 std::vector<e8util::color3>
-e8::bidirect_mis_path_tracer::sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+e8::bidirect_lvc_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const {
+    // Trace a light subpath per pixel into the shared cache, each by the random numbers of its
+    // pixel.
+    std::vector<path_vertex> &light_vertices = m_cache->light_vertices;
+    std::vector<unsigned> &connectible = m_cache->connectible;
+    std::vector<unsigned> &light_dims = m_cache->light_dims;
+    light_vertices.clear();
+    connectible.clear();
+    light_dims.resize(rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        trace_light_subpath(sampler, path_space, mats, light_sources, m_max_path_len,
+                            &light_vertices, &connectible);
+        light_dims[i] = sampler.dimension();
+    }
+
+    // Picking m_num_connections cached vertices at random makes, in expectation, this many times
+    // the connections that a light subpath of its own would make.
+    float num_connections =
+        connectible.empty()
+            ? 0.0f
+            : static_cast<float>(m_num_connections) * rays.size() / connectible.size();
+
+    std::vector<e8util::color3> rad(rays.size());
+    std::vector<path_vertex> &cam_path = m_cache->cam_path;
+    path_densities &dens = m_cache->dens;
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        // Skip the random numbers that the pixel's light subpath took.
+        while (sampler.dimension() < light_dims[i]) {
+            sampler.draw();
+        }
+
+        first_hits::hit const &hit = first_hits.hits[i];
+        if (!hit.intersect.valid()) {
+            continue;
+        }
+        cam_path.clear();
+        path_vertex x0;
+        x0.vert = hit.intersect;
+        x0.o = -rays[i].v();
+        x0.throughput = 1.0f;
+        x0.dens_fwd = 1.0f;
+        x0.light = hit.light;
+        cam_path.push_back(x0);
+
+        for (unsigned c = 1;; c++) {
+            if (cam_path[c - 1].light != nullptr) {
+                rad[i] += lvc_hit_emission(cam_path, c, light_sources, num_connections, &dens);
+            }
+            if (c + 1 > m_max_path_len ||
+                !survive_russian_roulette(sampler, c - 1, &cam_path[c - 1].throughput)) {
+                break;
+            }
+
+            rad[i] += lvc_next_event(sampler, cam_path, c, path_space, mats, light_sources,
+                                     num_connections, &dens);
+            for (unsigned k = 0; k < m_num_connections && !connectible.empty(); k++) {
+                unsigned pick = std::min(static_cast<unsigned>(sampler.draw() * connectible.size()),
+                                         static_cast<unsigned>(connectible.size()) - 1);
+                unsigned y_index = connectible[pick];
+                if (c + light_vertices[y_index].depth + 1 <= m_max_path_len) {
+                    rad[i] += lvc_connect(cam_path, c, light_vertices, y_index, path_space, mats,
+                                          light_sources, num_connections, &dens);
+                }
+            }
+
+            path_vertex const &x = cam_path[c - 1];
+            float w_dens;
+            e8util::vec3 w = sample_brdf(&sampler, &w_dens, x.vert, x.o, mats);
+            if (w_dens == 0.0f) {
+                break;
+            }
+            e8::intersect_info next = path_space.intersect(e8util::ray(x.vert.vertex, w));
+            if (!next.valid() || next.normal.inner(-w) <= 0.0f) {
+                break;
+            }
+
+            path_vertex y;
+            y.vert = next;
+            y.o = -w;
+            y.throughput =
+                x.throughput * brdf(x.vert, x.o, w, mats) * x.vert.normal.inner(w) / w_dens;
+            y.dens_fwd = w_dens * next.normal.inner(-w) / (next.t * next.t);
+            y.light = light_sources.obj_light(*next.geo);
+            y.depth = c;
+            if (c >= 2) {
+                path_vertex &prev = cam_path[c - 2];
+                prev.dens_rev = mat_pdf(x.vert, w, x.o, mats) *
+                                std::abs(prev.vert.normal.inner(x.o)) / (x.vert.t * x.vert.t);
+            }
+            cam_path.push_back(y);
+        }
+    }
+    return rad;
+}
+
+struct e8::pssmlt_path_tracer::chain_state {
+    chain_state() : pss(/*seed=*/0) {}
+
+    pss_sampler pss;
+    std::vector<float> bootstrap_cdf;
+};
+
+e8::pssmlt_path_tracer::pssmlt_path_tracer() : m_chain(std::make_unique<chain_state>()) {}
+
+e8::pssmlt_path_tracer::~pssmlt_path_tracer() = default;
+
+void e8::pssmlt_path_tracer::reset() { m_chain = std::make_unique<chain_state>(); }
+
+std::vector<e8util::color3>
+e8::pssmlt_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                               first_hits const &first_hits, if_path_space const &path_space,
+                               if_material_container const &mats,
+                               if_light_sources const &light_sources) const {
+    std::vector<e8util::color3> rad(rays.size());
+    if (rays.empty()) {
+        return rad;
+    }
+    unsigned num_pixels = static_cast<unsigned>(rays.size());
+    uint64_t seed = chain_seed(sampler);
+    e8util::rng rng(seed);
+    pss_sampler &pss = m_chain->pss;
+    unsigned width = sampler.batch_pixels() == nullptr ? sampler.image_width() : 0;
+    if (width != 0 && num_pixels % width != 0) {
+        width = 0;
+    }
+
+    // The normalization is the average luminance over the primary sample space.
+    unsigned num_bootstrap = std::max(1U, num_pixels / m_bootstrap_ratio);
+    std::vector<float> &cdf = m_chain->bootstrap_cdf;
+    cdf.resize(num_bootstrap);
+    float sum_lum = 0.0f;
+    for (unsigned k = 0; k < num_bootstrap; k++) {
+        pss.reset(e8util::hash64(seed + k));
+        unsigned pixel;
+        float lum;
+        pss_path_contribution(pss, m_estimator, rays, first_hits, path_space, mats, light_sources,
+                              width, &pixel, &lum);
+        sum_lum += lum;
+        cdf[k] = sum_lum;
+    }
+    if (sum_lum == 0.0f) {
+        return rad;
+    }
+    float norm = sum_lum / num_bootstrap;
+
+    // A path x is visited with density lum(x)/norm, so it contributes f(x)*norm/lum(x) to its
+    // pixel, scaled by the number of pixels over the number of mutations.
+    unsigned num_mutations = num_pixels;
+    unsigned num_chains = std::min(m_num_chains, num_mutations);
+    float splat_scale = norm * num_pixels / num_mutations;
+    for (unsigned c = 0; c < num_chains; c++) {
+        unsigned k = static_cast<unsigned>(
+            std::upper_bound(cdf.begin(), cdf.end(), rng.draw() * sum_lum) - cdf.begin());
+        pss.reset(e8util::hash64(seed + std::min(k, num_bootstrap - 1)));
+        unsigned cur_pixel;
+        float cur_lum;
+        e8util::color3 cur_f =
+            pss_path_contribution(pss, m_estimator, rays, first_hits, path_space, mats,
+                                  light_sources, width, &cur_pixel, &cur_lum);
+        if (cur_lum == 0.0f) {
+            continue;
+        }
+
+        unsigned chain_len = num_mutations / num_chains + (c < num_mutations % num_chains ? 1 : 0);
+        for (unsigned m = 0; m < chain_len; m++) {
+            pss.start_mutation(rng.draw() < MltLargeStepProb);
+            unsigned pixel;
+            float lum;
+            e8util::color3 f =
+                pss_path_contribution(pss, m_estimator, rays, first_hits, path_space, mats,
+                                      light_sources, width, &pixel, &lum);
+
+            // Splat both the proposal and the current state by their expected contributions
+            // (Veach, 1997).
+            float accept_prob = std::min(1.0f, lum / cur_lum);
+            if (lum > 0.0f) {
+                rad[pixel] += f * (accept_prob * splat_scale / lum);
+            }
+            rad[cur_pixel] += cur_f * ((1.0f - accept_prob) * splat_scale / cur_lum);
+
+            if (rng.draw() < accept_prob) {
+                pss.accept();
+                cur_pixel = pixel;
+                cur_lum = lum;
+                cur_f = f;
+            } else {
+                pss.reject();
+            }
+        }
+    }
+    return rad;
+}
+
+struct e8::ppm_path_tracer::photon_map {
+    // Photons of the pass as traced, then grouped by the grid cell they hash to.
+    std::vector<photon> photons;
+    std::vector<photon> sorted;
+
+    // Photons of cell c are sorted[cell_start[c]] to sorted[cell_start[c + 1] - 1].
+    std::vector<unsigned> cell_start;
+
+    // Where build() places the next photon of every cell.
+    std::vector<unsigned> cell_cursor;
+
+    std::vector<unsigned> light_dims;
+
+    float radius2 = 0.0f;
+    float inv_cell_size = 0.0f;
+
+    // Number of passes traced so far, and the squared radius of the next pass relative to the
+    // first.
+    unsigned num_passes = 0;
+    float radius2_scale = 1.0f;
+
+    unsigned cell_of(int64_t x, int64_t y, int64_t z) const {
+        uint64_t h = e8util::hash64(static_cast<uint64_t>(x));
+        h = e8util::hash64(h ^ static_cast<uint64_t>(y));
+        h = e8util::hash64(h ^ static_cast<uint64_t>(z));
+        return static_cast<unsigned>(h & (cell_start.size() - 2));
+    }
+
+    int64_t grid_coord(float x) const {
+        return static_cast<int64_t>(std::floor(x * inv_cell_size));
+    }
+
+    /**
+     * @brief build Groups the photons by cells twice the radius wide, so that a lookup visits at
+     * most two cells along each axis. The hash table has a power of two cells, no fewer than the
+     * photons.
+     */
+    void build(float radius) {
+        radius2 = radius * radius;
+        inv_cell_size = 0.5f / radius;
+        unsigned num_cells = 1;
+        while (num_cells < photons.size()) {
+            num_cells <<= 1;
+        }
+        cell_start.assign(num_cells + 1, 0);
+        for (photon const &ph : photons) {
+            cell_start[cell_of(grid_coord(ph.p(0)), grid_coord(ph.p(1)), grid_coord(ph.p(2))) +
+                       1]++;
+        }
+        for (unsigned c = 0; c < num_cells; c++) {
+            cell_start[c + 1] += cell_start[c];
+        }
+        cell_cursor.assign(cell_start.begin(), cell_start.end() - 1);
+        sorted.resize(photons.size());
+        for (photon const &ph : photons) {
+            unsigned c = cell_of(grid_coord(ph.p(0)), grid_coord(ph.p(1)), grid_coord(ph.p(2)));
+            sorted[cell_cursor[c]++] = ph;
+        }
+    }
+
+    /**
+     * @brief radiance Density estimate of the radiance that the photons within the radius of x
+     * reflect towards o.
+     */
+    e8util::color3 radiance(e8::intersect_info const &x, e8util::vec3 const &o,
+                            e8::if_material const &mat) const {
+        if (sorted.empty()) {
+            return 0.0f;
+        }
+        float radius = std::sqrt(radius2);
+        int64_t lo[3];
+        int64_t hi[3];
+        for (unsigned a = 0; a < 3; a++) {
+            lo[a] = grid_coord(x.vertex(a) - radius);
+            hi[a] = grid_coord(x.vertex(a) + radius);
+        }
+
+        // Distinct grid cells may hash to the same table cell, which must be visited once.
+        unsigned visited[27];
+        unsigned num_visited = 0;
+        e8util::color3 sum;
+        for (int64_t gx = lo[0]; gx <= hi[0]; gx++) {
+            for (int64_t gy = lo[1]; gy <= hi[1]; gy++) {
+                for (int64_t gz = lo[2]; gz <= hi[2]; gz++) {
+                    unsigned c = cell_of(gx, gy, gz);
+                    if (std::find(visited, visited + num_visited, c) != visited + num_visited) {
+                        continue;
+                    }
+                    visited[num_visited++] = c;
+                    for (unsigned k = cell_start[c]; k < cell_start[c + 1]; k++) {
+                        photon const &ph = sorted[k];
+                        e8util::vec3 d = ph.p - x.vertex;
+                        // Photons on the other side of a thin wall face the other way.
+                        if (d.inner(d) > radius2 || ph.n.inner(x.normal) <= 0.0f) {
+                            continue;
+                        }
+                        sum += mat.eval(x.uv, x.normal, o, ph.w) * ph.power;
+                    }
+                }
+            }
+        }
+        return sum / (static_cast<float>(M_PI) * radius2);
+    }
+};
+
+e8::ppm_path_tracer::ppm_path_tracer() : m_photons(std::make_unique<photon_map>()) {}
+
+e8::ppm_path_tracer::~ppm_path_tracer() = default;
+
+void e8::ppm_path_tracer::reset() { m_photons = std::make_unique<photon_map>(); }
+
+std::vector<e8util::color3>
+e8::ppm_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                            first_hits const &first_hits, if_path_space const &path_space,
+                            if_material_container const &mats,
+                            if_light_sources const &light_sources) const {
     std::vector<e8util::color3> rad(rays.size());
+    if (rays.empty()) {
+        return rad;
+    }
 
-    std::unique_ptr<sampled_pathlet[]> cam_path =
-        std::unique_ptr<sampled_pathlet[]>(new sampled_pathlet[m_max_path_len]);
+    // Trace a photon path per pixel, each by the random numbers of its pixel.
+    photon_map &map = *m_photons;
+    map.photons.clear();
+    map.light_dims.resize(rays.size());
+    float power_scale = 1.0f / rays.size();
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        trace_photon_path(sampler, path_space, mats, light_sources, power_scale, &map.photons);
+        map.light_dims[i] = sampler.dimension();
+    }
 
-    std::unique_ptr<sampled_pathlet[]> light_path =
-        std::unique_ptr<sampled_pathlet[]>(new sampled_pathlet[m_max_path_len]);
+    float scene_radius = path_space.aabb().enclosing_radius();
+    float radius2 = std::min(PpmInitialLookupPhotons / (static_cast<float>(M_PI) * rays.size()),
+                             PpmMaxInitialRadiusRatio * PpmMaxInitialRadiusRatio) *
+                    scene_radius * scene_radius * map.radius2_scale;
+    map.build(std::sqrt(radius2));
+    map.num_passes++;
+    map.radius2_scale *= (map.num_passes + PpmRadiusAlpha) / (map.num_passes + 1);
 
     for (unsigned i = 0; i < rays.size(); i++) {
-        // Initiates the first pathlets for both camera and light, then random walk over the path
-        // space.
-        e8util::ray cam_path0 = rays[i];
-        unsigned cam_path_len = sample_path(&rng, cam_path.get(), cam_path0, first_hits.hits[i],
-                                            path_space, mats, m_max_path_len);
+        sampler.start_pixel(i);
+        // Skip the random numbers that the pixel's photon path took.
+        while (sampler.dimension() < map.light_dims[i]) {
+            sampler.draw();
+        }
+
+        first_hits::hit const &hit = first_hits.hits[i];
+        if (!hit.intersect.valid()) {
+            continue;
+        }
+
+        // Follow the camera path through the glossy surfaces until it reaches a diffuse one. The
+        // glossy vertices sample the lights as unidirect_mis_path_tracer does.
+        e8::intersect_info x = hit.intersect;
+        e8util::vec3 o = -rays[i].v();
+        e8::if_light const *light = hit.light;
+        e8util::color3 throughput = 1.0f;
+        float emission_weight = 1.0f;
+        for (unsigned depth = 0;; depth++) {
+            if (light != nullptr) {
+                rad[i] += throughput * emission_weight * light->radiance(o, x.normal, x.uv);
+            }
+            e8::if_material const &mat = mats.find(x.geo->material_id());
+            if (mat.diffuse()) {
+                rad[i] += throughput * (transport_direct_illum(sampler, o, x, path_space, mats,
+                                                               light_sources,
+                                                               /*multi_light_samps=*/1) +
+                                        map.radiance(x, o, mat));
+                break;
+            }
+            if (!survive_russian_roulette(sampler, depth, &throughput)) {
+                break;
+            }
+            rad[i] += throughput *
+                      transport_direct_illum_mis(sampler, o, x, path_space, mats, light_sources);
+
+            float w_dens;
+            e8util::vec3 w = mat.sample(&sampler, &w_dens, x.uv, x.normal, o);
+            if (w_dens == 0.0f) {
+                break;
+            }
+            e8::intersect_info next = path_space.intersect(e8util::ray(x.vertex, w));
+            if (!next.valid() || next.normal.inner(-w) <= 0.0f) {
+                break;
+            }
+            throughput = throughput * mat.eval(x.uv, x.normal, o, w) * x.normal.inner(w) / w_dens;
+            light = light_sources.obj_light(*next.geo);
+            if (light != nullptr) {
+                float brdf_dens = w_dens * next.normal.inner(-w) / (next.t * next.t);
+                float light_dens =
+                    light_sources.light_prob(light, x.vertex, x.normal) *
+                    light->emission_surface_dens(x.vertex, next.vertex, next.normal, next.face);
+                emission_weight = power_heuristic(brdf_dens, light_dens);
+            }
+            x = next;
+            o = -w;
+        }
+    }
+    return rad;
+}
+
+struct e8::vpl_path_tracer::vpl_set {
+    std::vector<photon> vpls;
+    bool deposited = false;
+
+    // The random numbers every pixel took to deposit the VPLs, in the pass that deposited them.
+    std::vector<unsigned> light_dims;
+
+    // Shadow rays from the point being shaded to the VPLs it gathers from, their bounds, what the
+    // VPLs contribute unless occluded, and the results of the shadow test.
+    std::vector<e8util::ray> rays;
+    std::vector<float> t_max;
+    std::vector<e8util::color3> contribs;
+    std::vector<bool> occluded;
+};
+
+e8::vpl_path_tracer::vpl_path_tracer() : m_vpls(std::make_unique<vpl_set>()) {}
 
-        if_light::emission_sample emission_sample;
-        if_light const *light = sample_illum_source(&rng, &emission_sample, light_sources);
-        e8util::ray light_path0 = e8util::ray(emission_sample.surface.p, emission_sample.w);
-        unsigned light_path_len =
-            sample_path(&rng, light_path.get(), light_path0, emission_sample.solid_angle_dens,
-                        path_space, mats, m_max_path_len);
+e8::vpl_path_tracer::~vpl_path_tracer() = default;
 
-        // Compute radiance by combining different strategies.
-        rad[i] = transport_all_connectible_subpaths(cam_path.get(), cam_path_len, light_path.get(),
-                                                    light_path_len, emission_sample, *light,
-                                                    path_space, mats);
+void e8::vpl_path_tracer::reset() { m_vpls = std::make_unique<vpl_set>(); }
+
+std::vector<e8util::color3>
+e8::vpl_path_tracer::sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                            first_hits const &first_hits, if_path_space const &path_space,
+                            if_material_container const &mats,
+                            if_light_sources const &light_sources) const {
+    std::vector<e8util::color3> rad(rays.size());
+    if (rays.empty()) {
+        return rad;
     }
 
+    vpl_set &set = *m_vpls;
+    set.light_dims.clear();
+    if (!set.deposited) {
+        // Spread the light subpaths over the pixels, each traced by the random numbers of its
+        // pixel.
+        set.light_dims.resize(rays.size());
+        float power_scale = 1.0f / VplLightPaths;
+        unsigned num_traced = 0;
+        for (unsigned i = 0; i < rays.size(); i++) {
+            sampler.start_pixel(i);
+            unsigned num_paths =
+                (VplLightPaths - num_traced) / (static_cast<unsigned>(rays.size()) - i);
+            for (unsigned k = 0; k < num_paths; k++) {
+                trace_photon_path(sampler, path_space, mats, light_sources, power_scale,
+                                  &set.vpls, /*min_depth=*/1);
+            }
+            num_traced += num_paths;
+            set.light_dims[i] = sampler.dimension();
+        }
+        set.deposited = true;
+    }
+
+    float min_dist = VplClampDistanceRatio * path_space.aabb().enclosing_radius();
+    float max_geo_term = 1.0f / (min_dist * min_dist);
+    unsigned num_vpls = static_cast<unsigned>(set.vpls.size());
+    unsigned num_gathered = std::min(VplGatherCount, num_vpls);
+    for (unsigned i = 0; i < rays.size(); i++) {
+        sampler.start_pixel(i);
+        // Skip the random numbers that the pixel's light subpaths took.
+        while (!set.light_dims.empty() && sampler.dimension() < set.light_dims[i]) {
+            sampler.draw();
+        }
+
+        first_hits::hit const &hit = first_hits.hits[i];
+        if (!hit.intersect.valid()) {
+            continue;
+        }
+        e8::intersect_info const &x = hit.intersect;
+        e8util::vec3 o = -rays[i].v();
+        if (hit.light != nullptr) {
+            rad[i] += hit.light->radiance(o, x.normal, x.uv);
+        }
+        rad[i] += transport_direct_illum(sampler, o, x, path_space, mats, light_sources,
+                                         /*multi_light_samps=*/1);
+        if (num_gathered == 0) {
+            continue;
+        }
+
+        // Systematic sampling, which gathers from every VPL with probability
+        // num_gathered/num_vpls.
+        e8::if_material const &mat = mats.find(x.geo->material_id());
+        float offset = sampler.draw();
+        set.rays.clear();
+        set.t_max.clear();
+        set.contribs.clear();
+        for (unsigned k = 0; k < num_gathered; k++) {
+            unsigned v = std::min(static_cast<unsigned>((k + offset) * num_vpls / num_gathered),
+                                  num_vpls - 1);
+            photon const &vpl = set.vpls[v];
+            e8util::vec3 l = vpl.p - x.vertex;
+            float dist2 = l.inner(l);
+            if (dist2 == 0.0f) {
+                continue;
+            }
+            float dist = std::sqrt(dist2);
+            e8util::vec3 w = l / dist;
+            float cos_x = x.normal.inner(w);
+            float cos_vpl = -vpl.n.inner(w);
+            if (cos_x <= 0.0f || cos_vpl <= 0.0f) {
+                continue;
+            }
+            float geo_term = std::min(cos_x * cos_vpl / dist2, max_geo_term);
+            e8util::color3 contrib = mat.eval(x.uv, x.normal, o, w) *
+                                     vpl.mat->eval(vpl.uv, vpl.n, -w, vpl.w) * vpl.power *
+                                     geo_term;
+            if (e8util::equals(contrib, e8util::vec3(0.0f))) {
+                continue;
+            }
+            set.rays.push_back(e8util::ray(x.vertex, w));
+            set.t_max.push_back(dist - 1e-3f);
+            set.contribs.push_back(contrib);
+        }
+
+        path_space.occluded(set.rays, 1e-4f, set.t_max, &set.occluded);
+        e8util::color3 gathered;
+        for (unsigned k = 0; k < set.rays.size(); k++) {
+            if (!set.occluded[k]) {
+                gathered += set.contribs[k];
+            }
+        }
+        rad[i] += gathered * (static_cast<float>(num_vpls) / num_gathered);
+    }
     return rad;
 }
@@ -7,10 +7,14 @@
 #include "pathspace.h"
 #include "tensor.h"
 #include <iosfwd>
+#include <memory>
 #include <vector>
 
 namespace e8 {
 
+class irradiance_cache;
+class path_guide;
+
 /**
  * @brief The if_path_tracer class CPU path-tracing interface.
  */
@@ -19,6 +23,9 @@ class if_path_tracer {
     if_path_tracer() = default;
     virtual ~if_path_tracer() = default;
 
+    // Maximum path length of the tracers whose paths only terminate by Russian roulette.
+    static unsigned const unlimited_path_len = ~0U;
+
     /**
      * @brief The first_hits struct Contains the intersection information about the first hit test.
      */
@@ -47,7 +54,9 @@ class if_path_tracer {
 
     /**
      * @brief sample Compute a single sample of the measurement function estimate.
-     * @param rng Random number generator.
+     * @param sampler Source of the random numbers. Implementations call start_pixel() before
+     * drawing the numbers of every pixel, so a pixel's estimate doesn't depend on the other pixels
+     * in the batch.
      * @param first_hits In aperture configuration, the first hits are deterministic. The
      * path-tracer can save computation by using the cached intersection information about the first
      * hits.
@@ -56,11 +65,25 @@ class if_path_tracer {
      * @param mats Material container.
      * @return A sample of the measurement function estimate.
      */
-    virtual std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    virtual std::vector<e8util::vec3> sample(if_sampler &sampler,
+                                             std::vector<e8util::ray> const &rays,
                                              first_hits const &first_hits,
                                              if_path_space const &path_space,
                                              if_material_container const &mats,
                                              if_light_sources const &light_sources) const = 0;
+
+    /**
+     * @brief end_pass Called on every tracer of a renderer once all of them have finished their
+     * samples of a pass, and before any of them samples again, so that the tracers which learn from
+     * their samples can share what they have learnt.
+     */
+    virtual void end_pass();
+
+    /**
+     * @brief reset Discards what the tracer has learnt about the scene from the previous samples.
+     * It has to be called whenever the scene changes.
+     */
+    virtual void reset();
 };
 
 /**
@@ -71,7 +94,7 @@ class position_tracer : public if_path_tracer {
     position_tracer() = default;
     ~position_tracer() override = default;
 
-    std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const override;
@@ -85,12 +108,38 @@ class normal_tracer : public if_path_tracer {
     normal_tracer() = default;
     ~normal_tracer() override = default;
 
-    std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const override;
 };
 
+/**
+ * @brief The ao_tracer class Cheap shaded preview of the geometry and the materials: the albedo of
+ * the first hit, darkened by the fraction of its hemisphere that is occluded within a radius. Only
+ * short occlusion rays are traced, so it runs at interactive rates. Lights show their radiance, and
+ * surfaces seen from behind are shaded as if seen from the front.
+ */
+class ao_tracer : public if_path_tracer {
+  public:
+    /**
+     * @brief ao_tracer
+     * @param radius_ratio Range of the occlusion rays, relative to the scene's enclosing radius.
+     * @param num_rays Number of cosine-weighted occlusion rays per sample.
+     */
+    ao_tracer(float radius_ratio, unsigned num_rays);
+    ~ao_tracer() override = default;
+
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const override;
+
+  private:
+    float m_radius_ratio;
+    unsigned m_num_rays;
+};
+
 /**
  * @brief The direct_path_tracer class
  * unidirectional tracer with throughput limited to 2.
@@ -100,32 +149,85 @@ class direct_path_tracer : public if_path_tracer {
     direct_path_tracer() = default;
     ~direct_path_tracer() override = default;
 
-    std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const override;
 };
 
+/**
+ * @brief The restir_path_tracer class Direct illumination by reservoir-based spatiotemporal
+ * importance resampling (Bitterli et al., "Spatiotemporal reservoir resampling for real-time ray
+ * tracing with dynamic direct lighting", 2020). Every pixel draws cheap light candidates and keeps
+ * one of them in a weighted reservoir, resampled by the unshadowed contribution. The reservoir
+ * absorbs the one its pixel kept in the previous pass, and then those of a few neighbor pixels
+ * whose first hits, the G-buffer, are alike. Only the sample finally kept is traced, with a single
+ * shadow ray per pixel. The reuse is biased where the visibility differs between the pixels, which
+ * is confined to the penumbrae. Temporal reuse needs the passes to cover the same batch of pixels,
+ * and spatial reuse needs the batch to be the whole image, as the sampler tells.
+ */
+class restir_path_tracer : public if_path_tracer {
+  public:
+    restir_path_tracer();
+    ~restir_path_tracer() override;
+
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const override;
+    void reset() override;
+
+  private:
+    struct reservoirs;
+
+    // Reservoirs of the previous pass and the scratch of the current one. Mutable, since sample()
+    // updates them and every sampling thread owns its tracer.
+    mutable std::unique_ptr<reservoirs> m_reservoirs;
+};
+
 /**
  * @brief The unidirect_lt1_path_tracer class
  * unidirectional tracer with unlimited throughput.
  */
 class unidirect_path_tracer : public if_path_tracer {
   public:
-    unidirect_path_tracer() = default;
-    ~unidirect_path_tracer() override = default;
+    /**
+     * @brief unidirect_path_tracer
+     * @param max_path_len Maximum number of vertices of a path, not counting the one on the
+     * camera. Russian roulette terminates the paths by their throughput before that.
+     * @param guide If not null, the paths sample their directions at the diffuse vertices from
+     * either the BSDF or the guide, weighting the two by one-sample MIS, and the guide learns from
+     * the radiance the paths find. Tracers of different threads share the guide, and each records
+     * its own passes.
+     */
+    explicit unidirect_path_tracer(unsigned max_path_len = unlimited_path_len,
+                                   std::shared_ptr<path_guide> guide = nullptr);
+    ~unidirect_path_tracer() override;
 
-    std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const override;
+    void end_pass() override;
+    void reset() override;
 
   protected:
-    e8util::vec3 sample_indirect_illum(e8util::rng &rng, e8util::vec3 const &o,
+    e8util::vec3 sample_indirect_illum(if_sampler &sampler, e8util::vec3 const &o,
                                        e8::intersect_info const &vert,
                                        if_path_space const &path_space,
                                        if_material_container const &mats,
-                                       if_light_sources const &light_sources, unsigned depth) const;
+                                       if_light_sources const &light_sources) const;
+
+  private:
+    struct guiding_state;
+
+    unsigned m_max_path_len;
+
+    // Null if path guiding is off.
+    std::shared_ptr<path_guide> m_guide;
+    // Records of the guide and the scratch of the guided vertices. Mutable, since every sampling
+    // thread owns its tracer.
+    mutable std::unique_ptr<guiding_state> m_guiding;
 };
 
 /**
@@ -134,21 +236,67 @@ class unidirect_path_tracer : public if_path_tracer {
  */
 class unidirect_lt1_path_tracer : public if_path_tracer {
   public:
-    unidirect_lt1_path_tracer() = default;
-    ~unidirect_lt1_path_tracer() override = default;
+    /**
+     * @brief unidirect_lt1_path_tracer
+     * @param max_path_len Maximum number of vertices of a path, not counting the one on the
+     * camera.
+     * @param irradiance_caching Whether to interpolate the indirect irradiance at the diffuse first
+     * hits from an irradiance_cache, rather than tracing a path from every one of them. The cache
+     * fills up as the pixels miss it, and is kept until reset().
+     */
+    explicit unidirect_lt1_path_tracer(unsigned max_path_len = unlimited_path_len,
+                                       bool irradiance_caching = false);
+    ~unidirect_lt1_path_tracer() override;
 
-    std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const override;
+    void reset() override;
 
   protected:
-    e8util::vec3 sample_indirect_illum(e8util::rng &rng, e8util::vec3 const &o,
+    e8util::vec3 sample_indirect_illum(if_sampler &sampler, e8util::vec3 const &o,
                                        e8::intersect_info const &vert,
                                        if_path_space const &path_space,
                                        if_material_container const &mats,
-                                       if_light_sources const &light_sources, unsigned depth,
-                                       unsigned n, unsigned m) const;
+                                       if_light_sources const &light_sources,
+                                       unsigned multi_light_samps, unsigned start_depth = 0) const;
+
+  private:
+    /**
+     * @brief indirect_irradiance Interpolates the indirect irradiance at the vertex from the
+     * cache, or integrates it into a new record if the cache has no valid record there.
+     */
+    e8util::color3 indirect_irradiance(if_sampler &sampler, e8::intersect_info const &vert,
+                                       if_path_space const &path_space,
+                                       if_material_container const &mats,
+                                       if_light_sources const &light_sources) const;
+
+    unsigned m_max_path_len;
+
+    // Null if irradiance caching is off. Mutable, since sample() fills it up and every sampling
+    // thread owns its tracer.
+    mutable std::unique_ptr<irradiance_cache> m_irradiance_cache;
+};
+
+/**
+ * @brief The unidirect_mis_path_tracer class
+ * unidirectional tracer that samples both the lights and the BRDF at every vertex, and combines the
+ * two estimates with the power heuristic (Veach, "Robust Monte Carlo methods for light transport
+ * simulation", 1997).
+ */
+class unidirect_mis_path_tracer : public if_path_tracer {
+  public:
+    explicit unidirect_mis_path_tracer(unsigned max_path_len = unlimited_path_len);
+    ~unidirect_mis_path_tracer() override = default;
+
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const override;
+
+  private:
+    unsigned m_max_path_len;
 };
 
 /**
@@ -160,17 +308,19 @@ class bidirect_lt2_path_tracer : public if_path_tracer {
     bidirect_lt2_path_tracer() = default;
     ~bidirect_lt2_path_tracer() override = default;
 
-    std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const override;
 
   protected:
-    e8util::vec3
-    join_with_light_paths(e8util::rng &rng, e8util::vec3 const &o, e8::intersect_info const &vert,
-                          if_path_space const &path_space, if_material_container const &mats,
-                          if_light_sources const &light_sources, unsigned cam_path_len) const;
-    e8util::vec3 sample_indirect_illum(e8util::rng &rng, e8util::vec3 const &o,
+    e8util::vec3 join_with_light_paths(if_sampler &sampler, e8util::vec3 const &o,
+                                       e8::intersect_info const &vert,
+                                       if_path_space const &path_space,
+                                       if_material_container const &mats,
+                                       if_light_sources const &light_sources,
+                                       unsigned cam_path_len) const;
+    e8util::vec3 sample_indirect_illum(if_sampler &sampler, e8util::vec3 const &o,
                                        e8::intersect_info const &vert,
                                        if_path_space const &path_space,
                                        if_material_container const &mats,
@@ -184,21 +334,165 @@ class bidirect_lt2_path_tracer : public if_path_tracer {
  */
 class bidirect_mis_path_tracer : public if_path_tracer {
   public:
-    bidirect_mis_path_tracer() = default;
-    ~bidirect_mis_path_tracer() override = default;
+    bidirect_mis_path_tracer();
+    ~bidirect_mis_path_tracer() override;
 
-    std::vector<e8util::vec3> sample(e8util::rng &rng, std::vector<e8util::ray> const &rays,
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
                                      first_hits const &first_hits, if_path_space const &path_space,
                                      if_material_container const &mats,
                                      if_light_sources const &light_sources) const override;
 
+    /**
+     * @brief estimate A sample of the radiance arriving through a single camera ray. It draws from
+     * the sampler's current pixel, which sample() starts for every ray.
+     * @param hit The first hit of the ray.
+     */
+    e8util::color3 estimate(if_sampler &sampler, e8util::ray const &ray,
+                            first_hits::hit const &hit, if_path_space const &path_space,
+                            if_material_container const &mats,
+                            if_light_sources const &light_sources) const;
+
   protected:
-    e8::if_light const *sample_illum_source(e8util::rng *rng,
+    e8::if_light const *sample_illum_source(if_sampler *sampler,
                                             if_light::emission_sample *emission_samp,
                                             if_light_sources const &light_sources) const;
 
   private:
+    struct path_pool;
+
     static unsigned const m_max_path_len = 8;
+
+    // Vertices and prefix transports of the subpaths under sampling. Every sampling thread owns its
+    // tracer, so they are mutable and reused across pixels and samples without allocation.
+    mutable std::unique_ptr<path_pool> m_pool;
+};
+
+/**
+ * @brief The bidirect_lvc_path_tracer class
+ * bidirectional tracer that traces one shared pool of light subpaths for all the pixels, caches
+ * their vertices in a flat array, then connects every camera vertex to a few cached vertices picked
+ * at random (Davidovic et al., "Progressive light transport simulation on the GPU: survey and
+ * improvements", 2014). All techniques are combined with the balance heuristic.
+ */
+class bidirect_lvc_path_tracer : public if_path_tracer {
+  public:
+    explicit bidirect_lvc_path_tracer(unsigned max_path_len = unlimited_path_len);
+    ~bidirect_lvc_path_tracer() override;
+
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const override;
+
+  private:
+    struct vertex_cache;
+
+    // Number of cached light vertices every camera vertex connects to.
+    static unsigned const m_num_connections = 3;
+    unsigned m_max_path_len;
+
+    // Light vertex cache and camera path, kept by the tracer so their storage grows only once.
+    // Mutable, since every sampling thread owns its tracer.
+    mutable std::unique_ptr<vertex_cache> m_cache;
+};
+
+/**
+ * @brief The pssmlt_path_tracer class
+ * Metropolis light transport in the primary sample space (Kelemen et al., "A simple and robust
+ * mutation strategy for the Metropolis light transport algorithm", 2002) over the estimator of
+ * bidirect_mis_path_tracer. The first primary sample picks the pixel, so the chains concentrate on
+ * the bright paths anywhere in the image, and splat what they find into the pixels. Every sample()
+ * call normalizes by uniformly sampled bootstrap paths and runs its own chains, which start from
+ * bootstrap paths picked in proportion to their luminance. Each sampling thread owns a tracer, so
+ * the threads run independent chains.
+ */
+class pssmlt_path_tracer : public if_path_tracer {
+  public:
+    pssmlt_path_tracer();
+    ~pssmlt_path_tracer() override;
+
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const override;
+    void reset() override;
+
+  private:
+    struct chain_state;
+
+    // One bootstrap path per this many pixels.
+    static unsigned const m_bootstrap_ratio = 8;
+
+    // Number of chains a sample() call runs. Together they make one mutation per pixel.
+    static unsigned constexpr m_num_chains = 4;
+
+    bidirect_mis_path_tracer m_estimator;
+
+    // Primary sample space state and bootstrap luminances, reused across sample() calls. Mutable,
+    // since every sampling thread owns its tracer.
+    mutable std::unique_ptr<chain_state> m_chain;
+};
+
+/**
+ * @brief The ppm_path_tracer class
+ * progressive photon mapping in its probabilistic formulation (Knaus and Zwicker, "Progressive
+ * photon mapping: a probabilistic approach", 2011). Every sample() call is a photon mapping pass:
+ * it traces a photon path per pixel from the lights and stores the photons landing on diffuse
+ * surfaces in a hashed grid. Camera paths then follow the glossy surfaces to their first diffuse
+ * vertex, where next event estimation gives the direct illumination and the photons within the pass
+ * radius the rest. The radius shrinks with every pass, so the average of the passes converges,
+ * while the caustics the glossy surfaces focus onto diffuse ones are found from the light side.
+ * Lights without a surface emit no photons, so only their direct illumination is estimated. Each
+ * sampling thread owns a tracer, so the threads trace and look up their passes in parallel.
+ */
+class ppm_path_tracer : public if_path_tracer {
+  public:
+    ppm_path_tracer();
+    ~ppm_path_tracer() override;
+
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const override;
+    void reset() override;
+
+  private:
+    struct photon_map;
+
+    // Photons of the current pass and the radius schedule over the passes. Mutable, since sample()
+    // traces the photons and every sampling thread owns its tracer.
+    mutable std::unique_ptr<photon_map> m_photons;
+};
+
+/**
+ * @brief The vpl_path_tracer class Instant radiosity (Keller, "Instant radiosity", 1997), for fast
+ * interactive previews. The first sample() after construction or a reset() traces light subpaths
+ * that deposit virtual point lights wherever they land on a diffuse surface. The VPLs are then
+ * kept, so the image settles in a few frames instead of converging slowly. A sample shades its
+ * first hit with next event estimation for the direct illumination and a stratified subset of the
+ * VPLs for the rest. The shadow rays to the subset go to the path space as a batch. The geometry
+ * term to a VPL is clamped, which darkens the corners in exchange for no bright splotches. Light
+ * that reaches a diffuse surface only through a glossy one, and the glossy reflections at the first
+ * hit, are biased the same way. Each sampling thread owns a tracer, so the threads deposit their
+ * own VPLs and average over more of them.
+ */
+class vpl_path_tracer : public if_path_tracer {
+  public:
+    vpl_path_tracer();
+    ~vpl_path_tracer() override;
+
+    std::vector<e8util::vec3> sample(if_sampler &sampler, std::vector<e8util::ray> const &rays,
+                                     first_hits const &first_hits, if_path_space const &path_space,
+                                     if_material_container const &mats,
+                                     if_light_sources const &light_sources) const override;
+    void reset() override;
+
+  private:
+    struct vpl_set;
+
+    // VPLs deposited since the last reset, and the scratch of the batched shadow rays. Mutable,
+    // since sample() deposits them and every sampling thread owns its tracer.
+    mutable std::unique_ptr<vpl_set> m_vpls;
 };
 
 } // namespace e8
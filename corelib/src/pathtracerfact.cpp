@@ -1,5 +1,7 @@
 #include "pathtracerfact.h"
+#include "pathguide.h"
 #include "pathtracer.h"
+#include <algorithm>
 #include <cassert>
 
 e8::pathtracer_factory::pathtracer_factory(pt_type type, options opts)
@@ -8,6 +10,8 @@ e8::pathtracer_factory::pathtracer_factory(pt_type type, options opts)
 e8::pathtracer_factory::~pathtracer_factory() {}
 
 e8::if_path_tracer *e8::pathtracer_factory::create() {
+    unsigned max_path_len = m_opts.max_pathlen > 0 ? static_cast<unsigned>(m_opts.max_pathlen)
+                                                   : if_path_tracer::unlimited_path_len;
     switch (m_type) {
     case normal:
         return new e8::normal_tracer();
@@ -16,13 +20,32 @@ e8::if_path_tracer *e8::pathtracer_factory::create() {
     case direct:
         return new e8::direct_path_tracer();
     case unidirect:
-        return new e8::unidirect_path_tracer();
+        if (m_opts.path_guiding && m_guide == nullptr) {
+            m_guide = std::make_shared<path_guide>();
+        }
+        return new e8::unidirect_path_tracer(max_path_len,
+                                             m_opts.path_guiding ? m_guide : nullptr);
     case unidirect_lt1:
-        return new e8::unidirect_lt1_path_tracer();
+        return new e8::unidirect_lt1_path_tracer(max_path_len, m_opts.irradiance_caching);
+    case unidirect_mis:
+        return new e8::unidirect_mis_path_tracer(max_path_len);
     case bidirect_lt2:
         return new e8::bidirect_lt2_path_tracer();
     case bidirect_mis:
         return new e8::bidirect_mis_path_tracer();
+    case bidirect_lvc:
+        return new e8::bidirect_lvc_path_tracer(max_path_len);
+    case pssmlt:
+        return new e8::pssmlt_path_tracer();
+    case ppm:
+        return new e8::ppm_path_tracer();
+    case vpl:
+        return new e8::vpl_path_tracer();
+    case ao:
+        return new e8::ao_tracer(m_opts.ao_radius,
+                                 static_cast<unsigned>(std::max(0, m_opts.ao_rays)));
+    case restir:
+        return new e8::restir_path_tracer();
     }
     assert(false);
     return nullptr;
@@ -1,18 +1,52 @@
 #ifndef PATHTRACERFACT_H
 #define PATHTRACERFACT_H
 
+#include <memory>
+
 namespace e8 {
 class if_path_tracer;
+class path_guide;
 }
 
 namespace e8 {
 
 class pathtracer_factory {
   public:
-    enum pt_type { normal, position, direct, unidirect, unidirect_lt1, bidirect_lt2, bidirect_mis };
+    enum pt_type {
+        normal,
+        position,
+        direct,
+        unidirect,
+        unidirect_lt1,
+        unidirect_mis,
+        bidirect_lt2,
+        bidirect_mis,
+        bidirect_lvc,
+        pssmlt,
+        ppm,
+        vpl,
+        ao,
+        restir
+    };
 
     struct options {
+        // Maximum number of vertices of a path, excluding the one on the camera. Non-positive
+        // means unlimited.
         int max_pathlen = 8;
+
+        // Whether the tracers that support it interpolate the indirect illumination from an
+        // irradiance cache.
+        bool irradiance_caching = false;
+
+        // Whether the tracers that support it guide their paths by the incident radiance they
+        // learn from the paths of the previous passes. All the tracers the factory creates share
+        // what they learn.
+        bool path_guiding = false;
+
+        // Range of the ambient occlusion preview's rays, relative to the scene's enclosing radius,
+        // and the number of them per sample.
+        float ao_radius = 0.1f;
+        int ao_rays = 4;
     };
 
     pathtracer_factory(pt_type type, options opts);
@@ -23,6 +57,9 @@ class pathtracer_factory {
   private:
     pt_type m_type;
     options m_opts;
+
+    // Shared by the guided tracers.
+    std::shared_ptr<path_guide> m_guide;
 };
 
 } // namespace e8
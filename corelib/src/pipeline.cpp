@@ -2,6 +2,7 @@
 #include "camera.h"
 #include "cameracontainer.h"
 #include "compositor.h"
+#include "denoiser.h"
 #include "frame.h"
 #include "lightsources.h"
 #include "obj.h"
@@ -72,7 +73,13 @@ e8::pt_render_pipeline::~pt_render_pipeline() {}
 
 void e8::pt_render_pipeline::render_frame() {
     m_com->resize(m_frame->width(), m_frame->height());
-    m_objdb.push_updates();
+    bool scene_changed = m_objdb.push_updates();
+    if (scene_changed) {
+        // Samples accumulated for the old scene no longer apply, nor does what the tracers have
+        // learnt about it. Without progressive rendering, the renderer starts over by itself.
+        m_renderer->reset_accumulation();
+        m_renderer->reset_tracers();
+    }
 
     camera_container *cams =
         static_cast<camera_container *>(m_objdb.actuator_of(obj_protocol::obj_protocol_camera));
@@ -89,11 +96,21 @@ void e8::pt_render_pipeline::render_frame() {
     if_light_sources *light_sources =
         static_cast<if_light_sources *>(m_objdb.actuator_of(obj_protocol::obj_protocol_light));
     assert(light_sources != nullptr);
+    if (scene_changed) {
+        // The power of the sky and the environment lights depends on the extent of the scene, so
+        // the selection is committed again once they know it.
+        light_sources->set_scene_boundary(path_space->aabb());
+        light_sources->commit();
+    }
 
     if_camera const *cur_cam = cams->active_cam();
     if (cur_cam != nullptr) {
         m_renderer->render(m_com.get(), *path_space, *mats, *light_sources, *cur_cam,
                            m_samps_per_frame, m_firefly_filter);
+        light_sources->adapt();
+        if (m_denoise) {
+            m_denoiser->denoise(m_renderer->aovs(), m_com.get());
+        }
     }
 
     m_com->commit(m_frame);
@@ -104,31 +121,78 @@ e8util::flex_config e8::pt_render_pipeline::config_protocol() const {
     e8util::flex_config config;
     config.int_val["num_threads"] = 0;
     config.str_val["scene_file"] = "cornellball";
+    config.str_val["env_map"] = "";
     config.enum_vals["path_space"] = std::set<std::string>{"linear", "static_bvh"};
     config.enum_sel["path_space"] = "static_bvh";
     config.enum_vals["path_tracer"] =
-        std::set<std::string>{"normal",           "position",           "direct",
-                              "unidirectional",   "unidirectional_lt1", "bidirectional_lt2",
-                              "bidirectional_mis"};
+        std::set<std::string>{"normal",            "position",           "direct",
+                              "unidirectional",    "unidirectional_lt1", "unidirectional_mis",
+                              "bidirectional_lt2", "bidirectional_mis",  "bidirectional_lvc",
+                              "pssmlt",            "ppm",                "vpl",
+                              "ao",                "restir"};
     config.enum_sel["path_tracer"] = "unidirectional";
-    config.enum_vals["light_sources"] = std::set<std::string>{"basic"};
+    config.int_val["max_path_len"] = 8;
+    config.bool_val["irradiance_caching"] = false;
+    config.bool_val["path_guiding"] = false;
+    config.float_val["ao_radius"] = 0.1f;
+    config.int_val["ao_rays"] = 4;
+    config.enum_vals["light_sources"] = std::set<std::string>{"basic", "bvh", "adaptive"};
     config.enum_sel["light_sources"] = "basic";
     config.bool_val["auto_exposure"] = false;
     config.float_val["exposure"] = 1.0f;
     config.int_val["super_samples"] = 4;
     config.int_val["samples_per_frame"] = 64;
     config.bool_val["firefly_filter"] = false;
+    config.bool_val["denoise"] = false;
+    config.bool_val["progressive"] = true;
+    config.enum_vals["sampler"] = std::set<std::string>{"random", "sobol", "halton"};
+    config.enum_sel["sampler"] = "random";
+    config.bool_val["blue_noise"] = false;
+    config.bool_val["adaptive_sampling"] = false;
+    config.float_val["target_error"] = 0.01f;
     return config;
 }
 
+unsigned e8::pt_render_pipeline::accumulated_samples() const {
+    return m_renderer->accumulated_samples();
+}
+
+void e8::pt_render_pipeline::create_renderer() {
+    e8::pathtracer_factory::options pt_opts;
+    pt_opts.max_pathlen = m_max_path_len;
+    pt_opts.irradiance_caching = m_irradiance_caching;
+    pt_opts.path_guiding = m_path_guiding;
+    pt_opts.ao_radius = m_ao_radius;
+    pt_opts.ao_rays = m_ao_rays;
+    e8::sampler_factory::options sampler_opts;
+    sampler_opts.blue_noise = m_blue_noise;
+    m_renderer = std::make_unique<e8::pt_image_renderer>(
+        std::make_unique<e8::pathtracer_factory>(m_pt_type, pt_opts),
+        m_num_threads, std::make_unique<e8::sampler_factory>(m_sampler_type, sampler_opts));
+    m_renderer->enable_progressive(m_progressive);
+    m_renderer->enable_adaptive_sampling(m_adaptive_sampling, m_target_error);
+    m_denoiser = std::make_unique<e8::atrous_denoiser>(m_num_threads);
+}
+
+void e8::pt_render_pipeline::load_scene() {
+    m_objdb.clear();
+    if (m_scene_file == "cornellball") {
+        m_objdb.insert_roots(e8util::cornell_scene().load_roots());
+    } else {
+        m_objdb.insert_roots(e8util::gltf_scene(m_scene_file, m_env_map).load_roots());
+    }
+}
+
 void e8::pt_render_pipeline::update_pipeline(e8util::flex_config const &diff) {
     // update.
     diff.find_int("num_threads", [this](int const &num_threads) {
         m_num_threads = static_cast<unsigned>(num_threads);
     });
 
-    diff.find_enum("path_tracer", [this](std::string const &tracer_type,
-                                         e8util::flex_config const * /*config*/) {
+    bool renderer_changed = false;
+    diff.find_enum("path_tracer",
+                   [this, &renderer_changed](std::string const &tracer_type,
+                                             e8util::flex_config const * /*config*/) {
         e8::pathtracer_factory::pt_type pt_type = e8::pathtracer_factory::pt_type::normal;
         if (tracer_type == "normal") {
             pt_type = e8::pathtracer_factory::pt_type::normal;
@@ -140,16 +204,75 @@ void e8::pt_render_pipeline::update_pipeline(e8util::flex_config const &diff) {
             pt_type = e8::pathtracer_factory::pt_type::unidirect;
         } else if (tracer_type == "unidirectional_lt1") {
             pt_type = e8::pathtracer_factory::pt_type::unidirect_lt1;
+        } else if (tracer_type == "unidirectional_mis") {
+            pt_type = e8::pathtracer_factory::pt_type::unidirect_mis;
         } else if (tracer_type == "bidirectional_lt2") {
             pt_type = e8::pathtracer_factory::pt_type::bidirect_lt2;
         } else if (tracer_type == "bidirectional_mis") {
             pt_type = e8::pathtracer_factory::pt_type::bidirect_mis;
+        } else if (tracer_type == "bidirectional_lvc") {
+            pt_type = e8::pathtracer_factory::pt_type::bidirect_lvc;
+        } else if (tracer_type == "pssmlt") {
+            pt_type = e8::pathtracer_factory::pt_type::pssmlt;
+        } else if (tracer_type == "ppm") {
+            pt_type = e8::pathtracer_factory::pt_type::ppm;
+        } else if (tracer_type == "vpl") {
+            pt_type = e8::pathtracer_factory::pt_type::vpl;
+        } else if (tracer_type == "ao") {
+            pt_type = e8::pathtracer_factory::pt_type::ao;
+        } else if (tracer_type == "restir") {
+            pt_type = e8::pathtracer_factory::pt_type::restir;
+        }
+        m_pt_type = pt_type;
+        renderer_changed = true;
+    });
+
+    diff.find_int("max_path_len", [this, &renderer_changed](int const &val) {
+        m_max_path_len = val;
+        renderer_changed = true;
+    });
+
+    diff.find_bool("irradiance_caching", [this, &renderer_changed](bool const &val) {
+        m_irradiance_caching = val;
+        renderer_changed = true;
+    });
+
+    diff.find_bool("path_guiding", [this, &renderer_changed](bool const &val) {
+        m_path_guiding = val;
+        renderer_changed = true;
+    });
+
+    diff.find_float("ao_radius", [this, &renderer_changed](float const &val) {
+        m_ao_radius = val;
+        renderer_changed = true;
+    });
+
+    diff.find_int("ao_rays", [this, &renderer_changed](int const &val) {
+        m_ao_rays = val;
+        renderer_changed = true;
+    });
+
+    diff.find_enum("sampler", [this, &renderer_changed](std::string const &sampler_type,
+                                                        e8util::flex_config const * /*config*/) {
+        if (sampler_type == "random") {
+            m_sampler_type = e8::sampler_factory::random;
+        } else if (sampler_type == "sobol") {
+            m_sampler_type = e8::sampler_factory::sobol;
+        } else if (sampler_type == "halton") {
+            m_sampler_type = e8::sampler_factory::halton;
         }
-        m_renderer = std::make_unique<e8::pt_image_renderer>(
-            std::make_unique<e8::pathtracer_factory>(pt_type, e8::pathtracer_factory::options()),
-            m_num_threads);
+        renderer_changed = true;
+    });
+
+    diff.find_bool("blue_noise", [this, &renderer_changed](bool const &val) {
+        m_blue_noise = val;
+        renderer_changed = true;
     });
 
+    if (renderer_changed) {
+        create_renderer();
+    }
+
     diff.find_enum("path_space", [this](std::string const &path_space_type,
                                         e8util::flex_config const * /*config*/) {
         if (path_space_type == "linear") {
@@ -163,17 +286,25 @@ void e8::pt_render_pipeline::update_pipeline(e8util::flex_config const &diff) {
                                            e8util::flex_config const * /*config*/) {
         if (light_sources_type == "basic") {
             m_objdb.register_actuator(std::make_unique<basic_light_sources>());
+        } else if (light_sources_type == "bvh") {
+            m_objdb.register_actuator(std::make_unique<bvh_light_sources>());
+        } else if (light_sources_type == "adaptive") {
+            m_objdb.register_actuator(std::make_unique<adaptive_light_sources>());
         }
     });
 
-    diff.find_str("scene_file", [this](std::string const &scene_file) {
-        m_objdb.clear();
-        if (scene_file == "cornellball") {
-            m_objdb.insert_roots(e8util::cornell_scene().load_roots());
-        } else {
-            m_objdb.insert_roots(e8util::gltf_scene(scene_file).load_roots());
-        }
+    bool scene_changed = false;
+    diff.find_str("scene_file", [this, &scene_changed](std::string const &scene_file) {
+        m_scene_file = scene_file;
+        scene_changed = true;
+    });
+    diff.find_str("env_map", [this, &scene_changed](std::string const &env_map) {
+        m_env_map = env_map;
+        scene_changed = true;
     });
+    if (scene_changed) {
+        load_scene();
+    }
 
     diff.find_bool("auto_exposure", [this](bool const &val) { m_com->enable_auto_exposure(val); });
     diff.find_float("exposure", [this](float const &val) { m_com->exposure(val); });
@@ -182,4 +313,31 @@ void e8::pt_render_pipeline::update_pipeline(e8util::flex_config const &diff) {
                   [this](int const &val) { m_samps_per_frame = static_cast<unsigned>(val); });
 
     diff.find_bool("firefly_filter", [this](bool const &val) { m_firefly_filter = val; });
+
+    diff.find_bool("denoise", [this](bool const &val) { m_denoise = val; });
+
+    diff.find_bool("progressive", [this](bool const &val) {
+        m_progressive = val;
+        m_renderer->enable_progressive(val);
+    });
+
+    diff.find_bool("adaptive_sampling", [this](bool const &val) {
+        m_adaptive_sampling = val;
+        m_renderer->enable_adaptive_sampling(m_adaptive_sampling, m_target_error);
+    });
+    diff.find_float("target_error", [this](float const &val) {
+        m_target_error = val;
+        m_renderer->enable_adaptive_sampling(m_adaptive_sampling, m_target_error);
+    });
+
+    // Except for the exposure and the denoising, which are only applied to the accumulated image,
+    // every change in the configuration invalidates the samples accumulated so far.
+    e8util::flex_config sampling_diff = diff;
+    sampling_diff.bool_val.erase("auto_exposure");
+    sampling_diff.float_val.erase("exposure");
+    sampling_diff.bool_val.erase("denoise");
+    if (!sampling_diff.empty()) {
+        m_renderer->reset_accumulation();
+        m_renderer->reset_tracers();
+    }
 }
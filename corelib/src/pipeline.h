@@ -2,15 +2,21 @@
 #define PIPELINE_H
 
 #include "objdb.h"
+#include "pathtracerfact.h"
+#include "samplerfact.h"
 #include "thread.h"
 #include "util.h"
 #include <ctime>
 #include <memory>
+#include <string>
 
 namespace e8 {
 class aces_compositor;
 }
 namespace e8 {
+class atrous_denoiser;
+}
+namespace e8 {
 class if_frame;
 }
 namespace e8 {
@@ -69,12 +75,45 @@ class pt_render_pipeline : public if_render_pipeline {
     void update_pipeline(e8util::flex_config const &diff) override;
     e8util::flex_config config_protocol() const override;
 
+    /**
+     * @brief accumulated_samples Number of samples per pixel the latest frame is averaged from. In
+     * progressive mode, it keeps growing until the scene or the configuration changes.
+     */
+    unsigned accumulated_samples() const;
+
   private:
+    /**
+     * @brief create_renderer Replaces the renderer with one that runs the selected path-tracer and
+     * sampler.
+     */
+    void create_renderer();
+
+    /**
+     * @brief load_scene Replaces the scene with the one in the selected scene file, lit by the
+     * selected environment map, if any.
+     */
+    void load_scene();
+
     std::unique_ptr<e8::pt_image_renderer> m_renderer;
     std::unique_ptr<e8::aces_compositor> m_com;
+    std::unique_ptr<e8::atrous_denoiser> m_denoiser;
     unsigned m_num_threads = 0;
+    pathtracer_factory::pt_type m_pt_type = pathtracer_factory::unidirect;
+    int m_max_path_len = pathtracer_factory::options().max_pathlen;
+    bool m_irradiance_caching = pathtracer_factory::options().irradiance_caching;
+    bool m_path_guiding = pathtracer_factory::options().path_guiding;
+    float m_ao_radius = pathtracer_factory::options().ao_radius;
+    int m_ao_rays = pathtracer_factory::options().ao_rays;
+    sampler_factory::sampler_type m_sampler_type = sampler_factory::random;
+    bool m_blue_noise = false;
     unsigned m_samps_per_frame = 1;
     bool m_firefly_filter = true;
+    bool m_denoise = false;
+    bool m_progressive = true;
+    bool m_adaptive_sampling = false;
+    float m_target_error = 0.01f;
+    std::string m_scene_file;
+    std::string m_env_map;
 };
 
 } // namespace e8
@@ -1,34 +1,48 @@
 #include "renderer.h"
 #include "compositor.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
 
 e8::pt_image_renderer::sampling_task_data::sampling_task_data(
     e8util::data_id_t id, if_path_space const &path_space, if_material_container const &mats,
     if_light_sources const &light_sources, std::vector<e8util::ray> const &rays,
-    if_path_tracer::first_hits const &first_hits, unsigned num_samps, unsigned width,
-    unsigned height, bool firefly_filter)
+    if_path_tracer::first_hits const &first_hits, std::vector<unsigned> const *pixels,
+    uint64_t first_sample, unsigned num_samps, unsigned width)
     : e8util::if_task_storage(id), path_space(path_space), mats(mats), light_sources(light_sources),
-      rays(rays), first_hits(first_hits), num_samps(num_samps), width(width), height(height),
-      firefly_filter(firefly_filter) {}
+      rays(rays), first_hits(first_hits), pixels(pixels), first_sample(first_sample),
+      num_samps(num_samps), width(width) {}
 
-e8::pt_image_renderer::sampling_task::sampling_task() : e8util::if_task(false), m_pt(nullptr) {}
+e8::pt_image_renderer::sampling_task::sampling_task()
+    : e8util::if_task(false), m_index(0), m_pt(nullptr), m_sampler(nullptr) {}
 
-e8::pt_image_renderer::sampling_task::sampling_task(e8::if_path_tracer *pt, unsigned seed)
-    : e8util::if_task(false), m_rng(seed), m_pt(pt) {}
+e8::pt_image_renderer::sampling_task::sampling_task(e8::if_path_tracer *pt,
+                                                    e8::if_sampler *sampler, unsigned index)
+    : e8util::if_task(false), m_index(index), m_pt(pt), m_sampler(sampler) {}
 
 e8::pt_image_renderer::sampling_task::sampling_task(sampling_task &&rhs) {
     m_estimate = rhs.m_estimate;
-    m_rng = rhs.m_rng;
+    m_lum2 = rhs.m_lum2;
+    m_index = rhs.m_index;
     m_pt = rhs.m_pt;
+    m_sampler = rhs.m_sampler;
     rhs.m_pt = nullptr;
+    rhs.m_sampler = nullptr;
 }
 
-e8::pt_image_renderer::sampling_task::~sampling_task() { delete m_pt; }
+e8::pt_image_renderer::sampling_task::~sampling_task() {
+    delete m_pt;
+    delete m_sampler;
+}
 
 e8::pt_image_renderer::sampling_task &
 e8::pt_image_renderer::sampling_task::operator=(sampling_task rhs) {
     m_estimate = rhs.m_estimate;
-    m_rng = rhs.m_rng;
+    m_lum2 = rhs.m_lum2;
+    m_index = rhs.m_index;
     std::swap(m_pt, rhs.m_pt);
+    std::swap(m_sampler, rhs.m_sampler);
     return *this;
 }
 
@@ -37,69 +51,93 @@ void e8::pt_image_renderer::sampling_task::run(e8util::if_task_storage *p) {
 
     // Allocate and clear result buffer.
     m_estimate.resize(data->rays.size());
+    m_lum2.resize(data->rays.size());
     std::fill(m_estimate.begin(), m_estimate.end(), e8util::vec3());
+    std::fill(m_lum2.begin(), m_lum2.end(), 0.0f);
 
     // Compute and accumulate multi-sample estimate.
     for (unsigned i = 0; i < data->num_samps; i++) {
-        std::vector<e8util::vec3> estimate = m_pt->sample(
-            m_rng, data->rays, data->first_hits, data->path_space, data->mats, data->light_sources);
-        if (data->firefly_filter) {
-            for (unsigned y = 0; y < data->height; y++) {
-                for (unsigned x = 0; x < data->width; x++) {
-                    if (x > 0 && x < data->width - 1 && y > 0 && y < data->height - 1) {
-                        // Check if all 8 neighboring pixels are all within the firefly threshold,
-                        // otherwise cap the difference.
-                        float r00 = estimate[x - 1 + (y - 1) * data->width].norm2();
-                        float r10 = estimate[x + (y - 1) * data->width].norm2();
-                        float r20 = estimate[x + 1 + (y - 1) * data->width].norm2();
-
-                        float r01 = estimate[x - 1 + y * data->width].norm2();
-                        float r11 = estimate[x + y * data->width].norm2();
-                        float r21 = estimate[x + 1 + y * data->width].norm2();
-
-                        float r02 = estimate[x - 1 + (y + 1) * data->width].norm2();
-                        float r12 = estimate[x + (y + 1) * data->width].norm2();
-                        float r22 = estimate[x + 1 + (y + 1) * data->width].norm2();
-
-                        bool firefly =
-                            (r11 - r00) > FireFlyMinDiff && (r11 - r10) > FireFlyMinDiff &&
-                            (r11 - r20) > FireFlyMinDiff && (r11 - r01) > FireFlyMinDiff &&
-                            (r11 - r21) > FireFlyMinDiff && (r11 - r02) > FireFlyMinDiff &&
-                            (r11 - r12) > FireFlyMinDiff && (r11 - r22) > FireFlyMinDiff;
-                        if (firefly) {
-                            float cap =
-                                1.0f / 8.0f * (r00 + r10 + r20 + r01 + r21 + r02 + r12 + r22) +
-                                FireFlyMinDiff;
-                            m_estimate[x + y * data->width] +=
-                                estimate[x + y * data->width].at_most(cap);
-                        } else {
-                            m_estimate[x + y * data->width] += estimate[x + y * data->width];
-                        }
-                    } else {
-                        // Just copy the egde of the image because there is not enough sample.
-                        m_estimate[x + y * data->width] += estimate[x + y * data->width];
-                    }
-                }
-            }
-        } else {
-            for (unsigned j = 0; j < estimate.size(); j++) {
-                m_estimate[j] += estimate[j];
-            }
+        m_sampler->start_sample(data->first_sample + m_index * data->num_samps + i, data->pixels,
+                                data->width);
+        std::vector<e8util::vec3> estimate =
+            m_pt->sample(*m_sampler, data->rays, data->first_hits, data->path_space, data->mats,
+                         data->light_sources);
+        for (unsigned j = 0; j < estimate.size(); j++) {
+            float lum = e8util::color3_luminance(estimate[j]);
+            m_estimate[j] += estimate[j];
+            m_lum2[j] += lum * lum;
         }
     }
 }
 
+void e8::pt_image_renderer::sampling_task::end_pass() { m_pt->end_pass(); }
+
+void e8::pt_image_renderer::sampling_task::reset_tracer() { m_pt->reset(); }
+
 std::vector<e8util::vec3> const &e8::pt_image_renderer::sampling_task::get_estimates() const {
     return m_estimate;
 }
 
+std::vector<float> const &e8::pt_image_renderer::sampling_task::get_squared_luminances() const {
+    return m_lum2;
+}
+
+e8::pt_image_renderer::firefly_task_data::firefly_task_data(std::vector<float> const &norm2,
+                                                            if_compositor *compositor)
+    : norm2(norm2), compositor(compositor) {}
+
+e8::pt_image_renderer::firefly_task::firefly_task(unsigned index, unsigned num_bands)
+    : e8util::if_task(false), m_index(index), m_num_bands(num_bands) {}
+
+void e8::pt_image_renderer::firefly_task::run(e8util::if_task_storage *p) {
+    firefly_task_data *data = static_cast<firefly_task_data *>(p);
+    unsigned const w = data->compositor->width();
+    unsigned const h = data->compositor->height();
+    m_caps.resize(w);
+    float *caps = m_caps.data();
+
+    // The edge of the image is just copied because there are not enough neighbors.
+    unsigned y_begin = std::max(1U, h * m_index / m_num_bands);
+    unsigned y_end = std::min(h - 1, h * (m_index + 1) / m_num_bands);
+    for (unsigned y = y_begin; y < y_end; y++) {
+        // Check if all 8 neighboring pixels are all within the firefly threshold, otherwise cap
+        // the difference. The rows of squared norms are scanned in lockstep so that the check
+        // vectorizes.
+        float const *r0 = data->norm2.data() + (y - 1) * w;
+        float const *r1 = data->norm2.data() + y * w;
+        float const *r2 = data->norm2.data() + (y + 1) * w;
+        for (unsigned x = 1; x + 1 < w; x++) {
+            float max_neighbor =
+                std::max(std::max(std::max(r0[x - 1], r0[x]), std::max(r0[x + 1], r1[x - 1])),
+                         std::max(std::max(r1[x + 1], r2[x - 1]), std::max(r2[x], r2[x + 1])));
+            float sum_neighbors = r0[x - 1] + r0[x] + r0[x + 1] + r1[x - 1] + r1[x + 1] +
+                                  r2[x - 1] + r2[x] + r2[x + 1];
+            caps[x] = r1[x] - max_neighbor > FireFlyMinDiff
+                          ? 1.0f / 8.0f * sum_neighbors + FireFlyMinDiff
+                          : std::numeric_limits<float>::max();
+        }
+        for (unsigned x = 1; x + 1 < w; x++) {
+            if (caps[x] < std::numeric_limits<float>::max()) {
+                rgba_color &c = (*data->compositor)(x, y);
+                c = c.trunc().at_most(caps[x]).homo(c(3));
+            }
+        }
+    }
+}
+
 e8::pt_image_renderer::pt_image_renderer(std::unique_ptr<pathtracer_factory> fact,
-                                         unsigned num_threads)
+                                         unsigned num_threads,
+                                         std::unique_ptr<sampler_factory> sampler_fact)
     : m_tasks(num_threads == 0 ? e8util::cpu_core_count() : num_threads),
       m_thrpool(num_threads == 0 ? e8util::cpu_core_count() : num_threads), m_rng(1361) {
+    if (sampler_fact == nullptr) {
+        sampler_fact = std::make_unique<sampler_factory>(sampler_factory::random,
+                                                         sampler_factory::options());
+    }
     // create task constructs.
     for (unsigned i = 0; i < m_tasks.size(); i++) {
-        m_tasks[i] = sampling_task(fact->create(), i * 1361 + 33);
+        m_tasks[i] = sampling_task(fact->create(), sampler_fact->create(), i);
+        m_firefly_tasks.push_back(firefly_task(i, static_cast<unsigned>(m_tasks.size())));
     }
 }
 
@@ -108,6 +146,8 @@ e8::pt_image_renderer::render(if_compositor *compositor, if_path_space const &pa
                               if_material_container const &mats,
                               if_light_sources const &light_sources, if_camera const &cam,
                               unsigned num_samps, bool firefly_filter) {
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
     // Generate camera seed rays and first_hits
     std::vector<e8util::ray> rays(compositor->width() * compositor->height());
     for (unsigned j = 0; j < compositor->height(); j++) {
@@ -121,46 +161,276 @@ e8::pt_image_renderer::render(if_compositor *compositor, if_path_space const &pa
     if_path_tracer::first_hits first_hits =
         if_path_tracer::compute_first_hit(rays, path_space, light_sources);
 
-    // Launch tasks.
-    unsigned allocated_samps =
-        static_cast<unsigned>(std::ceil(static_cast<float>(num_samps) / m_tasks.size()));
-    sampling_task_data task_config(/*id=*/0, path_space, mats, light_sources, rays, first_hits,
-                                   allocated_samps, compositor->width(), compositor->height(),
-                                   firefly_filter);
-    for (unsigned i = 0; i < m_tasks.size(); i++) {
-        m_thrpool.run(&m_tasks[i], &task_config);
+    if (!m_progressive || m_accum.size() != rays.size()) {
+        m_accum.resize(rays.size());
+        m_accum_lum2.resize(rays.size());
+        m_accum_counts.resize(rays.size());
+        m_aov_sums.normal.resize(rays.size());
+        m_aov_sums.depth.resize(rays.size());
+        m_aov_sums.albedo.resize(rays.size());
+        m_aov_hits.resize(rays.size());
+        reset_accumulation();
     }
 
+    // Accumulate the AOVs of this call's camera rays.
+    for (unsigned i = 0; i < rays.size(); i++) {
+        intersect_info const &x = first_hits.hits[i].intersect;
+        if (!x.valid()) {
+            continue;
+        }
+        m_aov_sums.normal[i] += x.normal.inner(rays[i].v()) > 0.0f ? -x.normal : x.normal;
+        m_aov_sums.depth[i] += x.t;
+        m_aov_sums.albedo[i] += mats.find(x.geo->material_id()).albedo(x.uv);
+        m_aov_hits[i]++;
+    }
+
+    numerical_stats stats;
+    stats.converged = false;
+
+    uint64_t budget = static_cast<uint64_t>(num_samps) * rays.size();
+    uint64_t gathered = 0;
+    if (!m_adaptive) {
+        gathered += static_cast<uint64_t>(sample_pixels(/*pixels=*/nullptr, rays, first_hits,
+                                                        path_space, mats, light_sources, num_samps,
+                                                        compositor->width())) *
+                    rays.size();
+    } else {
+        // Every pixel needs a few samples before its variance estimate means anything.
+        unsigned min_samps = *std::min_element(m_accum_counts.begin(), m_accum_counts.end());
+        if (min_samps < AdaptiveMinSamps) {
+            gathered += static_cast<uint64_t>(sample_pixels(
+                            /*pixels=*/nullptr, rays, first_hits, path_space, mats, light_sources,
+                            std::min(num_samps, AdaptiveMinSamps - min_samps),
+                            compositor->width())) *
+                        rays.size();
+        }
+
+        // Each pass spends half of the remaining budget on the tiles which haven't reached the
+        // target error yet, so the error estimates get refined as the budget runs out.
+        while (true) {
+            std::vector<unsigned> pixels =
+                unconverged_pixels(compositor->width(), compositor->height());
+            if (pixels.empty()) {
+                stats.converged = true;
+                break;
+            }
+            uint64_t remaining = budget > gathered ? budget - gathered : 0;
+            if (remaining < pixels.size()) {
+                break;
+            }
+            unsigned pass_samps =
+                std::max(1U, static_cast<unsigned>(remaining / pixels.size() / 2));
+            gathered += static_cast<uint64_t>(sample_pixels(&pixels, rays, first_hits, path_space,
+                                                            mats, light_sources, pass_samps,
+                                                            compositor->width())) *
+                        pixels.size();
+        }
+    }
+
+    // Average estimates.
     for (unsigned j = 0; j < compositor->height(); j++) {
         for (unsigned i = 0; i < compositor->width(); i++) {
-            (*compositor)(i, j) = 0.0f;
+            unsigned p = i + j * compositor->width();
+            e8util::vec3 estimate =
+                m_accum_counts[p] > 0 ? m_accum[p] / static_cast<float>(m_accum_counts[p]) : 0.0f;
+            (*compositor)(i, j) = estimate.homo(1.0f);
         }
     }
+    if (firefly_filter) {
+        remove_fireflies(compositor);
+    }
 
-    // Retrieve and accumulate estimated values.
+    // Average the AOVs.
+    m_aovs.width = compositor->width();
+    m_aovs.height = compositor->height();
+    m_aovs.normal.assign(rays.size(), e8util::vec3());
+    m_aovs.depth.assign(rays.size(), 0.0f);
+    m_aovs.albedo.assign(rays.size(), e8util::color3());
+    m_aovs.variance.resize(rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        if (m_aov_hits[i] > 0) {
+            m_aovs.normal[i] = m_aov_sums.normal[i].normalize();
+            m_aovs.depth[i] = m_aov_sums.depth[i] / static_cast<float>(m_aov_hits[i]);
+            m_aovs.albedo[i] = m_aov_sums.albedo[i] / static_cast<float>(m_aov_hits[i]);
+        }
+        float sigma = pixel_sigma(i);
+        m_aovs.variance[i] =
+            m_accum_counts[i] > 0 ? sigma * sigma / static_cast<float>(m_accum_counts[i]) : 0.0f;
+    }
+
+    // Convergence statistics.
+    float sum_sigma = 0.0f;
+    float sum_scaled_sigma = 0.0f;
+    float max_scaled_sigma = 0.0f;
+    for (unsigned i = 0; i < rays.size(); i++) {
+        float sigma = pixel_sigma(i);
+        float scaled_sigma =
+            m_accum_counts[i] > 0 ? sigma / std::sqrt(static_cast<float>(m_accum_counts[i])) : 0;
+        sum_sigma += sigma;
+        sum_scaled_sigma += scaled_sigma;
+        max_scaled_sigma = std::max(max_scaled_sigma, scaled_sigma);
+    }
+    stats.sample_sigma = sum_sigma / rays.size();
+    stats.scaled_sigma = sum_scaled_sigma / rays.size();
+    stats.max_sigma = max_scaled_sigma;
+    stats.num_samples = static_cast<unsigned>(gathered / rays.size());
+
+    float secs =
+        std::chrono::duration<float>(std::chrono::steady_clock::now() - started).count();
+    stats.time_per_sample = gathered > 0 ? secs * rays.size() / gathered : 0.0f;
+
+    return stats;
+}
+
+unsigned e8::pt_image_renderer::sample_pixels(
+    std::vector<unsigned> const *pixels, std::vector<e8util::ray> const &rays,
+    if_path_tracer::first_hits const &first_hits, if_path_space const &path_space,
+    if_material_container const &mats, if_light_sources const &light_sources, unsigned num_samps,
+    unsigned width) {
+    // Pack the rays and first hits of the selected pixels, so tracers only work on those.
+    std::vector<e8util::ray> selected_rays;
+    if_path_tracer::first_hits selected_hits(0);
+    if (pixels != nullptr) {
+        selected_rays.resize(pixels->size());
+        selected_hits.hits.resize(pixels->size());
+        for (unsigned k = 0; k < pixels->size(); k++) {
+            selected_rays[k] = rays[(*pixels)[k]];
+            selected_hits.hits[k] = first_hits.hits[(*pixels)[k]];
+        }
+    }
+
+    // Launch tasks.
+    unsigned allocated_samps =
+        static_cast<unsigned>(std::ceil(static_cast<float>(num_samps) / m_tasks.size()));
+    sampling_task_data task_config(/*id=*/0, path_space, mats, light_sources,
+                                   pixels != nullptr ? selected_rays : rays,
+                                   pixels != nullptr ? selected_hits : first_hits, pixels,
+                                   m_num_samps_drawn, allocated_samps, width);
     for (unsigned i = 0; i < m_tasks.size(); i++) {
+        m_thrpool.run(&m_tasks[i], &task_config);
+    }
+
+    // Retrieve and accumulate estimated values.
+    for (unsigned k = 0; k < m_tasks.size(); k++) {
         e8util::task_info result = m_thrpool.retrieve_next_completed();
-        std::vector<e8util::vec3> const &estimates =
-            static_cast<sampling_task *>(result.task())->get_estimates();
+        sampling_task *task = static_cast<sampling_task *>(result.task());
+        std::vector<e8util::vec3> const &estimates = task->get_estimates();
+        std::vector<float> const &lum2 = task->get_squared_luminances();
+        for (unsigned j = 0; j < estimates.size(); j++) {
+            unsigned p = pixels != nullptr ? (*pixels)[j] : j;
+            m_accum[p] += estimates[j];
+            m_accum_lum2[p] += lum2[j];
+        }
+    }
+    for (sampling_task &task : m_tasks) {
+        task.end_pass();
+    }
 
-        for (unsigned j = 0; j < compositor->height(); j++) {
-            for (unsigned i = 0; i < compositor->width(); i++) {
-                (*compositor)(i, j) += estimates[i + j * compositor->width()].homo(1.0f);
-            }
+    unsigned gathered_samps = allocated_samps * static_cast<unsigned>(m_tasks.size());
+    m_num_samps_drawn += gathered_samps;
+    if (pixels != nullptr) {
+        for (unsigned p : *pixels) {
+            m_accum_counts[p] += gathered_samps;
+        }
+    } else {
+        for (unsigned &count : m_accum_counts) {
+            count += gathered_samps;
         }
     }
+    return gathered_samps;
+}
 
-    // Average estimates.
-    float scale = 1.0f / (allocated_samps * m_tasks.size());
+void e8::pt_image_renderer::remove_fireflies(if_compositor *compositor) {
+    m_norm2.resize(compositor->width() * compositor->height());
     for (unsigned j = 0; j < compositor->height(); j++) {
         for (unsigned i = 0; i < compositor->width(); i++) {
-            (*compositor)(i, j) *= scale;
+            m_norm2[i + j * compositor->width()] = (*compositor)(i, j).trunc().norm2();
         }
     }
+    firefly_task_data task_config(m_norm2, compositor);
+    for (firefly_task &task : m_firefly_tasks) {
+        m_thrpool.run(&task, &task_config);
+    }
+    for (unsigned k = 0; k < m_firefly_tasks.size(); k++) {
+        m_thrpool.retrieve_next_completed();
+    }
+}
 
-    // TODO: Complete all stats.
-    numerical_stats stats;
-    stats.num_samples = allocated_samps * static_cast<unsigned>(m_tasks.size());
+float e8::pt_image_renderer::pixel_sigma(unsigned i) const {
+    unsigned n = m_accum_counts[i];
+    if (n < 2) {
+        return 0.0f;
+    }
+    float mean = e8util::color3_luminance(m_accum[i]) / n;
+    float var = (m_accum_lum2[i] / n - mean * mean) * n / (n - 1);
+    return std::sqrt(std::max(var, 0.0f));
+}
 
-    return stats;
+std::vector<unsigned> e8::pt_image_renderer::unconverged_pixels(unsigned width,
+                                                                unsigned height) const {
+    std::vector<unsigned> pixels;
+    for (unsigned y0 = 0; y0 < height; y0 += AdaptiveTileSize) {
+        for (unsigned x0 = 0; x0 < width; x0 += AdaptiveTileSize) {
+            unsigned y1 = std::min(y0 + AdaptiveTileSize, height);
+            unsigned x1 = std::min(x0 + AdaptiveTileSize, width);
+
+            // Root mean square of the relative error of the pixel estimates in the tile.
+            float sum_err2 = 0.0f;
+            for (unsigned y = y0; y < y1; y++) {
+                for (unsigned x = x0; x < x1; x++) {
+                    unsigned p = x + y * width;
+                    float n = static_cast<float>(m_accum_counts[p]);
+                    float mean = e8util::color3_luminance(m_accum[p]) / n;
+                    float err =
+                        pixel_sigma(p) / std::sqrt(n) / std::max(mean, AdaptiveMinLuminance);
+                    sum_err2 += err * err;
+                }
+            }
+            if (std::sqrt(sum_err2 / ((x1 - x0) * (y1 - y0))) <= m_target_error) {
+                continue;
+            }
+            for (unsigned y = y0; y < y1; y++) {
+                for (unsigned x = x0; x < x1; x++) {
+                    pixels.push_back(x + y * width);
+                }
+            }
+        }
+    }
+    return pixels;
 }
+
+void e8::pt_image_renderer::enable_progressive(bool enable) { m_progressive = enable; }
+
+void e8::pt_image_renderer::enable_adaptive_sampling(bool enable, float target_error) {
+    m_adaptive = enable;
+    m_target_error = target_error;
+}
+
+void e8::pt_image_renderer::reset_accumulation() {
+    std::fill(m_accum.begin(), m_accum.end(), e8util::vec3());
+    std::fill(m_accum_lum2.begin(), m_accum_lum2.end(), 0.0f);
+    std::fill(m_accum_counts.begin(), m_accum_counts.end(), 0);
+    std::fill(m_aov_sums.normal.begin(), m_aov_sums.normal.end(), e8util::vec3());
+    std::fill(m_aov_sums.depth.begin(), m_aov_sums.depth.end(), 0.0f);
+    std::fill(m_aov_sums.albedo.begin(), m_aov_sums.albedo.end(), e8util::color3());
+    std::fill(m_aov_hits.begin(), m_aov_hits.end(), 0);
+}
+
+void e8::pt_image_renderer::reset_tracers() {
+    for (sampling_task &task : m_tasks) {
+        task.reset_tracer();
+    }
+}
+
+unsigned e8::pt_image_renderer::accumulated_samples() const {
+    if (m_accum_counts.empty()) {
+        return 0;
+    }
+    uint64_t total = 0;
+    for (unsigned count : m_accum_counts) {
+        total += count;
+    }
+    return static_cast<unsigned>(total / m_accum_counts.size());
+}
+
+e8::aov_buffers const &e8::pt_image_renderer::aovs() const { return m_aovs; }
@@ -2,11 +2,14 @@
 #define RENDERER_H
 
 #include "camera.h"
+#include "denoiser.h"
 #include "frame.h"
 #include "materialcontainer.h"
 #include "pathspace.h"
 #include "pathtracer.h"
 #include "pathtracerfact.h"
+#include "sampler.h"
+#include "samplerfact.h"
 #include "tensor.h"
 #include "thread.h"
 #include <memory>
@@ -26,19 +29,37 @@ class pt_image_renderer {
     /**
      * @brief pt_image_renderer It internally creates multiple path-tracers so they can be run in
      * parallel.
+     * @param fact Creates the path-tracers.
+     * @param num_threads Number of sampling threads. 0 means one per CPU core.
+     * @param sampler_fact Creates the samplers the path-tracers draw random numbers from. nullptr
+     * means independent random numbers.
      */
-    pt_image_renderer(std::unique_ptr<pathtracer_factory> fact, unsigned num_threads = 0);
+    pt_image_renderer(std::unique_ptr<pathtracer_factory> fact, unsigned num_threads = 0,
+                      std::unique_ptr<sampler_factory> sampler_fact = nullptr);
     ~pt_image_renderer() = default;
 
     /**
      * @brief The numerical_stats struct Convergence related statistics.
      */
     struct numerical_stats {
+        // Average standard deviation of the luminance of a single sample.
         float sample_sigma;
+
+        // Average standard deviation of the pixel estimates, which is the sample sigma scaled by
+        // the inverse square root of the number of samples accumulated.
         float scaled_sigma;
+
+        // Largest standard deviation among the pixel estimates.
         float max_sigma;
+
+        // Number of samples per pixel gathered in the render() call, on average.
         unsigned num_samples;
+
+        // Seconds spent on gathering one sample for the entire image.
         float time_per_sample;
+
+        // Whether adaptive sampling has brought every tile below the target relative error.
+        bool converged;
     };
 
     /**
@@ -49,15 +70,59 @@ class pt_image_renderer {
      * @param light_sources Light sources exist in the path-space.
      * @param cam Camera sensor in the path-space.
      * @param num_samps Total number of samples to gather to form the estimate. However, more
-     * samples may be gathered in order to make the computation parallelized better.
+     * samples may be gathered in order to make the computation parallelized better. When adaptive
+     * sampling is enabled, it is the average number of samples per pixel the call may spend.
      * @param firefly_filter Remove fireflies by applying prior assumption that at least one of the
-     * neighbor pixels must be smooth.
+     * neighbor pixels must be smooth. It applies to the averaged image once per call, so the
+     * accumulated samples are left untouched.
      * @return Convergence statistics (see above).
      */
     numerical_stats render(if_compositor *compositor, if_path_space const &path_space,
                            if_material_container const &mats, if_light_sources const &light_sources,
                            if_camera const &cam, unsigned num_samps, bool firefly_filter);
 
+    /**
+     * @brief enable_progressive When enabled, each render() call adds its samples to the ones
+     * gathered by the previous calls instead of starting over, so the image keeps converging until
+     * reset_accumulation() is called or the image size changes.
+     */
+    void enable_progressive(bool enable);
+
+    /**
+     * @brief enable_adaptive_sampling When enabled, render() distributes its sample budget over
+     * the image tiles according to their estimated relative error rather than evenly, and stops
+     * sampling once every tile's error is below the target.
+     * @param enable Whether to sample adaptively.
+     * @param target_error Relative error (standard deviation over the mean luminance) at which a
+     * tile is considered converged.
+     */
+    void enable_adaptive_sampling(bool enable, float target_error);
+
+    /**
+     * @brief reset_accumulation Discards all the samples accumulated so far.
+     */
+    void reset_accumulation();
+
+    /**
+     * @brief reset_tracers Discards what the path tracers have learnt about the scene from the
+     * previous samples. Unlike the accumulated samples, it is kept across render() calls in either
+     * mode, so it has to be called when the scene changes.
+     */
+    void reset_tracers();
+
+    /**
+     * @brief accumulated_samples Number of samples per pixel the last rendered image is averaged
+     * from. When adaptive sampling is enabled, it is the average over all pixels.
+     */
+    unsigned accumulated_samples() const;
+
+    /**
+     * @brief aovs Features of the first hits of the last rendered image, which guide the
+     * denoiser. They are averaged over the camera rays of the render() calls the samples were
+     * accumulated from, along with the variance of the pixel estimates.
+     */
+    aov_buffers const &aovs() const;
+
   private:
     /**
      * @brief The sampling_task_data struct Sampling configurations.
@@ -66,8 +131,9 @@ class pt_image_renderer {
         sampling_task_data(e8util::data_id_t id, if_path_space const &path_space,
                            if_material_container const &mats, if_light_sources const &light_sources,
                            std::vector<e8util::ray> const &rays,
-                           if_path_tracer::first_hits const &first_hits, unsigned num_samps,
-                           unsigned width, unsigned height, bool firefly_filter);
+                           if_path_tracer::first_hits const &first_hits,
+                           std::vector<unsigned> const *pixels, uint64_t first_sample,
+                           unsigned num_samps, unsigned width);
 
         ~sampling_task_data() override = default;
 
@@ -81,17 +147,18 @@ class pt_image_renderer {
         // Cache of the information about the first intersection.
         if_path_tracer::first_hits const &first_hits;
 
+        // Image pixels the rays belong to, or nullptr if the rays cover the entire image.
+        std::vector<unsigned> const *pixels;
+
+        // Global index of the first sample to compute. Task k computes the samples starting from
+        // first_sample + k*num_samps.
+        uint64_t first_sample;
+
         // Number of samples to compute to form the estimate.
         unsigned num_samps;
 
-        // The size of the image to be sampled.
+        // The width of the image to be sampled.
         unsigned width;
-        unsigned height;
-
-        // option to turn on/off firefly filter (See render() for detailed explanation).
-        bool firefly_filter;
-
-        uint8_t padding[3];
     };
 
     /**
@@ -101,27 +168,129 @@ class pt_image_renderer {
       public:
         sampling_task();
         sampling_task(sampling_task &&rhs);
-        sampling_task(e8::if_path_tracer *pt, unsigned seed);
+        sampling_task(e8::if_path_tracer *pt, e8::if_sampler *sampler, unsigned index);
         ~sampling_task() override;
 
         sampling_task &operator=(sampling_task rhs);
 
         void run(e8util::if_task_storage *) override;
+        void end_pass();
+        void reset_tracer();
         std::vector<e8util::vec3> const &get_estimates() const;
+        std::vector<float> const &get_squared_luminances() const;
 
       private:
         std::vector<e8util::vec3> m_estimate;
-        e8util::rng m_rng;
+        std::vector<float> m_lum2;
+        unsigned m_index;
         e8::if_path_tracer *m_pt;
+        e8::if_sampler *m_sampler;
+    };
+
+    /**
+     * @brief The firefly_task_data struct The averaged image to remove the fireflies from.
+     */
+    struct firefly_task_data : public e8util::if_task_storage {
+        firefly_task_data(std::vector<float> const &norm2, if_compositor *compositor);
+
+        ~firefly_task_data() override = default;
+
+        // Squared norm of every pixel of the image, before any is capped.
+        std::vector<float> const &norm2;
 
-        // Minimum difference in squared intensity to possibly classify a sample as firefly outlier.
+        // The image, which the tasks cap the fireflies of in place.
+        if_compositor *compositor;
+    };
+
+    /**
+     * @brief The firefly_task class Caps the fireflies in a band of rows of the image.
+     */
+    class firefly_task : public e8util::if_task {
+      public:
+        firefly_task(unsigned index, unsigned num_bands);
+
+        void run(e8util::if_task_storage *) override;
+
+      private:
+        unsigned m_index;
+        unsigned m_num_bands;
+
+        // Cap of every pixel in a row, or the largest float if the pixel isn't a firefly.
+        std::vector<float> m_caps;
+
+        // Minimum difference in squared intensity to possibly classify a pixel as firefly outlier.
         static float constexpr FireFlyMinDiff = 1.5f;
     };
 
+    /**
+     * @brief sample_pixels Gathers samples for the selected pixels in parallel and adds them to the
+     * accumulation buffers.
+     * @param pixels Indices of the pixels to sample, or nullptr to sample the entire image.
+     * @return Number of samples actually gathered for each selected pixel.
+     */
+    unsigned sample_pixels(std::vector<unsigned> const *pixels,
+                           std::vector<e8util::ray> const &rays,
+                           if_path_tracer::first_hits const &first_hits,
+                           if_path_space const &path_space, if_material_container const &mats,
+                           if_light_sources const &light_sources, unsigned num_samps,
+                           unsigned width);
+
+    /**
+     * @brief remove_fireflies Caps the pixels of the averaged image which exceed all of their
+     * neighbors, in parallel bands of rows.
+     */
+    void remove_fireflies(if_compositor *compositor);
+
+    /**
+     * @brief pixel_sigma Standard deviation of the luminance of the samples accumulated for pixel
+     * i.
+     */
+    float pixel_sigma(unsigned i) const;
+
+    /**
+     * @brief unconverged_pixels Collects the pixels of all the tiles whose relative error is above
+     * the target error.
+     */
+    std::vector<unsigned> unconverged_pixels(unsigned width, unsigned height) const;
+
     std::vector<sampling_task> m_tasks;
+    std::vector<firefly_task> m_firefly_tasks;
     e8util::thread_pool m_thrpool;
 
     e8util::rng m_rng;
+
+    // Number of samples drawn since construction, so that every sample gets a distinct sample
+    // index.
+    uint64_t m_num_samps_drawn = 0;
+
+    // Running sum of the estimates, the squared luminances and the number of samples each pixel is
+    // formed from.
+    std::vector<e8util::vec3> m_accum;
+    std::vector<float> m_accum_lum2;
+    std::vector<unsigned> m_accum_counts;
+    bool m_progressive = false;
+
+    // Squared norm of the pixels of the averaged image, which the firefly tasks compare.
+    std::vector<float> m_norm2;
+
+    // Running sum of the AOVs over the first hits of the camera rays, the number of the rays that
+    // hit the scene for each pixel, and the averages of the last rendered image.
+    aov_buffers m_aov_sums;
+    std::vector<unsigned> m_aov_hits;
+    aov_buffers m_aovs;
+
+    bool m_adaptive = false;
+    float m_target_error = 0.01f;
+
+    // Size of the square tiles adaptive sampling allocates samples to.
+    static unsigned constexpr AdaptiveTileSize = 16;
+
+    // Number of samples every pixel gets before its variance estimate is trusted.
+    static unsigned constexpr AdaptiveMinSamps = 4;
+
+    // Luminance below which the relative error is measured against this floor instead, so dark
+    // pixels don't keep drawing samples.
+    static float constexpr AdaptiveMinLuminance = 1e-2f;
 };
 
 /**
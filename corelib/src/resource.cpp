@@ -56,7 +56,11 @@ std::vector<std::shared_ptr<e8::if_geometry>> static cornell_scene_load_geometri
     geometries[4] = e8util::wavefront_obj("res/cornellbox/back_wall.obj").load_geometry();
     geometries[5] = e8util::wavefront_obj("res/cornellbox/left_sphere.obj").load_geometry();
     geometries[6] = e8util::wavefront_obj("res/cornellbox/right_sphere.obj").load_geometry();
-    geometries[7] = e8util::wavefront_obj("res/cornellbox/light.obj").load_geometry();
+    // The ceiling light in res/cornellbox/light.obj, as a rectangle facing down.
+    geometries[7] = std::make_shared<e8::quad>("res/cornellbox/light.obj",
+                                               /*o=*/e8util::vec3{0.235f, 1.58f, -0.19f},
+                                               /*u=*/e8util::vec3{0.0f, 0.0f, 0.38f},
+                                               /*v=*/e8util::vec3{-0.47f, 0.0f, 0.0f});
     return geometries;
 }
 
@@ -77,8 +81,8 @@ std::vector<std::shared_ptr<e8::if_material>> static cornell_scene_load_material
 }
 
 std::shared_ptr<e8::if_light> static cornell_scene_load_lights(
-    std::shared_ptr<e8::if_geometry> const light_geo) {
-    std::shared_ptr<e8::if_light> light = std::make_shared<e8::area_light>(
+    std::shared_ptr<e8::quad> const light_geo) {
+    std::shared_ptr<e8::if_light> light = std::make_shared<e8::quad_light>(
         "ceiling", light_geo, e8util::vec3{0.911f, 0.660f, 0.345f} * 15.0f);
     return light;
 }
@@ -104,7 +108,8 @@ std::shared_ptr<e8::if_camera> static cornell_scene_load_camera() {
 std::vector<std::shared_ptr<e8::if_obj>> e8util::cornell_scene::load_roots() {
     std::vector<std::shared_ptr<e8::if_geometry>> geometries = cornell_scene_load_geometries();
     std::vector<std::shared_ptr<e8::if_material>> mats = cornell_scene_load_materials();
-    std::shared_ptr<e8::if_light> obj_light = cornell_scene_load_lights(geometries[7]);
+    std::shared_ptr<e8::if_light> obj_light =
+        cornell_scene_load_lights(std::static_pointer_cast<e8::quad>(geometries[7]));
     std::shared_ptr<e8::if_camera> cams = cornell_scene_load_camera();
     std::vector<std::shared_ptr<e8::if_obj>> roots;
     roots.push_back(cams);
@@ -371,8 +376,8 @@ e8util::gltf_scene_internal::~gltf_scene_internal() {}
 
 tinygltf::Model const &e8util::gltf_scene_internal::get_model() const { return m_model; }
 
-e8util::gltf_scene::gltf_scene(std::string const &location)
-    : m_pimpl(std::make_unique<gltf_scene_internal>(location)) {}
+e8util::gltf_scene::gltf_scene(std::string const &location, std::string const &env_map)
+    : m_pimpl(std::make_unique<gltf_scene_internal>(location)), m_env_map(env_map) {}
 
 e8util::gltf_scene::~gltf_scene() {}
 
@@ -488,6 +493,86 @@ static std::shared_ptr<e8::if_geometry> load_geometry(tinygltf::Mesh const &mesh
     return geo;
 }
 
+/**
+ * @brief srgb_to_linear Decodes an 8-bit sRGB color channel, which is how glTF stores emission
+ * textures, to a linear value.
+ */
+static float srgb_to_linear(unsigned char c) {
+    float v = c / 255.0f;
+    if (v <= 0.04045f) {
+        return v / 12.92f;
+    }
+    return std::pow((v + 0.055f) / 1.055f, 2.4f);
+}
+
+static std::shared_ptr<e8::texture_map<e8util::vec3>> load_texture(int texture_idx,
+                                                                   tinygltf::Model const &model) {
+    if (texture_idx < 0 || static_cast<size_t>(texture_idx) >= model.textures.size()) {
+        return nullptr;
+    }
+    int image_idx = model.textures[static_cast<unsigned>(texture_idx)].source;
+    if (image_idx < 0 || static_cast<size_t>(image_idx) >= model.images.size()) {
+        return nullptr;
+    }
+    tinygltf::Image const &image = model.images[static_cast<unsigned>(image_idx)];
+    if (image.width <= 0 || image.height <= 0 || image.component < 3 || image.image.empty()) {
+        return nullptr;
+    }
+
+    unsigned width = static_cast<unsigned>(image.width);
+    unsigned height = static_cast<unsigned>(image.height);
+    unsigned component = static_cast<unsigned>(image.component);
+    std::vector<e8util::vec3> texels(width * height);
+    for (unsigned i = 0; i < texels.size(); i++) {
+        unsigned char const *texel = &image.image[i * component];
+        texels[i] = e8util::vec3{srgb_to_linear(texel[0]), srgb_to_linear(texel[1]),
+                                 srgb_to_linear(texel[2])};
+    }
+    return std::make_shared<e8::texture_map<e8util::vec3>>(width, height, texels);
+}
+
+/**
+ * @brief load_emissive_light Creates a light out of the geometry of the mesh if its material emits,
+ * with the emissive factor and texture of the material.
+ * @return nullptr if the mesh doesn't emit.
+ */
+static std::shared_ptr<e8::if_light>
+load_emissive_light(tinygltf::Mesh const &mesh, tinygltf::Model const &model,
+                    std::shared_ptr<e8::if_geometry> const &geo) {
+    // The primitives are merged into one geometry, which can only take one emissive material.
+    for (tinygltf::Primitive const &prim : mesh.primitives) {
+        if (prim.material < 0 || static_cast<size_t>(prim.material) >= model.materials.size()) {
+            continue;
+        }
+        tinygltf::Material const &gltf_mat = model.materials[static_cast<unsigned>(prim.material)];
+
+        e8util::vec3 factor;
+        auto factor_it = gltf_mat.additionalValues.find("emissiveFactor");
+        if (factor_it != gltf_mat.additionalValues.end() &&
+            factor_it->second.number_array.size() >= 3) {
+            std::vector<double> const &rgb = factor_it->second.number_array;
+            factor = e8util::vec3{static_cast<float>(rgb[0]), static_cast<float>(rgb[1]),
+                                  static_cast<float>(rgb[2])};
+        }
+        if (e8util::equals(factor, e8util::vec3())) {
+            continue;
+        }
+
+        std::shared_ptr<e8::texture_map<e8util::vec3>> texture;
+        auto texture_it = gltf_mat.additionalValues.find("emissiveTexture");
+        if (texture_it != gltf_mat.additionalValues.end()) {
+            texture = load_texture(texture_it->second.TextureIndex(), model);
+        }
+        std::shared_ptr<e8::emissive_mesh_light> light = std::make_shared<e8::emissive_mesh_light>(
+            mesh.name + "_emission", geo, factor, texture);
+        if (e8util::equals(light->power(), e8util::vec3())) {
+            return nullptr;
+        }
+        return light;
+    }
+    return nullptr;
+}
+
 std::vector<std::shared_ptr<e8::if_material>> e8util::gltf_scene::load_materials() const {
     std::vector<std::shared_ptr<e8::if_material>> mats;
 
@@ -518,6 +603,10 @@ std::vector<std::shared_ptr<e8::if_light>> e8util::gltf_scene::load_lights() con
 std::vector<std::shared_ptr<e8::if_light>> e8util::gltf_scene::load_virtual_lights() const {
     // Lights are not handled by glTF 2.0 as of now.
     // return as least one default light.
+    if (!m_env_map.empty()) {
+        return std::vector<std::shared_ptr<e8::if_light>>{
+            std::make_shared<e8::env_light>(m_env_map, e8util::load_radiance_map(m_env_map))};
+    }
     return std::vector<std::shared_ptr<e8::if_light>>{
         std::make_shared<e8::sky_light>(e8util::vec3{.529f, .808f, .922f})};
 }
@@ -544,7 +633,15 @@ static std::shared_ptr<e8::if_obj> load_node(tinygltf::Node const &node,
     // Create current node with metadata loaded in.
     std::shared_ptr<e8::if_obj> node_obj = nullptr;
     if (node.mesh >= 0) {
-        node_obj = load_geometry(model.meshes[static_cast<unsigned>(node.mesh)], model);
+        tinygltf::Mesh const &mesh = model.meshes[static_cast<unsigned>(node.mesh)];
+        std::shared_ptr<e8::if_geometry> geo = load_geometry(mesh, model);
+
+        // Emissive surfaces become lights, which follow the transformation of the geometry.
+        std::shared_ptr<e8::if_light> light = load_emissive_light(mesh, model, geo);
+        if (light != nullptr) {
+            geo->add_child(light);
+        }
+        node_obj = geo;
     } else if (node.camera >= 0) {
         node_obj = load_camera(model.cameras[static_cast<unsigned>(node.camera)]);
     }
@@ -595,5 +692,29 @@ std::vector<std::shared_ptr<e8::if_obj>> e8util::gltf_scene::load_roots() {
             }
         },
         std::set<e8::obj_protocol>{e8::obj_protocol::obj_protocol_geometry});
+
+    for (std::shared_ptr<e8::if_light> const &light : load_virtual_lights()) {
+        roots.push_back(light);
+    }
     return roots;
 }
+
+std::shared_ptr<e8::texture_map<e8util::vec3>>
+e8util::load_radiance_map(std::string const &location) {
+    int width;
+    int height;
+    int num_channels;
+    float *data = stbi_loadf(location.c_str(), &width, &height, &num_channels, /*desired=*/3);
+    if (data == nullptr) {
+        throw res_io_exception("Failed to load " + location + "\n\tError: " +
+                               stbi_failure_reason());
+    }
+
+    std::vector<e8util::vec3> texels(static_cast<unsigned>(width * height));
+    for (unsigned i = 0; i < texels.size(); i++) {
+        texels[i] = e8util::vec3{data[3 * i + 0], data[3 * i + 1], data[3 * i + 2]};
+    }
+    stbi_image_free(data);
+    return std::make_shared<e8::texture_map<e8util::vec3>>(
+        static_cast<unsigned>(width), static_cast<unsigned>(height), texels);
+}
@@ -49,6 +49,13 @@ class cornell_scene : public if_resource {
     std::vector<std::shared_ptr<e8::if_obj>> load_roots() override;
 };
 
+/**
+ * @brief load_radiance_map Loads an image as linear radiance, e.g. a Radiance .hdr file. LDR images
+ * are linearized with a 2.2 gamma.
+ * @throws res_io_exception if the image can't be loaded.
+ */
+std::shared_ptr<e8::texture_map<e8util::vec3>> load_radiance_map(std::string const &location);
+
 class gltf_scene_internal;
 
 /**
@@ -82,7 +89,13 @@ class gltf_scene_internal;
  */
 class gltf_scene : public if_resource {
   public:
-    gltf_scene(std::string const &location);
+    /**
+     * @brief gltf_scene
+     * @param location Location of the glTF file.
+     * @param env_map Location of an equirectangular radiance map that lights the scene. The scene
+     * is lit by a constant sky if it's empty.
+     */
+    gltf_scene(std::string const &location, std::string const &env_map = "");
     ~gltf_scene() override;
 
     std::vector<std::shared_ptr<e8::if_material>> load_materials() const;
@@ -93,6 +106,7 @@ class gltf_scene : public if_resource {
 
   private:
     std::unique_ptr<gltf_scene_internal> m_pimpl;
+    std::string m_env_map;
 };
 
 } // namespace e8util
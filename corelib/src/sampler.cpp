@@ -0,0 +1,363 @@
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Largest float below 1.
+float const OneMinusEpsilon = 0x1.fffffep-1f;
+
+// Range of the offsets small steps perturb the primary samples by.
+float const PssSmallStepMin = 1.0f / 1024.0f;
+float const PssSmallStepMax = 1.0f / 64.0f;
+
+uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+    x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/**
+ * @brief laine_karras_permutation A random permutation where each bit only depends on the bits
+ * below it (Laine and Karras, Stratified sampling for stochastic transparency, 2011).
+ */
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cU;
+    x ^= x * 0xb82f1e52U;
+    x ^= x * 0xc7afe638U;
+    x ^= x * 0x8d22f6e6U;
+    return x;
+}
+
+/**
+ * @brief nested_uniform_scramble Base-2 Owen scrambling of the fixed point fraction x. Every bit
+ * gets flipped or not depending on a hash of the more significant bits.
+ */
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/**
+ * @brief sobol_2d The first two dimensions of the Sobol' sequence, i.e. van der Corput and the
+ * dimension generated by the primitive polynomial x + 1, as 32-bit fixed point fractions.
+ */
+void sobol_2d(uint32_t index, uint32_t *x, uint32_t *y) {
+    *x = reverse_bits(index);
+    *y = 0;
+    for (uint32_t v = 1U << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            *y ^= v;
+        }
+    }
+}
+
+float fixed_point_to_float(uint32_t x) { return static_cast<float>(x >> 8) * 0x1p-24f; }
+
+unsigned const HaltonPrimes[] = {
+    2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+    59,  61,  67,  71,  73,  79,  83,  89,  97,  101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+
+unsigned const NumHaltonPrimes = sizeof(HaltonPrimes) / sizeof(HaltonPrimes[0]);
+
+/**
+ * @brief owen_scrambled_radical_inverse Radical inverse of index in the specified base, with each
+ * digit shifted by a random amount that depends on the more significant digits. The digits past
+ * the last non-zero one of the index must be scrambled too, or the result isn't uniform.
+ */
+float owen_scrambled_radical_inverse(uint64_t index, unsigned base, uint64_t seed) {
+    double inv_base = 1.0 / base;
+    double inv_base_n = 1.0;
+    double result = 0.0;
+    uint64_t prefix_hash = seed;
+    while (inv_base_n > 0x1p-24) {
+        unsigned digit = static_cast<unsigned>(index % base);
+        index /= base;
+        unsigned shift = static_cast<unsigned>(e8util::hash64(prefix_hash) % base);
+        inv_base_n *= inv_base;
+        result += ((digit + shift) % base) * inv_base_n;
+        prefix_hash = e8util::hash64(prefix_hash ^ (digit + 1));
+    }
+    return std::min(static_cast<float>(result), OneMinusEpsilon);
+}
+
+// Side length of the tiled blue-noise mask. It has to be a power of 2.
+unsigned const BlueNoiseSize = 64;
+
+/**
+ * @brief generate_blue_noise_mask Ranks the pixels of a toroidal BlueNoiseSize^2 mask with the
+ * void-and-cluster method (Ulichney, "The void-and-cluster method for dither array generation",
+ * 1993), so that the pixels of every rank threshold are evenly spread out. The mask maps each pixel
+ * to (rank + 0.5)/BlueNoiseSize^2.
+ */
+std::vector<float> generate_blue_noise_mask() {
+    unsigned const n = BlueNoiseSize * BlueNoiseSize;
+    float const sigma = 1.5f;
+
+    // Toroidal Gaussian filter, indexed by the offset between two pixels.
+    std::vector<float> gaussian(n);
+    for (unsigned dy = 0; dy < BlueNoiseSize; dy++) {
+        for (unsigned dx = 0; dx < BlueNoiseSize; dx++) {
+            float x = std::min(dx, BlueNoiseSize - dx);
+            float y = std::min(dy, BlueNoiseSize - dy);
+            gaussian[dx + dy * BlueNoiseSize] = std::exp(-(x * x + y * y) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<bool> pattern(n, false);
+    std::vector<float> energy(n, 0.0f);
+    auto toggle = [&](unsigned p, bool on) {
+        pattern[p] = on;
+        unsigned px = p % BlueNoiseSize;
+        unsigned py = p / BlueNoiseSize;
+        for (unsigned q = 0; q < n; q++) {
+            unsigned dx = (q % BlueNoiseSize - px) & (BlueNoiseSize - 1);
+            unsigned dy = (q / BlueNoiseSize - py) & (BlueNoiseSize - 1);
+            float g = gaussian[dx + dy * BlueNoiseSize];
+            energy[q] += on ? g : -g;
+        }
+    };
+    auto tightest_cluster = [&]() {
+        unsigned best = n;
+        for (unsigned p = 0; p < n; p++) {
+            if (pattern[p] && (best == n || energy[p] > energy[best])) {
+                best = p;
+            }
+        }
+        return best;
+    };
+    auto largest_void = [&]() {
+        unsigned best = n;
+        for (unsigned p = 0; p < n; p++) {
+            if (!pattern[p] && (best == n || energy[p] < energy[best])) {
+                best = p;
+            }
+        }
+        return best;
+    };
+
+    // Initial binary pattern: a tenth of the pixels at random, then repeatedly move the tightest
+    // cluster into the largest void until it settles.
+    e8util::rng rng(/*seed=*/BlueNoiseSize);
+    unsigned num_ones = 0;
+    while (num_ones < n / 10) {
+        unsigned p = rng.next() % n;
+        if (!pattern[p]) {
+            toggle(p, true);
+            num_ones++;
+        }
+    }
+    for (unsigned i = 0; i < n; i++) {
+        unsigned cluster = tightest_cluster();
+        toggle(cluster, false);
+        unsigned vacancy = largest_void();
+        if (vacancy == cluster) {
+            toggle(cluster, true);
+            break;
+        }
+        toggle(vacancy, true);
+    }
+    std::vector<bool> initial_pattern = pattern;
+    std::vector<float> initial_energy = energy;
+
+    // Rank the initial pattern by removing the tightest clusters, and the rest of the pixels by
+    // filling the largest voids.
+    std::vector<float> mask(n);
+    for (unsigned rank = num_ones; rank > 0; rank--) {
+        unsigned cluster = tightest_cluster();
+        toggle(cluster, false);
+        mask[cluster] = (rank - 1 + 0.5f) / n;
+    }
+    pattern = initial_pattern;
+    energy = initial_energy;
+    for (unsigned rank = num_ones; rank < n; rank++) {
+        unsigned vacancy = largest_void();
+        toggle(vacancy, true);
+        mask[vacancy] = (rank + 0.5f) / n;
+    }
+    return mask;
+}
+
+std::vector<float> const &blue_noise_mask() {
+    static std::vector<float> const mask = generate_blue_noise_mask();
+    return mask;
+}
+
+} // namespace
+
+e8::if_sampler::if_sampler(uint64_t seed) : m_seed(seed), m_pixel_seed(e8util::hash64(seed)) {}
+
+e8::if_sampler::~if_sampler() {}
+
+void e8::if_sampler::start_sample(uint64_t index, std::vector<unsigned> const *pixels,
+                                  unsigned width) {
+    m_index = index;
+    m_pixels = pixels;
+    m_width = width;
+}
+
+void e8::if_sampler::start_pixel(unsigned i) {
+    m_pixel = m_pixels != nullptr ? (*m_pixels)[i] : i;
+    if (m_blue_noise) {
+        // The blue-noise rotation alone decorrelates the pixels.
+        m_pixel_seed = e8util::hash64(m_seed);
+        m_mask_x = (m_width != 0 ? m_pixel % m_width : m_pixel) & (BlueNoiseSize - 1);
+        m_mask_y = (m_width != 0 ? m_pixel / m_width : 0) & (BlueNoiseSize - 1);
+    } else {
+        m_pixel_seed = e8util::hash64(m_seed ^ e8util::hash64(m_pixel));
+    }
+    m_dim = 0;
+    begin_pixel();
+}
+
+float e8::if_sampler::draw() {
+    unsigned dim = m_dim++;
+    float v = value(dim);
+    if (m_blue_noise) {
+        uint64_t shift = e8util::hash64(dim);
+        unsigned x = (m_mask_x + static_cast<unsigned>(shift)) & (BlueNoiseSize - 1);
+        unsigned y = (m_mask_y + static_cast<unsigned>(shift >> 32)) & (BlueNoiseSize - 1);
+        v += blue_noise_mask()[x + y * BlueNoiseSize];
+        if (v >= 1.0f) {
+            v -= 1.0f;
+        }
+    }
+    return v;
+}
+
+unsigned e8::if_sampler::dimension() const { return m_dim; }
+
+std::vector<unsigned> const *e8::if_sampler::batch_pixels() const { return m_pixels; }
+
+unsigned e8::if_sampler::image_width() const { return m_width; }
+
+void e8::if_sampler::enable_blue_noise(bool enable) {
+    m_blue_noise = enable;
+    if (enable) {
+        // Generate the mask ahead of the sampling.
+        blue_noise_mask();
+    }
+}
+
+e8::random_sampler::random_sampler(uint64_t seed) : if_sampler(seed), m_rng(seed) {}
+
+e8::random_sampler::~random_sampler() {}
+
+void e8::random_sampler::begin_pixel() { m_rng = e8util::rng(m_pixel_seed, m_index); }
+
+float e8::random_sampler::value(unsigned /*dim*/) { return m_rng.draw(); }
+
+e8::sobol_sampler::sobol_sampler(uint64_t seed) : if_sampler(seed) {}
+
+e8::sobol_sampler::~sobol_sampler() {}
+
+void e8::sobol_sampler::begin_pixel() { m_pair = ~0U; }
+
+float e8::sobol_sampler::value(unsigned dim) {
+    unsigned pair = dim / 2;
+    if (pair == m_pair && dim % 2 == 1) {
+        return m_pair_y;
+    }
+
+    uint64_t pair_seed = e8util::hash64(m_pixel_seed + pair);
+    uint32_t index =
+        nested_uniform_scramble(static_cast<uint32_t>(m_index), static_cast<uint32_t>(pair_seed));
+    uint32_t x;
+    uint32_t y;
+    sobol_2d(index, &x, &y);
+    x = nested_uniform_scramble(x, static_cast<uint32_t>(pair_seed >> 32));
+    y = nested_uniform_scramble(y, static_cast<uint32_t>(e8util::hash64(pair_seed)));
+
+    m_pair = pair;
+    m_pair_y = fixed_point_to_float(y);
+    return dim % 2 == 0 ? fixed_point_to_float(x) : m_pair_y;
+}
+
+e8::halton_sampler::halton_sampler(uint64_t seed) : if_sampler(seed) {}
+
+e8::halton_sampler::~halton_sampler() {}
+
+void e8::halton_sampler::begin_pixel() {}
+
+float e8::halton_sampler::value(unsigned dim) {
+    if (dim < NumHaltonPrimes) {
+        return owen_scrambled_radical_inverse(m_index, HaltonPrimes[dim],
+                                              e8util::hash64(m_pixel_seed + dim));
+    }
+    return e8util::rng(m_pixel_seed ^ m_index, dim).draw();
+}
+
+e8::pss_sampler::pss_sampler(uint64_t seed) : if_sampler(seed), m_rng(seed) {}
+
+e8::pss_sampler::~pss_sampler() {}
+
+void e8::pss_sampler::reset(uint64_t seed) {
+    m_rng = e8util::rng(seed);
+    m_state.clear();
+    m_mutation = 0;
+    m_last_large_step = 0;
+    m_large_step = true;
+}
+
+void e8::pss_sampler::start_mutation(bool large_step) {
+    m_mutation++;
+    m_large_step = large_step;
+}
+
+void e8::pss_sampler::accept() {
+    if (m_large_step) {
+        m_last_large_step = m_mutation;
+    }
+}
+
+void e8::pss_sampler::reject() {
+    for (primary_sample &x : m_state) {
+        if (x.modified == m_mutation) {
+            x.value = x.backup;
+            x.modified = x.backup_modified;
+        }
+    }
+    m_mutation--;
+}
+
+void e8::pss_sampler::begin_pixel() {}
+
+float e8::pss_sampler::value(unsigned dim) {
+    if (dim >= m_state.size()) {
+        // A dimension drawn for the first time joins the current state as a uniform number.
+        unsigned num_dims = static_cast<unsigned>(m_state.size());
+        m_state.resize(dim + 1);
+        for (unsigned d = num_dims; d <= dim; d++) {
+            m_state[d].value = m_rng.draw();
+            m_state[d].modified = m_mutation;
+        }
+    }
+
+    primary_sample &x = m_state[dim];
+    if (x.modified < m_last_large_step) {
+        // Large steps were accepted since the dimension was last drawn.
+        x.value = m_rng.draw();
+        x.modified = m_last_large_step;
+    }
+
+    x.backup = x.value;
+    x.backup_modified = x.modified;
+    if (m_large_step) {
+        x.value = m_rng.draw();
+    } else {
+        // Exponentially distributed offset in either direction, wrapped around [0, 1).
+        float u = m_rng.draw();
+        bool forward = u < 0.5f;
+        u = forward ? 2.0f * u : 2.0f * u - 1.0f;
+        float offset = PssSmallStepMax * std::exp(-std::log(PssSmallStepMax / PssSmallStepMin) * u);
+        float v = forward ? x.value + offset : x.value - offset;
+        v -= std::floor(v);
+        x.value = std::min(v, OneMinusEpsilon);
+    }
+    x.modified = m_mutation;
+    return x.value;
+}
@@ -0,0 +1,207 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "tensor.h"
+#include <stdint.h>
+#include <vector>
+
+namespace e8 {
+
+/**
+ * @brief The if_sampler class Source of the uniform random numbers a path sample consumes. Every
+ * number is identified by the pixel, the sample index and its dimension, i.e. the order in which it
+ * is drawn, so implementations can lay well-distributed point sets over the dimensions.
+ */
+class if_sampler {
+  public:
+    if_sampler(uint64_t seed);
+    virtual ~if_sampler();
+
+    /**
+     * @brief start_sample Sets the index of the sample the subsequent draws belong to.
+     * @param index Index of the sample. A pixel gets the best distributed sample set when it sees
+     * consecutive indices starting from 0.
+     * @param pixels Maps the i-th entry of a batch of pixels to its image pixel. nullptr means the
+     * batch is the entire image.
+     * @param width Width of the image, which locates the pixels on the blue-noise mask. 0 means
+     * the pixels are laid out in a single row.
+     */
+    void start_sample(uint64_t index, std::vector<unsigned> const *pixels = nullptr,
+                      unsigned width = 0);
+
+    /**
+     * @brief start_pixel Starts drawing the dimensions of the i-th pixel in the batch from
+     * dimension 0.
+     */
+    void start_pixel(unsigned i);
+
+    /**
+     * @brief draw Draws the next dimension of the current sample, uniformly distributed in [0, 1).
+     */
+    float draw();
+
+    /**
+     * @brief dimension The dimension the next draw() will return.
+     */
+    unsigned dimension() const;
+
+    /**
+     * @brief batch_pixels The batch of pixels given to start_sample().
+     */
+    std::vector<unsigned> const *batch_pixels() const;
+
+    /**
+     * @brief image_width The image width given to start_sample().
+     */
+    unsigned image_width() const;
+
+    /**
+     * @brief enable_blue_noise When enabled, all pixels share one sample set, and each pixel
+     * rotates it (modulo 1) by the value a tiled blue-noise mask takes at the pixel, with the mask
+     * shifted differently for every dimension. Neighbor pixels then receive well separated
+     * numbers, so the error at low sample counts is distributed as blue noise rather than white
+     * noise. See Georgiev and Fajardo, "Blue-noise dithered sampling", SIGGRAPH 2016 Talks.
+     */
+    void enable_blue_noise(bool enable);
+
+  protected:
+    /**
+     * @brief begin_pixel Called when the pixel and the sample index of the subsequent draws are
+     * known.
+     */
+    virtual void begin_pixel() = 0;
+
+    /**
+     * @brief value The dim-th dimension of the current sample.
+     */
+    virtual float value(unsigned dim) = 0;
+
+    uint64_t m_seed;
+    uint64_t m_index = 0;
+    unsigned m_pixel = 0;
+
+    // Per-pixel seed, which decorrelates the sample sets of different pixels.
+    uint64_t m_pixel_seed;
+
+  private:
+    std::vector<unsigned> const *m_pixels = nullptr;
+    unsigned m_width = 0;
+    unsigned m_dim = 0;
+
+    bool m_blue_noise = false;
+    unsigned m_mask_x = 0;
+    unsigned m_mask_y = 0;
+};
+
+/**
+ * @brief The random_sampler class Independent uniform random numbers drawn from a counter-based
+ * stream per pixel seed and sample.
+ */
+class random_sampler : public if_sampler {
+  public:
+    random_sampler(uint64_t seed);
+    ~random_sampler() override;
+
+  protected:
+    void begin_pixel() override;
+    float value(unsigned dim) override;
+
+  private:
+    e8util::rng m_rng;
+};
+
+/**
+ * @brief The sobol_sampler class Padded 2D Sobol' sampler (0,2)-sequence. Each pair of dimensions
+ * takes the first two Sobol' dimensions at an index shuffled by hashing, and the results are Owen
+ * scrambled, so different pairs and pixels are decorrelated while each keeps the stratification of
+ * the (0,2)-sequence. See Burley, "Practical Hash-based Owen Scrambling", JCGT 2020.
+ */
+class sobol_sampler : public if_sampler {
+  public:
+    sobol_sampler(uint64_t seed);
+    ~sobol_sampler() override;
+
+  protected:
+    void begin_pixel() override;
+    float value(unsigned dim) override;
+
+  private:
+    // The pair of dimensions last computed and its second dimension.
+    unsigned m_pair = ~0U;
+    float m_pair_y = 0.0f;
+};
+
+/**
+ * @brief The halton_sampler class Owen-scrambled Halton sampler. Dimension d is the radical
+ * inverse of the sample index in the base of the d-th prime, with the digits randomly permuted
+ * depending on the more significant ones. Dimensions beyond the tabulated primes fall back to
+ * independent random numbers.
+ */
+class halton_sampler : public if_sampler {
+  public:
+    halton_sampler(uint64_t seed);
+    ~halton_sampler() override;
+
+  protected:
+    void begin_pixel() override;
+    float value(unsigned dim) override;
+};
+
+/**
+ * @brief The pss_sampler class State of a Markov chain in the primary sample space (Kelemen et al.,
+ * "A simple and robust mutation strategy for the Metropolis light transport algorithm", 2002). It
+ * keeps every dimension drawn so far and mutates the dimensions lazily as they are drawn again: a
+ * large step replaces them with fresh uniform numbers, a small step perturbs them around their
+ * current values. Rejecting a mutation restores the dimensions it changed.
+ */
+class pss_sampler : public if_sampler {
+  public:
+    pss_sampler(uint64_t seed);
+    ~pss_sampler() override;
+
+    /**
+     * @brief reset Starts the chain over. The first state consists of uniform numbers determined by
+     * the seed, so resetting with the same seed reproduces it.
+     */
+    void reset(uint64_t seed);
+
+    /**
+     * @brief start_mutation Proposes the next state. The dimensions drawn from now on are mutated.
+     * @param large_step Whether to propose an independent state rather than a nearby one.
+     */
+    void start_mutation(bool large_step);
+
+    /**
+     * @brief accept Moves the chain to the proposed state.
+     */
+    void accept();
+
+    /**
+     * @brief reject Keeps the chain at the state before the last start_mutation().
+     */
+    void reject();
+
+  protected:
+    void begin_pixel() override;
+    float value(unsigned dim) override;
+
+  private:
+    struct primary_sample {
+        float value = 0.0f;
+        float backup = 0.0f;
+
+        // Mutation that last changed the value, and the one before.
+        uint64_t modified = 0;
+        uint64_t backup_modified = 0;
+    };
+
+    e8util::rng m_rng;
+    std::vector<primary_sample> m_state;
+    uint64_t m_mutation = 0;
+    uint64_t m_last_large_step = 0;
+    bool m_large_step = true;
+};
+
+} // namespace e8
+
+#endif // SAMPLER_H
@@ -0,0 +1,26 @@
+#include "samplerfact.h"
+#include "sampler.h"
+#include <cassert>
+
+e8::sampler_factory::sampler_factory(sampler_type type, options opts)
+    : m_type(type), m_opts(opts) {}
+
+e8::sampler_factory::~sampler_factory() {}
+
+e8::if_sampler *e8::sampler_factory::create() {
+    e8::if_sampler *sampler = nullptr;
+    switch (m_type) {
+    case random:
+        sampler = new e8::random_sampler(m_opts.seed);
+        break;
+    case sobol:
+        sampler = new e8::sobol_sampler(m_opts.seed);
+        break;
+    case halton:
+        sampler = new e8::halton_sampler(m_opts.seed);
+        break;
+    }
+    assert(sampler != nullptr);
+    sampler->enable_blue_noise(m_opts.blue_noise);
+    return sampler;
+}
@@ -0,0 +1,38 @@
+#ifndef SAMPLERFACT_H
+#define SAMPLERFACT_H
+
+#include <stdint.h>
+
+namespace e8 {
+class if_sampler;
+}
+
+namespace e8 {
+
+class sampler_factory {
+  public:
+    enum sampler_type { random, sobol, halton };
+
+    struct options {
+        // Every sampler created shares the seed, so samplers that draw different sample indices
+        // together form a single well-distributed sample set.
+        uint64_t seed = 1361;
+
+        // Whether to distribute the error over the pixels as blue noise (see
+        // if_sampler::enable_blue_noise()).
+        bool blue_noise = false;
+    };
+
+    sampler_factory(sampler_type type, options opts);
+    ~sampler_factory();
+
+    if_sampler *create();
+
+  private:
+    sampler_type m_type;
+    options m_opts;
+};
+
+} // namespace e8
+
+#endif // SAMPLERFACT_H
@@ -1,11 +1,13 @@
 #ifndef TENSOR_H
 #define TENSOR_H
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <initializer_list>
 #include <ostream>
 #include <random>
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -984,28 +986,246 @@ inline vec3 vec3_cos_hemisphere_sample(vec3 const &n, float e0, float e1) {
     return x * u + y * v + z * n;
 }
 
+/**
+ * @brief hash64 Scrambles the bits of x (the splitmix64 finalizer), so that consecutive integers
+ * map to uncorrelated ones.
+ */
+inline uint64_t hash64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @brief The rng class PCG32 (http://www.pcg-random.org) random number generator. It has 16 bytes
+ * of state and costs a multiply-add plus a permutation per draw.
+ */
 class rng {
   public:
-    rng(unsigned int seed) : engine(seed), ur(0, 1) {}
+    /**
+     * @brief rng Counter-based construction. Every distinct (seed, stream) pair, e.g. a sample
+     * index and a pixel index, gives an independent sequence, so what a pixel receives doesn't
+     * depend on which thread samples it or in which order.
+     */
+    rng(uint64_t seed, uint64_t stream = 0);
+
+    /**
+     * @brief rng Seeds from the system entropy source.
+     */
+    rng();
+
+    uint32_t next();
+    uint64_t next64();
+
+    /**
+     * @brief draw Uniformly draws a number from [0, 1).
+     */
+    float draw();
+
+    /**
+     * @brief fill Draws n numbers at once. The result is the same as n calls to draw(), but eight
+     * interleaved lanes jump eight steps at a time, so the loop has no serial dependency and can be
+     * vectorized.
+     */
+    void fill(float *samples, unsigned n);
+
+  private:
+    static uint32_t output(uint64_t state);
+    static float to_float(uint32_t bits);
+
+    static uint64_t constexpr Mul = 6364136223846793005ULL;
+
+    uint64_t m_state;
+    uint64_t m_inc;
+};
+
+inline rng::rng(uint64_t seed, uint64_t stream) : m_state(0), m_inc(hash64(~stream) << 1 | 1) {
+    next();
+    m_state += hash64(seed);
+    next();
+}
+
+inline rng::rng()
+    : rng(static_cast<uint64_t>(std::random_device()()) << 32 | std::random_device()()) {}
+
+inline uint32_t rng::output(uint64_t state) {
+    uint32_t xorshifted = static_cast<uint32_t>(((state >> 18) ^ state) >> 27);
+    uint32_t rot = static_cast<uint32_t>(state >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+inline float rng::to_float(uint32_t bits) { return static_cast<float>(bits >> 8) * 0x1p-24f; }
 
-    rng() : ur(0, 1) {
-        std::random_device rd;
-        engine.seed(rd());
+inline uint32_t rng::next() {
+    uint64_t state = m_state;
+    m_state = state * Mul + m_inc;
+    return output(state);
+}
+
+inline uint64_t rng::next64() { return static_cast<uint64_t>(next()) << 32 | next(); }
+
+inline float rng::draw() { return to_float(next()); }
+
+inline void rng::fill(float *samples, unsigned n) {
+    unsigned constexpr Lanes = 8;
+
+    // Multiplier and increment of Lanes steps.
+    uint64_t mul_n = 1;
+    uint64_t inc_n = 0;
+    uint64_t lanes[Lanes];
+    for (unsigned l = 0; l < Lanes; l++) {
+        lanes[l] = m_state;
+        m_state = m_state * Mul + m_inc;
+        inc_n = inc_n * Mul + m_inc;
+        mul_n *= Mul;
     }
 
-    float draw() { return ur(engine); }
+    unsigned i = 0;
+    for (; i + Lanes <= n; i += Lanes) {
+        for (unsigned l = 0; l < Lanes; l++) {
+            // Same as output(), but without narrowing to 32 bits which stops vectorization.
+            uint64_t state = lanes[l];
+            uint64_t xorshifted = (((state >> 18) ^ state) >> 27) & 0xffffffffULL;
+            uint64_t rot = state >> 59;
+            uint64_t bits =
+                ((xorshifted >> rot) | (xorshifted << ((32 - rot) & 31))) & 0xffffffffULL;
+            samples[i + l] = static_cast<float>(static_cast<int32_t>(bits >> 8)) * 0x1p-24f;
+            lanes[l] = state * mul_n + inc_n;
+        }
+    }
+    m_state = lanes[0];
+    for (; i < n; i++) {
+        samples[i] = draw();
+    }
+}
+
+/**
+ * @brief The alias_table class Samples an index from a discrete distribution in constant time
+ * with Vose's alias method. Every index owns an equally likely bin, which keeps the index with
+ * probability q and otherwise falls through to an alias index. Building the table is linear in
+ * the number of indices.
+ */
+class alias_table {
+  public:
+    alias_table();
+
+    /**
+     * @brief alias_table Builds the table of the distribution proportional to weights. The weights
+     * have to be non-negative. If they sum to zero, the distribution is uniform.
+     */
+    alias_table(std::vector<float> const &weights);
+
+    /**
+     * @brief sample Samples an index.
+     * @param u Uniform random number in [0, 1). One number picks both the bin and the branch.
+     * @param prob Probability of the sampled index, if not nullptr.
+     */
+    unsigned sample(float u, float *prob = nullptr) const;
+
+    /**
+     * @brief prob Probability of index i.
+     */
+    float prob(unsigned i) const;
+
+    unsigned size() const;
+    bool empty() const;
 
   private:
-    std::default_random_engine engine;
-    std::uniform_real_distribution<float> ur;
+    struct bin {
+        float q;
+        unsigned alias;
+        float prob;
+    };
+
+    std::vector<bin> m_bins;
 };
 
+inline alias_table::alias_table() {}
+
+inline alias_table::alias_table(std::vector<float> const &weights) : m_bins(weights.size()) {
+    if (weights.empty()) {
+        return;
+    }
+    double sum = 0;
+    for (float w : weights) {
+        assert(w >= 0.0f);
+        sum += static_cast<double>(w);
+    }
+    unsigned n = static_cast<unsigned>(weights.size());
+
+    // Probabilities scaled by n, so an index whose scaled probability is 1 fills its bin exactly.
+    std::vector<double> scaled(n);
+    std::vector<unsigned> small;
+    std::vector<unsigned> large;
+    for (unsigned i = 0; i < n; i++) {
+        double p = sum > 0.0 ? weights[i] / sum : 1.0 / n;
+        m_bins[i].prob = static_cast<float>(p);
+        m_bins[i].alias = i;
+        scaled[i] = p * n;
+        if (scaled[i] < 1.0) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+
+    // Fill each under-full bin with the excess of an over-full index.
+    while (!small.empty() && !large.empty()) {
+        unsigned s = small.back();
+        small.pop_back();
+        unsigned l = large.back();
+        large.pop_back();
+
+        m_bins[s].q = static_cast<float>(scaled[s]);
+        m_bins[s].alias = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if (scaled[l] < 1.0) {
+            small.push_back(l);
+        } else {
+            large.push_back(l);
+        }
+    }
+
+    // What is left is full up to round-off errors.
+    for (unsigned i : large) {
+        m_bins[i].q = 1.0f;
+    }
+    for (unsigned i : small) {
+        m_bins[i].q = 1.0f;
+    }
+}
+
+inline unsigned alias_table::sample(float u, float *prob) const {
+    assert(!m_bins.empty());
+    float scaled = u * m_bins.size();
+    unsigned i = std::min(static_cast<unsigned>(scaled), static_cast<unsigned>(m_bins.size()) - 1);
+    float branch = scaled - i;
+    unsigned sampled = branch < m_bins[i].q ? i : m_bins[i].alias;
+    if (prob != nullptr) {
+        *prob = m_bins[sampled].prob;
+    }
+    return sampled;
+}
+
+inline float alias_table::prob(unsigned i) const { return m_bins[i].prob; }
+
+inline unsigned alias_table::size() const { return static_cast<unsigned>(m_bins.size()); }
+
+inline bool alias_table::empty() const { return m_bins.empty(); }
+
 #define CLAMP(x, lo, hi) ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
 
 // Colors.
 typedef vec3 color3;
 typedef vec4 color4;
 
+inline float color3_luminance(color3 const &c) {
+    return c(0) * 0.299f + c(1) * 0.587f + c(2) * 0.114f;
+}
+
 } // namespace e8util
 
 #endif // TENSOR_H
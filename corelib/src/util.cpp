@@ -44,6 +44,19 @@ e8util::flex_config e8util::flex_config::operator-(flex_config const &other) con
     return diff_this_from_other;
 }
 
+bool e8util::flex_config::empty() const {
+    if (!bool_val.empty() || !int_val.empty() || !float_val.empty() || !str_val.empty() ||
+        !enum_vals.empty() || !enum_sel.empty()) {
+        return false;
+    }
+    for (auto const &enum_val_config : enum_val_configs) {
+        if (!enum_val_config.second.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 e8util::not_implemented_exception::not_implemented_exception(std::string const &func_name)
     : std::logic_error(func_name + "() has not been implemented.") {}
 
@@ -25,6 +25,7 @@ class flex_config {
   public:
     flex_config();
     flex_config operator-(flex_config const &other) const;
+    bool empty() const;
     template <typename ReadOp> void find_bool(std::string const &key, ReadOp read_op) const;
     template <typename ReadOp> void find_int(std::string const &key, ReadOp read_op) const;
     template <typename ReadOp> void find_float(std::string const &key, ReadOp read_op) const;
@@ -77,4 +77,42 @@ void test::test_tensor::run() const {
         e8util::mat<DIMENSION, DIMENSION, double> I = m * n;
         assert(I == 1.0f);
     }
+
+    // Test random number generator.
+    e8util::rng rng0(/*seed=*/13, /*stream=*/7);
+    e8util::rng rng1(/*seed=*/13, /*stream=*/7);
+    float batch[1003];
+    rng0.fill(batch, 1003);
+    for (unsigned i = 0; i < 1003; i++) {
+        assert(batch[i] >= 0.0f && batch[i] < 1.0f);
+        assert(batch[i] == rng1.draw());
+    }
+    assert(rng0.draw() == rng1.draw());
+    assert(e8util::rng(/*seed=*/13, /*stream=*/7).draw() !=
+           e8util::rng(/*seed=*/13, /*stream=*/8).draw());
+    assert(e8util::rng(/*seed=*/13, /*stream=*/7).draw() !=
+           e8util::rng(/*seed=*/14, /*stream=*/7).draw());
+
+    // Test alias table.
+    std::vector<float> weights{1.0f, 0.0f, 3.0f, 0.5f, 2.5f, 3.0f};
+    e8util::alias_table table(weights);
+    assert(table.size() == weights.size());
+    assert(e8util::equals(table.prob(0), 0.1f));
+    assert(e8util::equals(table.prob(1), 0.0f));
+    assert(e8util::equals(table.prob(2), 0.3f));
+    std::vector<unsigned> counts(weights.size());
+    unsigned const NUM_SAMPLES = 100000;
+    for (unsigned i = 0; i < NUM_SAMPLES; i++) {
+        float prob;
+        unsigned k = table.sample(rng0.draw(), &prob);
+        assert(k < weights.size());
+        assert(prob == table.prob(k));
+        counts[k]++;
+    }
+    assert(counts[1] == 0);
+    for (unsigned k = 0; k < weights.size(); k++) {
+        assert(std::abs(static_cast<float>(counts[k]) / NUM_SAMPLES - table.prob(k)) < 0.01f);
+    }
+    e8util::alias_table uniform(std::vector<float>{0.0f, 0.0f});
+    assert(e8util::equals(uniform.prob(0), 0.5f) && e8util::equals(uniform.prob(1), 0.5f));
 }
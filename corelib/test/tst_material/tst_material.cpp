@@ -1,4 +1,5 @@
 #include "src/material.h"
+#include "src/sampler.h"
 #include <QtTest>
 #include <cmath>
 
@@ -14,11 +15,15 @@ class tst_material : public QObject {
     void cook_torrance_sample_dir();
     void cook_torrance_brdf();
     void cook_torrance_special_case();
+    void cook_torrance_pdf();
 
     void oren_nayar_name();
     void oren_nayar_sample_dir();
     void oren_nayar_brdf();
     void oren_nayar_special_case();
+    void oren_nayar_pdf();
+
+    void mixture_pdf();
 };
 
 tst_material::tst_material() {}
@@ -44,12 +49,12 @@ void generic_validate_mat_dir(float *p_valid, std::vector<e8util::vec3> *samples
     e8util::vec3 normal{0.0f, 0.0f, 1.0f};
     e8util::vec3 o_ray{1.0f, 1.0f, 1.0f};
     o_ray = o_ray.normalize();
-    e8util::rng rng(13);
+    e8::random_sampler sampler(/*seed=*/13);
 
     unsigned const NUM_SAMPLES = 1000;
     for (unsigned i = 0; i < NUM_SAMPLES; i++) {
         float dens = -1;
-        e8util::vec3 i_ray = mat.sample(&rng, &dens, /*uv=*/e8util::vec2(), normal, o_ray);
+        e8util::vec3 i_ray = mat.sample(&sampler, &dens, /*uv=*/e8util::vec2(), normal, o_ray);
 
         QVERIFY(dens >= 0.0f);
         if (!e8util::equals(i_ray, e8util::vec3())) {
@@ -106,6 +111,25 @@ void generic_validate_mat_brdf(e8::if_material const &mat) {
     QVERIFY(cumulative_density(2) < 1.0f);
 }
 
+void generic_validate_mat_pdf(e8::if_material const &mat) {
+    e8util::vec3 normal{0.0f, 0.0f, 1.0f};
+    e8util::vec3 o_ray = e8util::vec3{1.0f, 1.0f, 1.0f}.normalize();
+    e8::random_sampler sampler(/*seed=*/13);
+    for (unsigned i = 0; i < 1000; i++) {
+        sampler.start_sample(/*index=*/i);
+        sampler.start_pixel(0);
+        float dens;
+        e8util::vec3 i_ray = mat.sample(&sampler, &dens, /*uv=*/e8util::vec2(), normal, o_ray);
+        if (dens == 0.0f) {
+            continue;
+        }
+        float pdf = mat.pdf(/*uv=*/e8util::vec2(), normal, o_ray, i_ray);
+        QVERIFY2(std::abs(pdf - dens) <= 1e-3f * dens,
+                 ("pdf=" + std::to_string(pdf) + "|dens=" + std::to_string(dens)).c_str());
+    }
+    QVERIFY(mat.pdf(/*uv=*/e8util::vec2(), normal, o_ray, -normal) == 0.0f);
+}
+
 void tst_material::cook_torrance_sample_dir() {
     e8::cook_torr mat =
         e8::cook_torr("test_cook_torr", e8util::vec3({0.787f, 0.787f, 0.787f}), 0.2f, 2.93f);
@@ -157,6 +181,29 @@ void tst_material::cook_torrance_special_case() {
     QVERIFY(density(2) >= 0.0f);
 }
 
+void tst_material::cook_torrance_pdf() {
+    e8::cook_torr mat =
+        e8::cook_torr("test_cook_torr", e8util::vec3({0.787f, 0.787f, 0.787f}), 0.25f, 2.93f);
+    generic_validate_mat_pdf(mat);
+}
+
+void tst_material::oren_nayar_pdf() {
+    e8::oren_nayar mat =
+        e8::oren_nayar("test_oren_nayar", e8util::vec3({0.725f, 0.710f, 0.680f}), 0.078f);
+    generic_validate_mat_pdf(mat);
+}
+
+void tst_material::mixture_pdf() {
+    e8::mat_mixture mat(
+        "test_mixture",
+        std::make_unique<e8::oren_nayar>("test_oren_nayar", e8util::vec3({0.725f, 0.710f, 0.680f}),
+                                         0.078f),
+        std::make_unique<e8::cook_torr>("test_cook_torr", e8util::vec3({0.787f, 0.787f, 0.787f}),
+                                        0.25f, 2.93f),
+        /*ratio=*/0.3f);
+    generic_validate_mat_pdf(mat);
+}
+
 void tst_material::oren_nayar_special_case() {
     e8::oren_nayar mat =
         e8::oren_nayar("test_oren_nayar", e8util::vec3({0.725f, 0.710f, 0.680f}), 0.078f);
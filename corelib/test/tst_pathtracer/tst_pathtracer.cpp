@@ -1,11 +1,15 @@
 #include "src/geometry.h"
+#include "src/irradiancecache.h"
 #include "src/lightsources.h"
 #include "src/materialcontainer.h"
+#include "src/pathguide.h"
 #include "src/pathspace.h"
 #include "src/pathtracer.h"
 #include "src/resource.h"
+#include "src/sampler.h"
 #include <QString>
 #include <QtTest>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 
@@ -17,12 +21,42 @@ class tst_pathtracer : public QObject {
 
   private Q_SLOTS:
     void unidirect_tracer();
+    void unidirect_tracer_sobol();
+    void unidirect_tracer_halton();
+    void unidirect_tracer_blue_noise();
+    void unidirect_tracer_light_bvh();
+    void unidirect_tracer_adaptive_lights();
+    void unidirect_tracer_emissive_mesh();
+    void unidirect_tracer_path_guiding();
+    void path_guide_learning();
+    void emissive_mesh_skips_dark_texels();
+    void solid_angle_light_sampling();
+    void env_light_importance_sampling();
+    void unidirect_tracers_env_light();
+    void adaptive_light_selection();
     void unidirect_lt1_tracer();
+    void irradiance_cache_gradients();
+    void unidirect_lt1_irradiance_cache();
+    void unidirect_mis_tracer();
+    void area_light_surface_density();
+    void unidirect_mis_tracer_area_light();
+    void unidirect_tracers_max_path_len();
+    void unidirect_tracers_generic_layout();
     void bidirect_tracer();
+    void bidirect_lvc_tracer();
+    void pss_sampler_mutations();
+    void pssmlt_tracer();
+    void ppm_tracer();
+    void batched_shadow_rays();
+    void vpl_tracer();
+    void ao_tracer();
+    void restir_tracer();
 };
 
 struct sphere_scene {
-    sphere_scene() {
+    sphere_scene(std::unique_ptr<e8::if_light_sources> light_sources, bool textured_light = false,
+                 bool linear_layout = false)
+        : light_sources(std::move(light_sources)) {
         std::shared_ptr<e8::if_material> material =
             std::make_shared<e8::oren_nayar>("material", albedo, /*roughness=*/0.0f);
 
@@ -35,16 +69,27 @@ struct sphere_scene {
         sphere->update();
         sphere->attach_material(material->id());
 
-        path_space = std::make_unique<e8::bvh_path_space_layout>();
+        if (linear_layout) {
+            path_space = std::make_unique<e8::linear_path_space_layout>();
+        } else {
+            path_space = std::make_unique<e8::bvh_path_space_layout>();
+        }
         path_space->load(*sphere, e8util::mat44_scale(1.0f));
         path_space->commit();
 
-        std::shared_ptr<e8::if_light> light =
-            std::make_shared<e8::area_light>("light", sphere, light_rad);
+        std::shared_ptr<e8::if_light> light;
+        if (textured_light) {
+            // A constant texture modulated by the emissive factor emits the same radiance.
+            auto texture = std::make_shared<e8::texture_map<e8util::vec3>>(
+                /*width=*/2, /*height=*/2, std::vector<e8util::vec3>(4, e8util::vec3(0.5f)));
+            light = std::make_shared<e8::emissive_mesh_light>("light", sphere, 2.0f * light_rad,
+                                                               texture);
+        } else {
+            light = std::make_shared<e8::area_light>("light", sphere, light_rad);
+        }
 
-        light_sources = std::make_unique<e8::basic_light_sources>();
-        light_sources->load(*light, e8util::mat44_scale(1.0f));
-        light_sources->commit();
+        this->light_sources->load(*light, e8util::mat44_scale(1.0f));
+        this->light_sources->commit();
     }
 
     e8util::vec3 albedo = 0.7f;
@@ -55,8 +100,12 @@ struct sphere_scene {
     std::unique_ptr<e8::if_light_sources> light_sources;
 };
 
-void inner_sphere_validation(e8::if_path_tracer const &tracer, unsigned num_samps_per_dir) {
-    sphere_scene scene;
+void inner_sphere_validation(e8::if_path_tracer const &tracer, e8::if_sampler *sampler,
+                             unsigned num_samps_per_dir,
+                             std::unique_ptr<e8::if_light_sources> light_sources =
+                                 std::make_unique<e8::basic_light_sources>(),
+                             bool textured_light = false) {
+    sphere_scene scene(std::move(light_sources), textured_light);
     e8util::rng rn(13);
     float sum_x = 0;
     unsigned const k = 10;
@@ -68,9 +117,10 @@ void inner_sphere_validation(e8::if_path_tracer const &tracer, unsigned num_samp
             std::vector<e8util::ray>{r}, *scene.path_space, *scene.light_sources);
 
         for (unsigned j = 0; j < num_samps_per_dir; j++) {
+            sampler->start_sample(/*index=*/i * num_samps_per_dir + j);
             std::vector<e8util::vec3> estimate =
-                tracer.sample(rn, std::vector<e8util::ray>{r}, hits, *scene.path_space, *scene.mats,
-                              *scene.light_sources);
+                tracer.sample(*sampler, std::vector<e8util::ray>{r}, hits, *scene.path_space,
+                              *scene.mats, *scene.light_sources);
             QVERIFY(estimate.size() == 1);
             QVERIFY2(estimate[0](0) > 0 && estimate[0](1) > 0 && estimate[0](2) > 0,
                      ("At " + std::to_string(i) + "|" + std::to_string(j)).c_str());
@@ -86,15 +136,849 @@ void inner_sphere_validation(e8::if_path_tracer const &tracer, unsigned num_samp
 }
 
 void tst_pathtracer::unidirect_tracer() {
-    inner_sphere_validation(e8::unidirect_path_tracer(), /*num_samps_per_dir=*/2048);
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_path_tracer(), &sampler, /*num_samps_per_dir=*/2048);
+}
+
+void tst_pathtracer::unidirect_tracer_sobol() {
+    e8::sobol_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_path_tracer(), &sampler, /*num_samps_per_dir=*/2048);
+}
+
+void tst_pathtracer::unidirect_tracer_halton() {
+    e8::halton_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_path_tracer(), &sampler, /*num_samps_per_dir=*/2048);
+}
+
+void tst_pathtracer::unidirect_tracer_blue_noise() {
+    e8::sobol_sampler sampler(/*seed=*/13);
+    sampler.enable_blue_noise(true);
+    inner_sphere_validation(e8::unidirect_path_tracer(), &sampler, /*num_samps_per_dir=*/2048);
+}
+
+void tst_pathtracer::unidirect_tracer_light_bvh() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_path_tracer(), &sampler, /*num_samps_per_dir=*/2048,
+                            std::make_unique<e8::bvh_light_sources>());
+}
+
+void tst_pathtracer::unidirect_tracer_adaptive_lights() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_path_tracer(), &sampler, /*num_samps_per_dir=*/2048,
+                            std::make_unique<e8::adaptive_light_sources>());
+}
+
+void tst_pathtracer::unidirect_tracer_emissive_mesh() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_path_tracer(), &sampler, /*num_samps_per_dir=*/2048,
+                            std::make_unique<e8::basic_light_sources>(),
+                            /*textured_light=*/true);
+}
+
+void tst_pathtracer::unidirect_tracer_path_guiding() {
+    // Let the guide learn from a few passes before validating the guided paths.
+    sphere_scene scene(std::make_unique<e8::basic_light_sources>());
+    e8util::rng rn(13);
+    std::vector<e8util::ray> rays;
+    for (unsigned i = 0; i < 256; i++) {
+        rays.push_back(
+            e8util::ray(e8util::vec3{0, 0, 0}, e8util::vec3_sphere_sample(rn.draw(), rn.draw())));
+    }
+    e8::if_path_tracer::first_hits hits =
+        e8::if_path_tracer::compute_first_hit(rays, *scene.path_space, *scene.light_sources);
+    e8::unidirect_path_tracer tracer(e8::if_path_tracer::unlimited_path_len,
+                                     std::make_shared<e8::path_guide>());
+    e8::random_sampler sampler(/*seed=*/13);
+    for (unsigned k = 0; k < 8; k++) {
+        sampler.start_sample(/*index=*/k);
+        tracer.sample(sampler, rays, hits, *scene.path_space, *scene.mats, *scene.light_sources);
+        tracer.end_pass();
+    }
+    inner_sphere_validation(tracer, &sampler, /*num_samps_per_dir=*/2048);
+}
+
+void tst_pathtracer::path_guide_learning() {
+    // Radiance mostly arrives from a cap around +x.
+    e8::path_guide guide;
+    e8::path_guide::recorder rec;
+    e8util::aabb bound(e8util::vec3{-1, -1, -1}, e8util::vec3{1, 1, 1});
+    e8util::vec3 p{0.1f, 0.2f, 0.3f};
+    auto in_cap = [](e8util::vec3 const &w) { return w(0) > 0.9f; };
+    e8util::rng rn(13);
+    for (unsigned k = 0; k < 4; k++) {
+        guide.begin_pass(&rec, bound);
+        for (unsigned i = 0; i < 20000; i++) {
+            e8util::vec3 w = e8util::vec3_sphere_sample(rn.draw(), rn.draw());
+            float uniform_dens = 1.0f / (4.0f * static_cast<float>(M_PI));
+            guide.record(&rec, p, w, (in_cap(w) ? 10.0f : 0.1f) / uniform_dens);
+        }
+        guide.end_pass(&rec);
+    }
+    guide.begin_pass(&rec, bound);
+    QVERIFY(guide.trained());
+
+    // The density integrates to 1 over the sphere.
+    double integral = 0;
+    unsigned const num_dirs = 100000;
+    for (unsigned i = 0; i < num_dirs; i++) {
+        e8util::vec3 w = e8util::vec3_sphere_sample(rn.draw(), rn.draw());
+        integral += guide.pdf(p, w) * 4.0 * M_PI;
+    }
+    integral /= num_dirs;
+    QVERIFY2(std::abs(integral - 1.0) < 0.03, ("integral=" + std::to_string(integral)).c_str());
+
+    // The cap subtends 5% of the sphere but holds most of the energy.
+    e8::random_sampler sampler(/*seed=*/13);
+    sampler.start_sample(/*index=*/0);
+    sampler.start_pixel(0);
+    unsigned num_in_cap = 0;
+    unsigned const num_samps = 10000;
+    for (unsigned i = 0; i < num_samps; i++) {
+        float dens;
+        e8util::vec3 w = guide.sample(&sampler, p, &dens);
+        QVERIFY(std::abs(dens - guide.pdf(p, w)) <= 1e-4f * dens);
+        if (in_cap(w)) {
+            num_in_cap++;
+        }
+    }
+    QVERIFY2(num_in_cap > num_samps / 2, ("in cap=" + std::to_string(num_in_cap)).c_str());
+}
+
+void tst_pathtracer::emissive_mesh_skips_dark_texels() {
+    std::shared_ptr<e8::uv_sphere> sphere = std::make_shared<e8::uv_sphere>(
+        /*name=*/"sphere", /*o=*/e8util::vec3{0.0f, 0.0f, 0.0f}, /*r=*/1.0f,
+        /*res=*/30);
+    sphere->update();
+
+    // Only the texels on the right half of the texture, i.e. the northern hemisphere, emit.
+    unsigned const size = 64;
+    std::vector<e8util::vec3> texels(size * size);
+    for (unsigned i = 0; i < size * size; i++) {
+        texels[i] = i % size >= size / 2 ? 1.0f : 0.0f;
+    }
+    e8::emissive_mesh_light light(
+        "light", sphere, /*factor=*/1.0f,
+        std::make_shared<e8::texture_map<e8util::vec3>>(size, size, texels));
+
+    e8::random_sampler sampler(/*seed=*/13);
+    sampler.start_sample(/*index=*/0);
+    for (unsigned i = 0; i < 1000; i++) {
+        sampler.start_pixel(i);
+        e8::if_light::emission_surface_sample sample = light.sample_emssion_surface(&sampler);
+        QVERIFY2(sample.surface.uv(0) >= 0.5f - 1e-4f,
+                 ("At u=" + std::to_string(sample.surface.uv(0))).c_str());
+    }
+
+    std::vector<e8::triangle> const &tris = sphere->triangles();
+    std::vector<e8util::vec2> const &texcoords = sphere->texcoords();
+    for (unsigned i = 0; i < tris.size(); i++) {
+        float max_u = std::max(
+            {texcoords[tris[i](0)](0), texcoords[tris[i](1)](0), texcoords[tris[i](2)](0)});
+        if (max_u < 0.5f) {
+            QVERIFY(light.triangle_prob(i) == 0.0f);
+        }
+    }
+}
+
+void tst_pathtracer::solid_angle_light_sampling() {
+    // A rectangular light right above the target point, where area sampling is noisy.
+    std::shared_ptr<e8::quad> rect = std::make_shared<e8::quad>(
+        "rect", /*o=*/e8util::vec3{-0.5f, -0.4f, 1.0f}, /*u=*/e8util::vec3{0.0f, 0.8f, 0.0f},
+        /*v=*/e8util::vec3{1.0f, 0.0f, 0.0f});
+    e8::area_light tri_light("tri_light", rect, /*rad=*/1.0f);
+    e8::quad_light rect_light("rect_light", rect, /*rad=*/1.0f);
+    e8util::vec3 p{0.3f, 0.1f, 0.9f};
+    e8util::vec3 n{0.0f, 0.0f, 1.0f};
+
+    // Mean and variance of the irradiance estimates.
+    auto estimate = [&](e8::if_light const &light, bool solid_angle) {
+        e8::random_sampler sampler(/*seed=*/13);
+        unsigned const num_samps = 20000;
+        double sum = 0;
+        double sum2 = 0;
+        for (unsigned i = 0; i < num_samps; i++) {
+            sampler.start_sample(/*index=*/i);
+            sampler.start_pixel(0);
+            e8::if_light::emission_surface_sample sample =
+                solid_angle ? light.sample_emssion_surface(&sampler, p)
+                            : light.sample_emssion_surface(&sampler);
+            float x = light.eval(p - sample.surface.p, sample.surface.n, n, sample.surface.uv)(0) /
+                      sample.surface.area_dens;
+            sum += x;
+            sum2 += x * x;
+        }
+        double mu = sum / num_samps;
+        return std::make_pair(mu, sum2 / num_samps - mu * mu);
+    };
+
+    std::pair<double, double> area = estimate(tri_light, /*solid_angle=*/false);
+    std::pair<double, double> tri = estimate(tri_light, /*solid_angle=*/true);
+    std::pair<double, double> rect_est = estimate(rect_light, /*solid_angle=*/true);
+    QVERIFY2(std::abs(tri.first - area.first) < 0.1 * area.first,
+             ("tri=" + std::to_string(tri.first) + "|area=" + std::to_string(area.first)).c_str());
+    QVERIFY2(std::abs(rect_est.first - tri.first) < 0.01 * tri.first,
+             ("rect=" + std::to_string(rect_est.first) + "|tri=" + std::to_string(tri.first))
+                 .c_str());
+    QVERIFY(tri.second < 0.1 * area.second);
+    QVERIFY(rect_est.second < 0.1 * area.second);
+}
+
+void tst_pathtracer::env_light_importance_sampling() {
+    // A dim environment with a small bright patch above the horizon.
+    unsigned const width = 64;
+    unsigned const height = 32;
+    std::vector<e8util::vec3> texels(width * height, e8util::vec3(0.1f));
+    for (unsigned r = 10; r < 12; r++) {
+        for (unsigned c = 20; c < 23; c++) {
+            texels[c + r * width] = e8util::vec3(200.0f);
+        }
+    }
+    e8::env_light light("env", std::make_shared<e8::texture_map<e8util::vec3>>(width, height,
+                                                                               texels));
+    light.set_scene_boundary(e8util::aabb(e8util::vec3(-1.0f), e8util::vec3(1.0f)));
+    e8util::vec3 p{0.0f, 0.0f, 0.0f};
+    e8util::vec3 n{0.0f, 0.0f, 1.0f};
+    unsigned const num_samps = 20000;
+
+    // Irradiance estimated by importance sampling the map.
+    e8::random_sampler sampler(/*seed=*/13);
+    double sum = 0;
+    double sum2 = 0;
+    for (unsigned i = 0; i < num_samps; i++) {
+        sampler.start_sample(/*index=*/i);
+        sampler.start_pixel(0);
+        e8::if_light::emission_surface_sample sample = light.sample_emssion_surface(&sampler, p);
+        e8util::vec3 w = (sample.surface.p - p).normalize();
+        float dens = light.solid_angle_dens(w);
+        QVERIFY2(std::abs(dens - sample.surface.area_dens) < 1e-2f * sample.surface.area_dens,
+                 ("dens=" + std::to_string(dens) +
+                  "|area_dens=" + std::to_string(sample.surface.area_dens))
+                     .c_str());
+        float x = light.eval(p - sample.surface.p, sample.surface.n, n, sample.surface.uv)(0) /
+                  sample.surface.area_dens;
+        sum += x;
+        sum2 += x * x;
+    }
+    double mu = sum / num_samps;
+    double var = sum2 / num_samps - mu * mu;
+
+    // Irradiance estimated by sampling the hemisphere uniformly, with many more samples since
+    // few of them find the patch.
+    e8util::rng rn(13);
+    unsigned const num_uniform_samps = 100 * num_samps;
+    double uniform_sum = 0;
+    double uniform_sum2 = 0;
+    for (unsigned i = 0; i < num_uniform_samps; i++) {
+        e8util::vec3 w = e8util::vec3_sphere_sample(rn.draw(), rn.draw());
+        if (w(2) < 0) {
+            w = -w;
+        }
+        float x = light.radiance(-w, -w, e8::env_light::direction_to_uv(w))(0) * w(2) *
+                  2 * static_cast<float>(M_PI);
+        uniform_sum += x;
+        uniform_sum2 += x * x;
+    }
+    double uniform_mu = uniform_sum / num_uniform_samps;
+    double uniform_var = uniform_sum2 / num_uniform_samps - uniform_mu * uniform_mu;
+
+    QVERIFY2(std::abs(mu - uniform_mu) < 0.05 * uniform_mu,
+             ("mu=" + std::to_string(mu) + "|uniform=" + std::to_string(uniform_mu)).c_str());
+    QVERIFY(var < 0.1 * uniform_var);
+
+    // Until they know the extent of the scene, the infinite lights have no power.
+    QCOMPARE(e8::sky_light(e8util::vec3(1.0f)).power().norm(), 0.0f);
+
+    // The light sources pass the boundary on to the lights they hold, which places the emission
+    // around the scene and scales the power the selection weighs the lights by.
+    e8::basic_light_sources light_sources;
+    light_sources.load(light, e8util::mat44_scale(1.0f));
+    e8util::aabb bound(e8util::vec3(-2.0f), e8util::vec3(2.0f));
+    light_sources.set_scene_boundary(bound);
+    light_sources.commit();
+    float prob_mass;
+    sampler.start_sample(/*index=*/0);
+    sampler.start_pixel(0);
+    e8::if_light const *selected = light_sources.sample_light(&sampler, &prob_mass);
+    QVERIFY(selected != nullptr);
+    QCOMPARE(prob_mass, 1.0f);
+    QVERIFY(std::abs(selected->power().norm() - 4.0f * light.power().norm()) <
+            1e-3f * selected->power().norm());
+    e8::if_light::emission_surface_sample sample = selected->sample_emssion_surface(&sampler, p);
+    QVERIFY(std::abs((sample.surface.p - p).norm() - 2.0f * bound.enclosing_radius()) < 1e-3f);
+}
+
+void tst_pathtracer::unidirect_tracers_env_light() {
+    // A diffuse floor under a constant environment is only lit by the rays escaping the scene, and
+    // reflects the albedo times the environment whichever way the tracers reach the light.
+    std::vector<std::unique_ptr<e8::if_path_tracer>> tracers;
+    tracers.push_back(std::make_unique<e8::unidirect_path_tracer>());
+    tracers.push_back(std::make_unique<e8::unidirect_path_tracer>(
+        e8::if_path_tracer::unlimited_path_len, std::make_shared<e8::path_guide>()));
+    tracers.push_back(std::make_unique<e8::unidirect_lt1_path_tracer>());
+    tracers.push_back(std::make_unique<e8::unidirect_mis_path_tracer>());
+
+    e8util::vec3 albedo = 0.7f;
+    std::shared_ptr<e8::if_material> material =
+        std::make_shared<e8::oren_nayar>("material", albedo, /*roughness=*/0.0f);
+    e8::default_material_container mats;
+    mats.load(*material, e8util::mat44_scale(1.0f));
+
+    std::shared_ptr<e8::quad> floor = std::make_shared<e8::quad>(
+        "floor", /*o=*/e8util::vec3{-10.0f, -10.0f, 0.0f}, /*u=*/e8util::vec3{20.0f, 0.0f, 0.0f},
+        /*v=*/e8util::vec3{0.0f, 20.0f, 0.0f});
+    floor->attach_material(material->id());
+    e8::bvh_path_space_layout path_space;
+    path_space.load(*floor, e8util::mat44_scale(1.0f));
+    path_space.commit();
+
+    e8::env_light light("env", std::make_shared<e8::texture_map<e8util::vec3>>(
+                                   /*width=*/4, /*height=*/2,
+                                   std::vector<e8util::vec3>(8, e8util::vec3(1.0f))));
+    e8::basic_light_sources light_sources;
+    light_sources.load(light, e8util::mat44_scale(1.0f));
+    light_sources.set_scene_boundary(path_space.aabb());
+    light_sources.commit();
+    QCOMPARE(light_sources.infinite_lights().size(), static_cast<size_t>(1));
+
+    e8util::ray r(e8util::vec3{0.0f, 0.0f, 1.0f}, e8util::vec3{0.0f, 0.0f, -1.0f});
+    e8::if_path_tracer::first_hits hits =
+        e8::if_path_tracer::compute_first_hit(std::vector<e8util::ray>{r}, path_space,
+                                              light_sources);
+    std::vector<float> vars;
+    for (unsigned k = 0; k < tracers.size(); k++) {
+        e8::random_sampler sampler(/*seed=*/13);
+        unsigned const n = 16384;
+        float sum = 0;
+        float sum2 = 0;
+        for (unsigned i = 0; i < n; i++) {
+            sampler.start_sample(/*index=*/i);
+            float x = tracers[k]
+                          ->sample(sampler, std::vector<e8util::ray>{r}, hits, path_space, mats,
+                                   light_sources)[0]
+                          .sum();
+            sum += x;
+            sum2 += x * x;
+        }
+        float mu = sum / n;
+        vars.push_back(sum2 / n - mu * mu);
+        QVERIFY2(std::abs(mu - albedo.sum()) < 0.05f,
+                 ("At " + std::to_string(k) + ": mu=" + std::to_string(mu) +
+                  "|exp=" + std::to_string(albedo.sum()))
+                     .c_str());
+    }
+
+    // The cosine-weighted BRDF samples match the light of the diffuse floor better than the
+    // samples of the environment, and MIS keeps most of their advantage.
+    QVERIFY2(vars[3] < 0.5f * vars[2],
+             ("mis=" + std::to_string(vars[3]) + "|lt1=" + std::to_string(vars[2])).c_str());
+}
+
+void tst_pathtracer::adaptive_light_selection() {
+    // Two equally bright lights, where the first one never reaches the point p.
+    std::vector<std::shared_ptr<e8::if_light>> lights;
+    for (float x : {-2.0f, 2.0f}) {
+        std::shared_ptr<e8::quad> rect = std::make_shared<e8::quad>(
+            "rect", /*o=*/e8util::vec3{x, 0.0f, 1.0f}, /*u=*/e8util::vec3{0.0f, 1.0f, 0.0f},
+            /*v=*/e8util::vec3{1.0f, 0.0f, 0.0f});
+        lights.push_back(std::make_shared<e8::quad_light>("light", rect, /*rad=*/1.0f));
+    }
+    e8::adaptive_light_sources light_sources;
+    for (std::shared_ptr<e8::if_light> const &light : lights) {
+        light_sources.load(*light, e8util::mat44_scale(1.0f));
+    }
+    light_sources.commit();
+    light_sources.set_scene_boundary(e8util::aabb(e8util::vec3(-4.0f), e8util::vec3(4.0f)));
+
+    e8util::vec3 p{2.0f, 0.5f, 0.0f};
+    e8util::vec3 n{0.0f, 0.0f, 1.0f};
+    e8::if_light const *blocked = light_sources.obj_light(*lights[0]->geometries()[0]);
+    e8::if_light const *visible = light_sources.obj_light(*lights[1]->geometries()[0]);
+    QVERIFY(std::abs(light_sources.light_prob(blocked, p, n) - 0.5f) < 1e-4f);
+
+    // Records of one frame.
+    e8::random_sampler sampler(/*seed=*/13);
+    for (unsigned i = 0; i < 1000; i++) {
+        sampler.start_sample(/*index=*/i);
+        sampler.start_pixel(0);
+        float prob_mass;
+        e8::if_light const *light = light_sources.sample_light(&sampler, p, n, &prob_mass);
+        light_sources.record_contribution(light, p, light == visible ? 1.0f : 0.0f);
+    }
+    light_sources.commit();
+    light_sources.adapt();
+
+    float p_blocked = light_sources.light_prob(blocked, p, n);
+    float p_visible = light_sources.light_prob(visible, p, n);
+    QVERIFY2(p_blocked > 0 && p_blocked < 0.1f, ("p_blocked=" + std::to_string(p_blocked)).c_str());
+    QVERIFY(std::abs(p_blocked + p_visible - 1.0f) < 1e-4f);
+
+    unsigned num_visible = 0;
+    for (unsigned i = 0; i < 1000; i++) {
+        sampler.start_sample(/*index=*/i);
+        sampler.start_pixel(0);
+        float prob_mass;
+        e8::if_light const *light = light_sources.sample_light(&sampler, p, n, &prob_mass);
+        QVERIFY(std::abs(prob_mass - light_sources.light_prob(light, p, n)) < 1e-4f);
+        num_visible += light == visible ? 1 : 0;
+    }
+    QVERIFY(std::abs(num_visible / 1000.0f - p_visible) < 0.03f);
+
+    // Points that have nothing recorded still select by power.
+    e8util::vec3 q{-3.0f, -3.0f, -3.0f};
+    QVERIFY(std::abs(light_sources.light_prob(blocked, q, n) - 0.5f) < 1e-4f);
 }
 
 void tst_pathtracer::unidirect_lt1_tracer() {
-    // inner_sphere_validation(e8::unidirect_lt1_path_tracer(), /*num_samps_per_dir=*/256);
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_lt1_path_tracer(), &sampler, /*num_samps_per_dir=*/256);
+}
+
+void tst_pathtracer::irradiance_cache_gradients() {
+    unsigned const num_strata = e8::irradiance_cache::num_theta * e8::irradiance_cache::num_phi;
+    e8util::vec3 n{0.0f, 0.0f, 1.0f};
+    e8util::aabb bound(e8util::vec3{-10.0f, -10.0f, -10.0f}, e8util::vec3{10.0f, 10.0f, 10.0f});
+    e8util::vec3 rad[num_strata];
+    float dist[num_strata];
+
+    // A ceiling at z=1 whose radiance grows with x. Moving along x adds the same radiance in every
+    // direction.
+    e8::irradiance_cache ceiling;
+    ceiling.reset(bound, /*min_radius=*/0.0f, /*max_radius=*/10.0f);
+    for (unsigned j = 0; j < e8::irradiance_cache::num_theta; j++) {
+        for (unsigned k = 0; k < e8::irradiance_cache::num_phi; k++) {
+            e8util::vec3 w = e8::irradiance_cache::stratum_direction(n, j, k, 0.5f, 0.5f);
+            unsigned s = j * e8::irradiance_cache::num_phi + k;
+            dist[s] = 1.0f / w(2);
+            rad[s] = 1.0f + 0.5f * w(0) * dist[s];
+        }
+    }
+    e8util::vec3 e = ceiling.insert(e8util::vec3{0.0f, 0.0f, 0.0f}, n, rad, dist);
+    QVERIFY2(std::abs(e(0) - M_PI) < 0.01f, ("E=" + std::to_string(e(0))).c_str());
+    QVERIFY(ceiling.num_records() == 1);
+    QVERIFY(ceiling.lookup(e8util::vec3{0.1f, 0.0f, 0.0f}, n, &e));
+    float expected = M_PI * (1.0f + 0.5f * 0.1f);
+    QVERIFY2(std::abs(e(0) - expected) < 0.02f * expected,
+             ("E=" + std::to_string(e(0)) + "|expected=" + std::to_string(expected)).c_str());
+    QVERIFY(!ceiling.lookup(e8util::vec3{5.0f, 0.0f, 0.0f}, n, &e));
+
+    // A distant environment brighter towards x. Tilting the normal towards x collects more of it.
+    e8::irradiance_cache env;
+    env.reset(bound, /*min_radius=*/0.0f, /*max_radius=*/10.0f);
+    for (unsigned j = 0; j < e8::irradiance_cache::num_theta; j++) {
+        for (unsigned k = 0; k < e8::irradiance_cache::num_phi; k++) {
+            e8util::vec3 w = e8::irradiance_cache::stratum_direction(n, j, k, 0.5f, 0.5f);
+            unsigned s = j * e8::irradiance_cache::num_phi + k;
+            dist[s] = 1e6f;
+            rad[s] = 1.0f + 0.5f * w(0);
+        }
+    }
+    env.insert(e8util::vec3{0.0f, 0.0f, 0.0f}, n, rad, dist);
+    float alpha = 0.1f;
+    QVERIFY(env.lookup(e8util::vec3{0.0f, 0.0f, 0.0f},
+                       e8util::vec3{std::sin(alpha), 0.0f, std::cos(alpha)}, &e));
+    expected = M_PI + M_PI / 3.0f * std::sin(alpha);
+    QVERIFY2(std::abs(e(0) - expected) < 0.02f * expected,
+             ("E=" + std::to_string(e(0)) + "|expected=" + std::to_string(expected)).c_str());
+}
+
+void tst_pathtracer::unidirect_lt1_irradiance_cache() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(
+        e8::unidirect_lt1_path_tracer(e8::if_path_tracer::unlimited_path_len,
+                                      /*irradiance_caching=*/true),
+        &sampler, /*num_samps_per_dir=*/256);
+}
+
+void tst_pathtracer::unidirect_mis_tracer() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::unidirect_mis_path_tracer(), &sampler, /*num_samps_per_dir=*/2048);
+}
+
+void tst_pathtracer::area_light_surface_density() {
+    // A light of two triangles, which is sampled by solid angle, seen from a glossy floor.
+    std::shared_ptr<e8::quad> rect = std::make_shared<e8::quad>(
+        "rect", /*o=*/e8util::vec3{-0.5f, -0.5f, 1.0f}, /*u=*/e8util::vec3{0.0f, 1.0f, 0.0f},
+        /*v=*/e8util::vec3{1.0f, 0.0f, 0.0f});
+    e8::area_light light("light", rect, /*rad=*/1.0f);
+    e8util::vec3 p{0.2f, 0.1f, 0.0f};
+
+    // The area density of the light sampling a point agrees with the one it reports for the
+    // point.
+    e8::random_sampler sampler(/*seed=*/13);
+    std::vector<e8::triangle> const &tris = rect->triangles();
+    std::vector<e8util::vec3> const &verts = rect->vertices();
+    for (unsigned k = 0; k < 100; k++) {
+        sampler.start_sample(/*index=*/k);
+        sampler.start_pixel(0);
+        e8::if_light::emission_surface_sample sample = light.sample_emssion_surface(&sampler, p);
+
+        // Find the triangle the point lies on.
+        e8util::ray r(p, (sample.surface.p - p).normalize());
+        unsigned face = 0;
+        for (unsigned j = 0; j < tris.size(); j++) {
+            e8util::vec3 b;
+            float t;
+            if (r.intersect(verts[tris[j](0)], verts[tris[j](1)], verts[tris[j](2)], 0.0f, 10.0f, b,
+                            t)) {
+                face = j;
+            }
+        }
+        float dens = light.emission_surface_dens(p, sample.surface.p, sample.surface.n, face);
+        QVERIFY2(std::abs(dens - sample.surface.area_dens) < 1e-2f * sample.surface.area_dens,
+                 ("dens=" + std::to_string(dens) +
+                  "|area_dens=" + std::to_string(sample.surface.area_dens))
+                     .c_str());
+    }
+}
+
+void tst_pathtracer::unidirect_mis_tracer_area_light() {
+    // A diffuse floor under a light of two triangles, which is sampled by solid angle. The light
+    // reflects nothing, so the floor only reflects the direct illumination.
+    e8util::vec3 albedo = 0.7f;
+    std::shared_ptr<e8::if_material> material =
+        std::make_shared<e8::oren_nayar>("material", albedo, /*roughness=*/0.0f);
+    std::shared_ptr<e8::if_material> black =
+        std::make_shared<e8::oren_nayar>("black", /*albedo=*/0.0f, /*roughness=*/0.0f);
+    e8::default_material_container mats;
+    mats.load(*material, e8util::mat44_scale(1.0f));
+    mats.load(*black, e8util::mat44_scale(1.0f));
+
+    std::shared_ptr<e8::quad> floor = std::make_shared<e8::quad>(
+        "floor", /*o=*/e8util::vec3{-10.0f, -10.0f, 0.0f}, /*u=*/e8util::vec3{20.0f, 0.0f, 0.0f},
+        /*v=*/e8util::vec3{0.0f, 20.0f, 0.0f});
+    floor->attach_material(material->id());
+    std::shared_ptr<e8::quad> rect = std::make_shared<e8::quad>(
+        "rect", /*o=*/e8util::vec3{-0.5f, -0.5f, 1.0f}, /*u=*/e8util::vec3{0.0f, 1.0f, 0.0f},
+        /*v=*/e8util::vec3{1.0f, 0.0f, 0.0f});
+    rect->attach_material(black->id());
+    e8::bvh_path_space_layout path_space;
+    path_space.load(*floor, e8util::mat44_scale(1.0f));
+    path_space.load(*rect, e8util::mat44_scale(1.0f));
+    path_space.commit();
+
+    e8::area_light light("light", rect, /*rad=*/1.0f);
+    e8::basic_light_sources light_sources;
+    light_sources.load(light, e8util::mat44_scale(1.0f));
+    light_sources.commit();
+
+    // Irradiance at p, integrated over a fine grid on the light.
+    e8util::vec3 p{0.2f, 0.1f, 0.0f};
+    unsigned const res = 256;
+    double irradiance = 0;
+    for (unsigned j = 0; j < res; j++) {
+        for (unsigned k = 0; k < res; k++) {
+            e8util::vec3 q{-0.5f + (j + 0.5f) / res, -0.5f + (k + 0.5f) / res, 1.0f};
+            e8util::vec3 l = q - p;
+            float dist2 = l.inner(l);
+            irradiance += l(2) * l(2) / (dist2 * dist2) / (res * res);
+        }
+    }
+    float exp_rad = albedo.sum() / static_cast<float>(M_PI) * static_cast<float>(irradiance);
+
+    e8util::ray r(p + e8util::vec3{0.0f, 0.0f, 0.5f}, e8util::vec3{0.0f, 0.0f, -1.0f});
+    e8::if_path_tracer::first_hits hits = e8::if_path_tracer::compute_first_hit(
+        std::vector<e8util::ray>{r}, path_space, light_sources);
+    e8::unidirect_mis_path_tracer tracer;
+    e8::random_sampler sampler(/*seed=*/13);
+    unsigned const n = 4096;
+    float sum = 0;
+    for (unsigned i = 0; i < n; i++) {
+        sampler.start_sample(/*index=*/i);
+        sum += tracer
+                   .sample(sampler, std::vector<e8util::ray>{r}, hits, path_space, mats,
+                           light_sources)[0]
+                   .sum();
+    }
+    float mu = sum / n;
+    QVERIFY2(std::abs(mu - exp_rad) < 0.02f * exp_rad,
+             ("mu=" + std::to_string(mu) + "|exp=" + std::to_string(exp_rad)).c_str());
+}
+
+void tst_pathtracer::unidirect_tracers_max_path_len() {
+    // Paths of at most 3 vertices inside the sphere gather the emission of up to 2 bounces,
+    // whatever the way they sample the lights.
+    unsigned const max_path_len = 3;
+    std::vector<std::unique_ptr<e8::if_path_tracer>> tracers;
+    tracers.push_back(std::make_unique<e8::unidirect_path_tracer>(max_path_len));
+    tracers.push_back(std::make_unique<e8::unidirect_mis_path_tracer>(max_path_len));
+
+    sphere_scene scene(std::make_unique<e8::basic_light_sources>());
+    e8util::vec3 exp_rad = scene.light_rad * (scene.albedo * scene.albedo + scene.albedo + 1.0f);
+    e8util::ray r(e8util::vec3{0, 0, 0}, e8util::vec3{0, 0, 1});
+    e8::if_path_tracer::first_hits hits = e8::if_path_tracer::compute_first_hit(
+        std::vector<e8util::ray>{r}, *scene.path_space, *scene.light_sources);
+    for (std::unique_ptr<e8::if_path_tracer> const &tracer : tracers) {
+        e8::random_sampler sampler(/*seed=*/13);
+        unsigned const n = 8192;
+        e8util::vec3 sum;
+        for (unsigned i = 0; i < n; i++) {
+            sampler.start_sample(/*index=*/i);
+            sum += tracer->sample(sampler, std::vector<e8util::ray>{r}, hits, *scene.path_space,
+                                  *scene.mats, *scene.light_sources)[0];
+        }
+        float mu = sum.sum() / n;
+        QVERIFY2(std::abs(mu - exp_rad.sum()) < 0.1f,
+                 ("mu=" + std::to_string(mu) + "|exp=" + std::to_string(exp_rad.sum())).c_str());
+    }
+}
+
+void tst_pathtracer::unidirect_tracers_generic_layout() {
+    // The tracers are specialized for the BVH layout, and trace the paths of any other layout
+    // through the path space interface. Both find the same paths from the same random numbers.
+    std::vector<std::unique_ptr<e8::if_path_tracer>> tracers;
+    tracers.push_back(std::make_unique<e8::unidirect_path_tracer>());
+    tracers.push_back(std::make_unique<e8::unidirect_lt1_path_tracer>());
+    tracers.push_back(std::make_unique<e8::unidirect_mis_path_tracer>());
+
+    sphere_scene bvh_scene(std::make_unique<e8::basic_light_sources>());
+    sphere_scene linear_scene(std::make_unique<e8::basic_light_sources>(),
+                              /*textured_light=*/false, /*linear_layout=*/true);
+    e8util::rng rn(13);
+    std::vector<e8util::ray> rays;
+    for (unsigned i = 0; i < 16; i++) {
+        rays.push_back(e8util::ray(e8util::vec3{0, 0, 0},
+                                   e8util::vec3_sphere_sample(rn.draw(), rn.draw())));
+    }
+    e8::if_path_tracer::first_hits bvh_hits = e8::if_path_tracer::compute_first_hit(
+        rays, *bvh_scene.path_space, *bvh_scene.light_sources);
+    e8::if_path_tracer::first_hits linear_hits = e8::if_path_tracer::compute_first_hit(
+        rays, *linear_scene.path_space, *linear_scene.light_sources);
+    for (std::unique_ptr<e8::if_path_tracer> const &tracer : tracers) {
+        e8::random_sampler bvh_sampler(/*seed=*/13);
+        e8::random_sampler linear_sampler(/*seed=*/13);
+        for (unsigned k = 0; k < 64; k++) {
+            bvh_sampler.start_sample(/*index=*/k);
+            linear_sampler.start_sample(/*index=*/k);
+            std::vector<e8util::vec3> bvh_rad =
+                tracer->sample(bvh_sampler, rays, bvh_hits, *bvh_scene.path_space,
+                               *bvh_scene.mats, *bvh_scene.light_sources);
+            std::vector<e8util::vec3> linear_rad =
+                tracer->sample(linear_sampler, rays, linear_hits, *linear_scene.path_space,
+                               *linear_scene.mats, *linear_scene.light_sources);
+            for (unsigned i = 0; i < rays.size(); i++) {
+                QVERIFY2(std::abs(bvh_rad[i].sum() - linear_rad[i].sum()) <
+                             1e-3f * (1.0f + bvh_rad[i].sum()),
+                         ("At " + std::to_string(k) + "|" + std::to_string(i) + ": " +
+                          std::to_string(bvh_rad[i].sum()) + "|" +
+                          std::to_string(linear_rad[i].sum()))
+                             .c_str());
+            }
+        }
+    }
 }
 
 void tst_pathtracer::bidirect_tracer() {
-    // inner_sphere_validation(e8::bidirect_mis_path_tracer(), /*num_samps_per_dir=*/8);
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::bidirect_mis_path_tracer(), &sampler, /*num_samps_per_dir=*/256);
+}
+
+void tst_pathtracer::bidirect_lvc_tracer() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::bidirect_lvc_path_tracer(), &sampler, /*num_samps_per_dir=*/1024);
+}
+
+void tst_pathtracer::pss_sampler_mutations() {
+    e8::pss_sampler pss(/*seed=*/0);
+    unsigned const num_dims = 16;
+    auto draw_state = [&pss](std::vector<float> *state) {
+        pss.start_pixel(0);
+        for (float &v : *state) {
+            v = pss.draw();
+        }
+    };
+    auto num_near = [](std::vector<float> const &x, std::vector<float> const &y) {
+        unsigned n = 0;
+        for (unsigned d = 0; d < x.size(); d++) {
+            float dist = std::abs(x[d] - y[d]);
+            if (std::min(dist, 1.0f - dist) <= 1.0f / 64.0f + 1e-6f) {
+                n++;
+            }
+        }
+        return n;
+    };
+
+    // The first state is determined by the seed.
+    std::vector<float> x(num_dims);
+    std::vector<float> y(num_dims);
+    pss.reset(/*seed=*/7);
+    draw_state(&x);
+    pss.reset(/*seed=*/7);
+    draw_state(&y);
+    QVERIFY(x == y);
+
+    // Small steps stay close to the state (modulo 1), large steps don't.
+    pss.start_mutation(/*large_step=*/false);
+    draw_state(&y);
+    QVERIFY(num_near(x, y) == num_dims);
+    pss.reject();
+    pss.start_mutation(/*large_step=*/true);
+    draw_state(&y);
+    QVERIFY(num_near(x, y) < num_dims / 2);
+
+    // The rejected large step doesn't move the state.
+    pss.reject();
+    pss.start_mutation(/*large_step=*/false);
+    draw_state(&y);
+    QVERIFY(num_near(x, y) == num_dims);
+    pss.reject();
+
+    // An accepted large step replaces the dimensions it didn't draw as well.
+    pss.start_mutation(/*large_step=*/true);
+    pss.start_pixel(0);
+    float x0 = pss.draw();
+    pss.accept();
+    pss.start_mutation(/*large_step=*/false);
+    draw_state(&y);
+    QVERIFY(num_near(std::vector<float>{x0}, std::vector<float>{y[0]}) == 1);
+    QVERIFY(num_near(x, y) < num_dims / 2);
+}
+
+void tst_pathtracer::pssmlt_tracer() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::pssmlt_path_tracer(), &sampler, /*num_samps_per_dir=*/512);
+}
+
+void tst_pathtracer::ppm_tracer() {
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::ppm_path_tracer(), &sampler, /*num_samps_per_dir=*/1024);
+
+    // With many rays per pass, the photons spread over many grid cells. The surface of a sphere
+    // within a radius has the area of the disk, so only the curvature biases the estimates.
+    sphere_scene scene(std::make_unique<e8::basic_light_sources>());
+    e8util::rng rn(13);
+    std::vector<e8util::ray> rays;
+    for (unsigned i = 0; i < 1024; i++) {
+        rays.push_back(
+            e8util::ray(e8util::vec3{0, 0, 0}, e8util::vec3_sphere_sample(rn.draw(), rn.draw())));
+    }
+    e8::if_path_tracer::first_hits hits =
+        e8::if_path_tracer::compute_first_hit(rays, *scene.path_space, *scene.light_sources);
+    e8::ppm_path_tracer tracer;
+    unsigned const num_passes = 32;
+    float sum = 0;
+    for (unsigned k = 0; k < num_passes; k++) {
+        sampler.start_sample(/*index=*/k);
+        std::vector<e8util::vec3> estimate = tracer.sample(
+            sampler, rays, hits, *scene.path_space, *scene.mats, *scene.light_sources);
+        for (e8util::vec3 const &rad : estimate) {
+            sum += rad.sum();
+        }
+    }
+    float mu = sum / (num_passes * rays.size());
+    float exp_x = (scene.light_rad / (e8util::vec3(1) - scene.albedo)).sum();
+    QVERIFY2(std::abs(mu - exp_x) < 0.1f,
+             ("mu=" + std::to_string(mu) + "|exp{x}=" + std::to_string(exp_x)).c_str());
+}
+
+void tst_pathtracer::batched_shadow_rays() {
+    // Rays from the center end either before or beyond the sphere, in packets of different sizes.
+    sphere_scene scene(std::make_unique<e8::basic_light_sources>());
+    e8util::rng rn(13);
+    std::vector<e8util::ray> rays;
+    std::vector<float> t_max;
+    for (unsigned i = 0; i < 150; i++) {
+        rays.push_back(
+            e8util::ray(e8util::vec3{0, 0, 0}, e8util::vec3_sphere_sample(rn.draw(), rn.draw())));
+        t_max.push_back(5.0f + 10.0f * rn.draw());
+    }
+    std::vector<bool> occluded;
+    scene.path_space->occluded(rays, 1e-4f, t_max, &occluded);
+    QVERIFY(occluded.size() == rays.size());
+    for (unsigned i = 0; i < rays.size(); i++) {
+        float t;
+        QVERIFY2(occluded[i] == scene.path_space->has_intersect(rays[i], 1e-4f, t_max[i], t),
+                 ("At " + std::to_string(i)).c_str());
+    }
+}
+
+void tst_pathtracer::vpl_tracer() {
+    // Every point of the sphere sees every other at the same geometry term, which stays below the
+    // clamp, so the VPLs are unbiased.
+    e8::random_sampler sampler(/*seed=*/13);
+    inner_sphere_validation(e8::vpl_path_tracer(), &sampler, /*num_samps_per_dir=*/256);
+}
+
+void tst_pathtracer::ao_tracer() {
+    // Seen from the center of an unlit sphere, a cosine-weighted ray from the wall crosses the
+    // sphere at the distance of twice the radius times the cosine, so the fraction of the rays
+    // escaping the occlusion radius r is 1 - (r/2R)^2.
+    float const sphere_radius = 10.0f;
+    e8util::color3 const albedo = 0.7f;
+    std::shared_ptr<e8::if_material> material =
+        std::make_shared<e8::oren_nayar>("material", albedo, /*roughness=*/0.0f);
+    e8::default_material_container mats;
+    mats.load(*material, e8util::mat44_scale(1.0f));
+    e8::uv_sphere sphere(/*name=*/"sphere", /*o=*/e8util::vec3{0.0f, 0.0f, 0.0f},
+                         /*r=*/sphere_radius, /*res=*/30, /*flip_normal=*/true);
+    sphere.update();
+    sphere.attach_material(material->id());
+    e8::bvh_path_space_layout path_space;
+    path_space.load(sphere, e8util::mat44_scale(1.0f));
+    path_space.commit();
+    e8::basic_light_sources light_sources;
+    light_sources.commit();
+
+    e8util::rng rn(13);
+    std::vector<e8util::ray> rays;
+    for (unsigned i = 0; i < 256; i++) {
+        rays.push_back(
+            e8util::ray(e8util::vec3{0, 0, 0}, e8util::vec3_sphere_sample(rn.draw(), rn.draw())));
+    }
+    e8::if_path_tracer::first_hits hits =
+        e8::if_path_tracer::compute_first_hit(rays, path_space, light_sources);
+
+    e8::random_sampler sampler(/*seed=*/13);
+    for (float radius_ratio : {0.01f, 0.5f, 1.0f}) {
+        e8::ao_tracer tracer(radius_ratio, /*num_rays=*/16);
+        float sum = 0;
+        unsigned const num_samps = 16;
+        for (unsigned k = 0; k < num_samps; k++) {
+            sampler.start_sample(/*index=*/k);
+            std::vector<e8util::vec3> estimate =
+                tracer.sample(sampler, rays, hits, path_space, mats, light_sources);
+            for (e8util::vec3 const &rad : estimate) {
+                sum += rad(0);
+            }
+        }
+        float mu = sum / (num_samps * rays.size());
+        float r = radius_ratio * path_space.aabb().enclosing_radius() / (2 * sphere_radius);
+        float exp_x = albedo(0) * (1.0f - std::min(1.0f, r * r));
+        QVERIFY2(std::abs(mu - exp_x) < 0.02f,
+                 ("mu=" + std::to_string(mu) + "|exp{x}=" + std::to_string(exp_x)).c_str());
+    }
+}
+
+void tst_pathtracer::restir_tracer() {
+    // The rays cover an image, so the reservoirs are reused across the neighbor pixels as well as
+    // the passes. The wall sees the whole light, which it reflects by the albedo.
+    sphere_scene scene(std::make_unique<e8::basic_light_sources>());
+    unsigned const width = 32;
+    std::vector<e8util::ray> rays;
+    for (unsigned y = 0; y < width; y++) {
+        for (unsigned x = 0; x < width; x++) {
+            e8util::vec3 dir{(x + 0.5f) / width - 0.5f, (y + 0.5f) / width - 0.5f, -1.0f};
+            rays.push_back(e8util::ray(e8util::vec3{0, 0, 0}, dir.normalize()));
+        }
+    }
+    e8::if_path_tracer::first_hits hits =
+        e8::if_path_tracer::compute_first_hit(rays, *scene.path_space, *scene.light_sources);
+
+    e8::random_sampler sampler(/*seed=*/13);
+    e8::restir_path_tracer tracer;
+    unsigned const num_passes = 16;
+    float sum = 0;
+    for (unsigned k = 0; k < num_passes; k++) {
+        sampler.start_sample(/*index=*/k, /*pixels=*/nullptr, width);
+        std::vector<e8util::vec3> estimate = tracer.sample(
+            sampler, rays, hits, *scene.path_space, *scene.mats, *scene.light_sources);
+        for (e8util::vec3 const &rad : estimate) {
+            sum += rad.sum();
+        }
+    }
+    float mu = sum / (num_passes * rays.size());
+    float exp_x = (scene.light_rad + scene.light_rad * scene.albedo).sum();
+    QVERIFY2(std::abs(mu - exp_x) < 0.1f,
+             ("mu=" + std::to_string(mu) + "|exp{x}=" + std::to_string(exp_x)).c_str());
 }
 
 QTEST_APPLESS_MAIN(tst_pathtracer)
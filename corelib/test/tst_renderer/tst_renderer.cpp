@@ -1,6 +1,7 @@
 #include "src/camera.h"
 #include "src/cameracontainer.h"
 #include "src/compositor.h"
+#include "src/denoiser.h"
 #include "src/frame.h"
 #include "src/lightsources.h"
 #include "src/pathspace.h"
@@ -21,6 +22,10 @@ class tst_renderer : public QObject {
 
   private slots:
     void pt_render_cornel_balls();
+    void pt_render_progressive();
+    void pt_render_adaptive();
+    void pt_render_firefly_filter();
+    void denoise();
 };
 
 struct cornell_balls {
@@ -167,6 +172,198 @@ void tst_renderer::pt_render_cornel_balls() {
     }
 }
 
+void tst_renderer::pt_render_progressive() {
+    cornell_balls scene = cornell_box_path_space();
+    e8::pt_image_renderer renderer(
+        std::make_unique<e8::pathtracer_factory>(e8::pathtracer_factory::unidirect_lt1,
+                                                 e8::pathtracer_factory::options()),
+        /*num_threads=*/1);
+    renderer.enable_progressive(true);
+
+    e8::clamp_compositor compositor(/*width=*/80, /*height=*/60);
+    for (unsigned k = 1; k <= 4; k++) {
+        renderer.render(&compositor, *scene.path_space, *scene.mats, *scene.light_sources,
+                        *scene.camera,
+                        /*num_samps=*/2, /*firefly_filter=*/false);
+        QCOMPARE(renderer.accumulated_samples(), 2 * k);
+    }
+
+    renderer.reset_accumulation();
+    renderer.render(&compositor, *scene.path_space, *scene.mats, *scene.light_sources,
+                    *scene.camera,
+                    /*num_samps=*/2, /*firefly_filter=*/false);
+    QCOMPARE(renderer.accumulated_samples(), 2u);
+
+    // Resizing the image restarts the accumulation.
+    compositor.resize(/*width=*/40, /*height=*/30);
+    renderer.render(&compositor, *scene.path_space, *scene.mats, *scene.light_sources,
+                    *scene.camera,
+                    /*num_samps=*/2, /*firefly_filter=*/false);
+    QCOMPARE(renderer.accumulated_samples(), 2u);
+}
+
+void tst_renderer::pt_render_adaptive() {
+    cornell_balls scene = cornell_box_path_space();
+    e8::pt_image_renderer renderer(
+        std::make_unique<e8::pathtracer_factory>(e8::pathtracer_factory::unidirect_lt1,
+                                                 e8::pathtracer_factory::options()),
+        /*num_threads=*/1);
+    renderer.enable_progressive(true);
+    renderer.enable_adaptive_sampling(/*enable=*/true, /*target_error=*/0.5f);
+
+    e8::clamp_compositor compositor(/*width=*/80, /*height=*/60);
+    e8::pt_image_renderer::numerical_stats stats =
+        renderer.render(&compositor, *scene.path_space, *scene.mats, *scene.light_sources,
+                        *scene.camera,
+                        /*num_samps=*/64, /*firefly_filter=*/false);
+    QVERIFY(stats.converged);
+    QVERIFY(stats.num_samples < 64);
+    QVERIFY(stats.sample_sigma > 0);
+    QVERIFY(stats.scaled_sigma > 0 && stats.scaled_sigma <= stats.max_sigma);
+
+    // Converged tiles aren't sampled again.
+    stats = renderer.render(&compositor, *scene.path_space, *scene.mats, *scene.light_sources,
+                            *scene.camera,
+                            /*num_samps=*/64, /*firefly_filter=*/false);
+    QVERIFY(stats.converged);
+    QCOMPARE(stats.num_samples, 0u);
+}
+
+void tst_renderer::pt_render_firefly_filter() {
+    cornell_balls scene = cornell_box_path_space();
+    e8::pt_image_renderer plain_renderer(
+        std::make_unique<e8::pathtracer_factory>(e8::pathtracer_factory::unidirect,
+                                                 e8::pathtracer_factory::options()),
+        /*num_threads=*/1);
+    e8::pt_image_renderer filtered_renderer(
+        std::make_unique<e8::pathtracer_factory>(e8::pathtracer_factory::unidirect,
+                                                 e8::pathtracer_factory::options()),
+        /*num_threads=*/1);
+    plain_renderer.enable_progressive(true);
+    filtered_renderer.enable_progressive(true);
+
+    e8::clamp_compositor plain(/*width=*/80, /*height=*/60);
+    e8::clamp_compositor filtered(/*width=*/80, /*height=*/60);
+    for (unsigned k = 1; k <= 2; k++) {
+        plain_renderer.render(&plain, *scene.path_space, *scene.mats, *scene.light_sources,
+                              *scene.camera,
+                              /*num_samps=*/1, /*firefly_filter=*/false);
+        filtered_renderer.render(&filtered, *scene.path_space, *scene.mats,
+                                 *scene.light_sources, *scene.camera,
+                                 /*num_samps=*/1, /*firefly_filter=*/true);
+
+        // The filter only caps the averaged image and leaves the accumulation alone.
+        QCOMPARE(filtered_renderer.accumulated_samples(), plain_renderer.accumulated_samples());
+
+        unsigned num_capped = 0;
+        for (unsigned j = 0; j < 60; j++) {
+            for (unsigned i = 0; i < 80; i++) {
+                e8::rgba_color const &a = plain(i, j);
+                e8::rgba_color const &b = filtered(i, j);
+                bool edge = i == 0 || j == 0 || i + 1 == 80 || j + 1 == 60;
+                for (unsigned c = 0; c < 4; c++) {
+                    if (edge) {
+                        QCOMPARE(b(c), a(c));
+                    } else {
+                        QVERIFY(b(c) <= a(c) + 1e-5f);
+                    }
+                }
+                if (b.trunc().norm2() < a.trunc().norm2()) {
+                    num_capped++;
+                }
+            }
+        }
+        QVERIFY(num_capped > 0);
+    }
+}
+
+void tst_renderer::denoise() {
+    // Two noisy walls meet in the middle of the image, under a row that sees nothing.
+    unsigned const width = 64;
+    unsigned const height = 48;
+    e8::aov_buffers aovs;
+    aovs.width = width;
+    aovs.height = height;
+    e8util::rng rn(13);
+    e8::clamp_compositor noisy(width, height);
+    for (unsigned y = 0; y < height; y++) {
+        for (unsigned x = 0; x < width; x++) {
+            bool left = x < width / 2;
+            aovs.normal.push_back(y == 0 ? e8util::vec3() : left ? e8util::vec3{1, 0, 0}
+                                                                 : e8util::vec3{0, 0, 1});
+            aovs.depth.push_back(y == 0 ? 0.0f : 1.0f);
+            aovs.albedo.push_back(e8util::color3(0.5f));
+            aovs.variance.push_back(0.03f);
+            float noise = 0.6f * rn.draw() - 0.3f;
+            noisy(x, y) = e8util::vec3(left ? 0.8f + noise : 0.2f + noise).homo(1.0f);
+        }
+    }
+
+    e8::clamp_compositor filtered(width, height);
+    e8::clamp_compositor filtered_in_parallel(width, height);
+    for (unsigned y = 0; y < height; y++) {
+        for (unsigned x = 0; x < width; x++) {
+            filtered(x, y) = noisy(x, y);
+            filtered_in_parallel(x, y) = noisy(x, y);
+        }
+    }
+    e8::atrous_denoiser(/*num_threads=*/1).denoise(aovs, &filtered);
+    e8::atrous_denoiser(/*num_threads=*/3).denoise(aovs, &filtered_in_parallel);
+
+    float err2_before = 0;
+    float err2_after = 0;
+    for (unsigned y = 0; y < height; y++) {
+        for (unsigned x = 0; x < width; x++) {
+            QCOMPARE(filtered_in_parallel(x, y)(0), filtered(x, y)(0));
+            if (y == 0) {
+                QCOMPARE(filtered(x, y)(0), noisy(x, y)(0));
+                continue;
+            }
+            float truth = x < width / 2 ? 0.8f : 0.2f;
+            err2_before += (noisy(x, y)(0) - truth) * (noisy(x, y)(0) - truth);
+            err2_after += (filtered(x, y)(0) - truth) * (filtered(x, y)(0) - truth);
+        }
+    }
+    QVERIFY2(err2_after < 0.1f * err2_before, (std::to_string(err2_after) + "|" +
+                                               std::to_string(err2_before))
+                                                  .c_str());
+
+    // Nothing bleeds across the edge.
+    for (unsigned x : {width / 2 - 1, width / 2}) {
+        float sum = 0;
+        for (unsigned y = 1; y < height; y++) {
+            sum += filtered(x, y)(0);
+        }
+        float truth = x < width / 2 ? 0.8f : 0.2f;
+        QVERIFY2(std::abs(sum / (height - 1) - truth) < 0.05f,
+                 (std::to_string(x) + "|" + std::to_string(sum / (height - 1))).c_str());
+    }
+
+    // The renderer provides the AOVs of the image it rendered.
+    cornell_balls scene = cornell_box_path_space();
+    e8::pt_image_renderer renderer(
+        std::make_unique<e8::pathtracer_factory>(e8::pathtracer_factory::unidirect_lt1,
+                                                 e8::pathtracer_factory::options()),
+        /*num_threads=*/1);
+    e8::clamp_compositor compositor(/*width=*/80, /*height=*/60);
+    renderer.render(&compositor, *scene.path_space, *scene.mats, *scene.light_sources,
+                    *scene.camera,
+                    /*num_samps=*/2, /*firefly_filter=*/false);
+    e8::aov_buffers const &rendered = renderer.aovs();
+    QCOMPARE(rendered.width, 80u);
+    QCOMPARE(rendered.height, 60u);
+    QCOMPARE(rendered.depth.size(), 80u * 60u);
+    unsigned num_hits = 0;
+    for (unsigned p = 0; p < rendered.depth.size(); p++) {
+        QVERIFY(rendered.variance[p] >= 0);
+        if (rendered.depth[p] > 0) {
+            QVERIFY(std::abs(rendered.normal[p].norm() - 1.0f) < 1e-3f);
+            num_hits++;
+        }
+    }
+    QVERIFY(num_hits > 0);
+}
+
 QTEST_APPLESS_MAIN(tst_renderer)
 
 #include "tst_renderer.moc"